@@ -0,0 +1,173 @@
+#include "prod/funds_controller/alert_dispatcher.h"
+
+#include "util/error/error.h"
+#include "util/log/log.h"
+#include "util/slack/slack.h"
+#include "util/time/time.h"
+
+#include <algorithm>
+
+namespace funds_controller {
+
+namespace {
+
+int64_t nowMs() {
+  return static_cast<int64_t>(nowSystem()) / 1'000'000;
+}
+
+}  // namespace
+
+tl::expected<void, std::string> SlackAlertSink::send(const std::string& message) {
+  try {
+    util::SlackAlerter::FundsAlerter().send(message);
+  } catch (const std::exception& e) {
+    return tl::make_unexpected(std::string{"Failed to send slack alert. Exception: "} + e.what());
+  }
+  return {};
+}
+
+LocalAlertSink::LocalAlertSink(std::chrono::milliseconds latency): latency_(latency) {
+}
+
+tl::expected<void, std::string> LocalAlertSink::send(const std::string& message) {
+  if (latency_.count() > 0) {
+    std::this_thread::sleep_for(latency_);
+  }
+  std::lock_guard lock(mutex_);
+  messages_.push_back(message);
+  return {};
+}
+
+std::vector<std::string> LocalAlertSink::messages() const {
+  std::lock_guard lock(mutex_);
+  return messages_;
+}
+
+AlertDispatcher::AlertDispatcher(Options options, std::shared_ptr<AlertSink> sink):
+    options_(options),
+    sink_(std::move(sink)),
+    thread_([this](std::stop_token stop_token) { run(stop_token); }) {
+  ASSERT_FATAL(options_.max_keys > 0, "Alert dispatcher should track at least one key");
+  ASSERT_FATAL(options_.max_messages_per_send > 0, "Alert dispatcher should send at least one message");
+}
+
+AlertDispatcher::~AlertDispatcher() {
+  thread_.request_stop();
+  thread_.join();
+  sendDue(nowMs(), true);
+}
+
+bool AlertDispatcher::alert(const std::string& key, std::string message) {
+  ++alerts_;
+  const auto now = nowMs();
+  {
+    std::lock_guard lock(mutex_);
+    auto it = keys_.find(key);
+    if (it != keys_.end() && now < it->second.window_end_ms) {
+      ++it->second.coalesced;
+      it->second.last_message = std::move(message);
+      ++coalesced_;
+      return true;
+    }
+    if (it == keys_.end()) {
+      if (keys_.size() >= options_.max_keys) {
+        ++dropped_since_send_;
+        ++dropped_;
+        return false;
+      }
+      it = keys_.emplace(key, KeyState{}).first;
+    } else {
+      // the window ended before the dispatcher thread got to it
+      queueSummary(key, it->second);
+    }
+    it->second.window_end_ms = now + options_.coalesce_window.count();
+    due_.push_back(std::move(message));
+  }
+  condition_.notify_one();
+  return true;
+}
+
+AlertDispatcher::Stats AlertDispatcher::stats() const {
+  return {
+      .alerts = alerts_.load(),
+      .coalesced = coalesced_.load(),
+      .dropped = dropped_.load(),
+      .sends = sends_.load(),
+      .failed_sends = failed_sends_.load(),
+  };
+}
+
+void AlertDispatcher::run(std::stop_token stop_token) {
+  while (!stop_token.stop_requested()) {
+    const auto now = nowMs();
+    sendDue(now, false);
+    std::unique_lock lock(mutex_);
+    int64_t next_window_end_ms = now + options_.coalesce_window.count();
+    for (const auto& [key, state] : keys_) {
+      next_window_end_ms = std::min(next_window_end_ms, state.window_end_ms);
+    }
+    condition_.wait_for(lock,
+                        stop_token,
+                        std::chrono::milliseconds(std::max<int64_t>(next_window_end_ms - now, 1)),
+                        [this] { return !due_.empty() || dropped_since_send_ > 0; });
+  }
+}
+
+void AlertDispatcher::sendDue(int64_t now_ms, bool flush) {
+  std::vector<std::string> due;
+  uint64_t dropped = 0;
+  {
+    std::lock_guard lock(mutex_);
+    for (auto it = keys_.begin(); it != keys_.end();) {
+      if (!flush && now_ms < it->second.window_end_ms) {
+        ++it;
+        continue;
+      }
+      if (it->second.coalesced == 0) {
+        it = keys_.erase(it);
+        continue;
+      }
+      // the key is still firing, the summary opens a new window
+      queueSummary(it->first, it->second);
+      it->second.window_end_ms = now_ms + options_.coalesce_window.count();
+      ++it;
+    }
+    due.swap(due_);
+    std::swap(dropped, dropped_since_send_);
+  }
+  if (due.empty() && dropped == 0) {
+    return;
+  }
+
+  std::string message;
+  for (size_t i = 0; i < std::min(due.size(), options_.max_messages_per_send); ++i) {
+    message += (message.empty() ? "" : "\n") + due[i];
+  }
+  if (due.size() > options_.max_messages_per_send) {
+    message += std::format("\n... and {} more alerts", due.size() - options_.max_messages_per_send);
+  }
+  if (dropped > 0) {
+    message += std::format("{}{} alerts dropped, too many distinct alerts", message.empty() ? "" : "\n", dropped);
+  }
+  ++sends_;
+  if (auto result = sink_->send(message); !result.has_value()) {
+    ++failed_sends_;
+    LOG_ERROR("Failed to send alert {}: {}", message, result.error());
+  }
+}
+
+void AlertDispatcher::queueSummary(const std::string& key, KeyState& state) {
+  if (state.coalesced == 0) {
+    return;
+  }
+  due_.push_back(std::format("{} more alerts of {}, last: {}", state.coalesced, key, state.last_message));
+  state.coalesced = 0;
+  state.last_message.clear();
+}
+
+AlertDispatcher& alertDispatcher() {
+  static AlertDispatcher dispatcher({}, std::make_shared<SlackAlertSink>());
+  return dispatcher;
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,386 @@
+#include "prod/funds_controller/batch_runner.h"
+
+#include "prod/funds_controller/universe_snapshot.h"
+
+#include "util/error/error.h"
+
+#include <magic_enum/magic_enum.hpp>
+#include <simdjson.h>
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string_view>
+
+namespace funds_controller {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Fields = std::map<std::string, std::string, std::less<>>;
+
+const std::map<std::string_view, BatchCommand::Type> kCommandTypes = {
+    {"borrow", BatchCommand::Type::Borrow},
+    {"repay", BatchCommand::Type::Repay},
+    {"hedge", BatchCommand::Type::Hedge},
+    {"loan_transfer", BatchCommand::Type::LoanTransfer},
+    {"transfer", BatchCommand::Type::Transfer},
+    {"block", BatchCommand::Type::Block},
+    {"unblock", BatchCommand::Type::Unblock},
+};
+
+int64_t percentile(std::vector<int64_t> latencies, double quantile) {
+  if (latencies.empty()) {
+    return 0;
+  }
+  auto nth = latencies.begin() + static_cast<ptrdiff_t>(quantile * static_cast<double>(latencies.size() - 1));
+  std::nth_element(latencies.begin(), nth, latencies.end());
+  return *nth;
+}
+
+std::string_view trim(std::string_view text) {
+  while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+    text.remove_prefix(1);
+  }
+  while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r')) {
+    text.remove_suffix(1);
+  }
+  return text;
+}
+
+std::vector<std::string_view> splitCsv(std::string_view line) {
+  std::vector<std::string_view> fields;
+  while (true) {
+    size_t separator = line.find(',');
+    fields.push_back(trim(line.substr(0, separator)));
+    if (separator == std::string_view::npos) {
+      return fields;
+    }
+    line.remove_prefix(separator + 1);
+  }
+}
+
+tl::expected<std::string_view, std::string> field(const Fields& fields, std::string_view name) {
+  auto it = fields.find(name);
+  EXPECT_WITH_STRING(it != fields.end() && !it->second.empty(), "Missing field " << name);
+  return std::string_view{it->second};
+}
+
+template <class Enum>
+tl::expected<Enum, std::string> enumField(const Fields& fields, std::string_view name) {
+  auto text = field(fields, name);
+  PROPAGATE_ERROR(text);
+  auto value = magic_enum::enum_cast<Enum>(*text);
+  EXPECT_WITH_STRING(value.has_value(), "Unknown " << name << " " << *text);
+  return *value;
+}
+
+tl::expected<BatchCommand, std::string> makeCommand(size_t line, const Fields& fields) {
+  BatchCommand command{.line = line};
+  auto type_name = field(fields, "command");
+  PROPAGATE_ERROR(type_name);
+  auto type = kCommandTypes.find(*type_name);
+  EXPECT_WITH_STRING(type != kCommandTypes.end(), "Unknown command " << *type_name);
+  command.type = type->second;
+
+  if (command.type == BatchCommand::Type::Block || command.type == BatchCommand::Type::Unblock) {
+    auto subaccount = field(fields, "subaccount");
+    PROPAGATE_ERROR(subaccount);
+    auto market = enumField<infra::Market::Type>(fields, "market");
+    PROPAGATE_ERROR(market);
+    auto symbol = field(fields, "symbol");
+    PROPAGATE_ERROR(symbol);
+    auto rule_type = field(fields, "rule_type");
+    PROPAGATE_ERROR(rule_type);
+    command.subaccount = *subaccount;
+    command.market = infra::Market{*market};
+    command.symbol = *symbol;
+    command.rule_type = *rule_type;
+    return command;
+  }
+
+  auto asset = field(fields, "asset");
+  PROPAGATE_ERROR(asset);
+  auto amount_text = field(fields, "amount");
+  PROPAGATE_ERROR(amount_text);
+  auto mantissa = parseFixedPointMantissa(*amount_text);
+  EXPECT_WITH_STRING(mantissa.has_value() && *mantissa > 0, "Invalid amount " << *amount_text);
+  command.asset = *asset;
+  command.amount = util::Decimal::withMantissa(*mantissa);
+  if (auto it = fields.find("idempotency_key"); it != fields.end()) {
+    command.idempotency_key = it->second;
+  }
+
+  if (command.type == BatchCommand::Type::Transfer || command.type == BatchCommand::Type::LoanTransfer) {
+    auto from = field(fields, "from");
+    PROPAGATE_ERROR(from);
+    auto to = field(fields, "to");
+    PROPAGATE_ERROR(to);
+    command.subaccount = *from;
+    command.to_subaccount = *to;
+    if (command.type == BatchCommand::Type::Transfer) {
+      auto from_wallet = enumField<infra::Wallet::Type>(fields, "from_wallet");
+      PROPAGATE_ERROR(from_wallet);
+      auto to_wallet = enumField<infra::Wallet::Type>(fields, "to_wallet");
+      PROPAGATE_ERROR(to_wallet);
+      command.wallet = infra::Wallet{*from_wallet};
+      command.to_wallet = infra::Wallet{*to_wallet};
+    } else {
+      auto from_exchange = enumField<infra::Exchange>(fields, "from_exchange");
+      PROPAGATE_ERROR(from_exchange);
+      auto to_exchange = enumField<infra::Exchange>(fields, "to_exchange");
+      PROPAGATE_ERROR(to_exchange);
+      command.exchange = *from_exchange;
+      command.to_exchange = *to_exchange;
+    }
+    return command;
+  }
+
+  auto subaccount = field(fields, "subaccount");
+  PROPAGATE_ERROR(subaccount);
+  auto exchange = enumField<infra::Exchange>(fields, "exchange");
+  PROPAGATE_ERROR(exchange);
+  command.subaccount = *subaccount;
+  command.exchange = *exchange;
+  return command;
+}
+
+// Flat object of strings and numbers, numbers are kept as their text.
+tl::expected<Fields, std::string> parseJsonLine(simdjson::ondemand::parser& parser, std::string_view line) {
+  simdjson::padded_string padded(line);
+  simdjson::ondemand::document document;
+  simdjson::ondemand::object object;
+  if (auto error = parser.iterate(padded).get(document); error || (error = document.get_object().get(object))) {
+    return tl::make_unexpected(std::string{"Invalid JSON: "} + simdjson::error_message(error));
+  }
+  Fields fields;
+  for (auto field_result : object) {
+    simdjson::ondemand::field json_field;
+    std::string_view key;
+    simdjson::ondemand::json_type type;
+    if (auto error = field_result.get(json_field); error || (error = json_field.unescaped_key().get(key)) ||
+                                                   (error = json_field.value().type().get(type))) {
+      return tl::make_unexpected(std::string{"Invalid JSON: "} + simdjson::error_message(error));
+    }
+    std::string_view value;
+    auto error = type == simdjson::ondemand::json_type::number ? json_field.value().raw_json_token().get(value)
+                                                               : json_field.value().get_string().get(value);
+    if (error) {
+      return tl::make_unexpected(std::format("Invalid JSON field {}: {}", key, simdjson::error_message(error)));
+    }
+    fields.emplace(std::string{key}, std::string{trim(value)});
+  }
+  return fields;
+}
+
+// The limit a command uses up, none for repays, loan transfers and block rules.
+std::optional<LimitCheck> limitCheck(const BatchCommand& command) {
+  switch (command.type) {
+    case BatchCommand::Type::Borrow:
+      return LimitCheck{Limit::Type::MaxLoan, command.subaccount, command.asset, command.amount};
+    case BatchCommand::Type::Hedge:
+      return LimitCheck{Limit::Type::MaxHedge, command.subaccount, command.asset, command.amount};
+    case BatchCommand::Type::Transfer:
+      return LimitCheck{Limit::Type::MaxDailyTransfer, command.subaccount, command.asset, command.amount};
+    default:
+      return std::nullopt;
+  }
+}
+
+}  // namespace
+
+std::vector<LeaseKey> BatchCommand::keys() const {
+  switch (type) {
+    case Type::Transfer:
+    case Type::LoanTransfer:
+      return {{subaccount, asset}, {to_subaccount, asset}};
+    case Type::Block:
+    case Type::Unblock:
+      return {{subaccount, symbol}};
+    default:
+      return {{subaccount, asset}};
+  }
+}
+
+tl::expected<std::vector<BatchCommand>, std::string> parseBatchFile(const std::string& path) {
+  std::ifstream file(path);
+  EXPECT_WITH_STRING(file.is_open(), "Failed to open batch file " << path);
+  const bool csv = path.ends_with(".csv");
+  std::vector<BatchCommand> commands;
+  std::vector<std::string> header;
+  simdjson::ondemand::parser parser;
+  std::string line;
+  for (size_t line_number = 1; std::getline(file, line); ++line_number) {
+    if (trim(line).empty()) {
+      continue;
+    }
+    Fields fields;
+    if (csv) {
+      auto values = splitCsv(line);
+      if (header.empty()) {
+        header.assign(values.begin(), values.end());
+        continue;
+      }
+      EXPECT_WITH_STRING(values.size() == header.size(),
+                         path << ":" << line_number << ": expected " << header.size() << " fields, got "
+                              << values.size());
+      for (size_t i = 0; i < values.size(); ++i) {
+        fields.emplace(header[i], values[i]);
+      }
+    } else {
+      auto json_fields = parseJsonLine(parser, line);
+      EXPECT_WITH_STRING(json_fields.has_value(), path << ":" << line_number << ": " << json_fields.error());
+      fields = std::move(*json_fields);
+    }
+    auto command = makeCommand(line_number, fields);
+    EXPECT_WITH_STRING(command.has_value(), path << ":" << line_number << ": " << command.error());
+    commands.push_back(std::move(*command));
+  }
+  LOG_INFO("Parsed {} commands from {}", commands.size(), path);
+  return commands;
+}
+
+double BatchRunner::Summary::commandsPerSecond() const {
+  if (elapsed.count() == 0) {
+    return 0;
+  }
+  return static_cast<double>(commands) * 1e6 / static_cast<double>(elapsed.count());
+}
+
+BatchRunner::BatchRunner(Options options, Managers managers): options_(options), managers_(managers) {
+  ASSERT_FATAL(options_.parallelism > 0, "Parallelism should be positive");
+}
+
+BatchRunner::Summary BatchRunner::run(const std::vector<BatchCommand>& commands,
+                                      const std::function<void(const Result&)>& on_result) {
+  // a command starts once the commands it waits for are done, it waits for the last earlier command
+  // on each of its keys
+  std::vector<std::vector<size_t>> dependents(commands.size());
+  std::vector<size_t> waiting(commands.size());
+  std::deque<size_t> ready;
+  std::map<LeaseKey, size_t> last_command;
+  for (size_t i = 0; i < commands.size(); ++i) {
+    std::set<size_t> predecessors;
+    for (auto& key : commands[i].keys()) {
+      auto [it, inserted] = last_command.try_emplace(std::move(key), i);
+      if (!inserted) {
+        predecessors.insert(it->second);
+        it->second = i;
+      }
+    }
+    for (size_t predecessor : predecessors) {
+      dependents[predecessor].push_back(i);
+    }
+    waiting[i] = predecessors.size();
+    if (waiting[i] == 0) {
+      ready.push_back(i);
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable condition;
+  size_t remaining = commands.size();
+  std::vector<int64_t> latencies;
+  latencies.reserve(commands.size());
+  size_t failed = 0;
+  std::mutex result_mutex;
+
+  const auto start = Clock::now();
+  auto work = [&] {
+    std::unique_lock lock(mutex);
+    while (true) {
+      condition.wait(lock, [&] { return !ready.empty() || remaining == 0; });
+      if (ready.empty()) {
+        return;
+      }
+      const size_t index = ready.front();
+      ready.pop_front();
+      lock.unlock();
+
+      const auto command_start = Clock::now();
+      auto result = execute(commands[index]);
+      const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - command_start);
+      {
+        std::lock_guard result_lock(result_mutex);
+        on_result({commands[index], result, latency});
+      }
+
+      lock.lock();
+      latencies.push_back(latency.count());
+      failed += result.has_value() ? 0 : 1;
+      --remaining;
+      for (size_t dependent : dependents[index]) {
+        if (--waiting[dependent] == 0) {
+          ready.push_back(dependent);
+        }
+      }
+      condition.notify_all();
+    }
+  };
+  {
+    std::vector<std::jthread> workers;
+    for (size_t i = 0; i < std::min(options_.parallelism, commands.size()); ++i) {
+      workers.emplace_back(work);
+    }
+  }
+
+  Summary summary{
+      .commands = commands.size(),
+      .failed = failed,
+      .elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start),
+      .p50 = std::chrono::microseconds(percentile(latencies, 0.5)),
+      .p99 = std::chrono::microseconds(percentile(latencies, 0.99)),
+      .max = std::chrono::microseconds(percentile(std::move(latencies), 1.0)),
+  };
+  return summary;
+}
+
+tl::expected<void, std::string> BatchRunner::execute(const BatchCommand& command) {
+  if (managers_.limits_engine != nullptr) {
+    if (auto limit_check = limitCheck(command); limit_check.has_value()) {
+      auto checked = managers_.limits_engine->check({*std::move(limit_check)});
+      if (!checked.front().has_value()) {
+        return tl::make_unexpected(checked.front().error().message());
+      }
+    }
+  }
+  switch (command.type) {
+    case BatchCommand::Type::Borrow:
+      return managers_.loans_manager.borrow(
+          command.subaccount, command.exchange, command.asset, command.amount, command.idempotency_key);
+    case BatchCommand::Type::Repay:
+      return managers_.loans_manager.repay(
+          command.subaccount, command.exchange, command.asset, command.amount, command.idempotency_key);
+    case BatchCommand::Type::Hedge:
+      return managers_.hedge_manager.createHedge(
+          command.subaccount, command.exchange, command.asset, command.amount, command.idempotency_key);
+    case BatchCommand::Type::LoanTransfer:
+      return managers_.loans_manager.transfer(command.subaccount,
+                                              command.exchange,
+                                              command.to_subaccount,
+                                              command.to_exchange,
+                                              command.asset,
+                                              command.amount,
+                                              command.idempotency_key);
+    case BatchCommand::Type::Transfer:
+      return managers_.transaction_manager.transfer(command.subaccount,
+                                                    command.wallet,
+                                                    command.to_subaccount,
+                                                    command.to_wallet,
+                                                    command.asset,
+                                                    command.amount,
+                                                    command.idempotency_key);
+    case BatchCommand::Type::Block:
+      return managers_.trading_blocker.addBlockRule(
+          command.subaccount, *command.market, command.symbol, command.rule_type);
+    case BatchCommand::Type::Unblock:
+      return managers_.trading_blocker.removeBlockRule(
+          command.subaccount, *command.market, command.symbol, command.rule_type);
+  }
+  return tl::make_unexpected(std::string{"Unknown command"});
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,175 @@
+#include "prod/funds_controller/binance_state_source.h"
+
+#include "prod/funds_controller/universe_snapshot.h"
+
+#include "util/env/env.h"
+#include "util/error/error.h"
+#include "util/time/time.h"
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <simdjson.h>
+
+#include <iterator>
+#include <map>
+#include <string_view>
+#include <utility>
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kBalancePath = "/papi/v1/balance";
+const std::string kPositionsPath = "/papi/v1/um/positionRisk";
+
+std::string hmacSha256Hex(const std::string& secret, const std::string& message) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_size = 0;
+  HMAC(EVP_sha256(),
+       secret.data(),
+       static_cast<int>(secret.size()),
+       reinterpret_cast<const unsigned char*>(message.data()),
+       message.size(),
+       digest,
+       &digest_size);
+  std::string hex;
+  hex.reserve(digest_size * 2);
+  for (unsigned int i = 0; i < digest_size; ++i) {
+    std::format_to(std::back_inserter(hex), "{:02x}", digest[i]);
+  }
+  return hex;
+}
+
+tl::unexpected<std::string> parseError(const std::string& path, simdjson::error_code error) {
+  return tl::make_unexpected(std::format("Failed to parse {}: {}", path, simdjson::error_message(error)));
+}
+
+// Calls on_item with the string fields of every object of a top level array. Views point into body and
+// are valid only for the duration of the call.
+template <class OnItem>
+tl::expected<void, std::string> forEachItem(simdjson::ondemand::parser& parser,
+                                            std::string& body,
+                                            const std::string& path,
+                                            OnItem&& on_item) {
+  body.reserve(body.size() + simdjson::SIMDJSON_PADDING);
+  simdjson::ondemand::document document;
+  if (auto error = parser.iterate(simdjson::padded_string_view(body.data(), body.size(), body.capacity()))
+                       .get(document)) {
+    return parseError(path, error);
+  }
+  simdjson::ondemand::array items;
+  if (auto error = document.get_array().get(items)) {
+    return parseError(path, error);
+  }
+  for (auto item_result : items) {
+    simdjson::ondemand::value element;
+    simdjson::ondemand::object item;
+    if (auto error = item_result.get(element)) {
+      return parseError(path, error);
+    }
+    if (auto error = element.get_object().get(item)) {
+      return parseError(path, error);
+    }
+    std::map<std::string_view, std::string_view> fields;
+    for (auto field_result : item) {
+      simdjson::ondemand::field field;
+      std::string_view key;
+      std::string_view value;
+      if (auto error = field_result.get(field)) {
+        return parseError(path, error);
+      }
+      if (auto error = field.unescaped_key().get(key)) {
+        return parseError(path, error);
+      }
+      // numbers come as strings, the other fields are not needed
+      if (field.value().get_string().get(value) == simdjson::SUCCESS) {
+        fields.emplace(key, value);
+      }
+    }
+    PROPAGATE_ERROR(on_item(fields));
+  }
+  return {};
+}
+
+tl::expected<infra::Volume, std::string> amountField(const std::map<std::string_view, std::string_view>& fields,
+                                                     std::string_view name) {
+  auto it = fields.find(name);
+  EXPECT_WITH_STRING(it != fields.end(), "Missing field " << name);
+  auto mantissa = parseFixedPointMantissa(it->second);
+  EXPECT_WITH_STRING(mantissa.has_value(), "Invalid " << name << " " << it->second);
+  return util::Decimal::withMantissa(*mantissa);
+}
+
+}  // namespace
+
+BinanceStateSource::BinanceStateSource(Options options, ApiKeys api_keys):
+    options_(std::move(options)), api_keys_(std::move(api_keys)) {
+  ASSERT_FATAL(api_keys_, "Api keys are required");
+}
+
+tl::expected<ExchangeAccountState, std::string> BinanceStateSource::fetch(const ReconciliationAccount& account) {
+  EXPECT_WITH_STRING(account.exchange == infra::Exchange::Binance, "Not a binance account " << account.subaccount);
+  auto api_key = api_keys_(account.subaccount);
+  EXPECT_WITH_STRING(api_key.has_value(), "No api key for " << account.subaccount);
+  HttpClient http_client(options_.base_url, options_.request_timeout);
+  simdjson::ondemand::parser parser;
+  ExchangeAccountState state;
+
+  auto balances = signedGet(http_client, *api_key, kBalancePath);
+  PROPAGATE_ERROR(balances);
+  auto on_balance = [&state](const auto& fields) -> tl::expected<void, std::string> {
+    auto asset = fields.find("asset");
+    EXPECT_WITH_STRING(asset != fields.end(), "Missing field asset");
+    // margin balance including the borrowed funds, which is where the loans live
+    auto balance = amountField(fields, "crossMarginAsset");
+    PROPAGATE_ERROR(balance);
+    auto borrowed = amountField(fields, "crossMarginBorrowed");
+    PROPAGATE_ERROR(borrowed);
+    if (*balance != 0) {
+      state.balances.emplace(asset->second, *balance);
+    }
+    if (*borrowed != 0) {
+      state.borrowed.emplace(asset->second, *borrowed);
+    }
+    return {};
+  };
+  PROPAGATE_ERROR(forEachItem(parser, *balances, kBalancePath, on_balance));
+
+  auto positions = signedGet(http_client, *api_key, kPositionsPath);
+  PROPAGATE_ERROR(positions);
+  auto on_position = [&state](const auto& fields) -> tl::expected<void, std::string> {
+    auto symbol = fields.find("symbol");
+    EXPECT_WITH_STRING(symbol != fields.end(), "Missing field symbol");
+    // USD-M contracts are one unit of the base asset, the amount is the crypto equivalent already
+    auto amount = amountField(fields, "positionAmt");
+    PROPAGATE_ERROR(amount);
+    if (*amount != 0) {
+      state.futures_positions[{infra::Market::BinanceFutures, std::string{symbol->second}}] += *amount;
+    }
+    return {};
+  };
+  PROPAGATE_ERROR(forEachItem(parser, *positions, kPositionsPath, on_position));
+  return state;
+}
+
+tl::expected<std::string, std::string> BinanceStateSource::signedGet(HttpClient& http_client,
+                                                                     const ApiKey& api_key,
+                                                                     const std::string& path) {
+  std::string query = std::format(
+      "recvWindow={}&timestamp={}", options_.recv_window.count(), static_cast<int64_t>(nowSystem()) / 1'000'000);
+  query += "&signature=" + hmacSha256Hex(api_key.secret, query);
+  return http_client.get(path + "?" + query, std::format("X-MBX-APIKEY: {}\r\n", api_key.key));
+}
+
+BinanceStateSource::ApiKeys environmentApiKeys() {
+  return [](const std::string& subaccount) -> std::optional<BinanceStateSource::ApiKey> {
+    BinanceStateSource::ApiKey api_key{util::getEnv("BINANCE_API_KEY_" + subaccount, ""),
+                                       util::getEnv("BINANCE_API_SECRET_" + subaccount, "")};
+    if (api_key.key.empty() || api_key.secret.empty()) {
+      return std::nullopt;
+    }
+    return api_key;
+  };
+}
+
+}  // namespace funds_controller
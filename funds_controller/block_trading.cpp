@@ -1,12 +1,16 @@
 #include "prod/funds_controller/block_trading.h"
 
+#include "prod/funds_controller/ledger_writer.h"
+
 #include "common/instrument_description/util/market_map.h"
 #include "util/error/error.h"
 #include "util/lexical_cast/lexical_cast.h"
 #include "util/time/time.h"
 #include "util/slack/slack.h"
 
+#include <map>
 #include <set>
+#include <utility>
 
 namespace funds_controller {
 
@@ -17,10 +21,22 @@ const std::string kDoneBlockStatus = "done";
 // const std::string kPendingBlockStatus = "pending";
 const std::string kRemoveBlockStatus = "removed";
 
+bool isKnownType(const std::string& type) {
+  return type == "asset" || type == "pair";
+}
+
+std::string ruleTuple(const BlockRule& rule) {
+  return std::format("('{}', '{}', '{}', '{}')",
+                     rule.subaccount,
+                     util::lexical_cast<std::string>(rule.market),
+                     rule.symbol,
+                     rule.type);
+}
+
 }  // namespace
 
-TradingBlocker::TradingBlocker(): clickhouse_client_(getFundsControllerClickhouseClient()) {
-  ASSERT_FATAL(clickhouse_client_, "Failed to create clickhouse client");
+// Versions start from the wall clock so they keep increasing across restarts.
+TradingBlocker::TradingBlocker(): version_(static_cast<uint64_t>(static_cast<int64_t>(nowSystem()))) {
 }
 
 tl::expected<void, std::string> TradingBlocker::isTradingBlocked(
@@ -28,7 +44,7 @@ tl::expected<void, std::string> TradingBlocker::isTradingBlocked(
   std::string query = std::format(
       "SELECT market, symbol, type, status FROM {} WHERE subaccount = '{}'", kTradingBlockerTable, subaccount);
   infra::MarketMap<std::set<std::string>> block_assets, block_pairs;
-  clickhouse_client_->Select({std::move(query)}, [&block_assets, &block_pairs](const clickhouse::Block& block) {
+  clickhouse_client_.select({std::move(query)}, [&block_assets, &block_pairs](const clickhouse::Block& block) {
     for (size_t i = 0; i < block.GetRowCount(); ++i) {
       infra::Market market =
           infra::Market{util::lexical_cast<infra::Market::Type>(block[0]->As<clickhouse::ColumnString>()->At(i))};
@@ -63,93 +79,336 @@ tl::expected<void, std::string> TradingBlocker::addBlockRule(const std::string&
                                                              infra::Market market,
                                                              const std::string& symbol,
                                                              const std::string& type) {
-  EXPECT_WITH_STRING(type == "asset" || type == "pair", "Unknown type " << type);
-  auto status = getStatus(subaccount, market, symbol, type);
-  if (!status.has_value()) {
-    LOG_INFO("insert block rule {} {} {} {}", subaccount, market, symbol, type);
-    auto query = std::format(
-        "INSERT INTO {} (timestamp, subaccount, market, symbol, type, status) VALUES ('{}', '{}', '{}', '{}', '{}', "
-        "'{}')",
-        kTradingBlockerTable,
-        util::lexical_cast<std::string>(util::lexical_cast<int64_t>(nowSystem()) / 1'000'000),
-        subaccount,
-        util::lexical_cast<std::string>(market),
-        symbol,
-        type,
-        kDoneBlockStatus);
-    clickhouse_client_->Execute({std::move(query)});
-    return {};
-  }
-  if (*status == kDoneBlockStatus) {
-    LOG_INFO("block rule already exists");
-    return {};
-  }
-  EXPECT_WITH_STRING(status == kRemoveBlockStatus, "Unknown status " << *status);
-  EXPECT_WITH_STRING(false,
-                     "Finalize table to add block rule again. Current status is "
-                         << *status << " for " << subaccount << " " << market << " " << symbol << " " << type);
-  return {};
+  auto results = addBlockRules({BlockRule{subaccount, market, symbol, type}});
+  PROPAGATE_ERROR(results);
+  return results->front();
 }
 
 tl::expected<void, std::string> TradingBlocker::removeBlockRule(const std::string& subaccount,
                                                                 infra::Market market,
                                                                 const std::string& symbol,
                                                                 const std::string& type) {
-  EXPECT_WITH_STRING(type == "asset" || type == "pair", "Unknown type " << type);
-  auto status = getStatus(subaccount, market, symbol, type);
-  if (!status.has_value()) {
-    LOG_INFO("Block rule doesn't exists");
-    return {};
-  }
-  if (*status == kRemoveBlockStatus) {
-    LOG_INFO("block rule already under removal");
-    return {};
-  }
-  EXPECT_WITH_STRING(status == kDoneBlockStatus, "Unknown status " << *status);
-  LOG_INFO("remove block rule {} {} {} {}", subaccount, market, symbol, type);
+  auto results = removeBlockRules({BlockRule{subaccount, market, symbol, type}});
+  PROPAGATE_ERROR(results);
+  return results->front();
+}
+
+tl::expected<TradingBlocker::BlockRuleResults, std::string> TradingBlocker::addBlockRules(
+    const std::vector<BlockRule>& rules) {
+  BlockRuleResults results(rules.size());
+  auto statuses = getStatuses(rules);
+  PROPAGATE_ERROR(statuses);
+  std::set<std::string> inserted_keys;
+  // every copy of an inserted rule shares the outcome of the insert, only the first one is written
+  std::vector<size_t> inserted_rules;
+  std::vector<size_t> unique_inserted_rules;
+  std::string values;
+  const auto timestamp = util::lexical_cast<std::string>(util::lexical_cast<int64_t>(nowSystem()) / 1'000'000);
+  for (size_t i = 0; i < rules.size(); ++i) {
+    const auto& rule = rules[i];
+    results[i] = [&]() -> tl::expected<void, std::string> {
+      EXPECT_WITH_STRING(isKnownType(rule.type), "Unknown type " << rule.type);
+      const auto& status = (*statuses)[i];
+      if (!status.has_value()) {
+        inserted_rules.push_back(i);
+        if (!inserted_keys.insert(ruleTuple(rule)).second) {
+          return {};
+        }
+        LOG_INFO("insert block rule {} {} {} {}", rule.subaccount, rule.market, rule.symbol, rule.type);
+        values += std::format("{}('{}', '{}', '{}', '{}', '{}', '{}')",
+                              values.empty() ? "" : ", ",
+                              timestamp,
+                              rule.subaccount,
+                              util::lexical_cast<std::string>(rule.market),
+                              rule.symbol,
+                              rule.type,
+                              kDoneBlockStatus);
+        unique_inserted_rules.push_back(i);
+        return {};
+      }
+      if (*status == kDoneBlockStatus) {
+        LOG_INFO("block rule already exists");
+        return {};
+      }
+      EXPECT_WITH_STRING(status == kRemoveBlockStatus, "Unknown status " << *status);
+      EXPECT_WITH_STRING(false,
+                         "Finalize table to add block rule again. Current status is "
+                             << *status << " for " << rule.subaccount << " " << rule.market << " " << rule.symbol
+                             << " " << rule.type);
+    }();
+  }
+  if (values.empty()) {
+    return results;
+  }
+  auto insert_result = ledgerWriter()
+                           .insert(kTradingBlockerTable,
+                                   "(timestamp, subaccount, market, symbol, type, status)",
+                                   std::move(values),
+                                   unique_inserted_rules.size())
+                           .get();
+  if (!insert_result.has_value()) {
+    for (size_t i : inserted_rules) {
+      results[i] = tl::make_unexpected("Failed to insert block rule. " + insert_result.error().message);
+    }
+    return results;
+  }
+  for (size_t i : unique_inserted_rules) {
+    publish(BlockRuleDelta::Action::Add, rules[i]);
+  }
+  return results;
+}
+
+tl::expected<TradingBlocker::BlockRuleResults, std::string> TradingBlocker::removeBlockRules(
+    const std::vector<BlockRule>& rules) {
+  BlockRuleResults results(rules.size());
+  auto statuses = getStatuses(rules);
+  PROPAGATE_ERROR(statuses);
+  std::set<std::string> removed_keys;
+  std::vector<size_t> removed_rules;
+  std::vector<size_t> unique_removed_rules;
+  std::string tuples;
+  for (size_t i = 0; i < rules.size(); ++i) {
+    const auto& rule = rules[i];
+    results[i] = [&]() -> tl::expected<void, std::string> {
+      EXPECT_WITH_STRING(isKnownType(rule.type), "Unknown type " << rule.type);
+      const auto& status = (*statuses)[i];
+      if (!status.has_value()) {
+        LOG_INFO("Block rule doesn't exists");
+        return {};
+      }
+      if (*status == kRemoveBlockStatus) {
+        LOG_INFO("block rule already under removal");
+        return {};
+      }
+      EXPECT_WITH_STRING(status == kDoneBlockStatus, "Unknown status " << *status);
+      auto tuple = ruleTuple(rule);
+      if (removed_keys.insert(tuple).second) {
+        LOG_INFO("remove block rule {} {} {} {}", rule.subaccount, rule.market, rule.symbol, rule.type);
+        tuples += (tuples.empty() ? "" : ", ") + tuple;
+        unique_removed_rules.push_back(i);
+      }
+      removed_rules.push_back(i);
+      return {};
+    }();
+  }
+  if (tuples.empty()) {
+    return results;
+  }
+  // both mutations go out in one ALTER and are applied in order
   auto query = std::format(
-      "ALTER TABLE {} UPDATE status = '{}' WHERE subaccount = '{}' and market = '{}' and symbol = '{}' and type = '{}'",
+      "ALTER TABLE {} UPDATE status = '{}' WHERE (subaccount, market, symbol, type) IN ({}), DELETE WHERE "
+      "(subaccount, market, symbol, type) IN ({})",
       kTradingBlockerTable,
       kRemoveBlockStatus,
-      subaccount,
-      util::lexical_cast<std::string>(market),
-      symbol,
-      type);
-  LOG_DEBUG("{}", query);
-  clickhouse_client_->Execute({std::move(query)});
-  query =
-      std::format("ALTER TABLE {} DELETE WHERE subaccount = '{}' and market = '{}' and symbol = '{}' and type = '{}'",
-                  kTradingBlockerTable,
-                  subaccount,
-                  util::lexical_cast<std::string>(market),
-                  symbol,
-                  type);
+      tuples,
+      tuples);
   LOG_DEBUG("{}", query);
-  clickhouse_client_->Execute({std::move(query)});
-  return {};
+  try {
+    clickhouse_client_.execute({std::move(query)});
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    for (size_t i : removed_rules) {
+      results[i] = tl::make_unexpected(std::string{"Failed to remove block rule. Exception: "} + e.what());
+    }
+    return results;
+  }
+  for (size_t i : unique_removed_rules) {
+    publish(BlockRuleDelta::Action::Remove, rules[i]);
+  }
+  return results;
 }
 
+tl::expected<BlocklistSnapshot, std::string> TradingBlocker::getBlockRules() {
+  std::lock_guard lock(rules_mutex_);
+  if (!rules_.has_value()) {
+    auto read = readBlockRules();
+    PROPAGATE_ERROR(read);
+    auto rules = *std::move(read);
+    // removals are asynchronous mutations, the rows may still be there
+    for (auto& [tuple, rule] : early_changes_) {
+      if (rule.has_value()) {
+        rules.insert_or_assign(tuple, std::move(*rule));
+      } else {
+        rules.erase(tuple);
+      }
+    }
+    early_changes_.clear();
+    rules_ = std::move(rules);
+  }
 
-std::optional<std::string> TradingBlocker::getStatus(const std::string& subaccount,
-                                                     infra::Market market,
-                                                     const std::string& symbol,
-                                                     const std::string& type) {
-  std::string query =
-      std::format("SELECT status FROM {} WHERE subaccount = '{}' and market = '{}' and symbol = '{}' and type = '{}'",
-                  kTradingBlockerTable,
-                  subaccount,
-                  util::lexical_cast<std::string>(market),
-                  symbol,
-                  type);
-  std::optional<std::string> status = std::nullopt;
-  clickhouse_client_->Select({std::move(query)}, [&](const clickhouse::Block& block) {
-    for (size_t i = 0; i < block.GetRowCount(); ++i) {
-      ASSERT_FATAL(i == 0,
-                   "Multiple rows for block rule " << subaccount << " " << market << " " << symbol << " " << type);
-      status = std::string{block[0]->As<clickhouse::ColumnString>()->At(i)};
+  BlocklistSnapshot snapshot{.version = version()};
+  snapshot.rules.reserve(rules_->size());
+  for (const auto& [tuple, rule] : *rules_) {
+    snapshot.rules.push_back(rule);
+  }
+  return snapshot;
+}
+
+tl::expected<size_t, std::string> TradingBlocker::refreshBlockRules() {
+  std::lock_guard refresh_lock(refresh_mutex_);
+  {
+    std::lock_guard lock(rules_mutex_);
+    if (!rules_.has_value()) {
+      // the first snapshot reads the rules, nobody holds an older state to diff against
+      return 0;
     }
-  });
-  return status;
+    refresh_changes_.emplace();
+  }
+  auto read = readBlockRules();
+
+  std::vector<BlockRuleDelta> deltas;
+  {
+    std::lock_guard lock(rules_mutex_);
+    auto changes = *std::exchange(refresh_changes_, std::nullopt);
+    PROPAGATE_ERROR(read);
+    auto& rules = *read;
+    for (auto& [tuple, rule] : changes) {
+      if (rule.has_value()) {
+        rules.insert_or_assign(tuple, std::move(*rule));
+      } else {
+        rules.erase(tuple);
+      }
+    }
+    std::vector<BlockRule> removed;
+    for (const auto& [tuple, rule] : *rules_) {
+      if (!rules.contains(tuple)) {
+        removed.push_back(rule);
+      }
+    }
+    for (const auto& rule : removed) {
+      deltas.push_back(apply(BlockRuleDelta::Action::Remove, rule));
+    }
+    for (const auto& [tuple, rule] : rules) {
+      if (!rules_->contains(tuple)) {
+        deltas.push_back(apply(BlockRuleDelta::Action::Add, rule));
+      }
+    }
+  }
+  for (const auto& delta : deltas) {
+    LOG_INFO("{} block rule {} {} {} {} outside this instance",
+             delta.action == BlockRuleDelta::Action::Add ? "added" : "removed",
+             delta.rule.subaccount,
+             delta.rule.market,
+             delta.rule.symbol,
+             delta.rule.type);
+    subscribers_.publish(delta);
+  }
+  return deltas.size();
+}
+
+uint64_t TradingBlocker::subscribe(Subscribers<BlockRuleDelta>::Callback callback) {
+  return subscribers_.subscribe(std::move(callback));
+}
+
+void TradingBlocker::unsubscribe(uint64_t subscription_id) {
+  subscribers_.unsubscribe(subscription_id);
+}
+
+uint64_t TradingBlocker::version() const {
+  return version_.load(std::memory_order_acquire);
+}
+
+void TradingBlocker::publish(BlockRuleDelta::Action action, const BlockRule& rule) {
+  BlockRuleDelta delta;
+  {
+    std::lock_guard lock(rules_mutex_);
+    delta = apply(action, rule);
+    if (refresh_changes_.has_value()) {
+      refresh_changes_->insert_or_assign(ruleTuple(rule),
+                                         action == BlockRuleDelta::Action::Add ? std::optional{rule} : std::nullopt);
+    }
+  }
+  subscribers_.publish(delta);
+}
+
+BlockRuleDelta TradingBlocker::apply(BlockRuleDelta::Action action, const BlockRule& rule) {
+  BlockRuleDelta delta{.action = action, .version = version_.fetch_add(1, std::memory_order_acq_rel) + 1, .rule = rule};
+  auto tuple = ruleTuple(rule);
+  if (rules_.has_value()) {
+    if (action == BlockRuleDelta::Action::Add) {
+      rules_->insert_or_assign(std::move(tuple), rule);
+    } else {
+      rules_->erase(tuple);
+    }
+  } else {
+    early_changes_.insert_or_assign(std::move(tuple),
+                                    action == BlockRuleDelta::Action::Add ? std::optional{rule} : std::nullopt);
+  }
+  return delta;
+}
+
+tl::expected<std::map<std::string, BlockRule>, std::string> TradingBlocker::readBlockRules() {
+  std::map<std::string, BlockRule> rules;
+  std::string query = std::format(
+      "SELECT subaccount, market, symbol, type FROM {} WHERE status = '{}'", kTradingBlockerTable, kDoneBlockStatus);
+  try {
+    clickhouse_client_.select({std::move(query)}, [&rules](const clickhouse::Block& block) {
+      for (size_t i = 0; i < block.GetRowCount(); ++i) {
+        BlockRule rule{
+            .subaccount = std::string{block[0]->As<clickhouse::ColumnString>()->At(i)},
+            .market = infra::Market{
+                util::lexical_cast<infra::Market::Type>(block[1]->As<clickhouse::ColumnString>()->At(i))},
+            .symbol = std::string{block[2]->As<clickhouse::ColumnString>()->At(i)},
+            .type = std::string{block[3]->As<clickhouse::ColumnString>()->At(i)},
+        };
+        rules.emplace(ruleTuple(rule), std::move(rule));
+      }
+    });
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to get block rules. Exception: "} + e.what());
+  }
+  return rules;
+}
+
+tl::expected<std::vector<std::optional<std::string>>, std::string> TradingBlocker::getStatuses(
+    const std::vector<BlockRule>& rules) {
+  std::vector<std::optional<std::string>> statuses(rules.size());
+  std::set<std::string> tuples;
+  for (const auto& rule : rules) {
+    if (isKnownType(rule.type)) {
+      tuples.insert(ruleTuple(rule));
+    }
+  }
+  if (tuples.empty()) {
+    return statuses;
+  }
+  std::string query = std::format("SELECT subaccount, market, symbol, type, status FROM {} WHERE (subaccount, "
+                                  "market, symbol, type) IN (",
+                                  kTradingBlockerTable);
+  for (auto it = tuples.begin(); it != tuples.end(); ++it) {
+    query += (it == tuples.begin() ? "" : ", ") + *it;
+  }
+  query += ")";
+  std::map<std::string, std::string> status_by_rule;
+  try {
+    clickhouse_client_.select({std::move(query)}, [&status_by_rule](const clickhouse::Block& block) {
+      for (size_t i = 0; i < block.GetRowCount(); ++i) {
+        BlockRule rule{
+            .subaccount = std::string{block[0]->As<clickhouse::ColumnString>()->At(i)},
+            .market = infra::Market{
+                util::lexical_cast<infra::Market::Type>(block[1]->As<clickhouse::ColumnString>()->At(i))},
+            .symbol = std::string{block[2]->As<clickhouse::ColumnString>()->At(i)},
+            .type = std::string{block[3]->As<clickhouse::ColumnString>()->At(i)},
+        };
+        auto [it, inserted] =
+            status_by_rule.emplace(ruleTuple(rule), std::string{block[4]->As<clickhouse::ColumnString>()->At(i)});
+        ASSERT_FATAL(inserted,
+                     "Multiple rows for block rule " << rule.subaccount << " " << rule.market << " " << rule.symbol
+                                                     << " " << rule.type);
+      }
+    });
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to get block rules status. Exception: "} + e.what());
+  }
+  for (size_t i = 0; i < rules.size(); ++i) {
+    auto it = status_by_rule.find(ruleTuple(rules[i]));
+    if (it != status_by_rule.end()) {
+      statuses[i] = it->second;
+    }
+  }
+  return statuses;
 }
 
 }  // namespace funds_controller
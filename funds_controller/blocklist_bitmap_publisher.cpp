@@ -0,0 +1,270 @@
+#include "prod/funds_controller/blocklist_bitmap_publisher.h"
+
+#include "util/error/error.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+namespace funds_controller {
+
+namespace {
+
+using Layout = BlocklistBitmapLayout;
+
+void writeName(Layout::SubaccountName& name, const std::string& subaccount) {
+  name.size = static_cast<uint8_t>(subaccount.size());
+  std::memcpy(name.data, subaccount.data(), subaccount.size());
+}
+
+}  // namespace
+
+BlocklistBitmapPublisher::BlocklistBitmapPublisher(TradingBlocker& trading_blocker, Options options):
+    trading_blocker_(trading_blocker), options_(std::move(options)) {
+}
+
+BlocklistBitmapPublisher::~BlocklistBitmapPublisher() {
+  stop();
+}
+
+tl::expected<void, std::string> BlocklistBitmapPublisher::start() {
+  EXPECT_WITH_STRING(!options_.universe_path.empty(), "Universe snapshot path is required");
+  EXPECT_WITH_STRING(options_.subaccount_capacity > 0, "Subaccount capacity must be positive");
+  subscription_id_ = trading_blocker_.subscribe([this](const BlockRuleDelta& delta) { onDelta(delta); });
+  auto result = [&]() -> tl::expected<void, std::string> {
+    auto snapshot = trading_blocker_.getBlockRules();
+    PROPAGATE_ERROR(snapshot);
+    std::lock_guard lock(mutex_);
+    PROPAGATE_ERROR(loadUniverse());
+    version_ = snapshot->version;
+    for (const auto& rule : snapshot->rules) {
+      PROPAGATE_ERROR(applyDelta({.action = BlockRuleDelta::Action::Add, .version = version_, .rule = rule}));
+    }
+    for (const auto& delta : early_deltas_) {
+      if (delta.version > version_) {
+        PROPAGATE_ERROR(applyDelta(delta));
+      }
+    }
+    early_deltas_.clear();
+    uint32_t subaccount_capacity = std::max<uint32_t>(
+        options_.subaccount_capacity, std::bit_ceil(static_cast<uint32_t>(rules_.size())));
+    PROPAGATE_ERROR(writeSegment(subaccount_capacity));
+    loaded_ = true;
+    return {};
+  }();
+  if (!result.has_value()) {
+    trading_blocker_.unsubscribe(std::exchange(subscription_id_, 0));
+  }
+  return result;
+}
+
+void BlocklistBitmapPublisher::stop() {
+  if (subscription_id_ != 0) {
+    trading_blocker_.unsubscribe(std::exchange(subscription_id_, 0));
+  }
+  // the segment is left in place with the last published state
+  std::lock_guard lock(mutex_);
+  unmapSegment();
+  loaded_ = false;
+}
+
+tl::expected<void, std::string> BlocklistBitmapPublisher::refreshUniverse() {
+  std::lock_guard lock(mutex_);
+  EXPECT_WITH_STRING(loaded_, "Blocklist bitmap publisher is not started");
+  if (!universe_->isStale()) {
+    return {};
+  }
+  PROPAGATE_ERROR(loadUniverse());
+  return writeSegment(header().subaccount_capacity);
+}
+
+void BlocklistBitmapPublisher::onDelta(const BlockRuleDelta& delta) {
+  std::lock_guard lock(mutex_);
+  if (!loaded_) {
+    early_deltas_.push_back(delta);
+    return;
+  }
+  auto result = applyDelta(delta);
+  if (!result.has_value()) {
+    LOG_ERROR("Failed to publish block rule delta: {}", result.error());
+  }
+}
+
+tl::expected<void, std::string> BlocklistBitmapPublisher::applyDelta(const BlockRuleDelta& delta) {
+  version_ = std::max(version_, delta.version);
+  auto rules = rulesFor(delta.rule.subaccount);
+  PROPAGATE_ERROR(rules);
+  auto& rule_set = delta.rule.type == "pair" ? (*rules)->pairs : (*rules)->assets;
+  MarketSymbol key{static_cast<uint16_t>(delta.rule.market.type()), delta.rule.symbol};
+  if (delta.action == BlockRuleDelta::Action::Add) {
+    rule_set.insert(std::move(key));
+  } else {
+    rule_set.erase(key);
+  }
+  if (segment_ == nullptr) {
+    return {};
+  }
+  uint32_t slot = (*rules)->slot;
+  if (slot >= header().subaccount_capacity) {
+    return writeSegment(header().subaccount_capacity * 2);
+  }
+
+  auto& header = this->header();
+  auto* words = row(slot);
+  uint64_t sequence = header.sequence.load(std::memory_order_relaxed);
+  header.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  for (uint32_t instrument_id : affectedInstruments(delta.rule)) {
+    uint64_t mask = uint64_t{1} << (instrument_id % 64);
+    auto& word = words[instrument_id / 64];
+    uint64_t value = word.load(std::memory_order_relaxed);
+    word.store(isBlocked(**rules, instrument_id) ? value | mask : value & ~mask, std::memory_order_relaxed);
+  }
+  header.sequence.store(sequence + 2, std::memory_order_release);
+  return {};
+}
+
+tl::expected<BlocklistBitmapPublisher::SubaccountRules*, std::string> BlocklistBitmapPublisher::rulesFor(
+    const std::string& subaccount) {
+  auto it = rules_.find(subaccount);
+  if (it != rules_.end()) {
+    return &it->second;
+  }
+  EXPECT_WITH_STRING(subaccount.size() < Layout::kSubaccountNameSize, "Subaccount name is too long: " << subaccount);
+  uint32_t slot = static_cast<uint32_t>(rules_.size());
+  it = rules_.emplace(subaccount, SubaccountRules{.slot = slot}).first;
+  if (segment_ != nullptr && slot < header().subaccount_capacity) {
+    // names are immutable once the count covers them, so readers need no seqlock for the lookup
+    auto* names = reinterpret_cast<Layout::SubaccountName*>(static_cast<char*>(segment_) + Layout::namesOffset());
+    writeName(names[slot], subaccount);
+    header().subaccount_count.store(slot + 1, std::memory_order_release);
+  }
+  return &it->second;
+}
+
+tl::expected<void, std::string> BlocklistBitmapPublisher::loadUniverse() {
+  auto universe = UniverseSnapshot::open(options_.universe_path);
+  PROPAGATE_ERROR(universe);
+  instruments_.assign(universe->instrumentIdCapacity(), std::nullopt);
+  instrument_by_pair_.clear();
+  instruments_by_quote_asset_.clear();
+  for (const auto& record : universe->records()) {
+    auto instrument_description = UniverseSnapshot::toInstrumentDescription(record);
+    Instrument instrument{
+        .pair = {record.market_type, std::string{record.pair()}},
+        .quote_asset = {record.market_type, std::string{getBaseAndQuoteAssets(instrument_description).second}},
+    };
+    instrument_by_pair_.emplace(instrument.pair, record.instrument_id);
+    instruments_by_quote_asset_[instrument.quote_asset].push_back(record.instrument_id);
+    instruments_[record.instrument_id] = std::move(instrument);
+  }
+  universe_ = std::move(*universe);
+  return {};
+}
+
+// Builds a complete segment next to the published one and renames it into place, then retires the
+// old one so readers reopen.
+tl::expected<void, std::string> BlocklistBitmapPublisher::writeSegment(uint32_t subaccount_capacity) {
+  uint32_t instrument_capacity = universe_->instrumentIdCapacity();
+  size_t size = Layout::segmentSize(subaccount_capacity, instrument_capacity);
+  std::string tmp_path = options_.segment_path + ".tmp";
+  int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  EXPECT_WITH_STRING(fd >= 0, "Failed to create " << tmp_path << ": " << std::strerror(errno));
+  void* data = MAP_FAILED;
+  if (::ftruncate(fd, static_cast<off_t>(size)) == 0) {
+    data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  std::string error = std::strerror(errno);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    ::unlink(tmp_path.c_str());
+    EXPECT_WITH_STRING(false, "Failed to map " << tmp_path << ": " << error);
+  }
+
+  auto* header = new (data) Layout::Header{};
+  header->magic = Layout::kMagic;
+  header->version = Layout::kVersion;
+  header->subaccount_capacity = subaccount_capacity;
+  header->instrument_capacity = instrument_capacity;
+  header->words_per_subaccount = static_cast<uint32_t>(Layout::wordsPerSubaccount(instrument_capacity));
+  header->universe_created_at_ms = universe_->createdAtMs();
+  auto* names = reinterpret_cast<Layout::SubaccountName*>(static_cast<char*>(data) + Layout::namesOffset());
+  auto* bits =
+      reinterpret_cast<std::atomic<uint64_t>*>(static_cast<char*>(data) + Layout::bitsOffset(subaccount_capacity));
+  for (const auto& [subaccount, rules] : rules_) {
+    writeName(names[rules.slot], subaccount);
+    auto* words = bits + rules.slot * header->words_per_subaccount;
+    auto block = [&](uint32_t instrument_id) {
+      words[instrument_id / 64].fetch_or(uint64_t{1} << (instrument_id % 64), std::memory_order_relaxed);
+    };
+    for (const auto& pair : rules.pairs) {
+      if (auto it = instrument_by_pair_.find(pair); it != instrument_by_pair_.end()) {
+        block(it->second);
+      }
+    }
+    for (const auto& asset : rules.assets) {
+      if (auto it = instruments_by_quote_asset_.find(asset); it != instruments_by_quote_asset_.end()) {
+        std::for_each(it->second.begin(), it->second.end(), block);
+      }
+    }
+  }
+  header->subaccount_count.store(static_cast<uint32_t>(rules_.size()), std::memory_order_release);
+
+  if (::rename(tmp_path.c_str(), options_.segment_path.c_str()) != 0) {
+    error = std::strerror(errno);
+    ::munmap(data, size);
+    ::unlink(tmp_path.c_str());
+    EXPECT_WITH_STRING(false, "Failed to rename " << tmp_path << " to " << options_.segment_path << ": " << error);
+  }
+  if (segment_ != nullptr) {
+    this->header().retired.store(1, std::memory_order_release);
+    unmapSegment();
+  }
+  segment_ = data;
+  segment_size_ = size;
+  LOG_INFO("Published blocklist bitmap {} for {} subaccounts and {} instruments",
+           options_.segment_path,
+           rules_.size(),
+           instrument_capacity);
+  return {};
+}
+
+void BlocklistBitmapPublisher::unmapSegment() {
+  if (segment_ != nullptr) {
+    ::munmap(std::exchange(segment_, nullptr), std::exchange(segment_size_, 0));
+  }
+}
+
+bool BlocklistBitmapPublisher::isBlocked(const SubaccountRules& rules, uint32_t instrument_id) const {
+  const auto& instrument = instruments_[instrument_id];
+  return instrument.has_value() &&
+         (rules.pairs.contains(instrument->pair) || rules.assets.contains(instrument->quote_asset));
+}
+
+std::vector<uint32_t> BlocklistBitmapPublisher::affectedInstruments(const BlockRule& rule) const {
+  MarketSymbol key{static_cast<uint16_t>(rule.market.type()), rule.symbol};
+  if (rule.type == "pair") {
+    auto it = instrument_by_pair_.find(key);
+    return it != instrument_by_pair_.end() ? std::vector<uint32_t>{it->second} : std::vector<uint32_t>{};
+  }
+  auto it = instruments_by_quote_asset_.find(key);
+  return it != instruments_by_quote_asset_.end() ? it->second : std::vector<uint32_t>{};
+}
+
+BlocklistBitmapLayout::Header& BlocklistBitmapPublisher::header() const {
+  return *static_cast<Layout::Header*>(segment_);
+}
+
+std::atomic<uint64_t>* BlocklistBitmapPublisher::row(uint32_t slot) const {
+  auto* bits = reinterpret_cast<std::atomic<uint64_t>*>(static_cast<char*>(segment_) +
+                                                        Layout::bitsOffset(header().subaccount_capacity));
+  return bits + slot * header().words_per_subaccount;
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,369 @@
+#include "prod/funds_controller/blocklist_feed.h"
+
+#include "util/error/error.h"
+#include "util/lexical_cast/lexical_cast.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstring>
+#include <format>
+
+namespace funds_controller {
+
+namespace {
+
+constexpr size_t kMaxPendingBytes = 64 << 20;
+constexpr auto kReconnectDelay = std::chrono::seconds(1);
+
+const std::string kResetAction = "reset";
+const std::string kSyncedAction = "synced";
+const std::string kAddAction = "add";
+const std::string kRemoveAction = "remove";
+
+std::string ruleKey(const BlockRule& rule) {
+  return std::format(
+      "{}\t{}\t{}\t{}", rule.subaccount, util::lexical_cast<std::string>(rule.market), rule.symbol, rule.type);
+}
+
+std::string formatLine(const std::string& action, uint64_t version, const BlockRule* rule = nullptr) {
+  if (rule == nullptr) {
+    return std::format("{}\t{}\n", action, version);
+  }
+  return std::format("{}\t{}\t{}\n", action, version, ruleKey(*rule));
+}
+
+tl::expected<sockaddr_un, std::string> unixAddress(const std::string& path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  EXPECT_WITH_STRING(path.size() < sizeof(address.sun_path), "Socket path is too long: " << path);
+  std::memcpy(address.sun_path, path.data(), path.size());
+  return address;
+}
+
+void sleepFor(std::stop_token stop_token, std::chrono::milliseconds duration) {
+  std::mutex mutex;
+  std::condition_variable_any condition;
+  std::unique_lock lock(mutex);
+  condition.wait_for(lock, stop_token, duration, [] { return false; });
+}
+
+}  // namespace
+
+BlocklistFeedServer::BlocklistFeedServer(TradingBlocker& trading_blocker, std::string socket_path):
+    trading_blocker_(trading_blocker), socket_path_(std::move(socket_path)) {
+}
+
+BlocklistFeedServer::~BlocklistFeedServer() {
+  stop();
+}
+
+tl::expected<void, std::string> BlocklistFeedServer::start() {
+  ASSERT_FATAL(listen_fd_ < 0, "Blocklist feed is already started");
+  auto address = unixAddress(socket_path_);
+  PROPAGATE_ERROR(address);
+
+  subscription_id_ = trading_blocker_.subscribe([this](const BlockRuleDelta& delta) { onDelta(delta); });
+  auto snapshot = trading_blocker_.getBlockRules();
+  if (!snapshot.has_value()) {
+    trading_blocker_.unsubscribe(std::exchange(subscription_id_, 0));
+    return tl::make_unexpected(snapshot.error());
+  }
+  {
+    std::lock_guard lock(mutex_);
+    version_ = snapshot->version;
+    for (const auto& rule : snapshot->rules) {
+      rules_.emplace(ruleKey(rule), rule);
+    }
+    for (const auto& delta : early_deltas_) {
+      if (delta.version > version_) {
+        applyDelta(delta);
+      }
+    }
+    early_deltas_.clear();
+    loaded_ = true;
+  }
+
+  auto listening = [&]() -> tl::expected<void, std::string> {
+    ::unlink(socket_path_.c_str());
+    listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    EXPECT_WITH_STRING(listen_fd_ >= 0, "Failed to create socket: " << std::strerror(errno));
+    EXPECT_WITH_STRING(::bind(listen_fd_, reinterpret_cast<const sockaddr*>(&*address), sizeof(sockaddr_un)) == 0,
+                       "Failed to bind " << socket_path_ << ": " << std::strerror(errno));
+    EXPECT_WITH_STRING(::listen(listen_fd_, 64) == 0,
+                       "Failed to listen on " << socket_path_ << ": " << std::strerror(errno));
+    wake_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    EXPECT_WITH_STRING(wake_fd_ >= 0, "Failed to create eventfd: " << std::strerror(errno));
+    return {};
+  }();
+  if (!listening.has_value()) {
+    // closes whatever was opened and unsubscribes, start() can be retried
+    stop();
+    std::lock_guard lock(mutex_);
+    rules_.clear();
+    loaded_ = false;
+    return listening;
+  }
+  LOG_INFO("Blocklist feed listening on {} with {} rules", socket_path_, rules_.size());
+  thread_ = std::jthread([this](std::stop_token stop_token) { run(stop_token); });
+  return {};
+}
+
+void BlocklistFeedServer::stop() {
+  if (subscription_id_ != 0) {
+    trading_blocker_.unsubscribe(std::exchange(subscription_id_, 0));
+  }
+  if (thread_.joinable()) {
+    thread_.request_stop();
+    wake();
+    thread_.join();
+  }
+  for (auto& client : clients_) {
+    ::close(client.fd);
+  }
+  clients_.clear();
+  if (listen_fd_ >= 0) {
+    ::close(std::exchange(listen_fd_, -1));
+    ::unlink(socket_path_.c_str());
+  }
+  if (wake_fd_ >= 0) {
+    ::close(std::exchange(wake_fd_, -1));
+  }
+}
+
+void BlocklistFeedServer::onDelta(const BlockRuleDelta& delta) {
+  std::lock_guard lock(mutex_);
+  if (!loaded_) {
+    early_deltas_.push_back(delta);
+    return;
+  }
+  applyDelta(delta);
+  wake();
+}
+
+void BlocklistFeedServer::applyDelta(const BlockRuleDelta& delta) {
+  version_ = std::max(version_, delta.version);
+  const std::string* action = nullptr;
+  if (delta.action == BlockRuleDelta::Action::Add) {
+    rules_.insert_or_assign(ruleKey(delta.rule), delta.rule);
+    action = &kAddAction;
+  } else {
+    rules_.erase(ruleKey(delta.rule));
+    action = &kRemoveAction;
+  }
+  std::string line = formatLine(*action, delta.version, &delta.rule);
+  for (auto& client : clients_) {
+    client.pending += line;
+  }
+}
+
+void BlocklistFeedServer::wake() {
+  if (wake_fd_ >= 0) {
+    uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(wake_fd_, &one, sizeof(one));
+  }
+}
+
+void BlocklistFeedServer::run(std::stop_token stop_token) {
+  std::vector<pollfd> fds;
+  while (!stop_token.stop_requested()) {
+    fds.clear();
+    fds.push_back({.fd = listen_fd_, .events = POLLIN, .revents = 0});
+    fds.push_back({.fd = wake_fd_, .events = POLLIN, .revents = 0});
+    {
+      std::lock_guard lock(mutex_);
+      for (const auto& client : clients_) {
+        fds.push_back({.fd = client.fd,
+                       .events = static_cast<short>(POLLIN | (client.pending.empty() ? 0 : POLLOUT)),
+                       .revents = 0});
+      }
+    }
+    if (::poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) {
+      LOG_ERROR("Blocklist feed poll failed: {}", std::strerror(errno));
+      continue;
+    }
+    if (fds[1].revents & POLLIN) {
+      uint64_t counter;
+      [[maybe_unused]] auto read = ::read(wake_fd_, &counter, sizeof(counter));
+    }
+    std::lock_guard lock(mutex_);
+    // only this thread adds or removes clients, so fds[i + 2] still matches clients_[i]
+    std::vector<Client> alive;
+    alive.reserve(clients_.size());
+    for (size_t i = 0; i < clients_.size(); ++i) {
+      auto& client = clients_[i];
+      bool connected = true;
+      if (i + 2 < fds.size() && (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) {
+        char ignored[256];
+        ssize_t read = ::recv(client.fd, ignored, sizeof(ignored), MSG_DONTWAIT);
+        connected = read > 0 || (read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+      }
+      if (connected && flush(client)) {
+        alive.push_back(std::move(client));
+      } else {
+        ::close(client.fd);
+      }
+    }
+    clients_ = std::move(alive);
+    if (fds[0].revents & POLLIN) {
+      acceptClient();
+    }
+  }
+}
+
+void BlocklistFeedServer::acceptClient() {
+  while (true) {
+    int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    Client client{.fd = fd, .pending = formatLine(kResetAction, version_)};
+    for (const auto& [key, rule] : rules_) {
+      client.pending += formatLine(kAddAction, version_, &rule);
+    }
+    client.pending += formatLine(kSyncedAction, version_);
+    if (flush(client)) {
+      clients_.push_back(std::move(client));
+    } else {
+      ::close(fd);
+    }
+  }
+}
+
+bool BlocklistFeedServer::flush(Client& client) {
+  size_t sent = 0;
+  while (sent < client.pending.size()) {
+    ssize_t result = ::send(client.fd, client.pending.data() + sent, client.pending.size() - sent, MSG_NOSIGNAL);
+    if (result > 0) {
+      sent += static_cast<size_t>(result);
+      continue;
+    }
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    return false;
+  }
+  client.pending.erase(0, sent);
+  if (client.pending.size() > kMaxPendingBytes) {
+    LOG_ERROR("Dropping slow blocklist feed client with {} pending bytes", client.pending.size());
+    return false;
+  }
+  return true;
+}
+
+BlocklistFeedClient::BlocklistFeedClient(std::string socket_path,
+                                         std::function<void(const BlocklistSnapshot&)> on_snapshot,
+                                         std::function<void(const BlockRuleDelta&)> on_delta):
+    socket_path_(std::move(socket_path)), on_snapshot_(std::move(on_snapshot)), on_delta_(std::move(on_delta)) {
+}
+
+BlocklistFeedClient::~BlocklistFeedClient() {
+  stop();
+}
+
+void BlocklistFeedClient::start() {
+  ASSERT_FATAL(!thread_.joinable(), "Blocklist feed client is already started");
+  thread_ = std::jthread([this](std::stop_token stop_token) { run(stop_token); });
+}
+
+void BlocklistFeedClient::stop() {
+  if (thread_.joinable()) {
+    thread_.request_stop();
+    thread_.join();
+  }
+}
+
+void BlocklistFeedClient::run(std::stop_token stop_token) {
+  auto address = unixAddress(socket_path_);
+  ASSERT_FATAL(address.has_value(), address.error());
+  while (!stop_token.stop_requested()) {
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr*>(&*address), sizeof(sockaddr_un)) != 0) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      sleepFor(stop_token, kReconnectDelay);
+      continue;
+    }
+    // wake up periodically to notice stop requests
+    timeval timeout{.tv_sec = 1, .tv_usec = 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    pending_snapshot_.reset();
+    std::string buffer;
+    char chunk[64 * 1024];
+    while (!stop_token.stop_requested()) {
+      ssize_t read = ::recv(fd, chunk, sizeof(chunk), 0);
+      if (read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        continue;
+      }
+      if (read <= 0) {
+        LOG_INFO("Blocklist feed {} disconnected, reconnecting", socket_path_);
+        break;
+      }
+      buffer.append(chunk, static_cast<size_t>(read));
+      size_t line_start = 0;
+      size_t line_end;
+      while ((line_end = buffer.find('\n', line_start)) != std::string::npos) {
+        auto result = handleLine(std::string_view{buffer}.substr(line_start, line_end - line_start));
+        if (!result.has_value()) {
+          LOG_ERROR("{}", result.error());
+        }
+        line_start = line_end + 1;
+      }
+      buffer.erase(0, line_start);
+    }
+    ::close(fd);
+  }
+}
+
+tl::expected<void, std::string> BlocklistFeedClient::handleLine(std::string_view line) {
+  std::vector<std::string_view> fields;
+  while (true) {
+    size_t separator = line.find('\t');
+    fields.push_back(line.substr(0, separator));
+    if (separator == std::string_view::npos) {
+      break;
+    }
+    line.remove_prefix(separator + 1);
+  }
+  EXPECT_WITH_STRING(fields.size() >= 2, "Malformed blocklist feed line");
+  uint64_t version = 0;
+  std::from_chars(fields[1].data(), fields[1].data() + fields[1].size(), version);
+  if (fields[0] == kResetAction) {
+    pending_snapshot_ = BlocklistSnapshot{.version = version};
+    return {};
+  }
+  if (fields[0] == kSyncedAction) {
+    EXPECT_WITH_STRING(pending_snapshot_.has_value(), "Blocklist feed synced without reset");
+    on_snapshot_(*pending_snapshot_);
+    pending_snapshot_.reset();
+    return {};
+  }
+  EXPECT_WITH_STRING(fields.size() == 6, "Malformed blocklist feed rule line");
+  EXPECT_WITH_STRING(fields[0] == kAddAction || fields[0] == kRemoveAction,
+                     "Unknown blocklist feed action " << fields[0]);
+  BlockRuleDelta delta{
+      .action = fields[0] == kAddAction ? BlockRuleDelta::Action::Add : BlockRuleDelta::Action::Remove,
+      .version = version,
+      .rule = BlockRule{
+          .subaccount = std::string{fields[2]},
+          .market = infra::Market{util::lexical_cast<infra::Market::Type>(fields[3])},
+          .symbol = std::string{fields[4]},
+          .type = std::string{fields[5]},
+      },
+  };
+  if (pending_snapshot_.has_value()) {
+    pending_snapshot_->rules.push_back(std::move(delta.rule));
+    return {};
+  }
+  on_delta_(delta);
+  return {};
+}
+
+}  // namespace funds_controller
@@ -1,24 +1,116 @@
 #include "prod/funds_controller/clickhouse_client.h"
 
 #include "util/env/env.h"
+#include "util/error/error.h"
 
+#include <openssl/ssl.h>
+
+#include <condition_variable>
 #include <iomanip>
+#include <mutex>
 #include <sstream>
+#include <utility>
 
 namespace funds_controller {
 
-std::unique_ptr<clickhouse::Client> getFundsControllerClickhouseClient() {
+namespace {
+
+SSL_CTX* sharedSslContext() {
+  static SSL_CTX* ssl_context = [] {
+    SSL_CTX* context = SSL_CTX_new(TLS_client_method());
+    ASSERT_FATAL(context != nullptr, "Failed to create SSL context");
+    ASSERT_FATAL(SSL_CTX_set_default_verify_paths(context) == 1, "Failed to load CA locations");
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT);
+    return context;
+  }();
+  return ssl_context;
+}
+
+struct PendingConnections {
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t count = 0;
+  size_t failed = 0;
+};
+
+PendingConnections& pendingConnections() {
+  static PendingConnections pending;
+  return pending;
+}
+
+}  // namespace
+
+std::unique_ptr<clickhouse::Client> getFundsControllerClickhouseClient(std::chrono::milliseconds io_timeout) {
   const auto user = util::getEnv("CLICKHOUSE_FUNDS_CONTROLLER_USER", "default_funds_controller");
   const auto password = util::getEnv("CLICKHOUSE_FUNDS_CONTROLLER_PASSWORD", "xp2pW14mw!fzd?q");
-  return std::make_unique<clickhouse::Client>(clickhouse::ClientOptions()
-                                                  .SetHost("ah4ojmnosb.ap-southeast-1.aws.clickhouse.cloud")
-                                                  .SetPort(9440)
-                                                  .SetUser(user)
-                                                  .SetPassword(password)
-                                                  .SetSendRetries(5)
-                                                  .SetSSLOptions(clickhouse::ClientOptions::SSLOptions()));
+  auto options = clickhouse::ClientOptions()
+                     .SetHost("ah4ojmnosb.ap-southeast-1.aws.clickhouse.cloud")
+                     .SetPort(9440)
+                     .SetUser(user)
+                     .SetPassword(password)
+                     .SetSendRetries(5)
+                     .SetSSLOptions(clickhouse::ClientOptions::SSLOptions().SetExternalSSLContext(sharedSslContext()));
+  if (io_timeout.count() > 0) {
+    options.SetConnectionRecvTimeout(io_timeout).SetConnectionSendTimeout(io_timeout);
+  }
+  return std::make_unique<clickhouse::Client>(options);
 }
 
+ClickhouseClientHandle::ClickhouseClientHandle(std::chrono::milliseconds io_timeout): io_timeout_(io_timeout) {
+  auto& pending = pendingConnections();
+  {
+    std::lock_guard lock(pending.mutex);
+    ++pending.count;
+  }
+  client_ = std::async(std::launch::async, [&pending, io_timeout] {
+              struct Done {
+                PendingConnections& pending;
+                bool connected = false;
+                ~Done() {
+                  {
+                    std::lock_guard lock(pending.mutex);
+                    --pending.count;
+                    pending.failed += connected ? 0 : 1;
+                  }
+                  pending.done.notify_all();
+                }
+              } done{pending};
+              auto client = getFundsControllerClickhouseClient(io_timeout);
+              done.connected = true;
+              return client;
+            }).share();
+}
+
+clickhouse::Client& ClickhouseClientHandle::client() {
+  try {
+    return *client_.get();
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+  }
+  // a throwing connect leaves the failed one in place, the next call tries again
+  std::promise<std::unique_ptr<clickhouse::Client>> connected;
+  connected.set_value(getFundsControllerClickhouseClient(io_timeout_));
+  client_ = connected.get_future().share();
+  return *client_.get();
+}
+
+bool ClickhouseClientHandle::ready() {
+  try {
+    return client_.get() != nullptr;
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return false;
+  }
+}
+
+bool waitForClickhouseConnections() {
+  auto& pending = pendingConnections();
+  std::unique_lock lock(pending.mutex);
+  pending.done.wait(lock, [&pending] { return pending.count == 0; });
+  return std::exchange(pending.failed, 0) == 0;
+}
 
 std::string convertUUIDToString(const clickhouse::UUID& uuid) {
   std::stringstream ss;
@@ -0,0 +1,122 @@
+#include "prod/funds_controller/exposure_engine.h"
+
+#include "prod/funds_controller/clickhouse_client.h"
+
+#include "util/error/error.h"
+
+#include <mutex>
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kLoansInfoTable = "LOANS_INFO_v2";
+const std::string kHedgeInfoTable = "HEDGES_INFO_v2";
+const std::string kTransactionsTable = "TRANSACTIONS_v1";
+const std::string kDoneStatus = "done";
+
+}  // namespace
+
+void Exposure::apply(LedgerEvent::Kind kind, infra::Volume amount) {
+  switch (kind) {
+    case LedgerEvent::Kind::Loan:
+      loans += amount;
+      break;
+    case LedgerEvent::Kind::Hedge:
+      hedges += amount;
+      break;
+    case LedgerEvent::Kind::Transfer:
+      transfers += amount;
+      break;
+  }
+}
+
+ExposureEngine::ExposureEngine():
+    subscription_id_(ledgerEvents().subscribe([this](const LedgerEvent& event) { apply(event); })) {
+}
+
+ExposureEngine::~ExposureEngine() {
+  ledgerEvents().unsubscribe(subscription_id_);
+}
+
+tl::expected<void, std::string> ExposureEngine::load() {
+  auto clickhouse_client = getFundsControllerClickhouseClient();
+  EXPECT_WITH_STRING(clickhouse_client, "Failed to create clickhouse client");
+  std::vector<LedgerEvent> events;
+  auto load_events = [&](LedgerEvent::Kind kind, std::string query) {
+    clickhouse_client->Select({std::move(query)}, [&events, kind](const clickhouse::Block& block) {
+      for (size_t i = 0; i < block.GetRowCount(); ++i) {
+        events.push_back({kind,
+                          std::string{block[0]->As<clickhouse::ColumnString>()->At(i)},
+                          std::string{block[1]->As<clickhouse::ColumnString>()->At(i)},
+                          convertClickhouseDecimalToDecimal(block[2]->As<clickhouse::ColumnDecimal>()->At(i))});
+      }
+    });
+  };
+  auto amounts_query = [](const std::string& table) {
+    return std::format(
+        "SELECT subaccount, asset, sum(amount) FROM {} WHERE status = '{}' GROUP BY subaccount, asset",
+        table,
+        kDoneStatus);
+  };
+  try {
+    load_events(LedgerEvent::Kind::Loan, amounts_query(kLoansInfoTable));
+    load_events(LedgerEvent::Kind::Hedge, amounts_query(kHedgeInfoTable));
+    load_events(LedgerEvent::Kind::Transfer,
+                std::format("SELECT subaccount, asset, sum(amount) FROM ("
+                            "SELECT from_subaccount AS subaccount, asset, -amount AS amount FROM {0} "
+                            "WHERE type = 'transfer' AND status = '{1}' UNION ALL "
+                            "SELECT to_subaccount AS subaccount, asset, amount FROM {0} "
+                            "WHERE type = 'transfer' AND status = '{1}') GROUP BY subaccount, asset",
+                            kTransactionsTable,
+                            kDoneStatus));
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to load exposure. Exception: "} + e.what());
+  }
+
+  ExposureSnapshot state;
+  for (const auto& event : events) {
+    state.by_subaccount[event.subaccount][event.asset].apply(event.kind, event.amount);
+    state.by_asset[event.asset].apply(event.kind, event.amount);
+  }
+  restore(std::move(state));
+  return {};
+}
+
+void ExposureEngine::restore(ExposureSnapshot state) {
+  std::unique_lock lock(mutex_);
+  state.sequence = state_.sequence;
+  state_ = std::move(state);
+  LOG_INFO("Loaded exposure of {} assets", state_.by_asset.size());
+}
+
+Exposure ExposureEngine::exposure(const std::string& subaccount, const std::string& asset) const {
+  std::shared_lock lock(mutex_);
+  auto subaccount_it = state_.by_subaccount.find(subaccount);
+  if (subaccount_it == state_.by_subaccount.end()) {
+    return {};
+  }
+  auto it = subaccount_it->second.find(asset);
+  return it != subaccount_it->second.end() ? it->second : Exposure{};
+}
+
+Exposure ExposureEngine::exposure(const std::string& asset) const {
+  std::shared_lock lock(mutex_);
+  auto it = state_.by_asset.find(asset);
+  return it != state_.by_asset.end() ? it->second : Exposure{};
+}
+
+ExposureSnapshot ExposureEngine::snapshot() const {
+  std::shared_lock lock(mutex_);
+  return state_;
+}
+
+void ExposureEngine::apply(const LedgerEvent& event) {
+  std::unique_lock lock(mutex_);
+  state_.by_subaccount[event.subaccount][event.asset].apply(event.kind, event.amount);
+  state_.by_asset[event.asset].apply(event.kind, event.amount);
+  ++state_.sequence;
+}
+
+}  // namespace funds_controller
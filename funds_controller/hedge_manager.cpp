@@ -1,7 +1,15 @@
 #include "prod/funds_controller/hedge_manager.h"
 
+#include "prod/funds_controller/alert_dispatcher.h"
 #include "prod/funds_controller/block_trading.h"
+#include "prod/funds_controller/idempotency_store.h"
+#include "prod/funds_controller/ledger_events.h"
+#include "prod/funds_controller/lease_manager.h"
+#include "prod/funds_controller/ledger_writer.h"
 #include "prod/funds_controller/main_commands.h"
+#include "prod/funds_controller/operation_arena.h"
+#include "prod/funds_controller/row_updates.h"
+#include "prod/funds_controller/universe_snapshot.h"
 #include "prod/transfer/transfer.h"
 
 #include "common/instrument/instrument_impl.h"
@@ -10,11 +18,14 @@
 #include "util/generator/generate_uuid.h"
 #include "util/lexical_cast/lexical_cast.h"
 #include "util/time/time.h"
-#include "util/slack/slack.h"
 
 #include <magic_enum/magic_enum.hpp>
 
+#include <functional>
+#include <iterator>
+#include <map>
 #include <set>
+#include <tuple>
 
 namespace funds_controller {
 
@@ -25,12 +36,12 @@ const std::string kHedgeInfoTable = "HEDGES_INFO_v2";
 const std::string kDoneStatus = "done";
 // const std::string kPendingLoanStatus = "pending";
 const std::string kRemoveStatus = "removed";
+const AmountTable kHedgeRows{.name = kHedgeTable, .amount_column = "crypto_eq_amount", .has_update_timestamp = true};
+const AmountTable kHedgeInfoRows{.name = kHedgeInfoTable};
 
 }  // namespace
 
-HedgeManager::HedgeManager(): clickhouse_client_(getFundsControllerClickhouseClient()) {
-  ASSERT_FATAL(clickhouse_client_, "Failed to create clickhouse client");
-}
+HedgeManager::HedgeManager() = default;
 
 tl::expected<std::vector<HedgeManager::HedgeInfo>, std::string> HedgeManager::getHedgesInfo(
     const std::string& subaccount, const std::string& asset) {
@@ -39,7 +50,7 @@ tl::expected<std::vector<HedgeManager::HedgeInfo>, std::string> HedgeManager::ge
   std::vector<HedgeInfo> hedges_info;
   LOG_DEBUG("{}", query);
   try {
-    clickhouse_client_->Select({std::move(query)}, [&hedges_info, &subaccount, &asset](const clickhouse::Block& block) {
+    clickhouse_client_.select({std::move(query)}, [&hedges_info, &subaccount, &asset](const clickhouse::Block& block) {
       for (size_t i = 0; i < block.GetRowCount(); ++i) {
         HedgeInfo hedge_info;
         hedge_info.subaccount = subaccount;
@@ -64,40 +75,93 @@ tl::expected<std::vector<HedgeManager::HedgeInfo>, std::string> HedgeManager::ge
 }
 
 tl::expected<HedgeManager::FuturesHedge, std::string> HedgeManager::getFuturesHedge(const std::string& hedge_id) {
-  std::string query = "SELECT id, subaccount, market, pair, crypto_eq_amount, open_amount_usd, hedge_id, status FROM " +
-      kHedgeTable + " WHERE hedge_id = '" + hedge_id + "'";
-  FuturesHedge futures_hedge;
+  auto futures_hedges = getFuturesHedges({hedge_id});
+  PROPAGATE_ERROR(futures_hedges);
+  auto it = futures_hedges->find(hedge_id);
+  return it != futures_hedges->end() ? it->second : FuturesHedge{};
+}
+
+tl::expected<std::map<std::string, HedgeManager::FuturesHedge>, std::string> HedgeManager::getFuturesHedges(
+    const std::vector<std::string>& hedge_ids) {
+  std::map<std::string, FuturesHedge> futures_hedges;
+  if (hedge_ids.empty()) {
+    return futures_hedges;
+  }
+  std::string query = std::format(
+      "SELECT id, subaccount, market, pair, crypto_eq_amount, open_amount_usd, hedge_id, status FROM {} WHERE "
+      "hedge_id IN ({})",
+      kHedgeTable,
+      quotedList(hedge_ids));
   LOG_DEBUG("{}", query);
   try {
-    clickhouse_client_->Select({std::move(query)}, [&futures_hedge](const clickhouse::Block& block) {
-      ASSERT_FATAL(block.GetRowCount() <= 1, "Expected only one row");
-      if (block.GetRowCount() == 0) {
-        return;
-      }
-      futures_hedge.id = convertUUIDToString(block[0]->As<clickhouse::ColumnUUID>()->At(0));
-      futures_hedge.subaccount = std::string{block[1]->As<clickhouse::ColumnString>()->At(0)};
-      auto market_type =
-          magic_enum::enum_cast<infra::Market::Type>(std::string{block[2]->As<clickhouse::ColumnString>()->At(0)});
-      if (!market_type.has_value()) {
-        LOG_ERROR("Unknown market type {}", std::string{block[2]->As<clickhouse::ColumnString>()->At(0)});
-        return;
+    clickhouse_client_.select({std::move(query)}, [&futures_hedges](const clickhouse::Block& block) {
+      for (size_t i = 0; i < block.GetRowCount(); ++i) {
+        FuturesHedge futures_hedge;
+        futures_hedge.id = convertUUIDToString(block[0]->As<clickhouse::ColumnUUID>()->At(i));
+        futures_hedge.subaccount = std::string{block[1]->As<clickhouse::ColumnString>()->At(i)};
+        auto market_type =
+            magic_enum::enum_cast<infra::Market::Type>(std::string{block[2]->As<clickhouse::ColumnString>()->At(i)});
+        if (!market_type.has_value()) {
+          LOG_ERROR("Unknown market type {}", std::string{block[2]->As<clickhouse::ColumnString>()->At(i)});
+          continue;
+        }
+        futures_hedge.market = infra::Market{*market_type};
+        futures_hedge.pair = std::string{block[3]->As<clickhouse::ColumnString>()->At(i)};
+        futures_hedge.crypto_eq_amount =
+            convertClickhouseDecimalToDecimal(block[4]->As<clickhouse::ColumnDecimal>()->At(i));
+        futures_hedge.open_amount_usd =
+            convertClickhouseDecimalToDecimal(block[5]->As<clickhouse::ColumnDecimal>()->At(i));
+        futures_hedge.hedge_id = std::string{block[6]->As<clickhouse::ColumnString>()->At(i)};
+        futures_hedge.status = std::string{block[7]->As<clickhouse::ColumnString>()->At(i)};
+        auto hedge_id = futures_hedge.hedge_id;
+        ASSERT_FATAL(futures_hedges.emplace(std::move(hedge_id), std::move(futures_hedge)).second,
+                     "Expected only one row");
       }
-      futures_hedge.market = infra::Market{*market_type};
-      futures_hedge.pair = std::string{block[3]->As<clickhouse::ColumnString>()->At(0)};
-      futures_hedge.crypto_eq_amount =
-          convertClickhouseDecimalToDecimal(block[4]->As<clickhouse::ColumnDecimal>()->At(0));
-      futures_hedge.open_amount_usd =
-          convertClickhouseDecimalToDecimal(block[5]->As<clickhouse::ColumnDecimal>()->At(0));
-      futures_hedge.hedge_id = std::string{block[6]->As<clickhouse::ColumnString>()->At(0)};
-      futures_hedge.status = std::string{block[7]->As<clickhouse::ColumnString>()->At(0)};
     });
   } catch (const std::exception& e) {
     LOG_ERROR("clickhouse error: {}", e.what());
     return tl::make_unexpected(std::string{"Failed to get futures hedge info. Exception: "} + e.what());
   }
-  return futures_hedge;
+  return futures_hedges;
 }
 
+tl::expected<std::vector<HedgeManager::HedgeInfo>, std::string> HedgeManager::getHedgesInfo(
+    const std::set<std::pair<std::string, std::string>>& subaccount_assets) {
+  std::vector<HedgeInfo> hedges_info;
+  if (subaccount_assets.empty()) {
+    return hedges_info;
+  }
+  std::string tuples;
+  for (const auto& [subaccount, asset] : subaccount_assets) {
+    tuples += std::format("{}('{}', '{}')", tuples.empty() ? "" : ", ", subaccount, asset);
+  }
+  std::string query = std::format(
+      "SELECT id, subaccount, asset, amount, initial_subaccount, hedge_id FROM {} WHERE status = '{}' AND "
+      "(subaccount, asset) IN ({})",
+      kHedgeInfoTable,
+      kDoneStatus,
+      tuples);
+  LOG_DEBUG("{}", query);
+  try {
+    clickhouse_client_.select({std::move(query)}, [&hedges_info](const clickhouse::Block& block) {
+      for (size_t i = 0; i < block.GetRowCount(); ++i) {
+        HedgeInfo hedge_info;
+        hedge_info.id = convertUUIDToString(block[0]->As<clickhouse::ColumnUUID>()->At(i));
+        hedge_info.subaccount = std::string{block[1]->As<clickhouse::ColumnString>()->At(i)};
+        hedge_info.asset = std::string{block[2]->As<clickhouse::ColumnString>()->At(i)};
+        hedge_info.amount = convertClickhouseDecimalToDecimal(block[3]->As<clickhouse::ColumnDecimal>()->At(i));
+        hedge_info.initial_account = std::string{block[4]->As<clickhouse::ColumnString>()->At(i)};
+        hedge_info.hedge_id = std::string{block[5]->As<clickhouse::ColumnString>()->At(i)};
+        hedge_info.status = kDoneStatus;
+        hedges_info.push_back(std::move(hedge_info));
+      }
+    });
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to get hedges info. Exception: "} + e.what());
+  }
+  return hedges_info;
+}
 
 tl::expected<infra::Volume, std::string> HedgeManager::getCurrentHedgeAmountOnAccount(const std::string& subaccount,
                                                                                       const std::string& asset) {
@@ -113,44 +177,59 @@ tl::expected<infra::Volume, std::string> HedgeManager::getCurrentHedgeAmountOnAc
 tl::expected<void, std::string> HedgeManager::createHedge(const std::string& subaccount,
                                                           infra::Exchange exchange,
                                                           const std::string& asset,
-                                                          infra::Volume amount) {
+                                                          infra::Volume amount,
+                                                          const std::string& idempotency_key) {
+  if (!idempotency_key.empty()) {
+    return idempotencyStore().run({{subaccount, asset}},
+                                  idempotency_key,
+                                  std::format("hedge {} {} {} {}",
+                                              subaccount,
+                                              util::lexical_cast<std::string>(exchange),
+                                              asset,
+                                              util::lexical_cast<std::string>(amount)),
+                                  [&] { return executeCreateHedge(subaccount, exchange, asset, amount); });
+  }
+  return toResult(executeCreateHedge(subaccount, exchange, asset, amount));
+}
+
+OperationResult HedgeManager::executeCreateHedge(const std::string& subaccount,
+                                                 infra::Exchange exchange,
+                                                 const std::string& asset,
+                                                 infra::Volume amount) {
   EXPECT_WITH_STRING(amount > 0, "Amount should be positive");
+  auto lease = lockKeys({{subaccount, asset}});
+  PROPAGATE_ERROR(lease);
   LOG_INFO("Creating hedge {} {} {} {} {}", subaccount, exchange, asset, amount);
-  transfer::CryptoTransfer crypto_transfer({exchange});
-  auto futures_instrument_description = crypto_transfer.getFuturesInstrumentByAsset(asset, exchange);
-  auto instrument_updates = crypto_transfer.getInstrumentUpdates(futures_instrument_description.value.market);
-  PROPAGATE_ERROR(instrument_updates);
-  auto instrument_update = [&]() -> tl::expected<infra::InstrumentUpdate, std::string> {
-    for (const auto& instrument_update : *instrument_updates) {
-      if (instrument_update.description() == futures_instrument_description) {
-        return instrument_update;
-      }
-    }
-    EXPECT_WITH_STRING(false, "Instrument update for " << futures_instrument_description << " not found");
-  }();
-  PROPAGATE_ERROR(instrument_update);
-
-  infra::InstrumentImpl instrument(*instrument_update);
-  std::unique_ptr<ICommand> sell_command = std::make_unique<SendMarketCommand>(
-      subaccount, futures_instrument_description, -amount * (instrument.contractSize() * (1 / instrument.lotSize())));
-  std::unique_ptr<ICommand> buy_command = std::make_unique<SendMarketCommand>(
-      subaccount, crypto_transfer.getSpotInstrumentByAsset(asset, exchange), amount);
-  std::vector<std::unique_ptr<ICommand>> commands;
-  commands.push_back(std::move(sell_command));
-  commands.push_back(std::move(buy_command));
-  std::unique_ptr<ICommand> command = std::make_unique<MergeCommands>(std::move(commands));
-  auto hedge_result = command->execute();
+  auto command = makeHedgeCommand(subaccount, exchange, asset, amount);
+  PROPAGATE_ERROR(command);
+  auto futures_instrument_description =
+      transfer::CryptoTransfer({exchange}).getFuturesInstrumentByAsset(asset, exchange);
+  auto hedge_result = (*command)->execute();
   PROPAGATE_ERROR(hedge_result);
-  auto process_error = [&](const std::string& error) -> tl::expected<void, std::string> {
+  auto process_error = [&](const OperationError& error) -> OperationResult {
+    // a write that may still land books the hedge, closing it would leave the booking without a position
+    if (error.isUnknownOutcome()) {
+      alertDispatcher().alert("create_hedge_write_unknown " + subaccount + " " + asset,
+                              std::format("Hedge of {} {} in {} may not be recorded, not closing it: {}",
+                                          util::lexical_cast<std::string>(amount),
+                                          asset,
+                                          subaccount,
+                                          error.message));
+      return tl::make_unexpected(error);
+    }
     LOG_INFO("Closing hedge, because inserting to clickhouse failed");
-    auto command_result = command->undo();
+    auto command_result = (*command)->undo();
     if (!command_result.has_value()) {
-      util::SlackAlerter::FundsAlerter().send("Failed to write to clickhouse and closing hedge. Closing hedge error: " +
-                                       command_result.error());
-      return tl::make_unexpected("Failed to write to clickhouse and closing hedge. Closing hedge error: " +
-                                 command_result.error());
+      alertDispatcher().alert("create_hedge_undo " + subaccount + " " + asset,
+                              std::format("Failed to record hedge of {} {} in {} and to close it: {}",
+                                          util::lexical_cast<std::string>(amount),
+                                          asset,
+                                          subaccount,
+                                          command_result.error()));
+      return unknownOutcome("Failed to write to clickhouse and closing hedge. Closing hedge error: " +
+                            command_result.error());
     }
-    return tl::make_unexpected(std::string{"Failed to write to clickhouse. Exception: "} + error);
+    return tl::make_unexpected(std::string{"Failed to write to clickhouse. Exception: "} + error.message);
   };
   std::string hedge_id = util::generateUuid().substr(0, 30);
   auto result = createNewFuturesHedgeRow(subaccount,
@@ -166,95 +245,412 @@ tl::expected<void, std::string> HedgeManager::createHedge(const std::string& sub
     // deleteRowByHedgeId(kHedgeTable, hedge_id);
     return process_error(result.error());
   }
+  publishLedgerEvent(LedgerEvent::Kind::Hedge, subaccount, asset, amount);
   return {};
 }
 
-tl::expected<void, std::string> HedgeManager::deleteRowById(const std::string& table_name, const std::string& id) {
-  std::string query = std::format("ALTER TABLE {} UPDATE status = '{}' WHERE id = '{}'", table_name, kRemoveStatus, id);
-  try {
-    clickhouse_client_->Execute({std::move(query)});
-    query = std::format("ALTER TABLE {} DELETE WHERE id = '{}'", table_name, id);
-    clickhouse_client_->Execute({std::move(query)});
-  } catch (const std::exception& e) {
-    LOG_ERROR("clickhouse error: {}", e.what());
-    return tl::make_unexpected(std::string{"Failed to delete row. Exception: "} + e.what());
+tl::expected<void, std::string> HedgeManager::rebalance(const std::vector<HedgeTarget>& targets) {
+  using Key = std::pair<std::string, std::string>;
+  OperationArena arena;
+  std::set<Key> keys;
+  for (const auto& target : targets) {
+    EXPECT_WITH_STRING(target.amount >= 0, "Target hedge amount should not be negative");
+    EXPECT_WITH_STRING(keys.emplace(target.subaccount, target.asset).second,
+                       "Duplicate hedge target " << target.subaccount << " " << target.asset);
+  }
+  auto lease = lockKeys({keys.begin(), keys.end()});
+  PROPAGATE_ERROR(lease);
+  auto hedges_info = getHedgesInfo(keys);
+  PROPAGATE_ERROR(hedges_info);
+  std::vector<std::string> hedge_ids;
+  for (const auto& hedge_info : *hedges_info) {
+    hedge_ids.push_back(hedge_info.hedge_id);
+  }
+  auto futures_hedges = getFuturesHedges(hedge_ids);
+  PROPAGATE_ERROR(futures_hedges);
+
+  struct Row {
+    const HedgeInfo* info;
+    // the position, held by futures->subaccount on futures->market
+    const FuturesHedge* futures;
+  };
+  // rows by subaccount, exchange of the position and asset. The maps of the operation are keyed by
+  // views of the loaded rows and targets, which outlive them.
+  std::pmr::map<std::tuple<std::string_view, infra::Exchange, std::string_view>, std::pmr::vector<Row>> rows_by_key(
+      arena.resource());
+  std::pmr::map<std::string_view, infra::Volume> remaining_by_row(arena.resource());
+  for (const auto& hedge_info : *hedges_info) {
+    auto it = futures_hedges->find(hedge_info.hedge_id);
+    EXPECT_WITH_STRING(it != futures_hedges->end() && it->second.status == kDoneStatus,
+                       "Futures hedge " << hedge_info.hedge_id << " not found");
+    rows_by_key[{hedge_info.subaccount, it->second.market.exchange(), hedge_info.asset}].push_back(
+        {&hedge_info, &it->second});
+    remaining_by_row[hedge_info.id] = hedge_info.amount;
+  }
+
+  struct Adjustment {
+    const HedgeTarget* target;
+    infra::Volume amount;
+  };
+  std::map<std::pair<infra::Exchange, std::string>, std::pair<std::vector<Adjustment>, std::vector<Adjustment>>>
+      adjustments;
+  for (const auto& target : targets) {
+    infra::Volume current;
+    for (const auto& row : rows_by_key[{target.subaccount, target.exchange, target.asset}]) {
+      current += row.info->amount;
+    }
+    auto& [deficits, surpluses] = adjustments[{target.exchange, target.asset}];
+    if (target.amount > current) {
+      deficits.push_back({&target, target.amount - current});
+    } else if (target.amount < current) {
+      surpluses.push_back({&target, current - target.amount});
+    }
+  }
+
+  std::vector<HedgeInfo> new_hedges_info;
+  std::vector<FuturesHedge> new_futures_hedges;
+  // by hedge_id and asset
+  std::pmr::map<std::pair<std::string_view, std::string_view>, infra::Volume> close_by_hedge(arena.resource());
+  std::vector<std::unique_ptr<ICommand>> commands;
+  for (auto& [exchange_asset, deficits_surpluses] : adjustments) {
+    const auto& [exchange, asset] = exchange_asset;
+    auto& [deficits, surpluses] = deficits_surpluses;
+    // A surplus row only goes back to the subaccount holding its position, anywhere else the ledger
+    // would no longer match the positions. The rest of the surplus is closed where it is held.
+    for (auto& surplus : surpluses) {
+      for (const auto& row : rows_by_key[{surplus.target->subaccount, exchange, asset}]) {
+        auto& remaining = remaining_by_row[row.info->id];
+        for (auto& deficit : deficits) {
+          if (surplus.amount == 0 || remaining == 0) {
+            break;
+          }
+          if (deficit.amount == 0 || deficit.target->subaccount != row.futures->subaccount) {
+            continue;
+          }
+          infra::Volume moved = util::decimal::min(util::decimal::min(remaining, surplus.amount), deficit.amount);
+          HedgeInfo moved_hedge = *row.info;
+          moved_hedge.subaccount = deficit.target->subaccount;
+          moved_hedge.amount = moved;
+          new_hedges_info.push_back(std::move(moved_hedge));
+          remaining -= moved;
+          surplus.amount -= moved;
+          deficit.amount -= moved;
+        }
+      }
+    }
+    for (auto& surplus : surpluses) {
+      for (const auto& row : rows_by_key[{surplus.target->subaccount, exchange, asset}]) {
+        auto& remaining = remaining_by_row[row.info->id];
+        if (surplus.amount > 0 && remaining > 0) {
+          infra::Volume closed = util::decimal::min(remaining, surplus.amount);
+          close_by_hedge[{row.info->hedge_id, asset}] += closed;
+          remaining -= closed;
+          surplus.amount -= closed;
+        }
+      }
+      EXPECT_WITH_STRING(surplus.amount == 0,
+                         "Hedge rows of " << surplus.target->subaccount << " changed concurrently");
+    }
+    for (const auto& deficit : deficits) {
+      if (deficit.amount == 0) {
+        continue;
+      }
+      auto command = makeHedgeCommand(deficit.target->subaccount, exchange, asset, deficit.amount);
+      PROPAGATE_ERROR(command);
+      commands.push_back(std::move(*command));
+      auto futures_instrument_description =
+          transfer::CryptoTransfer({exchange}).getFuturesInstrumentByAsset(asset, exchange);
+      std::string hedge_id = util::generateUuid().substr(0, 30);
+      FuturesHedge futures_hedge;
+      futures_hedge.subaccount = deficit.target->subaccount;
+      futures_hedge.market = futures_instrument_description.value.market;
+      futures_hedge.pair = futures_instrument_description.value.pair;
+      futures_hedge.crypto_eq_amount = deficit.amount;
+      futures_hedge.hedge_id = hedge_id;
+      new_futures_hedges.push_back(std::move(futures_hedge));
+      HedgeInfo hedge_info;
+      hedge_info.subaccount = deficit.target->subaccount;
+      hedge_info.asset = asset;
+      hedge_info.amount = deficit.amount;
+      hedge_info.initial_account = deficit.target->subaccount;
+      hedge_info.hedge_id = hedge_id;
+      new_hedges_info.push_back(std::move(hedge_info));
+    }
+  }
+
+  std::pmr::vector<RowUpdate> futures_updates(arena.resource());
+  std::pmr::vector<RowUpdate> futures_restores(arena.resource());
+  std::pmr::map<std::tuple<std::string_view, infra::Exchange, std::string_view>, infra::Volume> close_by_holder(
+      arena.resource());
+  for (const auto& [hedge_id_asset, closed] : close_by_hedge) {
+    const auto& [hedge_id, asset] = hedge_id_asset;
+    const auto& futures_hedge = futures_hedges->at(std::string{hedge_id});
+    EXPECT_WITH_STRING(futures_hedge.crypto_eq_amount >= closed, "Futures hedge " << hedge_id << " is too small");
+    futures_updates.emplace_back(futures_hedge.id, futures_hedge.crypto_eq_amount - closed);
+    futures_restores.emplace_back(futures_hedge.id, futures_hedge.crypto_eq_amount);
+    // the order goes to the subaccount and exchange that hold the position
+    close_by_holder[{futures_hedge.subaccount, futures_hedge.market.exchange(), asset}] += closed;
+  }
+  for (const auto& [holder, amount] : close_by_holder) {
+    const auto& [subaccount, exchange, asset] = holder;
+    auto command = makeHedgeCommand(std::string{subaccount}, exchange, std::string{asset}, -amount);
+    PROPAGATE_ERROR(command);
+    commands.push_back(std::move(*command));
+  }
+
+  std::pmr::vector<RowUpdate> info_updates(arena.resource());
+  std::pmr::vector<RowUpdate> info_restores(arena.resource());
+  for (const auto& hedge_info : *hedges_info) {
+    const auto& remaining = remaining_by_row[hedge_info.id];
+    if (remaining != hedge_info.amount) {
+      info_updates.emplace_back(hedge_info.id, remaining);
+      info_restores.emplace_back(hedge_info.id, hedge_info.amount);
+    }
+  }
+  if (info_updates.empty() && new_hedges_info.empty()) {
+    return {};
+  }
+  LOG_INFO("Rebalancing hedges: {} rows changed, {} rows added, {} orders",
+           info_updates.size() + futures_updates.size(),
+           new_hedges_info.size() + new_futures_hedges.size(),
+           commands.size());
+
+  size_t executed_commands = 0;
+  std::vector<std::function<OperationResult()>> compensations;
+  // the rebalanced keys, for the alerts
+  auto targets_list = [&] {
+    std::string list;
+    for (const auto& [subaccount, asset] : keys) {
+      list += (list.empty() ? "" : ", ") + subaccount + " " + asset;
+    }
+    return list;
+  };
+  auto rollback = [&](const OperationError& error) -> tl::expected<void, std::string> {
+    // a write that may still land is part of the ledger already, rolling back around it would corrupt it;
+    // orders whose undo failed are left in place the same way
+    if (error.isUnknownOutcome()) {
+      alertDispatcher().alert("rebalance_write_unknown",
+                              std::format("Hedge rebalance of {} has unknown outcome, not rolling back: {}",
+                                          targets_list(),
+                                          error.message));
+      return tl::make_unexpected(error.message);
+    }
+    LOG_ERROR("Rolling back hedge rebalance: {}", error.message);
+    for (auto it = compensations.rbegin(); it != compensations.rend(); ++it) {
+      auto result = (*it)();
+      if (!result.has_value()) {
+        alertDispatcher().alert("rebalance_ledger_rollback",
+                                std::format("Failed to roll back hedge rebalance ledger of {}: {}",
+                                            targets_list(),
+                                            result.error().message));
+      }
+    }
+    while (executed_commands > 0) {
+      auto result = commands[--executed_commands]->undo();
+      if (!result.has_value()) {
+        alertDispatcher().alert("rebalance_orders_rollback",
+                                std::format("Failed to roll back hedge rebalance orders of {}: {}",
+                                            targets_list(),
+                                            result.error()));
+        return tl::make_unexpected("Failed to roll back hedge rebalance orders: " + result.error());
+      }
+    }
+    return tl::make_unexpected(error.message);
+  };
+  for (auto& command : commands) {
+    auto result = command->execute();
+    if (!result.has_value()) {
+      return rollback(result.error());
+    }
+    ++executed_commands;
+  }
+  auto result = updateRows(clickhouse_client_, kHedgeInfoRows, info_updates);
+  if (!result.has_value()) {
+    return rollback(result.error());
+  }
+  compensations.push_back([&] { return updateRows(clickhouse_client_, kHedgeInfoRows, info_restores); });
+  result = updateRows(clickhouse_client_, kHedgeRows, futures_updates);
+  if (!result.has_value()) {
+    return rollback(result.error());
+  }
+  compensations.push_back([&] { return updateRows(clickhouse_client_, kHedgeRows, futures_restores); });
+  result = createNewFuturesHedgeRows(new_futures_hedges);
+  if (!result.has_value()) {
+    return rollback(result.error());
+  }
+  compensations.push_back([&] {
+    std::vector<std::string> hedge_ids;
+    for (const auto& futures_hedge : new_futures_hedges) {
+      hedge_ids.push_back(futures_hedge.hedge_id);
+    }
+    return deleteRowsByHedgeId(kHedgeTable, hedge_ids);
+  });
+  result = createNewHedgeInfoRows(new_hedges_info);
+  if (!result.has_value()) {
+    return rollback(result.error());
+  }
+  // removed rows are already skipped by readers, a failed cleanup only leaves them behind
+  for (const auto& [table, updates] : {std::pair{&kHedgeInfoRows, &info_updates},
+                                       std::pair{&kHedgeRows, &futures_updates}}) {
+    auto delete_result = deleteRemovedRows(clickhouse_client_, *table, *updates);
+    if (!delete_result.has_value()) {
+      LOG_ERROR("{}", delete_result.error().message);
+    }
+  }
+  for (const auto& hedge_info : *hedges_info) {
+    publishLedgerEvent(LedgerEvent::Kind::Hedge,
+                       hedge_info.subaccount,
+                       hedge_info.asset,
+                       remaining_by_row[hedge_info.id] - hedge_info.amount);
+  }
+  for (const auto& hedge_info : new_hedges_info) {
+    publishLedgerEvent(LedgerEvent::Kind::Hedge, hedge_info.subaccount, hedge_info.asset, hedge_info.amount);
   }
   return {};
 }
 
-tl::expected<void, std::string> HedgeManager::changeAmountInRowById(const std::string& table_name,
-                                                                    const std::string& id,
-                                                                    infra::Volume new_amount) {
-  std::string amount_name = table_name == kHedgeTable ? "crypto_eq_amount" : "amount";
-  std::string query = std::format("ALTER TABLE {} UPDATE {} = '{}' WHERE id = '{}'",
+tl::expected<std::unique_ptr<ICommand>, std::string> HedgeManager::makeHedgeCommand(const std::string& subaccount,
+                                                                                   infra::Exchange exchange,
+                                                                                   const std::string& asset,
+                                                                                   infra::Volume amount) {
+  transfer::CryptoTransfer crypto_transfer({exchange});
+  auto futures_instrument_description = crypto_transfer.getFuturesInstrumentByAsset(asset, exchange);
+  // the universe snapshot spares the full instrument list download
+  auto lots_per_unit =
+      lotsPerUnit(futures_instrument_description.value.market, futures_instrument_description.value.pair);
+  if (!lots_per_unit.has_value()) {
+    auto instrument_updates = crypto_transfer.getInstrumentUpdates(futures_instrument_description.value.market);
+    PROPAGATE_ERROR(instrument_updates);
+    auto instrument_update = [&]() -> tl::expected<infra::InstrumentUpdate, std::string> {
+      for (const auto& instrument_update : *instrument_updates) {
+        if (instrument_update.description() == futures_instrument_description) {
+          return instrument_update;
+        }
+      }
+      EXPECT_WITH_STRING(false, "Instrument update for " << futures_instrument_description << " not found");
+    }();
+    PROPAGATE_ERROR(instrument_update);
+    infra::InstrumentImpl instrument(*instrument_update);
+    lots_per_unit = instrument.contractSize() * (1 / instrument.lotSize());
+  }
+
+  return makeCommand(SequenceCommand(
+      SendMarketCommand(subaccount, futures_instrument_description, -amount * *lots_per_unit),
+      SendMarketCommand(subaccount, crypto_transfer.getSpotInstrumentByAsset(asset, exchange), amount)));
+}
+
+OperationResult HedgeManager::deleteRowsByHedgeId(const std::string& table_name,
+                                                 const std::vector<std::string>& hedge_ids) {
+  if (hedge_ids.empty()) {
+    return {};
+  }
+  std::string query = std::format("ALTER TABLE {} UPDATE status = '{}' WHERE hedge_id IN ({}), DELETE WHERE "
+                                  "hedge_id IN ({})",
                                   table_name,
-                                  amount_name,
-                                  util::lexical_cast<std::string>(new_amount),
-                                  id);
+                                  kRemoveStatus,
+                                  quotedList(hedge_ids),
+                                  quotedList(hedge_ids));
   try {
-    clickhouse_client_->Execute({std::move(query)});
+    clickhouse_client_.execute({std::move(query)});
+  } catch (const ClickhouseUnknownOutcome& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return unknownOutcome(std::string{"Failed to delete rows. Exception: "} + e.what());
   } catch (const std::exception& e) {
     LOG_ERROR("clickhouse error: {}", e.what());
-    return tl::make_unexpected(std::string{"Failed to change amount in row. Exception: "} + e.what());
+    return tl::make_unexpected(std::string{"Failed to delete rows. Exception: "} + e.what());
   }
   return {};
 }
 
+OperationResult HedgeManager::createNewFuturesHedgeRow(const std::string& subaccount,
+                                                      infra::Market market,
+                                                      const std::string& pair,
+                                                      infra::Volume amount,
+                                                      const std::string& hedge_id) {
+  FuturesHedge futures_hedge;
+  futures_hedge.subaccount = subaccount;
+  futures_hedge.market = market;
+  futures_hedge.pair = pair;
+  futures_hedge.crypto_eq_amount = amount;
+  futures_hedge.hedge_id = hedge_id;
+  return createNewFuturesHedgeRows({futures_hedge});
+}
 
-tl::expected<void, std::string> HedgeManager::createNewFuturesHedgeRow(const std::string& subaccount,
-                                                                       infra::Market market,
-                                                                       const std::string& pair,
-                                                                       infra::Volume amount,
-                                                                       const std::string& hedge_id) {
-  infra::Volume amount_usd = amount *
-      transfer::CryptoTransfer({market.exchange()})
-          .getLastPrice(infra::InstrumentDescriptionFactory().get().create(market, pair));
+OperationResult HedgeManager::createNewFuturesHedgeRows(const std::vector<FuturesHedge>& futures_hedges) {
+  if (futures_hedges.empty()) {
+    return {};
+  }
   auto time = static_cast<int64_t>(nowSystem()) / 1'000'000;
-  std::string query = std::format(
-      "INSERT INTO {} (open_timestamp, last_update_timestamp, subaccount, market, pair, crypto_eq_amount, "
-      "open_amount_usd, hedge_id, status) VALUES ('{}', "
-      "'{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}')",
-      kHedgeTable,
-      time,
-      time,
-      subaccount,
-      magic_enum::enum_name(market.type()),
-      pair,
-      util::lexical_cast<std::string>(amount),
-      util::lexical_cast<std::string>(amount_usd),
-      hedge_id,
-      kDoneStatus);
-  try {
-    clickhouse_client_->Execute({std::move(query)});
-  } catch (const std::exception& e) {
-    LOG_ERROR("clickhouse error: {}", e.what());
-    return tl::make_unexpected(std::string{"Failed to create new hedge row. Exception: "} + e.what());
+  std::string values;
+  for (const auto& futures_hedge : futures_hedges) {
+    infra::Volume amount_usd = futures_hedge.crypto_eq_amount *
+        transfer::CryptoTransfer({futures_hedge.market.exchange()})
+            .getLastPrice(infra::InstrumentDescriptionFactory().get().create(futures_hedge.market, futures_hedge.pair));
+    values += std::format("{}('{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}')",
+                          values.empty() ? "" : ", ",
+                          time,
+                          time,
+                          futures_hedge.subaccount,
+                          magic_enum::enum_name(futures_hedge.market.type()),
+                          futures_hedge.pair,
+                          util::lexical_cast<std::string>(futures_hedge.crypto_eq_amount),
+                          util::lexical_cast<std::string>(amount_usd),
+                          futures_hedge.hedge_id,
+                          kDoneStatus);
+  }
+  auto result = ledgerWriter()
+                    .insert(kHedgeTable,
+                            "(open_timestamp, last_update_timestamp, subaccount, market, pair, crypto_eq_amount, "
+                            "open_amount_usd, hedge_id, status)",
+                            std::move(values),
+                            futures_hedges.size())
+                    .get();
+  if (!result.has_value()) {
+    return withContext("Failed to create new hedge row. ", result.error());
   }
   return {};
 }
 
-tl::expected<void, std::string> HedgeManager::createNewHedgeInfoRow(const std::string& subaccount,
-                                                                    const std::string& asset,
-                                                                    infra::Volume amount,
-                                                                    const std::string& initial_subaccount,
-                                                                    const std::string& hedge_id) {
-  std::string query = std::format(
-      "INSERT INTO {} (timestamp, subaccount, asset, amount, initial_subaccount, type, hedge_id, status) VALUES "
-      "('{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}')",
-      kHedgeInfoTable,
-      static_cast<int64_t>(nowSystem()) / 1'000'000,
-      subaccount,
-      asset,
-      util::lexical_cast<std::string>(amount),
-      initial_subaccount,
-      "hedge",
-      hedge_id,
-      kDoneStatus);
-  try {
-    clickhouse_client_->Execute({std::move(query)});
-  } catch (const std::exception& e) {
-    LOG_ERROR("clickhouse error: {}", e.what());
-    return tl::make_unexpected(std::string{"Failed to create new hedge info row. Exception: "} + e.what());
+OperationResult HedgeManager::createNewHedgeInfoRow(const std::string& subaccount,
+                                                   const std::string& asset,
+                                                   infra::Volume amount,
+                                                   const std::string& initial_subaccount,
+                                                   const std::string& hedge_id) {
+  HedgeInfo hedge_info;
+  hedge_info.subaccount = subaccount;
+  hedge_info.asset = asset;
+  hedge_info.amount = amount;
+  hedge_info.initial_account = initial_subaccount;
+  hedge_info.hedge_id = hedge_id;
+  return createNewHedgeInfoRows({hedge_info});
+}
+
+OperationResult HedgeManager::createNewHedgeInfoRows(const std::vector<HedgeInfo>& hedges_info) {
+  if (hedges_info.empty()) {
+    return {};
+  }
+  const auto timestamp = static_cast<int64_t>(nowSystem()) / 1'000'000;
+  std::string values;
+  for (const auto& hedge_info : hedges_info) {
+    values += std::format("{}('{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}')",
+                          values.empty() ? "" : ", ",
+                          timestamp,
+                          hedge_info.subaccount,
+                          hedge_info.asset,
+                          util::lexical_cast<std::string>(hedge_info.amount),
+                          hedge_info.initial_account,
+                          "hedge",
+                          hedge_info.hedge_id,
+                          kDoneStatus);
+  }
+  auto result = ledgerWriter()
+                    .insert(kHedgeInfoTable,
+                            "(timestamp, subaccount, asset, amount, initial_subaccount, type, hedge_id, status)",
+                            std::move(values),
+                            hedges_info.size())
+                    .get();
+  if (!result.has_value()) {
+    return withContext("Failed to create new hedge info row. ", result.error());
   }
   return {};
 }
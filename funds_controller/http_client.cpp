@@ -0,0 +1,305 @@
+#include "prod/funds_controller/http_client.h"
+
+#include "util/error/error.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <format>
+#include <optional>
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kHeadersEnd = "\r\n\r\n";
+const std::string kLineEnd = "\r\n";
+
+SSL_CTX* sharedSslContext() {
+  static SSL_CTX* context = [] {
+    SSL_CTX* context = SSL_CTX_new(TLS_client_method());
+    ASSERT_FATAL(context, "Failed to create SSL context");
+    SSL_CTX_set_default_verify_paths(context);
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+    return context;
+  }();
+  return context;
+}
+
+std::string lastSslError() {
+  char buffer[256];
+  ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+  return buffer;
+}
+
+std::string toLower(std::string_view value) {
+  std::string result{value};
+  std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return std::tolower(c); });
+  return result;
+}
+
+}  // namespace
+
+struct HttpClient::Connection {
+  ~Connection() {
+    if (ssl != nullptr) {
+      SSL_free(ssl);
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  tl::expected<void, std::string> writeAll(std::string_view data) {
+    while (!data.empty()) {
+      ssize_t written = ssl != nullptr ? SSL_write(ssl, data.data(), static_cast<int>(data.size()))
+                                       : ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+      EXPECT_WITH_STRING(written > 0, "Failed to write http request");
+      data.remove_prefix(static_cast<size_t>(written));
+    }
+    return {};
+  }
+
+  // Appends more bytes to buffer, returns false on orderly close.
+  tl::expected<bool, std::string> fill() {
+    char chunk[16 * 1024];
+    ssize_t read = ssl != nullptr ? SSL_read(ssl, chunk, sizeof(chunk)) : ::recv(fd, chunk, sizeof(chunk), 0);
+    if (read > 0) {
+      buffer.append(chunk, static_cast<size_t>(read));
+      return true;
+    }
+    if (read == 0 || (ssl != nullptr && SSL_get_error(ssl, static_cast<int>(read)) == SSL_ERROR_ZERO_RETURN)) {
+      return false;
+    }
+    EXPECT_WITH_STRING(false, "Failed to read http response (timeout or connection reset)");
+    return {};
+  }
+
+  tl::expected<std::string, std::string> readUntil(const std::string& delimiter) {
+    size_t position;
+    while ((position = buffer.find(delimiter)) == std::string::npos) {
+      auto more = fill();
+      PROPAGATE_ERROR(more);
+      EXPECT_WITH_STRING(*more, "Connection closed by peer");
+    }
+    std::string result = buffer.substr(0, position);
+    buffer.erase(0, position + delimiter.size());
+    return result;
+  }
+
+  tl::expected<std::string, std::string> readExactly(size_t size) {
+    while (buffer.size() < size) {
+      auto more = fill();
+      PROPAGATE_ERROR(more);
+      EXPECT_WITH_STRING(*more, "Connection closed by peer");
+    }
+    std::string result = buffer.substr(0, size);
+    buffer.erase(0, size);
+    return result;
+  }
+
+  tl::expected<std::string, std::string> readToEnd() {
+    while (true) {
+      auto more = fill();
+      PROPAGATE_ERROR(more);
+      if (!*more) {
+        break;
+      }
+    }
+    return std::move(buffer);
+  }
+
+  int fd = -1;
+  SSL* ssl = nullptr;
+  std::string buffer;
+};
+
+HttpClient::HttpClient(const std::string& base_url, std::chrono::milliseconds timeout): timeout_(timeout) {
+  std::string_view url = base_url;
+  if (url.starts_with("https://")) {
+    url.remove_prefix(8);
+  } else {
+    ASSERT_FATAL(url.starts_with("http://"), "Unsupported url scheme " << base_url);
+    tls_ = false;
+    url.remove_prefix(7);
+  }
+  size_t path_start = std::min(url.find('/'), url.size());
+  base_path_ = std::string{url.substr(path_start)};
+  std::string_view authority = url.substr(0, path_start);
+  size_t port_start = authority.find(':');
+  host_ = std::string{authority.substr(0, port_start)};
+  port_ = port_start == std::string_view::npos ? (tls_ ? "443" : "80") : std::string{authority.substr(port_start + 1)};
+}
+
+HttpClient::~HttpClient() = default;
+HttpClient::HttpClient(HttpClient&&) noexcept = default;
+HttpClient& HttpClient::operator=(HttpClient&&) noexcept = default;
+
+tl::expected<std::string, std::string> HttpClient::get(const std::string& path, const std::string& extra_headers) {
+  bool reused = connection_ != nullptr;
+  auto response = request(path, extra_headers);
+  if (!response.has_value() && reused) {
+    // keep-alive connection may have been closed by the server while idle
+    LOG_DEBUG("retrying {}{} on a fresh connection: {}", host_, path, response.error());
+    response = request(path, extra_headers);
+  }
+  return response;
+}
+
+tl::expected<void, std::string> HttpClient::connect() {
+  connection_.reset();
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addresses = nullptr;
+  int resolve_result = ::getaddrinfo(host_.c_str(), port_.c_str(), &hints, &addresses);
+  EXPECT_WITH_STRING(resolve_result == 0, "Failed to resolve " << host_ << ": " << gai_strerror(resolve_result));
+  std::unique_ptr<addrinfo, decltype(&::freeaddrinfo)> addresses_guard(addresses, &::freeaddrinfo);
+
+  auto connection = std::make_unique<Connection>();
+  timeval timeout{.tv_sec = static_cast<time_t>(timeout_.count() / 1000),
+                  .tv_usec = static_cast<suseconds_t>(timeout_.count() % 1000 * 1000)};
+  for (addrinfo* address = addresses; address != nullptr; address = address->ai_next) {
+    int fd = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    int no_delay = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+      connection->fd = fd;
+      break;
+    }
+    ::close(fd);
+  }
+  EXPECT_WITH_STRING(connection->fd >= 0, "Failed to connect to " << host_ << ":" << port_);
+
+  if (tls_) {
+    connection->ssl = SSL_new(sharedSslContext());
+    EXPECT_WITH_STRING(connection->ssl != nullptr, "Failed to create SSL: " << lastSslError());
+    SSL_set_fd(connection->ssl, connection->fd);
+    SSL_set_tlsext_host_name(connection->ssl, host_.c_str());
+    SSL_set1_host(connection->ssl, host_.c_str());
+    EXPECT_WITH_STRING(SSL_connect(connection->ssl) == 1, "TLS handshake with " << host_ << " failed: " << lastSslError());
+  }
+  connection_ = std::move(connection);
+  return {};
+}
+
+tl::expected<std::string, std::string> HttpClient::request(const std::string& path,
+                                                           const std::string& extra_headers) {
+  if (connection_ == nullptr) {
+    PROPAGATE_ERROR(connect());
+  }
+  auto fail = [this](const std::string& error) -> tl::expected<std::string, std::string> {
+    connection_.reset();
+    return tl::make_unexpected(error);
+  };
+
+  auto written = connection_->writeAll(std::format(
+      "GET {}{} HTTP/1.1\r\nHost: {}\r\nAccept: application/json\r\nAccept-Encoding: identity\r\n"
+      "User-Agent: funds_controller\r\n{}\r\n",
+      base_path_,
+      path,
+      host_,
+      extra_headers));
+  if (!written.has_value()) {
+    return fail(written.error());
+  }
+
+  auto headers = connection_->readUntil(kHeadersEnd);
+  if (!headers.has_value()) {
+    return fail(headers.error());
+  }
+  std::string_view header_view = *headers;
+  size_t status_end = header_view.find(kLineEnd);
+  std::string_view status_line = header_view.substr(0, status_end);
+  int status_code = 0;
+  if (status_line.size() < 12 ||
+      std::from_chars(status_line.data() + 9, status_line.data() + 12, status_code).ec != std::errc{}) {
+    return fail("Malformed http status line: " + std::string{status_line});
+  }
+
+  std::optional<size_t> content_length;
+  bool chunked = false;
+  bool close_after = false;
+  while (status_end != std::string_view::npos) {
+    header_view.remove_prefix(status_end + kLineEnd.size());
+    status_end = header_view.find(kLineEnd);
+    std::string_view line = header_view.substr(0, status_end);
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos) {
+      continue;
+    }
+    std::string name = toLower(line.substr(0, colon));
+    std::string_view value = line.substr(colon + 1);
+    value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+    if (name == "content-length") {
+      size_t length = 0;
+      std::from_chars(value.data(), value.data() + value.size(), length);
+      content_length = length;
+    } else if (name == "transfer-encoding") {
+      chunked = toLower(value).find("chunked") != std::string::npos;
+    } else if (name == "connection") {
+      close_after = toLower(value) == "close";
+    }
+  }
+
+  tl::expected<std::string, std::string> body;
+  if (chunked) {
+    body = std::string{};
+    while (true) {
+      auto size_line = connection_->readUntil(kLineEnd);
+      if (!size_line.has_value()) {
+        return fail(size_line.error());
+      }
+      size_t chunk_size = 0;
+      std::from_chars(size_line->data(), size_line->data() + size_line->size(), chunk_size, 16);
+      if (chunk_size == 0) {
+        // skip optional trailers up to the terminating empty line
+        while (true) {
+          auto trailer = connection_->readUntil(kLineEnd);
+          if (!trailer.has_value()) {
+            return fail(trailer.error());
+          }
+          if (trailer->empty()) {
+            break;
+          }
+        }
+        break;
+      }
+      auto chunk = connection_->readExactly(chunk_size + kLineEnd.size());
+      if (!chunk.has_value()) {
+        return fail(chunk.error());
+      }
+      body->append(*chunk, 0, chunk_size);
+    }
+  } else if (content_length.has_value()) {
+    body = connection_->readExactly(*content_length);
+  } else {
+    body = connection_->readToEnd();
+    close_after = true;
+  }
+  if (!body.has_value()) {
+    return fail(body.error());
+  }
+  if (close_after) {
+    connection_.reset();
+  }
+  EXPECT_WITH_STRING(status_code == 200,
+                     "GET " << host_ << base_path_ << path << " returned " << status_code << ": "
+                            << body->substr(0, 256));
+  return body;
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,152 @@
+#include "prod/funds_controller/idempotency_store.h"
+
+#include "prod/funds_controller/alert_dispatcher.h"
+#include "prod/funds_controller/lease_manager.h"
+
+#include "util/error/error.h"
+#include "util/time/time.h"
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kIdempotencyKeysTable = "IDEMPOTENCY_KEYS_v1";
+const std::string kDoneStatus = "done";
+const std::string kPendingStatus = "pending";
+const std::string kRemoveStatus = "removed";
+
+}  // namespace
+
+IdempotencyStore::IdempotencyStore(Options options): options_(options) {
+}
+
+IdempotencyStore::Result IdempotencyStore::run(const std::vector<LeaseKey>& keys,
+                                               const std::string& key,
+                                               const std::string& request,
+                                               const std::function<OperationResult()>& action) {
+  EXPECT_WITH_STRING(!key.empty() && key.find('\'') == std::string::npos, "Invalid idempotency key " << key);
+  // the owner of the operation's keys is the one instance that can run it, so it dedups the key too
+  for (const auto& lease_key : keys) {
+    PROPAGATE_ERROR(checkKeyOwner(lease_key));
+  }
+  std::promise<Result> promise;
+  std::shared_future<Result> duplicate;
+  {
+    std::lock_guard lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      EXPECT_WITH_STRING(it->second.request == request,
+                         "Idempotency key " << key << " was used for another request: " << it->second.request);
+      duplicate = it->second.result;
+    } else {
+      entries_.emplace(key, Entry{request, promise.get_future().share()});
+    }
+  }
+  if (duplicate.valid()) {
+    LOG_INFO("Duplicate request {} {}", key, request);
+    return duplicate.get();
+  }
+
+  auto outcome = execute(key, request, action);
+  {
+    std::lock_guard lock(mutex_);
+    // a key with an unknown outcome stays, duplicates get its error instead of running again
+    if (outcome.has_value() || outcome.error().isUnknownOutcome()) {
+      completed_keys_.push_back(key);
+      while (completed_keys_.size() > options_.cache_size) {
+        entries_.erase(completed_keys_.front());
+        completed_keys_.pop_front();
+      }
+    } else {
+      entries_.erase(key);
+    }
+  }
+  auto result = toResult(std::move(outcome));
+  promise.set_value(result);
+  return result;
+}
+
+OperationResult IdempotencyStore::execute(const std::string& key,
+                                          const std::string& request,
+                                          const std::function<OperationResult()>& action) {
+  auto stored_key = getStoredKey(key);
+  PROPAGATE_ERROR(stored_key);
+  if (stored_key->has_value()) {
+    const auto& [stored_request, status] = **stored_key;
+    EXPECT_WITH_STRING(stored_request == request,
+                       "Idempotency key " << key << " was used for another request: " << stored_request);
+    // a pending key was left by a process that died mid request, only reconciliation can tell what happened
+    EXPECT_WITH_STRING(status == kDoneStatus, "Request " << key << " has unknown outcome, reconcile before retrying");
+    LOG_INFO("Request {} already done", key);
+    return {};
+  }
+  PROPAGATE_ERROR(insertStatus(key, request, kPendingStatus));
+  auto result = action();
+  if (!result.has_value() && result.error().isUnknownOutcome()) {
+    alertDispatcher().alert("idempotency_unknown_outcome " + key,
+                            std::format("Request {} {} has unknown outcome, key left pending: {}",
+                                        key,
+                                        request,
+                                        result.error().message));
+    return result;
+  }
+  auto status_result = insertStatus(key, request, result.has_value() ? kDoneStatus : kRemoveStatus);
+  if (!status_result.has_value()) {
+    alertDispatcher().alert("idempotency_complete " + key,
+                            "Failed to complete idempotency key " + key + ": " + status_result.error());
+  }
+  return result;
+}
+
+tl::expected<std::optional<IdempotencyStore::StoredKey>, std::string> IdempotencyStore::getStoredKey(
+    const std::string& key) {
+  // on equal timestamps the completion row wins over the pending row it follows
+  std::string query = std::format("SELECT request, status FROM {} WHERE idempotency_key = '{}' ORDER BY timestamp "
+                                  "DESC, status = '{}' LIMIT 1",
+                                  kIdempotencyKeysTable,
+                                  key,
+                                  kPendingStatus);
+  std::optional<StoredKey> stored_key;
+  try {
+    clickhouse_client_.select({std::move(query)}, [&stored_key](const clickhouse::Block& block) {
+      if (block.GetRowCount() > 0) {
+        stored_key = StoredKey{std::string{block[0]->As<clickhouse::ColumnString>()->At(0)},
+                               std::string{block[1]->As<clickhouse::ColumnString>()->At(0)}};
+      }
+    });
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to read idempotency key. Exception: "} + e.what());
+  }
+  // a released key is free again
+  if (stored_key.has_value() && stored_key->status == kRemoveStatus) {
+    stored_key.reset();
+  }
+  return stored_key;
+}
+
+tl::expected<void, std::string> IdempotencyStore::insertStatus(const std::string& key,
+                                                              const std::string& request,
+                                                              const std::string& status) {
+  std::string query =
+      std::format("INSERT INTO {} (timestamp, idempotency_key, request, status) VALUES ('{}', '{}', '{}', '{}')",
+                  kIdempotencyKeysTable,
+                  static_cast<int64_t>(nowSystem()) / 1'000'000,
+                  key,
+                  request,
+                  status);
+  try {
+    clickhouse_client_.execute({std::move(query)});
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to write idempotency key. Exception: "} + e.what());
+  }
+  return {};
+}
+
+IdempotencyStore& idempotencyStore() {
+  static IdempotencyStore store({});
+  return store;
+}
+
+}  // namespace funds_controller
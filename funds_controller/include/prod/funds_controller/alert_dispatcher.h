@@ -0,0 +1,116 @@
+#pragma once
+
+#include <tl/expected.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace funds_controller {
+
+// Where the dispatched alerts end up. Called from the dispatcher thread only, one message at a time.
+class AlertSink {
+public:
+  virtual ~AlertSink() = default;
+
+  virtual tl::expected<void, std::string> send(const std::string& message) = 0;
+};
+
+// The funds Slack channel.
+class SlackAlertSink final : public AlertSink {
+public:
+  tl::expected<void, std::string> send(const std::string& message) override;
+};
+
+// Keeps the messages in memory, for local runs and for checking the dispatcher. A non zero latency
+// makes every send take that long, like a slow webhook.
+class LocalAlertSink final : public AlertSink {
+public:
+  explicit LocalAlertSink(std::chrono::milliseconds latency = {});
+
+  tl::expected<void, std::string> send(const std::string& message) override;
+  std::vector<std::string> messages() const;
+
+private:
+  const std::chrono::milliseconds latency_;
+  mutable std::mutex mutex_;
+  std::vector<std::string> messages_;
+};
+
+// Sends alerts from a background thread so the failure paths never wait on the sink. Alerts are
+// grouped by a key naming their call site. The first alert of a key goes out right away, the ones
+// raised within coalesce_window after it are counted and sent as one summary with the last message
+// when the window ends. At most max_keys keys are tracked, alerts of new keys beyond that are dropped
+// and the drop count is reported with the next message. Messages due at the same time go out as one
+// sink call, so a slow sink delays alerts but never makes them pile up.
+class AlertDispatcher {
+public:
+  struct Options {
+    std::chrono::milliseconds coalesce_window{30'000};
+    size_t max_keys = 1'024;
+    // messages listed in one sink call, the rest are only counted
+    size_t max_messages_per_send = 20;
+  };
+
+  struct Stats {
+    uint64_t alerts = 0;
+    uint64_t coalesced = 0;
+    uint64_t dropped = 0;
+    uint64_t sends = 0;
+    uint64_t failed_sends = 0;
+  };
+
+  AlertDispatcher(Options options, std::shared_ptr<AlertSink> sink);
+  // sends the pending alerts and summaries before returning
+  ~AlertDispatcher();
+
+  AlertDispatcher(const AlertDispatcher&) = delete;
+  AlertDispatcher& operator=(const AlertDispatcher&) = delete;
+
+  // Never blocks on the sink. False when the alert was dropped.
+  bool alert(const std::string& key, std::string message);
+
+  Stats stats() const;
+
+private:
+  struct KeyState {
+    // alerts of the key until then are coalesced
+    int64_t window_end_ms = 0;
+    uint64_t coalesced = 0;
+    std::string last_message;
+  };
+
+  void run(std::stop_token stop_token);
+  // Takes the messages due at now_ms, every pending summary when flushing, and sends them.
+  void sendDue(int64_t now_ms, bool flush);
+  void queueSummary(const std::string& key, KeyState& state);
+
+  const Options options_;
+  const std::shared_ptr<AlertSink> sink_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable_any condition_;
+  std::map<std::string, KeyState> keys_;
+  std::vector<std::string> due_;
+  uint64_t dropped_since_send_ = 0;
+
+  std::atomic<uint64_t> alerts_ = 0;
+  std::atomic<uint64_t> coalesced_ = 0;
+  std::atomic<uint64_t> dropped_ = 0;
+  std::atomic<uint64_t> sends_ = 0;
+  std::atomic<uint64_t> failed_sends_ = 0;
+
+  std::jthread thread_;
+};
+
+// Process-wide dispatcher to the funds Slack channel, flushed at exit.
+AlertDispatcher& alertDispatcher();
+
+}  // namespace funds_controller
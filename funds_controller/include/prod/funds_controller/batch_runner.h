@@ -0,0 +1,111 @@
+#pragma once
+
+#include "prod/funds_controller/block_trading.h"
+#include "prod/funds_controller/hedge_manager.h"
+#include "prod/funds_controller/lease_manager.h"
+#include "prod/funds_controller/limits_engine.h"
+#include "prod/funds_controller/loans_manager.h"
+#include "prod/funds_controller/transaction_manager.h"
+
+#include "common/instrument_description/instrument_description.h"
+#include "common/types/volume.h"
+#include "common/wallet/wallet.h"
+
+#include <tl/expected.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace funds_controller {
+
+// One line of a batch file. JSONL lines are objects, CSV files have a header row, both name the fields
+// the same way:
+//   borrow, repay, hedge:  subaccount, exchange, asset, amount
+//   loan_transfer:         from, from_exchange, to, to_exchange, asset, amount
+//   transfer:              from, from_wallet, to, to_wallet, asset, amount
+//   block, unblock:        subaccount, market, symbol, rule_type
+// plus an optional idempotency_key for the first four. Amounts may be strings or numbers, numbers are
+// taken as written and never go through a double.
+struct BatchCommand {
+  enum class Type { Borrow, Repay, Hedge, LoanTransfer, Transfer, Block, Unblock };
+
+  // line in the file, for the results
+  size_t line = 0;
+  Type type = Type::Borrow;
+  std::string subaccount;
+  std::string to_subaccount;
+  std::string asset;
+  infra::Volume amount;
+  infra::Exchange exchange = infra::Exchange::Binance;
+  infra::Exchange to_exchange = infra::Exchange::Binance;
+  infra::Wallet wallet;
+  infra::Wallet to_wallet;
+  std::optional<infra::Market> market;
+  std::string symbol;
+  std::string rule_type;
+  std::string idempotency_key;
+
+  // Keys the command reads and writes, commands sharing a key run in file order.
+  std::vector<LeaseKey> keys() const;
+};
+
+// Format is told by the extension, .csv files are CSV, anything else JSONL. Fails on the first
+// malformed line so a batch never runs half parsed.
+tl::expected<std::vector<BatchCommand>, std::string> parseBatchFile(const std::string& path);
+
+// Runs a batch on a pool of workers. Every command waits for the previous commands on its keys, so
+// commands on different keys run in parallel and the ones on the same key in file order, whichever
+// worker picks them. A failed command does not stop the commands after it, each result is reported.
+class BatchRunner {
+public:
+  struct Options {
+    size_t parallelism = std::max(1u, std::thread::hardware_concurrency());
+  };
+
+  struct Managers {
+    LoansManager& loans_manager;
+    HedgeManager& hedge_manager;
+    TransactionManager& transaction_manager;
+    TradingBlocker& trading_blocker;
+    // Borrows, hedges and transfers are checked against it before they run when set. Each command is
+    // checked on its own: commands of different subaccounts running at once may together overshoot an
+    // asset total limit by what is in flight. Loan transfers are not checked.
+    const LimitsEngine* limits_engine = nullptr;
+  };
+
+  struct Result {
+    const BatchCommand& command;
+    const tl::expected<void, std::string>& result;
+    std::chrono::microseconds latency;
+  };
+
+  struct Summary {
+    size_t commands = 0;
+    size_t failed = 0;
+    std::chrono::microseconds elapsed{0};
+    std::chrono::microseconds p50{0};
+    std::chrono::microseconds p99{0};
+    std::chrono::microseconds max{0};
+
+    double commandsPerSecond() const;
+  };
+
+  BatchRunner(Options options, Managers managers);
+
+  // on_result is called once per command in completion order, one call at a time.
+  Summary run(const std::vector<BatchCommand>& commands, const std::function<void(const Result&)>& on_result);
+
+private:
+  tl::expected<void, std::string> execute(const BatchCommand& command);
+
+  const Options options_;
+  Managers managers_;
+};
+
+}  // namespace funds_controller
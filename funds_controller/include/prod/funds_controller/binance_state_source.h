@@ -0,0 +1,53 @@
+#pragma once
+
+#include "prod/funds_controller/http_client.h"
+#include "prod/funds_controller/reconciliation.h"
+
+#include <tl/expected.hpp>
+
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <string>
+
+namespace funds_controller {
+
+// Binance portfolio margin accounts through the signed REST API: cross margin balances and liabilities
+// from /papi/v1/balance, USD-M futures positions from /papi/v1/um/positionRisk. Every fetch opens its
+// own connection, so accounts can be fetched concurrently.
+class BinanceStateSource final : public ExchangeStateSource {
+public:
+  // requests one fetch spends, for Reconciler::Options::requests_per_account
+  static constexpr double kRequestsPerFetch = 2;
+
+  struct ApiKey {
+    std::string key;
+    std::string secret;
+  };
+
+  // nullopt for subaccounts without a read key
+  using ApiKeys = std::function<std::optional<ApiKey>(const std::string& subaccount)>;
+
+  struct Options {
+    std::string base_url = "https://papi.binance.com";
+    std::chrono::milliseconds request_timeout{5'000};
+    std::chrono::milliseconds recv_window{5'000};
+  };
+
+  BinanceStateSource(Options options, ApiKeys api_keys);
+
+  tl::expected<ExchangeAccountState, std::string> fetch(const ReconciliationAccount& account) override;
+
+private:
+  tl::expected<std::string, std::string> signedGet(HttpClient& http_client,
+                                                   const ApiKey& api_key,
+                                                   const std::string& path);
+
+  const Options options_;
+  ApiKeys api_keys_;
+};
+
+// Keys from BINANCE_API_KEY_<subaccount> and BINANCE_API_SECRET_<subaccount>.
+BinanceStateSource::ApiKeys environmentApiKeys();
+
+}  // namespace funds_controller
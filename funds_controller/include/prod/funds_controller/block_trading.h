@@ -1,17 +1,50 @@
 #pragma once
 
-#include "prod/funds_controller/clickhouse_client.h"
+#include "prod/funds_controller/resilient_clickhouse_client.h"
+#include "prod/funds_controller/subscribers.h"
 
 #include "common/instrument_description/instrument_description.h"
 
 #include <tl/expected.hpp>
 
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <optional>
 #include <vector>
 
 namespace funds_controller {
 
+struct BlockRule {
+  std::string subaccount;
+  infra::Market market = infra::Market{infra::Market::BinanceFutures};
+  std::string symbol;
+  std::string type;
+};
+
+struct BlockRuleDelta {
+  enum class Action : uint8_t {
+    Add,
+    Remove,
+  };
+
+  Action action;
+  uint64_t version;
+  BlockRule rule;
+};
+
+// Rules active at `version`. Deltas with a greater version may or may not be reflected already,
+// applying them on top is idempotent.
+struct BlocklistSnapshot {
+  uint64_t version = 0;
+  std::vector<BlockRule> rules;
+};
+
 class TradingBlocker {
 public:
+  // Outer error means the batch could not be applied at all, otherwise there is one result per rule.
+  using BlockRuleResults = std::vector<tl::expected<void, std::string>>;
+
   TradingBlocker();
   tl::expected<void, std::string> isTradingBlocked(const std::string& subaccount,
                                                    const std::vector<infra::InstrumentDescription>& instruments);
@@ -24,12 +57,43 @@ public:
                                                   const std::string& symbol,
                                                   const std::string& type);
 
+  tl::expected<BlockRuleResults, std::string> addBlockRules(const std::vector<BlockRule>& rules);
+  tl::expected<BlockRuleResults, std::string> removeBlockRules(const std::vector<BlockRule>& rules);
+
+  // Subscribe before taking a snapshot to keep a local copy without gaps. Rules are read from clickhouse
+  // once, after that the snapshot is the in-memory set kept by publish() and refreshBlockRules(), so it
+  // never lags behind a delta because of a pending clickhouse mutation.
+  tl::expected<BlocklistSnapshot, std::string> getBlockRules();
+  // Re-reads the rules from clickhouse and publishes what changed since the last read, so the rules
+  // other processes add or remove reach the subscribers. Returns the number of deltas published. Changes
+  // this instance publishes while the rows are read win over the rows. A removal whose mutation is still
+  // pending reads as active, the rule is then blocked again until a later refresh sees it gone.
+  tl::expected<size_t, std::string> refreshBlockRules();
+  uint64_t subscribe(Subscribers<BlockRuleDelta>::Callback callback);
+  void unsubscribe(uint64_t subscription_id);
+  uint64_t version() const;
+
 private:
-  std::optional<std::string> getStatus(const std::string& subaccount,
-                                       infra::Market market,
-                                       const std::string& symbol,
-                                       const std::string& type);
-  std::unique_ptr<clickhouse::Client> clickhouse_client_;
+  void publish(BlockRuleDelta::Action action, const BlockRule& rule);
+  // under rules_mutex_, the delta still has to be published to the subscribers
+  BlockRuleDelta apply(BlockRuleDelta::Action action, const BlockRule& rule);
+  tl::expected<std::map<std::string, BlockRule>, std::string> readBlockRules();
+
+  tl::expected<std::vector<std::optional<std::string>>, std::string> getStatuses(const std::vector<BlockRule>& rules);
+  ResilientClickhouseClient clickhouse_client_;
+  std::atomic<uint64_t> version_;
+  Subscribers<BlockRuleDelta> subscribers_;
+
+  // Guards version increments together with the rule set so a snapshot is consistent with its version.
+  std::mutex rules_mutex_;
+  // Active rules by rule tuple, loaded on the first snapshot.
+  std::optional<std::map<std::string, BlockRule>> rules_;
+  // Changes published before the rules were loaded, nullopt for a removed rule.
+  std::map<std::string, std::optional<BlockRule>> early_changes_;
+  // one refresh at a time
+  std::mutex refresh_mutex_;
+  // Changes published while a refresh reads the rules, nullopt when no refresh is reading.
+  std::optional<std::map<std::string, std::optional<BlockRule>>> refresh_changes_;
 };
 
 }  // namespace funds_controller
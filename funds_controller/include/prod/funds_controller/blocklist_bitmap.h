@@ -0,0 +1,214 @@
+#pragma once
+
+// Header-only reader of the shared blocklist bitmap published by BlocklistBitmapPublisher.
+// Only depends on the standard library and POSIX, so trading processes can include it directly.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+namespace funds_controller {
+
+// Segment layout: header, subaccount name table, then one row of bits per subaccount slot indexed
+// by UniverseSnapshot instrument id. Rows are updated in place under the header seqlock. Slots and
+// their names never change once published; when the segment has to grow the publisher writes a new
+// one, renames it over the old path and marks the old segment retired.
+struct BlocklistBitmapLayout {
+  static constexpr uint64_t kMagic = 0x31'4b'4c'42'43'46'00'00;  // "\0\0FCBLK1"
+  static constexpr uint32_t kVersion = 1;
+  static constexpr size_t kSubaccountNameSize = 32;
+  static constexpr std::string_view kDefaultPath = "/dev/shm/funds_controller_blocklist";
+  // A write holds the sequence odd for a few stores. A reader still seeing it odd or changing after this
+  // many attempts assumes the publisher died mid-write and reports blocked.
+  static constexpr uint32_t kMaxReadAttempts = 4096;
+
+  struct alignas(64) Header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t subaccount_capacity;
+    uint32_t instrument_capacity;
+    uint32_t words_per_subaccount;
+    int64_t universe_created_at_ms;
+    std::atomic<uint32_t> subaccount_count;
+    std::atomic<uint32_t> retired;
+    // odd while the publisher is writing
+    alignas(64) std::atomic<uint64_t> sequence;
+  };
+
+  struct SubaccountName {
+    uint8_t size;
+    char data[kSubaccountNameSize - 1];
+
+    std::string_view view() const {
+      return {data, size};
+    }
+  };
+
+  static_assert(sizeof(Header) == 128);
+  static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+  static size_t wordsPerSubaccount(uint32_t instrument_capacity) {
+    return (instrument_capacity + 63) / 64;
+  }
+  static size_t namesOffset() {
+    return sizeof(Header);
+  }
+  static size_t bitsOffset(uint32_t subaccount_capacity) {
+    return (namesOffset() + subaccount_capacity * sizeof(SubaccountName) + 63) / 64 * 64;
+  }
+  static size_t segmentSize(uint32_t subaccount_capacity, uint32_t instrument_capacity) {
+    return bitsOffset(subaccount_capacity) +
+           subaccount_capacity * wordsPerSubaccount(instrument_capacity) * sizeof(uint64_t);
+  }
+};
+
+class BlocklistBitmapReader {
+public:
+  using Layout = BlocklistBitmapLayout;
+
+  static std::optional<BlocklistBitmapReader> open(const std::string& path = std::string{Layout::kDefaultPath}) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return std::nullopt;
+    }
+    struct stat segment_stat {};
+    if (::fstat(fd, &segment_stat) != 0 || static_cast<size_t>(segment_stat.st_size) < sizeof(Layout::Header)) {
+      ::close(fd);
+      return std::nullopt;
+    }
+    size_t size = static_cast<size_t>(segment_stat.st_size);
+    void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      return std::nullopt;
+    }
+    BlocklistBitmapReader reader(path, data, size);
+    const auto& header = reader.header();
+    if (header.magic != Layout::kMagic || header.version != Layout::kVersion ||
+        size != Layout::segmentSize(header.subaccount_capacity, header.instrument_capacity)) {
+      return std::nullopt;
+    }
+    return reader;
+  }
+
+  ~BlocklistBitmapReader() {
+    if (data_ != nullptr) {
+      ::munmap(data_, size_);
+    }
+  }
+  BlocklistBitmapReader(BlocklistBitmapReader&& other) noexcept:
+      path_(std::move(other.path_)), data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {
+  }
+  BlocklistBitmapReader& operator=(BlocklistBitmapReader&& other) noexcept {
+    std::swap(path_, other.path_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+
+  // Resolve once and keep the slot, slots are stable for the lifetime of the segment.
+  // A subaccount without a slot has no block rules.
+  std::optional<uint32_t> subaccountSlot(std::string_view subaccount) const {
+    uint32_t count = header().subaccount_count.load(std::memory_order_acquire);
+    for (uint32_t slot = 0; slot < count; ++slot) {
+      if (names()[slot].view() == subaccount) {
+        return slot;
+      }
+    }
+    return std::nullopt;
+  }
+
+  // Instrument ids outside the universe the segment was built for are reported as blocked, so is
+  // everything while a write never completes.
+  bool isBlocked(uint32_t slot, uint32_t instrument_id) const {
+    const auto& header = this->header();
+    if (instrument_id >= header.instrument_capacity) {
+      return true;
+    }
+    if (slot >= header.subaccount_capacity) {
+      return false;
+    }
+    const auto& word = bits()[slot * header.words_per_subaccount + instrument_id / 64];
+    for (uint32_t attempt = 0; attempt < Layout::kMaxReadAttempts; ++attempt) {
+      uint64_t sequence = header.sequence.load(std::memory_order_acquire);
+      if ((sequence & 1) == 0) {
+        uint64_t value = word.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header.sequence.load(std::memory_order_relaxed) == sequence) {
+          return (value >> (instrument_id % 64)) & 1;
+        }
+      }
+      pause();
+    }
+    return true;
+  }
+
+  bool isBlocked(std::string_view subaccount, uint32_t instrument_id) const {
+    auto slot = subaccountSlot(subaccount);
+    return slot.has_value() ? isBlocked(*slot, instrument_id) : instrument_id >= header().instrument_capacity;
+  }
+
+  // The publisher moved to a new segment, reopen to see further changes. Slots must be resolved again.
+  bool isRetired() const {
+    return header().retired.load(std::memory_order_acquire) != 0;
+  }
+
+  bool reopenIfRetired() {
+    if (!isRetired()) {
+      return false;
+    }
+    auto reader = open(path_);
+    if (!reader.has_value()) {
+      return false;
+    }
+    *this = std::move(*reader);
+    return true;
+  }
+
+  int64_t universeCreatedAtMs() const {
+    return header().universe_created_at_ms;
+  }
+
+private:
+  BlocklistBitmapReader(std::string path, void* data, size_t size): path_(std::move(path)), data_(data), size_(size) {
+  }
+
+  static void pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#else
+    std::this_thread::yield();
+#endif
+  }
+
+  const Layout::Header& header() const {
+    return *static_cast<const Layout::Header*>(data_);
+  }
+  const Layout::SubaccountName* names() const {
+    return reinterpret_cast<const Layout::SubaccountName*>(static_cast<const char*>(data_) + Layout::namesOffset());
+  }
+  const std::atomic<uint64_t>* bits() const {
+    return reinterpret_cast<const std::atomic<uint64_t>*>(static_cast<const char*>(data_) +
+                                                          Layout::bitsOffset(header().subaccount_capacity));
+  }
+
+  std::string path_;
+  void* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+}  // namespace funds_controller
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "prod/funds_controller/block_trading.h"
+#include "prod/funds_controller/blocklist_bitmap.h"
+#include "prod/funds_controller/universe_snapshot.h"
+
+#include <tl/expected.hpp>
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace funds_controller {
+
+// Mirrors the effective TradingBlocker state into a shared memory bitmap read by
+// BlocklistBitmapReader. Rules are resolved against the universe snapshot written by
+// ListingsWatcher: an instrument is blocked for a subaccount if its pair or its quote asset is.
+// It follows the deltas of the TradingBlocker, rules other processes change reach it once the serving
+// loop calls TradingBlocker::refreshBlockRules.
+class BlocklistBitmapPublisher {
+public:
+  struct Options {
+    std::string segment_path = std::string{BlocklistBitmapLayout::kDefaultPath};
+    std::string universe_path;
+    uint32_t subaccount_capacity = 256;
+  };
+
+  BlocklistBitmapPublisher(TradingBlocker& trading_blocker, Options options);
+  ~BlocklistBitmapPublisher();
+
+  tl::expected<void, std::string> start();
+  void stop();
+
+  // Rebuilds the segment if the universe snapshot was replaced since it was last loaded.
+  tl::expected<void, std::string> refreshUniverse();
+
+private:
+  using MarketSymbol = std::pair<uint16_t, std::string>;
+
+  struct SubaccountRules {
+    uint32_t slot;
+    std::set<MarketSymbol> pairs;
+    std::set<MarketSymbol> assets;
+  };
+
+  struct Instrument {
+    MarketSymbol pair;
+    MarketSymbol quote_asset;
+  };
+
+  void onDelta(const BlockRuleDelta& delta);
+  tl::expected<void, std::string> applyDelta(const BlockRuleDelta& delta);
+  tl::expected<SubaccountRules*, std::string> rulesFor(const std::string& subaccount);
+  tl::expected<void, std::string> loadUniverse();
+  tl::expected<void, std::string> writeSegment(uint32_t subaccount_capacity);
+  void unmapSegment();
+  bool isBlocked(const SubaccountRules& rules, uint32_t instrument_id) const;
+  std::vector<uint32_t> affectedInstruments(const BlockRule& rule) const;
+
+  BlocklistBitmapLayout::Header& header() const;
+  std::atomic<uint64_t>* row(uint32_t slot) const;
+
+  TradingBlocker& trading_blocker_;
+  Options options_;
+  uint64_t subscription_id_ = 0;
+
+  std::mutex mutex_;
+  bool loaded_ = false;
+  uint64_t version_ = 0;
+  std::vector<BlockRuleDelta> early_deltas_;
+  std::map<std::string, SubaccountRules> rules_;
+
+  std::optional<UniverseSnapshot> universe_;
+  std::vector<std::optional<Instrument>> instruments_;
+  std::map<MarketSymbol, uint32_t> instrument_by_pair_;
+  std::map<MarketSymbol, std::vector<uint32_t>> instruments_by_quote_asset_;
+
+  void* segment_ = nullptr;
+  size_t segment_size_ = 0;
+};
+
+}  // namespace funds_controller
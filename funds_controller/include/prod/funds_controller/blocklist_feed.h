@@ -0,0 +1,80 @@
+#pragma once
+
+#include "prod/funds_controller/block_trading.h"
+
+#include <tl/expected.hpp>
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace funds_controller {
+
+// Streams blocklist changes to local processes over a unix socket. Every client first receives the
+// full rule set ("reset", one "add" per rule, "synced") and then live "add"/"remove" deltas.
+// Lines are tab separated: action, version, subaccount, market, symbol, type.
+class BlocklistFeedServer {
+public:
+  BlocklistFeedServer(TradingBlocker& trading_blocker, std::string socket_path);
+  ~BlocklistFeedServer();
+
+  tl::expected<void, std::string> start();
+  void stop();
+
+private:
+  struct Client {
+    int fd;
+    std::string pending;
+  };
+
+  void onDelta(const BlockRuleDelta& delta);
+  void applyDelta(const BlockRuleDelta& delta);
+  void run(std::stop_token stop_token);
+  void acceptClient();
+  bool flush(Client& client);
+  void wake();
+
+  TradingBlocker& trading_blocker_;
+  std::string socket_path_;
+  int listen_fd_ = -1;
+  int wake_fd_ = -1;
+  uint64_t subscription_id_ = 0;
+
+  std::mutex mutex_;
+  bool loaded_ = false;
+  uint64_t version_ = 0;
+  std::vector<BlockRuleDelta> early_deltas_;
+  std::map<std::string, BlockRule> rules_;
+  std::vector<Client> clients_;
+  std::jthread thread_;
+};
+
+// Keeps a consumer process in sync with BlocklistFeedServer, reconnecting when the server restarts.
+// on_snapshot is called after every (re)connect, on_delta for every change after it.
+class BlocklistFeedClient {
+public:
+  BlocklistFeedClient(std::string socket_path,
+                      std::function<void(const BlocklistSnapshot&)> on_snapshot,
+                      std::function<void(const BlockRuleDelta&)> on_delta);
+  ~BlocklistFeedClient();
+
+  void start();
+  void stop();
+
+private:
+  void run(std::stop_token stop_token);
+  tl::expected<void, std::string> handleLine(std::string_view line);
+
+  std::string socket_path_;
+  std::function<void(const BlocklistSnapshot&)> on_snapshot_;
+  std::function<void(const BlockRuleDelta&)> on_delta_;
+  std::optional<BlocklistSnapshot> pending_snapshot_;
+  std::jthread thread_;
+};
+
+}  // namespace funds_controller
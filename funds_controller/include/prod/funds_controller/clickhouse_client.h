@@ -5,11 +5,46 @@
 
 #include <clickhouse/client.h>
 
+#include <chrono>
+#include <future>
 #include <memory>
 
 namespace funds_controller {
 
-std::unique_ptr<clickhouse::Client> getFundsControllerClickhouseClient();
+// Connects synchronously. All clients share one TLS context, so the CA store is loaded once.
+// A non zero io_timeout bounds every socket read and write, a stuck query fails instead of hanging.
+std::unique_ptr<clickhouse::Client> getFundsControllerClickhouseClient(std::chrono::milliseconds io_timeout = {});
+
+// Client connecting in the background from construction, so the handshakes of all managers overlap
+// instead of running one after another. The first call through the handle waits for the connection.
+// If the background connect failed, every call through the handle connects again in the caller and
+// throws when that fails too, so a handle recovers once ClickHouse is back. Like clickhouse::Client,
+// one user at a time.
+class ClickhouseClientHandle {
+public:
+  explicit ClickhouseClientHandle(std::chrono::milliseconds io_timeout = {});
+
+  clickhouse::Client* operator->() {
+    return &client();
+  }
+
+  clickhouse::Client& operator*() {
+    return client();
+  }
+
+  // Waits for the connection, false if it failed.
+  bool ready();
+
+private:
+  clickhouse::Client& client();
+
+  const std::chrono::milliseconds io_timeout_;
+  std::shared_future<std::unique_ptr<clickhouse::Client>> client_;
+};
+
+// Readiness barrier: waits until every connection started so far by a ClickhouseClientHandle is
+// established or failed. False if any of them failed since the previous call.
+bool waitForClickhouseConnections();
 
 std::string convertUUIDToString(const clickhouse::UUID& uuid);
 
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "prod/funds_controller/ledger_events.h"
+
+#include "common/types/volume.h"
+
+#include <tl/expected.hpp>
+
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+namespace funds_controller {
+
+struct Exposure {
+  // LOANS_INFO_v2 funds the subaccount holds
+  infra::Volume loans;
+  // HEDGES_INFO_v2 amounts covering them
+  infra::Volume hedges;
+  // net transfer flow, informational: loan transfers are already reflected in loans
+  infra::Volume transfers;
+
+  // borrowed position left unhedged
+  infra::Volume net() const {
+    return loans - hedges;
+  }
+
+  void apply(LedgerEvent::Kind kind, infra::Volume amount);
+};
+
+struct ExposureSnapshot {
+  // events applied when the snapshot was taken
+  uint64_t sequence = 0;
+  std::unordered_map<std::string, std::unordered_map<std::string, Exposure>> by_subaccount;
+  std::unordered_map<std::string, Exposure> by_asset;
+};
+
+// Net exposure kept up to date from ledgerEvents(), so risk checks read memory instead of the ledger.
+// Each event touches one (subaccount, asset) entry and one asset total.
+class ExposureEngine {
+public:
+  ExposureEngine();
+  ~ExposureEngine();
+
+  ExposureEngine(const ExposureEngine&) = delete;
+  ExposureEngine& operator=(const ExposureEngine&) = delete;
+
+  // Replaces the state with the ledger aggregates. Call it before the managers start mutating,
+  // events published while it runs may be counted twice; call it again to resync.
+  tl::expected<void, std::string> load();
+  // Same as load() from a state rebuilt elsewhere, e.g. by LedgerReplay::warmStart.
+  void restore(ExposureSnapshot state);
+
+  Exposure exposure(const std::string& subaccount, const std::string& asset) const;
+  Exposure exposure(const std::string& asset) const;
+  // Consistent copy of everything, no event is half applied.
+  ExposureSnapshot snapshot() const;
+
+private:
+  void apply(const LedgerEvent& event);
+
+  mutable std::shared_mutex mutex_;
+  ExposureSnapshot state_;
+  uint64_t subscription_id_;
+};
+
+}  // namespace funds_controller
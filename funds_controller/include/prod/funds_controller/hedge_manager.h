@@ -1,16 +1,28 @@
 #pragma once
 
-#include "prod/funds_controller/clickhouse_client.h"
+#include "prod/funds_controller/icommand.h"
+#include "prod/funds_controller/operation_error.h"
+#include "prod/funds_controller/resilient_clickhouse_client.h"
 
 #include "common/instrument_description/instrument_description.h"
 #include "common/types/volume.h"
 
 #include <tl/expected.hpp>
 
+#include <map>
+#include <memory>
+#include <set>
 #include <vector>
 
 namespace funds_controller {
 
+struct HedgeTarget {
+  std::string subaccount;
+  infra::Exchange exchange;
+  std::string asset;
+  infra::Volume amount;
+};
+
 class HedgeManager {
 public:
   HedgeManager();
@@ -43,31 +55,58 @@ public:
                                                                   const std::string& asset);
 
   tl::expected<FuturesHedge, std::string> getFuturesHedge(const std::string& hedge_id);
+  // keyed by hedge_id
+  tl::expected<std::map<std::string, FuturesHedge>, std::string> getFuturesHedges(
+      const std::vector<std::string>& hedge_ids);
 
+  // A non empty idempotency key makes retries of the same request safe, see IdempotencyStore.
   tl::expected<void, std::string> createHedge(const std::string& subaccount,
                                               infra::Exchange exchange,
                                               const std::string& asset,
-                                              infra::Volume amount);
+                                              infra::Volume amount,
+                                              const std::string& idempotency_key = {});
+
+  // Brings the hedge amount of every (subaccount, asset) on the target exchange to its target. A surplus
+  // row whose position is held by a subaccount that needs hedges goes back to it without trading, the
+  // rest is traded: new hedges are opened in the subaccounts that need them, excess ones are closed
+  // where they are held.
+  tl::expected<void, std::string> rebalance(const std::vector<HedgeTarget>& targets);
 
 private:
-  tl::expected<void, std::string> deleteRowById(const std::string& table_name, const std::string& id);
-  tl::expected<void, std::string> changeAmountInRowById(const std::string& table_name,
-                                                        const std::string& id,
-                                                        infra::Volume new_amount);
-
-  tl::expected<void, std::string> createNewFuturesHedgeRow(const std::string& subaccount,
-                                                           infra::Market market,
-                                                           const std::string& pair,
-                                                           infra::Volume amount,
-                                                           const std::string& hedge_id);
-
-  tl::expected<void, std::string> createNewHedgeInfoRow(const std::string& subaccount,
-                                                        const std::string& asset,
-                                                        infra::Volume amount,
-                                                        const std::string& initial_subaccount,
-                                                        const std::string& hedge_id);
-
-  std::unique_ptr<clickhouse::Client> clickhouse_client_;
+  // createHedge without an idempotency key
+  OperationResult executeCreateHedge(const std::string& subaccount,
+                                     infra::Exchange exchange,
+                                     const std::string& asset,
+                                     infra::Volume amount);
+
+  // done rows only
+  tl::expected<std::vector<HedgeInfo>, std::string> getHedgesInfo(
+      const std::set<std::pair<std::string, std::string>>& subaccount_assets);
+
+  // futures sell and spot buy of amount, negative amount closes the hedge
+  tl::expected<std::unique_ptr<ICommand>, std::string> makeHedgeCommand(const std::string& subaccount,
+                                                                        infra::Exchange exchange,
+                                                                        const std::string& asset,
+                                                                        infra::Volume amount);
+
+  // The row writers fail with an unknown outcome when the write missed its deadline.
+  OperationResult deleteRowsByHedgeId(const std::string& table_name, const std::vector<std::string>& hedge_ids);
+
+  OperationResult createNewFuturesHedgeRow(const std::string& subaccount,
+                                           infra::Market market,
+                                           const std::string& pair,
+                                           infra::Volume amount,
+                                           const std::string& hedge_id);
+  OperationResult createNewFuturesHedgeRows(const std::vector<FuturesHedge>& futures_hedges);
+
+  OperationResult createNewHedgeInfoRow(const std::string& subaccount,
+                                        const std::string& asset,
+                                        infra::Volume amount,
+                                        const std::string& initial_subaccount,
+                                        const std::string& hedge_id);
+  OperationResult createNewHedgeInfoRows(const std::vector<HedgeInfo>& hedges_info);
+
+  ResilientClickhouseClient clickhouse_client_;
 };
 
 }  // namespace funds_controller
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <tl/expected.hpp>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace funds_controller {
+
+// Blocking HTTP/1.1 GET client with a single keep-alive connection. https goes through OpenSSL,
+// plain http is accepted so exchanges can be replaced with a local stand-in.
+class HttpClient {
+public:
+  HttpClient(const std::string& base_url, std::chrono::milliseconds timeout);
+  ~HttpClient();
+
+  HttpClient(HttpClient&&) noexcept;
+  HttpClient& operator=(HttpClient&&) noexcept;
+
+  // `extra_headers` are "Name: value\r\n" lines sent after the default ones.
+  tl::expected<std::string, std::string> get(const std::string& path, const std::string& extra_headers = {});
+
+private:
+  struct Connection;
+
+  tl::expected<void, std::string> connect();
+  tl::expected<std::string, std::string> request(const std::string& path, const std::string& extra_headers);
+
+  bool tls_ = true;
+  std::string host_;
+  std::string port_;
+  std::string base_path_;
+  std::chrono::milliseconds timeout_;
+  std::unique_ptr<Connection> connection_;
+};
+
+}  // namespace funds_controller
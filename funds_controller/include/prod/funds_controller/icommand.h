@@ -1,5 +1,7 @@
 #pragma once
 
+#include "prod/funds_controller/operation_error.h"
+
 #include <tl/expected.hpp>
 
 #include <string>
@@ -8,7 +10,8 @@ namespace funds_controller {
 
 class ICommand {
 public:
-  virtual tl::expected<void, std::string> execute() = 0;
+  // An unknown outcome means part of the command may have taken effect and could not be undone.
+  virtual OperationResult execute() = 0;
   virtual tl::expected<void, std::string> undo() = 0;
   virtual ~ICommand() = default;
 };
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "prod/funds_controller/lease_manager.h"
+#include "prod/funds_controller/operation_error.h"
+#include "prod/funds_controller/resilient_clickhouse_client.h"
+
+#include <tl/expected.hpp>
+
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace funds_controller {
+
+// Runs every client request at most once per idempotency key. Keys are checked in memory first and
+// in IDEMPOTENCY_KEYS_v1 after a restart or eviction, so a retried or hedged duplicate request gets
+// the outcome of the first one instead of booking the ledger twice. The table is append only, every
+// status change is a new row and the latest row of a key wins. Only transfer rows carry the key, as
+// their inner_id; loan and hedge rows do not, for them the table records just the request.
+//
+// The check and the pending row are not atomic in clickhouse. Two instances only stay apart through
+// the leases: with a LeaseManager installed a request is refused by every instance but the owner of
+// the keys its operation locks, so all requests on those keys are deduplicated by one instance. Without
+// one a single instance must serve the keys. A client reusing an idempotency key for an operation on
+// other keys is only caught by the clickhouse check.
+class IdempotencyStore {
+public:
+  using Result = tl::expected<void, std::string>;
+
+  struct Options {
+    // completed keys kept in memory, older ones are answered from clickhouse
+    size_t cache_size = 100'000;
+  };
+
+  explicit IdempotencyStore(Options options);
+
+  // `keys` are the lease keys of the operation. `request` describes the arguments, reusing a key for a
+  // different request is an error.
+  // Concurrent duplicates wait for the running one and share its result. A request that rolled back
+  // releases the key so it can be retried. One with an unknown outcome keeps it pending, later
+  // duplicates are refused until the key is reconciled.
+  Result run(const std::vector<LeaseKey>& keys,
+             const std::string& key,
+             const std::string& request,
+             const std::function<OperationResult()>& action);
+
+private:
+  struct Entry {
+    std::string request;
+    std::shared_future<Result> result;
+  };
+
+  struct StoredKey {
+    std::string request;
+    std::string status;
+  };
+
+  OperationResult execute(const std::string& key,
+                          const std::string& request,
+                          const std::function<OperationResult()>& action);
+
+  tl::expected<std::optional<StoredKey>, std::string> getStoredKey(const std::string& key);
+  tl::expected<void, std::string> insertStatus(const std::string& key,
+                                               const std::string& request,
+                                               const std::string& status);
+
+  const Options options_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  // completed keys in completion order, for eviction
+  std::deque<std::string> completed_keys_;
+
+  ResilientClickhouseClient clickhouse_client_;
+};
+
+// Process wide store shared by all managers.
+IdempotencyStore& idempotencyStore();
+
+}  // namespace funds_controller
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "prod/funds_controller/resilient_clickhouse_client.h"
+
+#include <tl/expected.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace funds_controller {
+
+// (subaccount, asset), the unit the managers read, act on and write back
+using LeaseKey = std::pair<std::string, std::string>;
+
+struct Lease {
+  std::string instance;
+  uint32_t shard;
+  // wall clock, a lease with expires_at_ms <= now is released
+  int64_t expires_at_ms;
+};
+
+// Shared lease table of all instances. Writes are last writer wins per (instance, shard).
+class LeaseStore {
+public:
+  virtual ~LeaseStore() = default;
+
+  virtual tl::expected<void, std::string> write(const std::vector<Lease>& leases) = 0;
+  // every unexpired lease of every instance
+  virtual tl::expected<std::vector<Lease>, std::string> read() = 0;
+};
+
+// LEASES_v1, for instances on different hosts. Best effort: inserts are last writer wins with no
+// compare-and-set and no quorum, and the ledger writes carry no fencing token. Two instances that read
+// the table at the same time can both claim a shard, the lower score backs off only at its next
+// renewal, and a paused instance can still write after its lease ran out. The leases keep instances
+// from colliding in normal operation, they are not a correctness guarantee under partitions or pauses.
+class ClickhouseLeaseStore final : public LeaseStore {
+public:
+  tl::expected<void, std::string> write(const std::vector<Lease>& leases) override;
+  tl::expected<std::vector<Lease>, std::string> read() override;
+
+private:
+  ResilientClickhouseClient clickhouse_client_;
+};
+
+// In-process stand-in for the coordinator, for instances sharing one process and for local runs.
+class LocalLeaseStore final : public LeaseStore {
+public:
+  tl::expected<void, std::string> write(const std::vector<Lease>& leases) override;
+  tl::expected<std::vector<Lease>, std::string> read() override;
+
+private:
+  std::mutex mutex_;
+  std::map<std::pair<std::string, uint32_t>, int64_t> expires_at_ms_;
+};
+
+// Shards the keys over the live instances. Every instance heartbeats through the store and the shards
+// are spread by rendezvous hashing over the live set, so an instance joining or leaving only moves the
+// shards it gains or loses. A shard changes hands through its lease: the new owner claims it only once
+// no other lease on it is left, and starts serving it one renewal later if no other claim showed up.
+// An instance stops serving its shards safety_margin before its last successful renewal runs out, so
+// with a store that serializes claims two instances never act on the same key unless clocks drift by
+// more than the margin. ClickhouseLeaseStore does not, see there.
+class LeaseManager {
+public:
+  // shard of the instance heartbeat, the live set is the instances holding it
+  static constexpr uint32_t kMembershipShard = UINT32_MAX;
+
+  struct Options {
+    std::string instance;
+    uint32_t shards = 256;
+    std::chrono::milliseconds lease_duration{15'000};
+    std::chrono::milliseconds renew_interval{3'000};
+    std::chrono::milliseconds safety_margin{3'000};
+  };
+
+  // Keys locked for one operation, in shard order so concurrent operations cannot deadlock.
+  class Guard {
+  public:
+    Guard() = default;
+
+  private:
+    friend class LeaseManager;
+    std::vector<std::unique_lock<std::mutex>> locks_;
+  };
+
+  LeaseManager(Options options, std::shared_ptr<LeaseStore> store);
+  // releases the leases so the other instances take over without waiting for them to expire, and
+  // uninstalls the manager if it is the installed one
+  ~LeaseManager();
+
+  LeaseManager(const LeaseManager&) = delete;
+  LeaseManager& operator=(const LeaseManager&) = delete;
+
+  uint32_t shardOf(const LeaseKey& key) const;
+  bool owns(const LeaseKey& key) const;
+  // Instance to route the key to: the lease holder, during a handover the instance taking over.
+  std::optional<std::string> owner(const LeaseKey& key) const;
+
+  // Fails when a key is owned by another instance, the error names it so the caller can route there.
+  // Also serializes operations on the same shard within this instance.
+  tl::expected<Guard, std::string> lock(const std::vector<LeaseKey>& keys);
+
+  // One heartbeat and rebalance round, run by the background thread every renew_interval.
+  tl::expected<void, std::string> renew();
+
+  // Waits until the instance serves its first shards, one renewal after it claimed them. False on timeout.
+  bool waitUntilServing(std::chrono::milliseconds timeout) const;
+
+private:
+  void run(std::stop_token stop_token);
+  uint64_t score(uint32_t shard, const std::string& instance) const;
+  // live instance with the highest score
+  std::optional<std::string> preferredOwner(uint32_t shard, const std::set<std::string>& instances) const;
+
+  const Options options_;
+  const std::shared_ptr<LeaseStore> store_;
+  std::vector<std::mutex> shard_mutexes_;
+
+  mutable std::mutex mutex_;
+  std::set<uint32_t> owned_;
+  std::set<uint32_t> claimed_;
+  int64_t serve_until_ms_ = 0;
+  std::set<std::string> instances_;
+  // unexpired lease holders by shard, from the last renewal
+  std::map<uint32_t, std::string> holders_;
+
+  std::jthread thread_;
+};
+
+// Installed by main when it runs as a named instance, the managers check it before mutating a key.
+void setLeaseManager(LeaseManager* lease_manager);
+
+// Locks the keys of one operation on the installed lease manager, a no-op when there is none.
+tl::expected<LeaseManager::Guard, std::string> lockKeys(const std::vector<LeaseKey>& keys);
+
+// Fails when the key is leased to another instance, without locking its shard.
+tl::expected<void, std::string> checkKeyOwner(const LeaseKey& key);
+
+}  // namespace funds_controller
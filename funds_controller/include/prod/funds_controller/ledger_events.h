@@ -0,0 +1,42 @@
+#pragma once
+
+#include "prod/funds_controller/subscribers.h"
+
+#include "common/types/volume.h"
+
+#include <string>
+
+namespace funds_controller {
+
+// A committed change of one ledger aggregate. Every event mirrors a write the managers made:
+// Loan to LOANS_INFO_v2 amounts, Hedge to HEDGES_INFO_v2 amounts, Transfer to TRANSACTIONS_v1
+// transfer rows (negative for the sender, positive for the receiver).
+struct LedgerEvent {
+  enum class Kind : uint8_t {
+    Loan,
+    Hedge,
+    Transfer,
+  };
+
+  Kind kind;
+  std::string subaccount;
+  std::string asset;
+  infra::Volume amount;
+};
+
+// Process wide bus the managers publish to after their ledger writes succeed.
+inline Subscribers<LedgerEvent>& ledgerEvents() {
+  static Subscribers<LedgerEvent> events;
+  return events;
+}
+
+inline void publishLedgerEvent(LedgerEvent::Kind kind,
+                               const std::string& subaccount,
+                               const std::string& asset,
+                               infra::Volume amount) {
+  if (amount != 0) {
+    ledgerEvents().publish({kind, subaccount, asset, amount});
+  }
+}
+
+}  // namespace funds_controller
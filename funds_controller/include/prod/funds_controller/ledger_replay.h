@@ -0,0 +1,90 @@
+#pragma once
+
+#include "prod/funds_controller/exposure_engine.h"
+#include "prod/funds_controller/ledger_events.h"
+#include "prod/funds_controller/resilient_clickhouse_client.h"
+
+#include <tl/expected.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+
+namespace funds_controller {
+
+// Append-only copy of ledgerEvents() in LEDGER_EVENTS_v1, the input of the replay. LOANS_INFO_v2 and
+// HEDGES_INFO_v2 are updated in place and cannot tell past states, the journal can. It must be alive
+// whenever the managers mutate the ledger, main runs it with --journal or --ledger-snapshot.
+class LedgerJournal {
+public:
+  LedgerJournal();
+  ~LedgerJournal();
+
+  LedgerJournal(const LedgerJournal&) = delete;
+  LedgerJournal& operator=(const LedgerJournal&) = delete;
+
+  // Writes the current ledger aggregates as opening rows when the journal is empty, so a journal
+  // started on an existing ledger replays to the same state. History before it is not known.
+  static tl::expected<void, std::string> bootstrap();
+
+private:
+  void write(const LedgerEvent& event);
+
+  uint64_t subscription_id_;
+};
+
+// Sums of the journal for one subaccount and asset, as Decimal(38, 12) mantissas.
+struct LedgerBalance {
+  clickhouse::Int128 loans = 0;
+  clickhouse::Int128 hedges = 0;
+  clickhouse::Int128 transfers = 0;
+};
+
+struct LedgerState {
+  // every journal row with timestamp <= high_water_mark_ms is included, no later one
+  int64_t high_water_mark_ms = 0;
+  std::map<std::pair<std::string, std::string>, LedgerBalance> balances;
+
+  ExposureSnapshot toExposure() const;
+};
+
+// Rebuilds the ledger state from the journal, one query per subaccount partition in parallel, and keeps
+// it in a local snapshot file so a restart only replays the rows written since. The file is read in
+// place through mmap and replaced atomically.
+class LedgerReplay {
+public:
+  struct Options {
+    size_t parallelism = 8;
+    // rows older than this are assumed committed, the snapshot never goes past now - settle_delay so a
+    // late batched write cannot end up behind its high water mark
+    std::chrono::milliseconds settle_delay{60'000};
+    std::string snapshot_path = "ledger_state.snapshot";
+  };
+
+  explicit LedgerReplay(Options options);
+
+  // Loads the snapshot, replays the settled rows after it and persists the result, then replays the
+  // rest. Call it before the managers start mutating, like ExposureEngine::load.
+  tl::expected<LedgerState, std::string> warmStart();
+
+  // State as of timestamp_ms for audits, on top of the snapshot when it is not newer, from the start
+  // of the journal otherwise.
+  tl::expected<LedgerState, std::string> stateAsOf(int64_t timestamp_ms);
+
+  static tl::expected<void, std::string> writeSnapshot(const std::string& path, const LedgerState& state);
+  static tl::expected<LedgerState, std::string> readSnapshot(const std::string& path);
+
+private:
+  // adds the rows in (state.high_water_mark_ms, to_timestamp_ms]
+  tl::expected<void, std::string> replay(LedgerState& state, int64_t to_timestamp_ms);
+  tl::expected<LedgerState, std::string> replayPartition(size_t partition,
+                                                         int64_t from_timestamp_ms,
+                                                         int64_t to_timestamp_ms);
+
+  const Options options_;
+  ResilientClickhouseClient clickhouse_client_;
+};
+
+}  // namespace funds_controller
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "prod/funds_controller/mpsc_queue.h"
+#include "prod/funds_controller/operation_error.h"
+#include "prod/funds_controller/resilient_clickhouse_client.h"
+
+#include <tl/expected.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace funds_controller {
+
+// Background writer grouping ledger inserts. Writes to the same table and columns are merged into
+// one INSERT, so concurrent operations share a round trip and a part instead of creating one each.
+// The writer flushes as soon as it finds the queue empty: a lone write goes out at once and the writes
+// arriving during an INSERT make up the next batch. Under a steady stream a batch is flushed when it
+// reaches max_rows or its first write is max_delay old.
+class LedgerWriter {
+public:
+  using Result = OperationResult;
+  // runs on the writer thread once the INSERT returned, must not wait for another write
+  using Callback = std::function<void(const Result&)>;
+
+  struct Options {
+    size_t max_rows = 10'000;
+    std::chrono::milliseconds max_delay{5};
+  };
+
+  explicit LedgerWriter(Options options);
+  ~LedgerWriter();
+
+  // `values` holds `rows` comma separated tuples. The future completes once the INSERT carrying them
+  // returned. A failed INSERT fails every write of its batch, so one bad row also fails the unrelated
+  // operations batched with it, each of them sees the error and rolls back. An INSERT that missed its
+  // deadline fails its writes with an unknown outcome, they must not be rolled back.
+  std::future<Result> insert(std::string table, std::string columns, std::string values, size_t rows = 1);
+  // Same without waiting, for writers that must not block: `done` gets the result.
+  void insert(std::string table, std::string columns, std::string values, size_t rows, Callback done);
+
+private:
+  struct Write {
+    std::string table;
+    std::string columns;
+    std::string values;
+    size_t rows;
+    // done when set, promise otherwise
+    std::promise<Result> promise;
+    Callback done;
+  };
+
+  void push(Write write);
+  void run(std::stop_token stop_token);
+
+  const Options options_;
+  ResilientClickhouseClient clickhouse_client_;
+  MpscQueue<Write> queue_;
+  std::mutex wake_mutex_;
+  std::condition_variable_any wake_;
+  // set by every push, cleared by the writer before it drains the queue
+  bool signaled_ = false;
+  std::jthread thread_;
+};
+
+// Process wide writer shared by all managers.
+LedgerWriter& ledgerWriter();
+
+}  // namespace funds_controller
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "prod/funds_controller/exposure_engine.h"
+#include "prod/funds_controller/resilient_clickhouse_client.h"
+
+#include "common/types/volume.h"
+
+#include <tl/expected.hpp>
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace funds_controller {
+
+// A LIMITS_v1 row. An empty subaccount limits the asset total over all subaccounts, otherwise the
+// limit applies to that subaccount alone. Both are checked when both are defined. Amounts are in units
+// of the asset, the engine has no prices.
+struct Limit {
+  enum class Type : uint8_t {
+    // borrowed amount held, LOANS_INFO_v2
+    MaxLoan,
+    // hedged amount, HEDGES_INFO_v2
+    MaxHedge,
+    // amount transferred out since the start of the UTC day, TRANSACTIONS_v1
+    MaxDailyTransfer,
+  };
+
+  Type type;
+  std::string subaccount;
+  std::string asset;
+  infra::Volume value;
+};
+
+// Proposed operation: a borrow, a hedge or an outgoing transfer of `amount`. Negative amounts (repays,
+// closed hedges) always pass and free room for the following checks of the batch.
+struct LimitCheck {
+  Limit::Type type;
+  std::string subaccount;
+  std::string asset;
+  infra::Volume amount;
+};
+
+struct LimitRejection {
+  Limit limit;
+  // usage before the check, including the accepted checks before it in the batch
+  infra::Volume usage;
+  infra::Volume requested;
+
+  std::string message() const;
+};
+
+// Pre-trade limits checked against usage kept in memory. Loans and hedges are read from the exposure
+// engine, daily transfer volume is counted from ledgerEvents(). A check never touches clickhouse.
+class LimitsEngine {
+public:
+  using LimitCheckResults = std::vector<tl::expected<void, LimitRejection>>;
+
+  explicit LimitsEngine(const ExposureEngine& exposure);
+  ~LimitsEngine();
+
+  LimitsEngine(const LimitsEngine&) = delete;
+  LimitsEngine& operator=(const LimitsEngine&) = delete;
+
+  // Replaces the limits with LIMITS_v1 and the daily transfer volume with today's transfers. Call it
+  // again to pick up changed limits. Transfers published while the rows are read are buffered and added
+  // on top, a transfer whose row the read already saw then counts twice until the next load, never
+  // zero times.
+  tl::expected<void, std::string> load();
+
+  // One result per check, in order. The checks are evaluated as one batch: each sees the usage of the
+  // accepted checks before it, so the batch as a whole stays within the limits. Nothing is reserved,
+  // usage moves once the operations are booked.
+  LimitCheckResults check(const std::vector<LimitCheck>& checks) const;
+
+private:
+  static constexpr size_t kTypes = 3;
+
+  using Values = std::array<std::optional<infra::Volume>, kTypes>;
+
+  struct AssetLimits {
+    Values total;
+    std::unordered_map<std::string, Values> by_subaccount;
+  };
+
+  struct AssetTransfers {
+    infra::Volume total;
+    std::unordered_map<std::string, infra::Volume> by_subaccount;
+  };
+
+  // usage of one limit, without the batch
+  infra::Volume usage(Limit::Type type, const std::string& subaccount, const std::string& asset) const;
+  void apply(const LedgerEvent& event);
+  // under mutex_
+  static void addTransfer(std::unordered_map<std::string, AssetTransfers>& transfers, const LedgerEvent& event);
+
+  const ExposureEngine& exposure_;
+  ResilientClickhouseClient clickhouse_client_;
+
+  // one load at a time
+  std::mutex load_mutex_;
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<std::string, AssetLimits> limits_;
+  // outgoing transfers of transfer_day_, counted as zero once the day is over
+  int64_t transfer_day_ = 0;
+  std::unordered_map<std::string, AssetTransfers> transfers_;
+  // transfer events since the running load started reading
+  std::optional<std::vector<LedgerEvent>> loading_events_;
+  uint64_t subscription_id_;
+};
+
+}  // namespace funds_controller
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "prod/funds_controller/http_client.h"
+#include "prod/funds_controller/universe_snapshot.h"
+
+#include "common/instrument_description/instrument_description.h"
+
+#include <simdjson.h>
+#include <tl/expected.hpp>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace funds_controller {
+
+struct ListingEvent {
+  enum class Type : uint8_t {
+    Added,
+    Removed,
+    StatusChanged,
+  };
+
+  Type type;
+  InstrumentListing listing;
+  std::string previous_status;
+};
+
+class ListingsWatcher {
+public:
+  // Called from the polling threads, possibly concurrently for different markets.
+  using Callback = std::function<void(const ListingEvent&)>;
+
+  struct Options {
+    std::vector<infra::Market> markets;
+    std::chrono::milliseconds poll_interval = std::chrono::seconds(30);
+    std::chrono::milliseconds request_timeout = std::chrono::seconds(10);
+    // Base url overrides per market, e.g. "http://127.0.0.1:8080" for a local stand-in.
+    std::map<infra::Market::Type, std::string> endpoints;
+    // Universe snapshot used as the baseline on start and rewritten after every change.
+    std::string snapshot_path;
+  };
+
+  static std::vector<infra::Market> defaultMarkets();
+  static std::string defaultEndpoint(infra::Market market);
+  static std::string exchangeInfoPath(infra::Market market);
+
+  ListingsWatcher(Options options, Callback callback);
+  ~ListingsWatcher();
+
+  void start();
+  void stop();
+
+  // Polls every market concurrently once and waits for all of them.
+  tl::expected<void, std::string> pollOnce();
+
+  std::vector<InstrumentListing> universe() const;
+
+private:
+  struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view value) const {
+      return std::hash<std::string_view>{}(value);
+    }
+  };
+
+  struct Entry {
+    InstrumentListing listing;
+    uint64_t seen_generation = 0;
+  };
+
+  struct MarketState {
+    MarketState(infra::Market market, HttpClient http_client);
+
+    infra::Market market;
+    std::mutex poll_mutex;
+    HttpClient http_client;
+    simdjson::ondemand::parser parser;
+    size_t last_response_hash = 0;
+
+    mutable std::mutex listings_mutex;
+    std::unordered_map<std::string, Entry, StringHash, std::equal_to<>> listings;
+    uint64_t generation = 0;
+    bool initialized = false;
+  };
+
+  tl::expected<void, std::string> poll(MarketState& state);
+  void run(MarketState& state, std::stop_token stop_token);
+  void loadSnapshot();
+  tl::expected<void, std::string> persistSnapshot();
+
+  Options options_;
+  Callback callback_;
+  std::vector<std::unique_ptr<MarketState>> markets_;
+  std::vector<std::jthread> threads_;
+
+  std::mutex snapshot_mutex_;
+  std::optional<UniverseSnapshot> snapshot_;
+};
+
+}  // namespace funds_controller
@@ -1,12 +1,14 @@
 #pragma once
 
-#include "prod/funds_controller/clickhouse_client.h"
+#include "prod/funds_controller/operation_error.h"
+#include "prod/funds_controller/resilient_clickhouse_client.h"
 
 #include "common/instrument_description/instrument_description.h"
 #include "common/types/volume.h"
 
 #include <tl/expected.hpp>
 
+#include <map>
 #include <vector>
 
 namespace funds_controller {
@@ -48,44 +50,63 @@ public:
                                                                 const std::string& asset);
 
   tl::expected<BorrowInfo, std::string> getBorrowInfo(const std::string& loan_id);
+  // keyed by loan_id, loan ids without a borrow row are missing from the result
+  tl::expected<std::map<std::string, BorrowInfo>, std::string> getBorrowsInfo(const std::vector<std::string>& loan_ids);
 
+  // A non empty idempotency key makes retries of the same request safe, see IdempotencyStore.
   tl::expected<void, std::string> borrow(const std::string& subaccount,
                                          infra::Exchange exchange,
                                          const std::string& asset,
-                                         infra::Volume amount);
+                                         infra::Volume amount,
+                                         const std::string& idempotency_key = {});
   tl::expected<void, std::string> repay(const std::string& subaccount,
                                         infra::Exchange exchange,
                                         const std::string& asset,
-                                        infra::Volume amount);
+                                        infra::Volume amount,
+                                        const std::string& idempotency_key = {});
   tl::expected<void, std::string> transfer(const std::string& from_subaccount,
                                            infra::Exchange from_subaccount_exchange,
                                            const std::string& to_subaccount,
                                            infra::Exchange to_subaccount_exchange,
                                            const std::string& asset,
-                                           infra::Volume amount);
+                                           infra::Volume amount,
+                                           const std::string& idempotency_key = {});
+
+  // The same without an idempotency key, telling a clean rollback from an unknown outcome.
+  OperationResult executeBorrow(const std::string& subaccount,
+                                infra::Exchange exchange,
+                                const std::string& asset,
+                                infra::Volume amount);
+  OperationResult executeRepay(const std::string& subaccount,
+                               infra::Exchange exchange,
+                               const std::string& asset,
+                               infra::Volume amount);
+  OperationResult executeTransfer(const std::string& from_subaccount,
+                                  infra::Exchange from_subaccount_exchange,
+                                  const std::string& to_subaccount,
+                                  infra::Exchange to_subaccount_exchange,
+                                  const std::string& asset,
+                                  infra::Volume amount);
 
 private:
-  tl::expected<void, std::string> deleteRowByLoanId(const std::string& table_name, const std::string& loan_id);
 
-  tl::expected<void, std::string> deleteRowById(const std::string& table_name, const std::string& id);
+  // The row writers fail with an unknown outcome when the write missed its deadline.
+  OperationResult deleteRowByLoanId(const std::string& table_name, const std::string& loan_id);
 
-  tl::expected<void, std::string> changeAmountInRowById(const std::string& table_name,
-                                                        const std::string& id,
-                                                        infra::Volume new_amount);
+  OperationResult createNewBorrowRow(const std::string& subaccount,
+                                     const std::string& asset,
+                                     infra::Volume amount,
+                                     const std::string& loan_id,
+                                     infra::Exchange exchange);
 
-  tl::expected<void, std::string> createNewBorrowRow(const std::string& subaccount,
-                                                     const std::string& asset,
-                                                     infra::Volume amount,
-                                                     const std::string& loan_id,
-                                                     infra::Exchange exchange);
+  OperationResult createNewLoansRow(const std::string& subaccount,
+                                    const std::string& asset,
+                                    infra::Volume amount,
+                                    const std::string& initial_subaccount,
+                                    const std::string& loan_id);
+  OperationResult createNewLoansRows(const std::vector<LoanInfo>& loans_info);
 
-  tl::expected<void, std::string> createNewLoansRow(const std::string& subaccount,
-                                                    const std::string& asset,
-                                                    infra::Volume amount,
-                                                    const std::string& initial_subaccount,
-                                                    const std::string& loan_id);
-
-  std::unique_ptr<clickhouse::Client> clickhouse_client_;
+  ResilientClickhouseClient clickhouse_client_;
 };
 
 }  // namespace funds_controller
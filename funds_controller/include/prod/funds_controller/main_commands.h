@@ -1,13 +1,16 @@
 #pragma once
 
+#include "alert_dispatcher.h"
 #include "icommand.h"
 
 #include "common/instrument_description/instrument_description.h"
 #include "common/types/volume.h"
 #include "common/wallet/wallet.h"
 
+#include <concepts>
 #include <memory>
 #include <string>
+#include <tuple>
 #include <vector>
 
 namespace funds_controller {
@@ -16,7 +19,7 @@ class MergeCommands : public ICommand {
 public:
   MergeCommands(std::vector<std::unique_ptr<ICommand>> commands);
 
-  tl::expected<void, std::string> execute() override;
+  OperationResult execute() override;
 
   tl::expected<void, std::string> undo() override;
 
@@ -25,13 +28,115 @@ private:
   size_t executed_commands_count_ = 0;
 };
 
-class SendMarketCommand : public ICommand {
+template <class T>
+concept Command = requires(T& command) {
+  { command.execute() } -> std::same_as<OperationResult>;
+  { command.undo() } -> std::same_as<tl::expected<void, std::string>>;
+};
+
+// Fixed shape counterpart of MergeCommands: the steps are stored by value in a tuple and called
+// without virtual dispatch or allocations. A step may also be a pointer to an ICommand when its type
+// is only known at runtime. A failed execute undoes the executed steps in reverse order before
+// returning the error, undo() does the same after a successful execute. When that undo fails the
+// executed steps are left in place and execute reports an unknown outcome.
+template <class... Commands>
+class SequenceCommand {
+public:
+  explicit SequenceCommand(Commands... commands): commands_(std::move(commands)...) {
+  }
+
+  OperationResult execute() {
+    auto result = executeFrom<0>();
+    if (!result.has_value()) {
+      auto undo_result = undo();
+      if (!undo_result.has_value()) {
+        return unknownOutcome(result.error().message + ", undo failed: " + undo_result.error());
+      }
+    }
+    return result;
+  }
+
+  tl::expected<void, std::string> undo() {
+    return undoBefore<sizeof...(Commands)>();
+  }
+
+private:
+  template <class Step>
+  static auto& step(Step& command) {
+    if constexpr (Command<Step>) {
+      return command;
+    } else {
+      return *command;
+    }
+  }
+
+  template <size_t I>
+  OperationResult executeFrom() {
+    if constexpr (I == sizeof...(Commands)) {
+      return {};
+    } else {
+      auto result = step(std::get<I>(commands_)).execute();
+      if (!result.has_value()) {
+        return result;
+      }
+      ++executed_commands_count_;
+      return executeFrom<I + 1>();
+    }
+  }
+
+  template <size_t I>
+  tl::expected<void, std::string> undoBefore() {
+    if constexpr (I == 0) {
+      return {};
+    } else {
+      if (I <= executed_commands_count_) {
+        auto result = step(std::get<I - 1>(commands_)).undo();
+        if (!result.has_value()) {
+          alertDispatcher().alert("command_undo", "Failed to undo command, command index: " + std::to_string(I - 1));
+          return result;
+        }
+        --executed_commands_count_;
+      }
+      return undoBefore<I - 1>();
+    }
+  }
+
+  std::tuple<Commands...> commands_;
+  size_t executed_commands_count_ = 0;
+};
+
+// Adapts a command held by value to ICommand, for the places that keep commands of different types.
+template <Command T>
+class ErasedCommand final : public ICommand {
+public:
+  explicit ErasedCommand(T command): command_(std::move(command)) {
+  }
+
+  OperationResult execute() override {
+    return command_.execute();
+  }
+
+  tl::expected<void, std::string> undo() override {
+    return command_.undo();
+  }
+
+private:
+  T command_;
+};
+
+// One allocation for the whole command, however many steps it has.
+template <Command T>
+std::unique_ptr<ICommand> makeCommand(T command) {
+  return std::make_unique<ErasedCommand<T>>(std::move(command));
+}
+
+class SendMarketCommand final : public ICommand {
 public:
   SendMarketCommand(const std::string& subaccount,
                     const infra::InstrumentDescription& instrument_description,
                     infra::Volume amount);
 
-  tl::expected<void, std::string> execute() override;
+  OperationResult execute() override;
   tl::expected<void, std::string> undo() override;
 
 private:
@@ -40,7 +145,7 @@ private:
   infra::Volume amount_;
 };
 
-class TransferCryptoCommand : public ICommand {
+class TransferCryptoCommand final : public ICommand {
 public:
   TransferCryptoCommand(const std::string& from_subaccount,
                         infra::Wallet from_wallet,
@@ -49,7 +154,7 @@ public:
                         const std::string& asset,
                         infra::Volume amount);
 
-  tl::expected<void, std::string> execute() override;
+  OperationResult execute() override;
   tl::expected<void, std::string> undo() override;
 
 private:
@@ -61,4 +166,32 @@ private:
   infra::Volume amount_;
 };
 
+class BorrowCommand final : public ICommand {
+public:
+  BorrowCommand(const std::string& subaccount, infra::Exchange exchange, const std::string& asset, infra::Volume amount);
+
+  OperationResult execute() override;
+  tl::expected<void, std::string> undo() override;
+
+private:
+  std::string subaccount_;
+  infra::Exchange exchange_;
+  std::string asset_;
+  infra::Volume amount_;
+};
+
+class RepayCommand final : public ICommand {
+public:
+  RepayCommand(const std::string& subaccount, infra::Exchange exchange, const std::string& asset, infra::Volume amount);
+
+  OperationResult execute() override;
+  tl::expected<void, std::string> undo() override;
+
+private:
+  std::string subaccount_;
+  infra::Exchange exchange_;
+  std::string asset_;
+  infra::Volume amount_;
+};
+
 }  // namespace funds_controller
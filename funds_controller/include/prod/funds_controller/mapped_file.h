@@ -0,0 +1,44 @@
+#pragma once
+
+#include <tl/expected.hpp>
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace funds_controller {
+
+class MappedFile {
+public:
+  static tl::expected<MappedFile, std::string> open(const std::string& path);
+
+  MappedFile() = default;
+  ~MappedFile();
+
+  MappedFile(MappedFile&& other) noexcept;
+  MappedFile& operator=(MappedFile&& other) noexcept;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  std::span<const std::byte> data() const {
+    return {static_cast<const std::byte*>(data_), size_};
+  }
+
+  // True if the path now points to a different file than the one mapped.
+  bool isReplaced(const std::string& path) const;
+
+private:
+  void* data_ = nullptr;
+  size_t size_ = 0;
+  dev_t device_ = 0;
+  ino_t inode_ = 0;
+};
+
+// Writes content to a temporary file next to path, fsyncs it and renames it over path, so readers
+// see either the old or the new file and never a partial one.
+tl::expected<void, std::string> replaceFileAtomically(const std::string& path, std::string_view content);
+
+}  // namespace funds_controller
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+namespace funds_controller {
+
+// Unbounded lock-free queue for many producers and a single consumer. A push is one allocation and
+// one atomic exchange, pop() must only be called from the consumer thread.
+template <class T>
+class MpscQueue {
+public:
+  MpscQueue(): head_(new Node), tail_(head_.load(std::memory_order_relaxed)) {
+  }
+
+  ~MpscQueue() {
+    while (pop().has_value()) {
+    }
+    delete tail_;
+  }
+
+  MpscQueue(const MpscQueue&) = delete;
+  MpscQueue& operator=(const MpscQueue&) = delete;
+
+  void push(T value) {
+    auto* node = new Node{std::move(value)};
+    auto* prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Empty while a concurrent push is between its two steps, the value shows up on a later pop.
+  std::optional<T> pop() {
+    auto* next = tail_->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      return std::nullopt;
+    }
+    std::optional<T> value = std::move(next->value);
+    next->value.reset();
+    delete tail_;
+    tail_ = next;
+    return value;
+  }
+
+private:
+  struct Node {
+    // empty in the node tail_ points to
+    std::optional<T> value;
+    std::atomic<Node*> next = nullptr;
+  };
+
+  std::atomic<Node*> head_;
+  Node* tail_;
+};
+
+}  // namespace funds_controller
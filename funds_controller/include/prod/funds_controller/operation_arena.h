@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+
+namespace funds_controller {
+
+// Monotonic arena for the temporaries of one manager operation: row update lists, id lists and
+// query fragments. Nothing is freed until the arena goes out of scope, then everything is released
+// at once. The first kInlineSize bytes come from the arena itself, the rest from a pool owned by the
+// thread, so concurrent operations never share an allocator lock.
+//
+// While alive the arena is the current one of its thread, helpers deep in the call pick it up through
+// current() instead of taking a resource parameter. Memory from it must not outlive the operation.
+class OperationArena {
+public:
+  static constexpr size_t kInlineSize = 16 * 1024;
+
+  OperationArena(): resource_(buffer_.data(), buffer_.size(), threadPool()), previous_(current_) {
+    current_ = this;
+  }
+
+  ~OperationArena() {
+    current_ = previous_;
+  }
+
+  OperationArena(const OperationArena&) = delete;
+  OperationArena& operator=(const OperationArena&) = delete;
+
+  std::pmr::memory_resource* resource() {
+    return &resource_;
+  }
+
+  // Innermost arena of the calling thread, the default resource outside of any operation.
+  static std::pmr::memory_resource* current() {
+    return current_ != nullptr ? current_->resource() : std::pmr::get_default_resource();
+  }
+
+private:
+  static std::pmr::memory_resource* threadPool() {
+    thread_local std::pmr::unsynchronized_pool_resource pool;
+    return &pool;
+  }
+
+  inline static thread_local OperationArena* current_ = nullptr;
+
+  alignas(std::max_align_t) std::array<std::byte, kInlineSize> buffer_;
+  std::pmr::monotonic_buffer_resource resource_;
+  OperationArena* previous_;
+};
+
+}  // namespace funds_controller
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <tl/expected.hpp>
+
+#include <cstdint>
+#include <string>
+#include <utility>
+
+namespace funds_controller {
+
+// Failure of a manager operation. RolledBack means nothing the operation did is left behind and it is
+// safe to retry. UnknownOutcome means it may have taken effect: a compensation failed, or a write
+// missed its deadline and may still land. Such an operation must not be compensated or retried, only
+// reconciled.
+struct OperationError {
+  enum class Kind : uint8_t {
+    RolledBack,
+    UnknownOutcome,
+  };
+
+  // plain error strings are failures before anything was changed or after a clean rollback
+  OperationError(std::string message): message(std::move(message)) {
+  }
+  OperationError(Kind kind, std::string message): kind(kind), message(std::move(message)) {
+  }
+
+  bool isUnknownOutcome() const {
+    return kind == Kind::UnknownOutcome;
+  }
+
+  Kind kind = Kind::RolledBack;
+  std::string message;
+};
+
+using OperationResult = tl::expected<void, OperationError>;
+
+inline tl::unexpected<OperationError> unknownOutcome(std::string message) {
+  return tl::make_unexpected(OperationError(OperationError::Kind::UnknownOutcome, std::move(message)));
+}
+
+// The same failure with `context` in front of its message.
+inline tl::unexpected<OperationError> withContext(const std::string& context, OperationError error) {
+  error.message = context + error.message;
+  return tl::make_unexpected(std::move(error));
+}
+
+// For the public string based interfaces.
+inline tl::expected<void, std::string> toResult(OperationResult result) {
+  if (!result.has_value()) {
+    return tl::make_unexpected(std::move(result.error().message));
+  }
+  return {};
+}
+
+// For the string based calls underneath, their errors changed nothing.
+inline OperationResult fromResult(tl::expected<void, std::string> result) {
+  if (!result.has_value()) {
+    return tl::make_unexpected(OperationError(std::move(result.error())));
+  }
+  return {};
+}
+
+}  // namespace funds_controller
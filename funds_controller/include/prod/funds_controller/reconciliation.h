@@ -0,0 +1,110 @@
+#pragma once
+
+#include "prod/funds_controller/icommand.h"
+#include "prod/funds_controller/token_bucket.h"
+
+#include "common/instrument_description/instrument_description.h"
+#include "common/types/volume.h"
+
+#include <tl/expected.hpp>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace funds_controller {
+
+struct ReconciliationAccount {
+  std::string subaccount;
+  infra::Exchange exchange;
+};
+
+// What the exchange reports for one subaccount. Futures positions are crypto equivalent amounts
+// keyed by (market, pair), negative for shorts.
+struct ExchangeAccountState {
+  std::map<std::string, infra::Volume> balances;
+  std::map<std::string, infra::Volume> borrowed;
+  std::map<std::pair<infra::Market::Type, std::string>, infra::Volume> futures_positions;
+};
+
+// Exchange side of the reconciliation. Implementations are called concurrently for different accounts.
+// BinanceStateSource reads Binance portfolio margin accounts, main runs it with --reconcile.
+class ExchangeStateSource {
+public:
+  virtual ~ExchangeStateSource() = default;
+
+  virtual tl::expected<ExchangeAccountState, std::string> fetch(const ReconciliationAccount& account) = 0;
+};
+
+struct ReconciliationDiff {
+  enum class Kind : uint8_t {
+    // BORROWS_v2 against the exchange liability
+    Borrow,
+    // LOANS_INFO_v2 funds missing from the exchange balance
+    Balance,
+    // FUTURES_HEDGES_v2 against the exchange position
+    FuturesPosition,
+  };
+
+  Kind kind;
+  ReconciliationAccount account;
+  // asset, or pair for futures positions
+  std::string symbol;
+  infra::Market market = infra::Market{infra::Market::BinanceFutures};
+  infra::Volume ledger_amount;
+  infra::Volume exchange_amount;
+};
+
+struct ReconciliationReport {
+  std::vector<ReconciliationDiff> diffs;
+  // by (subaccount, exchange), a subaccount may be reconciled on several exchanges
+  std::map<std::pair<std::string, infra::Exchange>, std::string> failed_accounts;
+  size_t reconciled_accounts = 0;
+  std::chrono::milliseconds duration{0};
+};
+
+class Reconciler {
+public:
+  struct RateBudget {
+    double requests_per_second;
+    double burst;
+  };
+
+  struct Options {
+    size_t parallelism = 32;
+    // exchange requests spent by one ExchangeStateSource::fetch
+    double requests_per_account = 3;
+    std::map<infra::Exchange, RateBudget> rate_budgets;
+    infra::Volume tolerance = util::Decimal::withMantissa(1'000);
+  };
+
+  Reconciler(std::shared_ptr<ExchangeStateSource> source, Options options);
+
+  // Fetches all accounts in parallel while the ledger snapshot is loaded, then joins them in memory.
+  tl::expected<ReconciliationReport, std::string> reconcile(const std::vector<ReconciliationAccount>& accounts);
+
+  // Commands moving the exchange back to the ledger state: repay or borrow the borrow drift and
+  // trade away the futures position drift. Balance diffs need a manual look and get no command.
+  tl::expected<std::vector<std::unique_ptr<ICommand>>, std::string> corrections(const ReconciliationReport& report);
+
+private:
+  struct LedgerSnapshot {
+    std::map<std::pair<std::string, std::string>, infra::Volume> borrowed;
+    std::map<std::pair<std::string, std::string>, infra::Volume> loans;
+    std::map<std::tuple<std::string, infra::Market::Type, std::string>, infra::Volume> futures_hedges;
+  };
+
+  tl::expected<LedgerSnapshot, std::string> loadLedger(const std::vector<ReconciliationAccount>& accounts);
+  // nullptr for exchanges without a budget
+  TokenBucket* budget(infra::Exchange exchange) const;
+
+  std::shared_ptr<ExchangeStateSource> source_;
+  Options options_;
+  std::map<infra::Exchange, std::unique_ptr<TokenBucket>> budgets_;
+};
+
+}  // namespace funds_controller
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <tl/expected.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <compare>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <thread>
+
+namespace funds_controller {
+
+// Time bucketed loan and hedge history. Amounts are doubles: reports are analytics over millions
+// of rows, not ledger values. LOANS_INFO_v2 and HEDGES_INFO_v2 only hold current amounts, so the
+// history is rebuilt from the movements in the ledger journal and reports cannot start before it.
+class ReportingEngine {
+public:
+  struct Options {
+    size_t parallelism = std::max(1u, std::thread::hardware_concurrency());
+    std::chrono::milliseconds bucket = std::chrono::hours(1);
+    // yearly borrow rate per asset, assets without one get no borrow cost
+    std::map<std::string, double> annual_borrow_rates;
+  };
+
+  struct Key {
+    std::string subaccount;
+    std::string asset;
+    int64_t bucket_start_ms;
+
+    auto operator<=>(const Key&) const = default;
+  };
+
+  // Averages are time weighted over the bucket. All amounts are in the asset, the journal keeps no
+  // prices.
+  struct Row {
+    // LEDGER_EVENTS_v1 loan amount outstanding
+    double average_loan = 0;
+    // LEDGER_EVENTS_v1 hedge amount outstanding
+    double average_hedge = 0;
+    // TRANSACTIONS_v1 transfers
+    double transferred_in = 0;
+    double transferred_out = 0;
+    double borrow_cost = 0;
+  };
+
+  using Report = std::map<Key, Row>;
+
+  explicit ReportingEngine(Options options);
+
+  // Subaccounts are hashed into `parallelism` partitions, each loaded as column batches over its own
+  // connection and aggregated on its own thread. Loan and hedge amounts start from the journal sums
+  // before the range and change with every movement inside it. Fails for ranges starting before the
+  // first journal row, the amounts held then are not known.
+  tl::expected<Report, std::string> build(int64_t from_timestamp_ms, int64_t to_timestamp_ms);
+
+  static void writeCsv(const Report& report, std::ostream& out);
+  // Appends the report through the ledger writer.
+  static tl::expected<void, std::string> insert(const Report& report, const std::string& table_name);
+
+private:
+  tl::expected<Report, std::string> buildPartition(size_t partition,
+                                                  int64_t from_timestamp_ms,
+                                                  int64_t to_timestamp_ms);
+
+  const Options options_;
+};
+
+}  // namespace funds_controller
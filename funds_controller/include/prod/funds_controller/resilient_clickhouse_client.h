@@ -0,0 +1,141 @@
+#pragma once
+
+#include "prod/funds_controller/clickhouse_client.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace funds_controller {
+
+// Thrown instead of running a query while the breaker is open or when a query misses its deadline.
+class ClickhouseUnavailable : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// A write sent to the server missed its deadline. It may have landed or may still land, so it must not
+// be compensated like a failed write, only reconciled.
+class ClickhouseUnknownOutcome : public ClickhouseUnavailable {
+public:
+  using ClickhouseUnavailable::ClickhouseUnavailable;
+};
+
+// One breaker for the process, the cluster is the failure domain. Opens after failure_threshold
+// consecutive failures or timeouts and rejects every call for open_duration. Then a single probe goes
+// through, its success closes the breaker and its failure opens it again.
+class ClickhouseCircuitBreaker {
+public:
+  struct Options {
+    size_t failure_threshold = 5;
+    std::chrono::milliseconds open_duration{5'000};
+  };
+
+  explicit ClickhouseCircuitBreaker(Options options);
+
+  // false while open, the caller fails fast instead of queueing behind a sick cluster
+  bool allow();
+  void onSuccess();
+  void onFailure(const std::string& error);
+
+  size_t rejected() const {
+    return rejected_.load();
+  }
+
+private:
+  enum class State {
+    Closed,
+    Open,
+    HalfOpen,
+  };
+
+  const Options options_;
+  std::mutex mutex_;
+  State state_ = State::Closed;
+  size_t consecutive_failures_ = 0;
+  std::chrono::steady_clock::time_point open_until_;
+  bool probe_in_flight_ = false;
+  std::atomic<size_t> rejected_ = 0;
+};
+
+ClickhouseCircuitBreaker& clickhouseCircuitBreaker();
+
+// Client with a deadline on every call, a small pool of connections and hedged reads. A read still
+// running after the p99 of recent reads is sent again on an idle connection and the first answer wins.
+// Calls missing their deadline return while the straggler finishes in the background, its connection
+// goes back to the pool afterwards. Errors are thrown like clickhouse::Client does.
+class ResilientClickhouseClient {
+public:
+  struct Options {
+    std::chrono::milliseconds read_deadline{3'000};
+    std::chrono::milliseconds write_deadline{10'000};
+    // bounds of the hedge delay, max_hedge_delay is used until enough reads were seen
+    std::chrono::milliseconds min_hedge_delay{10};
+    std::chrono::milliseconds max_hedge_delay{1'000};
+    size_t connections = 2;
+  };
+
+  struct Stats {
+    size_t reads = 0;
+    size_t writes = 0;
+    size_t hedged_reads = 0;
+    size_t hedge_wins = 0;
+    size_t timeouts = 0;
+    size_t failures = 0;
+    std::chrono::microseconds p50{0};
+    std::chrono::microseconds p99{0};
+    std::chrono::microseconds p999{0};
+  };
+
+  ResilientClickhouseClient();
+  explicit ResilientClickhouseClient(Options options);
+
+  // Blocks are buffered and handed to the callback on the calling thread once the winning attempt
+  // completed, so the callback never races a straggler. Meant for small reads, stream large ones with
+  // SelectCursor.
+  void select(const std::string& query, const std::function<void(const clickhouse::Block&)>& callback);
+
+  // Never hedged, an INSERT sent twice books twice. A write missing its deadline after it was sent throws
+  // ClickhouseUnknownOutcome.
+  void execute(const std::string& query);
+
+  // Read latencies are over the last kLatencyWindow reads.
+  Stats stats() const;
+
+private:
+  static constexpr size_t kLatencyWindow = 1'024;
+
+  struct Pool;
+  struct Call;
+
+  std::vector<clickhouse::Block> run(const std::string& query, bool read);
+  void startAttempt(const std::shared_ptr<Call>& call,
+                    std::shared_ptr<ClickhouseClientHandle> connection,
+                    size_t attempt,
+                    const std::string& query,
+                    bool read);
+  void recordLatency(std::chrono::microseconds latency);
+
+  const Options options_;
+  std::shared_ptr<Pool> pool_;
+
+  std::atomic<size_t> reads_ = 0;
+  std::atomic<size_t> writes_ = 0;
+  std::atomic<size_t> hedged_reads_ = 0;
+  std::atomic<size_t> hedge_wins_ = 0;
+  std::atomic<size_t> timeouts_ = 0;
+  std::atomic<size_t> failures_ = 0;
+
+  mutable std::mutex latency_mutex_;
+  // ring of the last read latencies in microseconds
+  std::vector<int64_t> latencies_;
+  size_t recorded_ = 0;
+  std::atomic<int64_t> hedge_delay_us_;
+};
+
+}  // namespace funds_controller
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "prod/funds_controller/operation_error.h"
+#include "prod/funds_controller/resilient_clickhouse_client.h"
+
+#include "common/types/volume.h"
+
+#include <tl/expected.hpp>
+
+#include <memory_resource>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace funds_controller {
+
+// Ledger tables whose rows carry an amount and a done/removed status: loans, hedges and futures hedges.
+struct AmountTable {
+  std::string name;
+  std::string amount_column = "amount";
+  // futures hedges also keep the time of their last change
+  bool has_update_timestamp = false;
+};
+
+// New amount of a row, zero marks the row as removed. Allocator aware, so the ids of a pmr vector of
+// updates live in the operation arena with it: emplace them rather than push braced temporaries.
+struct RowUpdate {
+  using allocator_type = std::pmr::polymorphic_allocator<>;
+
+  RowUpdate(std::string_view id, infra::Volume amount, allocator_type allocator = {}):
+      id(id, allocator), amount(amount) {
+  }
+  RowUpdate(const RowUpdate& other, allocator_type allocator): id(other.id, allocator), amount(other.amount) {
+  }
+  RowUpdate(RowUpdate&& other, allocator_type allocator): id(std::move(other.id), allocator), amount(other.amount) {
+  }
+  RowUpdate(const RowUpdate&) = default;
+  RowUpdate(RowUpdate&&) = default;
+  RowUpdate& operator=(const RowUpdate&) = default;
+  RowUpdate& operator=(RowUpdate&&) = default;
+
+  std::pmr::string id;
+  infra::Volume amount;
+};
+
+// "'a', 'b', ..." for IN clauses, allocated from the current operation arena
+std::pmr::string quotedList(const std::vector<std::string>& values);
+
+// Applies all updates to the table in one mutation. A mutation that missed its deadline is an unknown
+// outcome.
+OperationResult updateRows(ResilientClickhouseClient& clickhouse_client,
+                           const AmountTable& table,
+                           std::span<const RowUpdate> updates);
+// Deletes the rows the updates removed. Readers already skip them, this only cleans up.
+OperationResult deleteRemovedRows(ResilientClickhouseClient& clickhouse_client,
+                                  const AmountTable& table,
+                                  std::span<const RowUpdate> updates);
+
+}  // namespace funds_controller
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "prod/funds_controller/clickhouse_client.h"
+
+#include "util/log/log.h"
+
+#include <tl/expected.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace funds_controller {
+
+// Pull cursor over a SELECT, streaming it block by block instead of materialising the result.
+// The query runs on its own connection in a background thread and each block is converted to a
+// Batch right in the Select callback: decoded rows, or the clickhouse::Block itself for column access.
+// At most max_buffered batches wait for the reader, a slow reader stalls the query instead of growing
+// memory. Destroying the cursor, or cancel(), stops the query at the next block.
+template <class Batch>
+class SelectCursor {
+public:
+  using Convert = std::function<Batch(const clickhouse::Block&)>;
+
+  SelectCursor(std::string query, Convert convert, size_t max_buffered = 4):
+      convert_(std::move(convert)), max_buffered_(max_buffered) {
+    thread_ = std::jthread([this, query = std::move(query)] { run(query); });
+  }
+
+  ~SelectCursor() {
+    cancel();
+  }
+
+  SelectCursor(const SelectCursor&) = delete;
+  SelectCursor& operator=(const SelectCursor&) = delete;
+
+  // Next batch, std::nullopt once the result is exhausted or the cursor was cancelled.
+  tl::expected<std::optional<Batch>, std::string> next() {
+    std::unique_lock lock(mutex_);
+    readable_.wait(lock, [this] { return !batches_.empty() || finished_ || cancelled_; });
+    if (!batches_.empty()) {
+      auto batch = std::move(batches_.front());
+      batches_.pop_front();
+      writable_.notify_one();
+      return std::optional<Batch>{std::move(batch)};
+    }
+    if (error_.has_value()) {
+      return tl::make_unexpected(*error_);
+    }
+    return std::optional<Batch>{};
+  }
+
+  void cancel() {
+    {
+      std::lock_guard lock(mutex_);
+      cancelled_ = true;
+      batches_.clear();
+    }
+    readable_.notify_all();
+    writable_.notify_all();
+  }
+
+private:
+  void run(const std::string& query) {
+    std::optional<std::string> error;
+    try {
+      auto clickhouse_client = getFundsControllerClickhouseClient();
+      clickhouse_client->SelectCancelable(query, [this](const clickhouse::Block& block) {
+        if (block.GetRowCount() == 0) {
+          return !isCancelled();
+        }
+        auto batch = convert_(block);
+        std::unique_lock lock(mutex_);
+        writable_.wait(lock, [this] { return batches_.size() < max_buffered_ || cancelled_; });
+        if (cancelled_) {
+          return false;
+        }
+        batches_.push_back(std::move(batch));
+        readable_.notify_one();
+        return true;
+      });
+    } catch (const std::exception& e) {
+      LOG_ERROR("clickhouse error: {}", e.what());
+      error = std::string{"Failed to stream select. Exception: "} + e.what();
+    }
+    {
+      std::lock_guard lock(mutex_);
+      finished_ = true;
+      error_ = std::move(error);
+    }
+    readable_.notify_all();
+  }
+
+  bool isCancelled() {
+    std::lock_guard lock(mutex_);
+    return cancelled_;
+  }
+
+  const Convert convert_;
+  const size_t max_buffered_;
+  std::mutex mutex_;
+  std::condition_variable readable_;
+  std::condition_variable writable_;
+  std::deque<Batch> batches_;
+  bool cancelled_ = false;
+  bool finished_ = false;
+  std::optional<std::string> error_;
+  // last member, joined before the state above is destroyed
+  std::jthread thread_;
+};
+
+// Converter decoding every row of a block with `decode(block, row)`.
+template <class Row, class Decode>
+typename SelectCursor<std::vector<Row>>::Convert decodeRows(Decode decode) {
+  return [decode = std::move(decode)](const clickhouse::Block& block) {
+    std::vector<Row> rows;
+    rows.reserve(block.GetRowCount());
+    for (size_t i = 0; i < block.GetRowCount(); ++i) {
+      rows.push_back(decode(block, i));
+    }
+    return rows;
+  };
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+namespace funds_controller {
+
+// Thread-safe list of event callbacks. publish() runs callbacks on the publishing thread without
+// holding the registration lock; unsubscribe() waits for in-flight callbacks, so it must not be
+// called from inside a callback.
+template <class Event>
+class Subscribers {
+public:
+  using Callback = std::function<void(const Event&)>;
+
+  uint64_t subscribe(Callback callback) {
+    std::lock_guard lock(mutex_);
+    auto callbacks = std::make_shared<CallbackMap>(*callbacks_);
+    uint64_t id = next_id_++;
+    callbacks->emplace(id, std::move(callback));
+    callbacks_ = std::move(callbacks);
+    return id;
+  }
+
+  void unsubscribe(uint64_t id) {
+    {
+      std::lock_guard lock(mutex_);
+      auto callbacks = std::make_shared<CallbackMap>(*callbacks_);
+      callbacks->erase(id);
+      callbacks_ = std::move(callbacks);
+    }
+    std::unique_lock wait_for_publishers(publish_mutex_);
+  }
+
+  void publish(const Event& event) const {
+    std::shared_lock publishing(publish_mutex_);
+    std::shared_ptr<const CallbackMap> callbacks;
+    {
+      std::lock_guard lock(mutex_);
+      callbacks = callbacks_;
+    }
+    for (const auto& [id, callback] : *callbacks) {
+      callback(event);
+    }
+  }
+
+  bool empty() const {
+    std::lock_guard lock(mutex_);
+    return callbacks_->empty();
+  }
+
+private:
+  using CallbackMap = std::map<uint64_t, Callback>;
+
+  mutable std::mutex mutex_;
+  mutable std::shared_mutex publish_mutex_;
+  std::shared_ptr<const CallbackMap> callbacks_ = std::make_shared<CallbackMap>();
+  uint64_t next_id_ = 1;
+};
+
+}  // namespace funds_controller
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+namespace funds_controller {
+
+// Blocking token bucket shared by all threads calling one exchange.
+class TokenBucket {
+public:
+  TokenBucket(double tokens_per_second, double burst):
+      tokens_per_second_(tokens_per_second), burst_(burst), tokens_(burst), updated_at_(Clock::now()) {
+  }
+
+  // Requests larger than the burst are capped to it, otherwise they could never be served.
+  void acquire(double tokens = 1) {
+    tokens = std::min(tokens, burst_);
+    while (true) {
+      std::chrono::duration<double> wait;
+      {
+        std::lock_guard lock(mutex_);
+        refill();
+        if (tokens_ >= tokens) {
+          tokens_ -= tokens;
+          return;
+        }
+        wait = std::chrono::duration<double>((tokens - tokens_) / tokens_per_second_);
+      }
+      std::this_thread::sleep_for(wait);
+    }
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  void refill() {
+    auto now = Clock::now();
+    tokens_ = std::min(burst_, tokens_ + std::chrono::duration<double>(now - updated_at_).count() * tokens_per_second_);
+    updated_at_ = now;
+  }
+
+  const double tokens_per_second_;
+  const double burst_;
+  std::mutex mutex_;
+  double tokens_;
+  Clock::time_point updated_at_;
+};
+
+}  // namespace funds_controller
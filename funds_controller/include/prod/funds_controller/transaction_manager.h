@@ -1,29 +1,83 @@
 #pragma once
 
 #include "prod/funds_controller/loans_manager.h"
+#include "prod/funds_controller/select_cursor.h"
 
 #include "common/instrument_description/instrument_description.h"
 #include "common/wallet/wallet.h"
 
 #include <tl/expected.hpp>
 
+#include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
 namespace funds_controller {
 
+struct TransferIntent {
+  std::string from_subaccount;
+  infra::Wallet from_wallet;
+  std::string to_subaccount;
+  infra::Wallet to_wallet;
+  std::string asset;
+  infra::Volume amount;
+};
+
+// TRANSACTIONS_v1 row, wallets as recorded.
+struct TransactionRecord {
+  int64_t timestamp_ms;
+  std::string from_subaccount;
+  std::string from_wallet;
+  std::string to_subaccount;
+  std::string to_wallet;
+  std::string asset;
+  infra::Volume amount;
+  std::string type;
+  std::string inner_id;
+  std::string status;
+};
+
 class TransactionManager {
 public:
+  using TransactionCursor = SelectCursor<std::vector<TransactionRecord>>;
+
+  struct NettedTransfers {
+    // inner_id shared by the recorded intents and executions of the batch
+    std::string batch_id;
+    std::vector<TransferIntent> executed;
+    // one result per intent, an intent fails together with the net transfer it was folded into
+    std::vector<tl::expected<void, std::string>> results;
+    // Set when the executed transfers could not be recorded. The funds did move, do not retry them.
+    std::optional<std::string> record_error;
+  };
+
   TransactionManager();
 
+  // A non empty idempotency key makes retries of the same request safe, see IdempotencyStore.
+  // It is also recorded as the inner_id of the transfer row.
   tl::expected<void, std::string> transfer(const std::string& from_subaccount,
                                            infra::Wallet from_subaccount_wallet,
                                            const std::string& to_subaccount,
                                            infra::Wallet to_subaccount_wallet,
                                            const std::string& asset,
-                                           infra::Volume amount);
+                                           infra::Volume amount,
+                                           const std::string& idempotency_key = {});
+
+  // Nets the intents per asset and pair of (subaccount, wallet) endpoints and executes only the
+  // net flows. Intents are recorded as "transfer_intent" rows next to the executed transfers. Failing to
+  // record them is reported in record_error with the executed transfers, not as an outer error.
+  tl::expected<NettedTransfers, std::string> transferNetted(const std::vector<TransferIntent>& intents);
+
+  // Streams transactions with timestamp in [from_timestamp_ms, to_timestamp_ms) ordered by time, one
+  // batch per clickhouse block. An empty subaccount matches every subaccount on either side.
+  std::unique_ptr<TransactionCursor> streamTransactions(int64_t from_timestamp_ms,
+                                                        int64_t to_timestamp_ms,
+                                                        const std::string& subaccount = {});
 
 private:
+  OperationResult executeTransfer(const TransferIntent& transfer);
+
   tl::expected<void, std::string> checkAccount(const std::string& subaccount, infra::Wallet wallet);
 
   tl::expected<void, std::string> addTransferTransaction(const std::string& from_subaccount,
@@ -31,9 +85,10 @@ private:
                                                          const std::string& to_subaccount,
                                                          infra::Wallet to_subaccount_wallet,
                                                          const std::string& asset,
-                                                         infra::Volume amount);
+                                                         infra::Volume amount,
+                                                         const std::string& inner_id);
+  tl::expected<void, std::string> insertTransactions(const std::string& values, size_t rows);
 
-  std::unique_ptr<clickhouse::Client> clickhouse_client_;
   LoansManager loans_manager_;
 };
 
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "prod/funds_controller/mapped_file.h"
+
+#include "common/instrument_description/instrument_description.h"
+#include "common/types/volume.h"
+
+#include <tl/expected.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace funds_controller {
+
+// Fixed point mantissas with 12 fractional digits, the scale of the Decimal(21, 12) ledger columns.
+struct ContractMetadata {
+  int64_t tick_size = 0;
+  int64_t lot_size = 0;
+  int64_t contract_size = 0;
+};
+
+struct InstrumentListing {
+  infra::Market market = infra::Market{infra::Market::BinanceFutures};
+  std::string pair;
+  std::string status;
+  int64_t listing_time_ms = 0;
+  ContractMetadata metadata;
+};
+
+std::optional<int64_t> parseFixedPointMantissa(std::string_view text);
+
+// Read-only view of a binary instrument universe file. The file is used in place through mmap:
+// a header, records sorted by (market, pair) and an instrument id -> record index table.
+class UniverseSnapshot {
+public:
+  static constexpr uint64_t kMagic = 0x31'56'49'4e'55'43'46'00;  // "\0FCUNIV1"
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint32_t kNoRecord = UINT32_MAX;
+
+  struct Header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t record_count;
+    uint32_t instrument_id_capacity;
+    uint32_t reserved;
+    int64_t created_at_ms;
+  };
+
+  struct Record {
+    uint32_t instrument_id;
+    uint16_t market_type;
+    uint8_t pair_size;
+    uint8_t status_size;
+    char pair_data[32];
+    char status_data[24];
+    int64_t listing_time_ms;
+    ContractMetadata metadata;
+
+    infra::Market market() const {
+      return infra::Market{static_cast<infra::Market::Type>(market_type)};
+    }
+    std::string_view pair() const {
+      return {pair_data, pair_size};
+    }
+    std::string_view status() const {
+      return {status_data, status_size};
+    }
+  };
+
+  static_assert(sizeof(Header) == 40);
+  static_assert(sizeof(Record) == 96);
+
+  static tl::expected<UniverseSnapshot, std::string> open(const std::string& path);
+
+  // Instrument ids of listings already present in previous are kept, new listings get fresh ids,
+  // so ids can index long-lived tables such as the shared blocklist.
+  static tl::expected<void, std::string> write(const std::string& path,
+                                               const std::vector<InstrumentListing>& listings,
+                                               const UniverseSnapshot* previous);
+
+  std::span<const Record> records() const;
+  const Record* find(infra::Market market, std::string_view pair) const;
+  const Record* byInstrumentId(uint32_t instrument_id) const;
+  uint32_t instrumentIdCapacity() const;
+  int64_t createdAtMs() const;
+
+  // The file was atomically replaced since this snapshot was opened.
+  bool isStale() const;
+
+  static InstrumentListing toListing(const Record& record);
+  static infra::InstrumentDescription toInstrumentDescription(const Record& record);
+  static infra::Volume toVolume(int64_t mantissa);
+
+private:
+  UniverseSnapshot(std::string path, MappedFile file);
+
+  const Header& header() const;
+
+  std::string path_;
+  MappedFile file_;
+};
+
+// Maps the snapshot at path as the process universe, done once by main at startup. The listings
+// watcher may replace the file later, universeSnapshot() then maps the new one.
+tl::expected<void, std::string> loadUniverseSnapshot(const std::string& path);
+
+// The process universe, nullptr when none was loaded.
+std::shared_ptr<const UniverseSnapshot> universeSnapshot();
+
+// Order lots per unit of the base asset, contract_size / lot_size, from the process universe. Empty
+// when the instrument or its metadata is missing, callers then fetch the instrument from the exchange.
+std::optional<infra::Volume> lotsPerUnit(infra::Market market, std::string_view pair);
+
+}  // namespace funds_controller
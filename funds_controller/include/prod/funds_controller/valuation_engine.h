@@ -0,0 +1,105 @@
+#pragma once
+
+#include "prod/funds_controller/exposure_engine.h"
+#include "prod/funds_controller/ledger_events.h"
+#include "prod/funds_controller/subscribers.h"
+
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace funds_controller {
+
+// Live USD value of the open loans and hedges, published on every price tick and ledger event. The
+// spans index subaccounts and are only valid during the callback.
+struct Valuation {
+  uint64_t sequence = 0;
+  std::span<const std::string> subaccounts;
+  std::span<const double> loans_usd;
+  std::span<const double> hedges_usd;
+  double total_loans_usd = 0;
+  double total_hedges_usd = 0;
+};
+
+struct SubaccountValuation {
+  double loans_usd = 0;
+  double hedges_usd = 0;
+
+  // borrowed value left unhedged
+  double net_usd() const {
+    return loans_usd - hedges_usd;
+  }
+};
+
+struct ValuationSnapshot {
+  uint64_t sequence = 0;
+  std::unordered_map<std::string, SubaccountValuation> by_subaccount;
+  SubaccountValuation total;
+};
+
+// Mark-to-market of every open position. Amounts are kept as one column per asset indexed by
+// subaccount, so a tick revalues an asset with one multiply-accumulate over contiguous doubles:
+// value[s] += amount[s] * (price - previous price). Assets are valued at zero until their first tick,
+// stablecoins need a constant price fed once.
+//
+// Updates accumulate in double, a full revaluation every kRevalueInterval updates bounds the drift.
+//
+// Library only: the funds controller binary has no price feed, so main does not build one. The process
+// that owns the price streams creates it, loads it from an ExposureEngine snapshot and calls onPrice.
+class ValuationEngine {
+public:
+  static constexpr uint64_t kRevalueInterval = 100'000;
+
+  ValuationEngine();
+  ~ValuationEngine();
+
+  ValuationEngine(const ValuationEngine&) = delete;
+  ValuationEngine& operator=(const ValuationEngine&) = delete;
+
+  // Replaces the positions with the exposure snapshot. Same caveat as ExposureEngine::load: events
+  // published while the snapshot is taken may be counted twice.
+  void load(const ExposureSnapshot& exposure);
+
+  // Price of one unit of `asset` in USD. Called from the price feeds.
+  void onPrice(const std::string& asset, double price);
+
+  ValuationSnapshot snapshot() const;
+
+  // Callbacks run on the updating thread with the engine locked, they must not call back into it.
+  uint64_t subscribe(Subscribers<Valuation>::Callback callback);
+  void unsubscribe(uint64_t subscription_id);
+
+private:
+  struct AssetColumns {
+    double price = 0;
+    // amounts by subaccount index
+    std::vector<double> loans;
+    std::vector<double> hedges;
+    double total_loans = 0;
+    double total_hedges = 0;
+  };
+
+  void apply(const LedgerEvent& event);
+  AssetColumns& asset(const std::string& asset);
+  size_t subaccount(const std::string& subaccount);
+  void revalue();
+  void publish();
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, AssetColumns> assets_;
+  std::unordered_map<std::string, size_t> subaccount_index_;
+  std::vector<std::string> subaccounts_;
+  std::vector<double> loans_usd_;
+  std::vector<double> hedges_usd_;
+  double total_loans_usd_ = 0;
+  double total_hedges_usd_ = 0;
+  uint64_t sequence_ = 0;
+
+  Subscribers<Valuation> subscribers_;
+  uint64_t subscription_id_;
+};
+
+}  // namespace funds_controller
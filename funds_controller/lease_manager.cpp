@@ -0,0 +1,340 @@
+#include "prod/funds_controller/lease_manager.h"
+
+#include "util/error/error.h"
+#include "util/time/time.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <string_view>
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kLeasesTable = "LEASES_v1";
+// rows older than this are expired whatever they say, keeps the lease query off old parts
+constexpr int64_t kLeaseLookbackMs = 10 * 60 * 1'000;
+
+std::atomic<LeaseManager*> installed_lease_manager = nullptr;
+
+int64_t nowMs() {
+  return static_cast<int64_t>(nowSystem()) / 1'000'000;
+}
+
+// stable across processes and builds, unlike std::hash
+uint64_t fnv1a(std::string_view text, uint64_t hash = 14'695'981'039'346'656'037ULL) {
+  for (char c : text) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1'099'511'628'211ULL;
+  }
+  return hash;
+}
+
+uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+void sleepFor(std::stop_token stop_token, std::chrono::milliseconds duration) {
+  std::mutex mutex;
+  std::condition_variable_any condition;
+  std::unique_lock lock(mutex);
+  condition.wait_for(lock, stop_token, duration, [] { return false; });
+}
+
+}  // namespace
+
+tl::expected<void, std::string> ClickhouseLeaseStore::write(const std::vector<Lease>& leases) {
+  const auto timestamp = nowMs();
+  std::string values;
+  for (const auto& lease : leases) {
+    values += std::format("{}('{}', '{}', {}, {})",
+                          values.empty() ? "" : ", ",
+                          timestamp,
+                          lease.instance,
+                          lease.shard,
+                          lease.expires_at_ms);
+  }
+  try {
+    clickhouse_client_.execute(
+        std::format("INSERT INTO {} (timestamp, instance, shard, expires_at) VALUES {}", kLeasesTable, values));
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to write leases. Exception: "} + e.what());
+  }
+  return {};
+}
+
+tl::expected<std::vector<Lease>, std::string> ClickhouseLeaseStore::read() {
+  const auto now = nowMs();
+  std::string query = std::format(
+      "SELECT instance, shard, argMax(expires_at, timestamp) AS expires FROM {} WHERE timestamp > {} "
+      "GROUP BY instance, shard HAVING expires > {}",
+      kLeasesTable,
+      now - kLeaseLookbackMs,
+      now);
+  std::vector<Lease> leases;
+  try {
+    clickhouse_client_.select({std::move(query)}, [&leases](const clickhouse::Block& block) {
+      for (size_t i = 0; i < block.GetRowCount(); ++i) {
+        leases.push_back({std::string{block[0]->As<clickhouse::ColumnString>()->At(i)},
+                          block[1]->As<clickhouse::ColumnUInt32>()->At(i),
+                          block[2]->As<clickhouse::ColumnInt64>()->At(i)});
+      }
+    });
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to read leases. Exception: "} + e.what());
+  }
+  return leases;
+}
+
+tl::expected<void, std::string> LocalLeaseStore::write(const std::vector<Lease>& leases) {
+  std::lock_guard lock(mutex_);
+  for (const auto& lease : leases) {
+    expires_at_ms_[{lease.instance, lease.shard}] = lease.expires_at_ms;
+  }
+  return {};
+}
+
+tl::expected<std::vector<Lease>, std::string> LocalLeaseStore::read() {
+  const auto now = nowMs();
+  std::vector<Lease> leases;
+  std::lock_guard lock(mutex_);
+  std::erase_if(expires_at_ms_, [now](const auto& entry) { return entry.second <= now; });
+  for (const auto& [key, expires_at_ms] : expires_at_ms_) {
+    leases.push_back({key.first, key.second, expires_at_ms});
+  }
+  return leases;
+}
+
+LeaseManager::LeaseManager(Options options, std::shared_ptr<LeaseStore> store):
+    options_(std::move(options)),
+    store_(std::move(store)),
+    shard_mutexes_(options_.shards),
+    thread_([this](std::stop_token stop_token) { run(stop_token); }) {
+  ASSERT_FATAL(!options_.instance.empty(), "Lease manager needs an instance name");
+  ASSERT_FATAL(options_.safety_margin < options_.lease_duration - options_.renew_interval,
+               "Leases must be renewed more than safety_margin before they expire");
+}
+
+LeaseManager::~LeaseManager() {
+  LeaseManager* installed = this;
+  installed_lease_manager.compare_exchange_strong(installed, nullptr);
+  thread_.request_stop();
+  thread_.join();
+  const auto now = nowMs();
+  std::vector<Lease> releases{{options_.instance, kMembershipShard, now}};
+  {
+    std::lock_guard lock(mutex_);
+    for (uint32_t shard : owned_) {
+      releases.push_back({options_.instance, shard, now});
+    }
+    for (uint32_t shard : claimed_) {
+      releases.push_back({options_.instance, shard, now});
+    }
+    owned_.clear();
+    claimed_.clear();
+  }
+  if (auto result = store_->write(releases); !result.has_value()) {
+    LOG_ERROR("Failed to release leases of {}, they expire on their own: {}", options_.instance, result.error());
+  }
+}
+
+uint32_t LeaseManager::shardOf(const LeaseKey& key) const {
+  auto hash = fnv1a(key.second, fnv1a(std::string_view{"\0", 1}, fnv1a(key.first)));
+  return static_cast<uint32_t>(mix(hash) % options_.shards);
+}
+
+bool LeaseManager::owns(const LeaseKey& key) const {
+  const auto shard = shardOf(key);
+  std::lock_guard lock(mutex_);
+  return owned_.contains(shard) && nowMs() < serve_until_ms_;
+}
+
+std::optional<std::string> LeaseManager::owner(const LeaseKey& key) const {
+  const auto shard = shardOf(key);
+  std::lock_guard lock(mutex_);
+  if (owned_.contains(shard)) {
+    return options_.instance;
+  }
+  auto it = holders_.find(shard);
+  if (it != holders_.end()) {
+    return it->second;
+  }
+  return preferredOwner(shard, instances_);
+}
+
+tl::expected<LeaseManager::Guard, std::string> LeaseManager::lock(const std::vector<LeaseKey>& keys) {
+  std::set<uint32_t> shards;
+  for (const auto& key : keys) {
+    shards.insert(shardOf(key));
+  }
+  Guard guard;
+  for (uint32_t shard : shards) {
+    guard.locks_.emplace_back(shard_mutexes_[shard]);
+  }
+  // checked once locked, a renewal may have handed the shard over while waiting
+  for (const auto& key : keys) {
+    if (!owns(key)) {
+      return tl::make_unexpected(std::format("{} {} is leased to {}, route the request there",
+                                             key.first,
+                                             key.second,
+                                             owner(key).value_or("no instance yet")));
+    }
+  }
+  return guard;
+}
+
+tl::expected<void, std::string> LeaseManager::renew() {
+  const auto now = nowMs();
+  auto leases = store_->read();
+  PROPAGATE_ERROR(leases);
+  std::set<std::string> instances{options_.instance};
+  // unexpired leases of the other instances by shard
+  std::map<uint32_t, std::vector<std::string>> others;
+  for (const auto& lease : *leases) {
+    if (lease.shard == kMembershipShard) {
+      instances.insert(lease.instance);
+    } else if (lease.instance != options_.instance) {
+      others[lease.shard].push_back(lease.instance);
+    }
+  }
+
+  std::set<uint32_t> held;
+  {
+    std::lock_guard lock(mutex_);
+    held.insert(owned_.begin(), owned_.end());
+    held.insert(claimed_.begin(), claimed_.end());
+  }
+  const int64_t expires_at_ms = now + options_.lease_duration.count();
+  std::vector<Lease> writes{{options_.instance, kMembershipShard, expires_at_ms}};
+  std::set<uint32_t> owned;
+  std::set<uint32_t> claimed;
+  std::vector<uint32_t> released;
+  for (uint32_t shard = 0; shard < options_.shards; ++shard) {
+    const bool preferred = preferredOwner(shard, instances) == options_.instance;
+    auto other = others.find(shard);
+    if (held.contains(shard)) {
+      // two instances with different views may claim the same shard, the higher score keeps it
+      const bool outbid = other != others.end() &&
+          std::any_of(other->second.begin(), other->second.end(), [&](const std::string& instance) {
+                            return score(shard, instance) > score(shard, options_.instance);
+                          });
+      if (preferred && !outbid) {
+        owned.insert(shard);
+        writes.push_back({options_.instance, shard, expires_at_ms});
+      } else {
+        released.push_back(shard);
+        writes.push_back({options_.instance, shard, now});
+      }
+    } else if (preferred && other == others.end()) {
+      claimed.insert(shard);
+      writes.push_back({options_.instance, shard, expires_at_ms});
+    }
+  }
+
+  // stop serving the released shards and let their running operations finish before giving them away
+  {
+    std::lock_guard lock(mutex_);
+    for (uint32_t shard : released) {
+      owned_.erase(shard);
+      claimed_.erase(shard);
+    }
+  }
+  for (uint32_t shard : released) {
+    std::lock_guard drain(shard_mutexes_[shard]);
+  }
+  PROPAGATE_ERROR(store_->write(writes));
+
+  std::map<uint32_t, std::string> holders;
+  for (const auto& [shard, holding_instances] : others) {
+    holders[shard] = *std::max_element(
+        holding_instances.begin(), holding_instances.end(), [&](const std::string& lhs, const std::string& rhs) {
+          return score(shard, lhs) < score(shard, rhs);
+        });
+  }
+  std::lock_guard lock(mutex_);
+  if (owned != owned_ || instances != instances_) {
+    LOG_INFO("Instance {} owns {} of {} shards, claims {}, {} instances live",
+             options_.instance,
+             owned.size(),
+             options_.shards,
+             claimed.size(),
+             instances.size());
+  }
+  owned_ = std::move(owned);
+  claimed_ = std::move(claimed);
+  serve_until_ms_ = expires_at_ms - options_.safety_margin.count();
+  instances_ = std::move(instances);
+  holders_ = std::move(holders);
+  return {};
+}
+
+bool LeaseManager::waitUntilServing(std::chrono::milliseconds timeout) const {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (true) {
+    {
+      std::lock_guard lock(mutex_);
+      if (!owned_.empty() && nowMs() < serve_until_ms_) {
+        return true;
+      }
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
+void LeaseManager::run(std::stop_token stop_token) {
+  while (!stop_token.stop_requested()) {
+    if (auto result = renew(); !result.has_value()) {
+      LOG_ERROR("Failed to renew leases of {}: {}", options_.instance, result.error());
+    }
+    sleepFor(stop_token, options_.renew_interval);
+  }
+}
+
+uint64_t LeaseManager::score(uint32_t shard, const std::string& instance) const {
+  return mix(fnv1a(instance) ^ mix(shard));
+}
+
+std::optional<std::string> LeaseManager::preferredOwner(uint32_t shard, const std::set<std::string>& instances) const {
+  auto best = std::max_element(instances.begin(), instances.end(), [&](const std::string& lhs, const std::string& rhs) {
+    return score(shard, lhs) < score(shard, rhs);
+  });
+  if (best == instances.end()) {
+    return std::nullopt;
+  }
+  return *best;
+}
+
+void setLeaseManager(LeaseManager* lease_manager) {
+  installed_lease_manager.store(lease_manager);
+}
+
+tl::expected<LeaseManager::Guard, std::string> lockKeys(const std::vector<LeaseKey>& keys) {
+  auto* lease_manager = installed_lease_manager.load();
+  if (lease_manager == nullptr) {
+    return LeaseManager::Guard{};
+  }
+  return lease_manager->lock(keys);
+}
+
+tl::expected<void, std::string> checkKeyOwner(const LeaseKey& key) {
+  auto* lease_manager = installed_lease_manager.load();
+  if (lease_manager == nullptr || lease_manager->owns(key)) {
+    return {};
+  }
+  return tl::make_unexpected(std::format("{} {} is leased to {}, route the request there",
+                                         key.first,
+                                         key.second,
+                                         lease_manager->owner(key).value_or("no instance yet")));
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,341 @@
+#include "prod/funds_controller/ledger_replay.h"
+
+#include "prod/funds_controller/alert_dispatcher.h"
+#include "prod/funds_controller/ledger_writer.h"
+#include "prod/funds_controller/mapped_file.h"
+
+#include "util/error/error.h"
+#include "util/lexical_cast/lexical_cast.h"
+#include "util/time/time.h"
+
+#include <magic_enum/magic_enum.hpp>
+
+#include <cstring>
+#include <future>
+#include <vector>
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kLedgerEventsTable = "LEDGER_EVENTS_v1";
+const std::string kLedgerEventsColumns = "(timestamp, kind, subaccount, asset, amount)";
+const std::string kLoansInfoTable = "LOANS_INFO_v2";
+const std::string kHedgeInfoTable = "HEDGES_INFO_v2";
+const std::string kTransactionsTable = "TRANSACTIONS_v1";
+const std::string kDoneStatus = "done";
+
+constexpr uint64_t kMagic = 0x31'52'44'47'4c'43'46'00;  // "\0FCLGDR1"
+constexpr uint32_t kVersion = 1;
+constexpr std::chrono::milliseconds kReplayDeadline{120'000};
+
+struct Mantissa {
+  int64_t high;
+  uint64_t low;
+};
+
+struct Header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t record_count;
+  int64_t high_water_mark_ms;
+  int64_t created_at_ms;
+};
+
+struct Record {
+  uint8_t subaccount_size;
+  uint8_t asset_size;
+  uint8_t reserved[6];
+  char subaccount_data[64];
+  char asset_data[24];
+  Mantissa loans;
+  Mantissa hedges;
+  Mantissa transfers;
+};
+
+static_assert(sizeof(Header) == 40);
+static_assert(sizeof(Record) == 144);
+
+Mantissa split(clickhouse::Int128 value) {
+  return {static_cast<int64_t>(value >> 64), static_cast<uint64_t>(value)};
+}
+
+clickhouse::Int128 join(Mantissa mantissa) {
+  return (static_cast<clickhouse::Int128>(mantissa.high) << 64) | static_cast<clickhouse::Int128>(mantissa.low);
+}
+
+int64_t nowMs() {
+  return static_cast<int64_t>(nowSystem()) / 1'000'000;
+}
+
+void add(LedgerBalance& balance, const LedgerBalance& other) {
+  balance.loans += other.loans;
+  balance.hedges += other.hedges;
+  balance.transfers += other.transfers;
+}
+
+}  // namespace
+
+LedgerJournal::LedgerJournal():
+    subscription_id_(ledgerEvents().subscribe([this](const LedgerEvent& event) { write(event); })) {
+}
+
+LedgerJournal::~LedgerJournal() {
+  ledgerEvents().unsubscribe(subscription_id_);
+}
+
+void LedgerJournal::write(const LedgerEvent& event) {
+  // published from the managers' write paths, the result is checked on the writer thread instead
+  ledgerWriter().insert(kLedgerEventsTable,
+                        kLedgerEventsColumns,
+                        std::format("('{}', '{}', '{}', '{}', '{}')",
+                                    nowMs(),
+                                    magic_enum::enum_name(event.kind),
+                                    event.subaccount,
+                                    event.asset,
+                                    util::lexical_cast<std::string>(event.amount)),
+                        1,
+                        [event](const LedgerWriter::Result& result) {
+                          if (result.has_value()) {
+                            return;
+                          }
+                          // the ledger itself is written, only replays past this point are off until the
+                          // journal is fixed
+                          alertDispatcher().alert("ledger_journal " + event.subaccount + " " + event.asset,
+                                                  std::format("Failed to journal {} {} {} {}: {}",
+                                                              magic_enum::enum_name(event.kind),
+                                                              event.subaccount,
+                                                              event.asset,
+                                                              util::lexical_cast<std::string>(event.amount),
+                                                              result.error().message));
+                        });
+}
+
+tl::expected<void, std::string> LedgerJournal::bootstrap() {
+  auto clickhouse_client = getFundsControllerClickhouseClient();
+  EXPECT_WITH_STRING(clickhouse_client, "Failed to create clickhouse client");
+  const auto timestamp = nowMs();
+  auto opening_rows = [&](LedgerEvent::Kind kind, const std::string& select) {
+    return std::format("INSERT INTO {} {} SELECT {}, '{}', subaccount, asset, sum(amount) FROM ({}) "
+                       "GROUP BY subaccount, asset",
+                       kLedgerEventsTable,
+                       kLedgerEventsColumns,
+                       timestamp,
+                       magic_enum::enum_name(kind),
+                       select);
+  };
+  try {
+    uint64_t rows = 0;
+    clickhouse_client->Select({"SELECT count() FROM " + kLedgerEventsTable}, [&rows](const clickhouse::Block& block) {
+      if (block.GetRowCount() > 0) {
+        rows = block[0]->As<clickhouse::ColumnUInt64>()->At(0);
+      }
+    });
+    if (rows > 0) {
+      LOG_INFO("Ledger journal already has {} rows", rows);
+      return {};
+    }
+    clickhouse_client->Execute({opening_rows(
+        LedgerEvent::Kind::Loan,
+        std::format("SELECT subaccount, asset, amount FROM {} WHERE status = '{}'", kLoansInfoTable, kDoneStatus))});
+    clickhouse_client->Execute({opening_rows(
+        LedgerEvent::Kind::Hedge,
+        std::format("SELECT subaccount, asset, amount FROM {} WHERE status = '{}'", kHedgeInfoTable, kDoneStatus))});
+    clickhouse_client->Execute(
+        {opening_rows(LedgerEvent::Kind::Transfer,
+                      std::format("SELECT from_subaccount AS subaccount, asset, -amount AS amount FROM {0} "
+                                  "WHERE type = 'transfer' AND status = '{1}' UNION ALL "
+                                  "SELECT to_subaccount AS subaccount, asset, amount FROM {0} "
+                                  "WHERE type = 'transfer' AND status = '{1}'",
+                                  kTransactionsTable,
+                                  kDoneStatus))});
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to bootstrap ledger journal. Exception: "} + e.what());
+  }
+  LOG_INFO("Bootstrapped ledger journal at {}", timestamp);
+  return {};
+}
+
+ExposureSnapshot LedgerState::toExposure() const {
+  ExposureSnapshot snapshot;
+  for (const auto& [key, balance] : balances) {
+    const auto& [subaccount, asset] = key;
+    for (auto [kind, mantissa] : {std::pair{LedgerEvent::Kind::Loan, balance.loans},
+                                  std::pair{LedgerEvent::Kind::Hedge, balance.hedges},
+                                  std::pair{LedgerEvent::Kind::Transfer, balance.transfers}}) {
+      auto amount = convertClickhouseDecimalToDecimal(mantissa);
+      snapshot.by_subaccount[subaccount][asset].apply(kind, amount);
+      snapshot.by_asset[asset].apply(kind, amount);
+    }
+  }
+  return snapshot;
+}
+
+LedgerReplay::LedgerReplay(Options options):
+    options_(std::move(options)),
+    clickhouse_client_(ResilientClickhouseClient::Options{.read_deadline = kReplayDeadline,
+                                                          .connections = options_.parallelism}) {
+}
+
+tl::expected<LedgerState, std::string> LedgerReplay::warmStart() {
+  LedgerState state;
+  if (auto snapshot = readSnapshot(options_.snapshot_path); snapshot.has_value()) {
+    state = std::move(*snapshot);
+    LOG_INFO("Loaded ledger snapshot at {} with {} balances", state.high_water_mark_ms, state.balances.size());
+  } else {
+    LOG_INFO("Replaying the whole ledger journal: {}", snapshot.error());
+  }
+  PROPAGATE_ERROR(replay(state, nowMs() - options_.settle_delay.count()));
+  PROPAGATE_ERROR(writeSnapshot(options_.snapshot_path, state));
+  PROPAGATE_ERROR(replay(state, nowMs()));
+  return state;
+}
+
+tl::expected<LedgerState, std::string> LedgerReplay::stateAsOf(int64_t timestamp_ms) {
+  LedgerState state;
+  auto snapshot = readSnapshot(options_.snapshot_path);
+  if (snapshot.has_value() && snapshot->high_water_mark_ms <= timestamp_ms) {
+    state = std::move(*snapshot);
+  }
+  PROPAGATE_ERROR(replay(state, timestamp_ms));
+  return state;
+}
+
+tl::expected<void, std::string> LedgerReplay::replay(LedgerState& state, int64_t to_timestamp_ms) {
+  if (to_timestamp_ms <= state.high_water_mark_ms) {
+    return {};
+  }
+  std::vector<std::future<tl::expected<LedgerState, std::string>>> partitions;
+  for (size_t partition = 0; partition < options_.parallelism; ++partition) {
+    partitions.push_back(std::async(std::launch::async, [this, partition, &state, to_timestamp_ms] {
+      return replayPartition(partition, state.high_water_mark_ms, to_timestamp_ms);
+    }));
+  }
+  std::optional<std::string> error;
+  std::vector<LedgerState> deltas;
+  for (auto& partition : partitions) {
+    auto delta = partition.get();
+    if (!delta.has_value()) {
+      error = delta.error();
+      continue;
+    }
+    deltas.push_back(std::move(*delta));
+  }
+  EXPECT_WITH_STRING(!error.has_value(), "Failed to replay ledger journal: " << *error);
+  for (const auto& delta : deltas) {
+    for (const auto& [key, balance] : delta.balances) {
+      add(state.balances[key], balance);
+    }
+  }
+  LOG_INFO("Replayed ledger journal from {} to {}", state.high_water_mark_ms, to_timestamp_ms);
+  state.high_water_mark_ms = to_timestamp_ms;
+  return {};
+}
+
+tl::expected<LedgerState, std::string> LedgerReplay::replayPartition(size_t partition,
+                                                                     int64_t from_timestamp_ms,
+                                                                     int64_t to_timestamp_ms) {
+  std::string query = std::format(
+      "SELECT subaccount, asset, kind, sum(amount) FROM {} WHERE timestamp > {} AND timestamp <= {} AND "
+      "cityHash64(subaccount) % {} = {} GROUP BY subaccount, asset, kind",
+      kLedgerEventsTable,
+      from_timestamp_ms,
+      to_timestamp_ms,
+      options_.parallelism,
+      partition);
+  LedgerState delta;
+  std::optional<std::string> unknown_kind;
+  try {
+    clickhouse_client_.select({std::move(query)}, [&delta, &unknown_kind](const clickhouse::Block& block) {
+      for (size_t i = 0; i < block.GetRowCount(); ++i) {
+        auto& balance = delta.balances[{std::string{block[0]->As<clickhouse::ColumnString>()->At(i)},
+                                        std::string{block[1]->As<clickhouse::ColumnString>()->At(i)}}];
+        auto kind_name = block[2]->As<clickhouse::ColumnString>()->At(i);
+        auto mantissa = block[3]->As<clickhouse::ColumnDecimal>()->At(i);
+        auto kind = magic_enum::enum_cast<LedgerEvent::Kind>(kind_name);
+        if (!kind.has_value()) {
+          unknown_kind = std::string{kind_name};
+          continue;
+        }
+        switch (*kind) {
+          case LedgerEvent::Kind::Loan:
+            balance.loans += mantissa;
+            break;
+          case LedgerEvent::Kind::Hedge:
+            balance.hedges += mantissa;
+            break;
+          case LedgerEvent::Kind::Transfer:
+            balance.transfers += mantissa;
+            break;
+        }
+      }
+    });
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to read ledger journal. Exception: "} + e.what());
+  }
+  EXPECT_WITH_STRING(!unknown_kind.has_value(), "Unknown ledger event kind " << *unknown_kind);
+  return delta;
+}
+
+tl::expected<void, std::string> LedgerReplay::writeSnapshot(const std::string& path, const LedgerState& state) {
+  std::vector<Record> records;
+  records.reserve(state.balances.size());
+  for (const auto& [key, balance] : state.balances) {
+    const auto& [subaccount, asset] = key;
+    EXPECT_WITH_STRING(subaccount.size() <= sizeof(Record::subaccount_data), "Subaccount is too long: " << subaccount);
+    EXPECT_WITH_STRING(asset.size() <= sizeof(Record::asset_data), "Asset is too long: " << asset);
+    Record record{};
+    record.subaccount_size = static_cast<uint8_t>(subaccount.size());
+    record.asset_size = static_cast<uint8_t>(asset.size());
+    std::memcpy(record.subaccount_data, subaccount.data(), subaccount.size());
+    std::memcpy(record.asset_data, asset.data(), asset.size());
+    record.loans = split(balance.loans);
+    record.hedges = split(balance.hedges);
+    record.transfers = split(balance.transfers);
+    records.push_back(record);
+  }
+  Header header{
+      .magic = kMagic,
+      .version = kVersion,
+      .record_size = sizeof(Record),
+      .record_count = records.size(),
+      .high_water_mark_ms = state.high_water_mark_ms,
+      .created_at_ms = nowMs(),
+  };
+  std::string content;
+  content.reserve(sizeof(Header) + records.size() * sizeof(Record));
+  content.append(reinterpret_cast<const char*>(&header), sizeof(Header));
+  content.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+  return replaceFileAtomically(path, content);
+}
+
+tl::expected<LedgerState, std::string> LedgerReplay::readSnapshot(const std::string& path) {
+  auto file = MappedFile::open(path);
+  PROPAGATE_ERROR(file);
+  auto data = file->data();
+  EXPECT_WITH_STRING(data.size() >= sizeof(Header), "Ledger snapshot " << path << " is truncated");
+  const auto& header = *reinterpret_cast<const Header*>(data.data());
+  EXPECT_WITH_STRING(header.magic == kMagic, "Not a ledger snapshot: " << path);
+  EXPECT_WITH_STRING(header.version == kVersion,
+                     "Unsupported ledger snapshot version " << header.version << ", expected " << kVersion);
+  EXPECT_WITH_STRING(header.record_size == sizeof(Record), "Unexpected ledger record size " << header.record_size);
+  size_t expected_size = sizeof(Header) + header.record_count * sizeof(Record);
+  EXPECT_WITH_STRING(data.size() == expected_size,
+                     "Ledger snapshot " << path << " has size " << data.size() << ", expected " << expected_size);
+
+  LedgerState state;
+  state.high_water_mark_ms = header.high_water_mark_ms;
+  const auto* records = reinterpret_cast<const Record*>(data.data() + sizeof(Header));
+  for (const auto& record : std::span(records, header.record_count)) {
+    state.balances.emplace_hint(state.balances.end(),
+                                std::pair{std::string{record.subaccount_data, record.subaccount_size},
+                                          std::string{record.asset_data, record.asset_size}},
+                                LedgerBalance{join(record.loans), join(record.hedges), join(record.transfers)});
+  }
+  return state;
+}
+
+}  // namespace funds_controller
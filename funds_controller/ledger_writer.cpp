@@ -0,0 +1,145 @@
+#include "prod/funds_controller/ledger_writer.h"
+
+#include "util/error/error.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace funds_controller {
+
+namespace {
+
+// writer sleep when there is nothing to flush
+constexpr std::chrono::milliseconds kIdleWait{1'000};
+
+}  // namespace
+
+LedgerWriter::LedgerWriter(Options options):
+    options_(options), thread_([this](std::stop_token stop_token) { run(stop_token); }) {
+}
+
+LedgerWriter::~LedgerWriter() {
+  // wakes the writer through its stop token, it flushes what is queued before returning
+  thread_.request_stop();
+  thread_.join();
+}
+
+std::future<LedgerWriter::Result> LedgerWriter::insert(std::string table,
+                                                       std::string columns,
+                                                       std::string values,
+                                                       size_t rows) {
+  std::promise<Result> promise;
+  auto future = promise.get_future();
+  push({std::move(table), std::move(columns), std::move(values), rows, std::move(promise), {}});
+  return future;
+}
+
+void LedgerWriter::insert(std::string table, std::string columns, std::string values, size_t rows, Callback done) {
+  push({std::move(table), std::move(columns), std::move(values), rows, {}, std::move(done)});
+}
+
+void LedgerWriter::push(Write write) {
+  queue_.push(std::move(write));
+  {
+    std::lock_guard lock(wake_mutex_);
+    signaled_ = true;
+  }
+  wake_.notify_one();
+}
+
+void LedgerWriter::run(std::stop_token stop_token) {
+  using Clock = std::chrono::steady_clock;
+  struct Batch {
+    std::string values;
+    size_t rows = 0;
+    Clock::time_point deadline;
+    std::vector<std::promise<Result>> promises;
+    std::vector<Callback> callbacks;
+  };
+  std::map<std::pair<std::string, std::string>, Batch> batches;
+  auto flush = [this](const std::pair<std::string, std::string>& key, Batch& batch) {
+    Result result;
+    try {
+      clickhouse_client_.execute({std::format("INSERT INTO {} {} VALUES {}", key.first, key.second, batch.values)});
+    } catch (const ClickhouseUnknownOutcome& e) {
+      LOG_ERROR("clickhouse error: {}", e.what());
+      result = unknownOutcome(std::string{"Exception: "} + e.what());
+    } catch (const std::exception& e) {
+      LOG_ERROR("clickhouse error: {}", e.what());
+      result = tl::make_unexpected(std::string{"Exception: "} + e.what());
+    }
+    LOG_DEBUG("Flushed {} rows of {} writes to {}",
+              batch.rows,
+              batch.promises.size() + batch.callbacks.size(),
+              key.first);
+    for (auto& promise : batch.promises) {
+      promise.set_value(result);
+    }
+    for (const auto& done : batch.callbacks) {
+      done(result);
+    }
+  };
+
+  while (true) {
+    bool stopping = stop_token.stop_requested();
+    {
+      std::lock_guard lock(wake_mutex_);
+      signaled_ = false;
+    }
+    // false when the drain stopped on a due batch with writes still queued
+    bool drained = true;
+    while (auto write = queue_.pop()) {
+      auto now = Clock::now();
+      auto key = std::make_pair(std::move(write->table), std::move(write->columns));
+      auto& batch = batches[key];
+      if (batch.rows == 0) {
+        batch.deadline = now + options_.max_delay;
+      }
+      batch.values += (batch.values.empty() ? "" : ", ") + write->values;
+      batch.rows += write->rows;
+      if (write->done) {
+        batch.callbacks.push_back(std::move(write->done));
+      } else {
+        batch.promises.push_back(std::move(write->promise));
+      }
+      if (batch.rows >= options_.max_rows) {
+        flush(key, batch);
+        batches.erase(key);
+      }
+      if (std::any_of(batches.begin(), batches.end(), [now](const auto& entry) {
+            return entry.second.deadline <= now;
+          })) {
+        drained = false;
+        break;
+      }
+    }
+
+    auto now = Clock::now();
+    auto wait_until = now + kIdleWait;
+    for (auto it = batches.begin(); it != batches.end();) {
+      if (stopping || drained || it->second.deadline <= now) {
+        flush(it->first, it->second);
+        it = batches.erase(it);
+      } else {
+        wait_until = std::min(wait_until, it->second.deadline);
+        ++it;
+      }
+    }
+    if (stopping) {
+      return;
+    }
+    if (!drained) {
+      continue;
+    }
+    std::unique_lock lock(wake_mutex_);
+    wake_.wait_until(lock, stop_token, wait_until, [this] { return signaled_; });
+  }
+}
+
+LedgerWriter& ledgerWriter() {
+  static LedgerWriter writer({});
+  return writer;
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,222 @@
+#include "prod/funds_controller/limits_engine.h"
+
+#include "util/error/error.h"
+#include "util/time/time.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <tuple>
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kLimitsTable = "LIMITS_v1";
+const std::string kTransactionsTable = "TRANSACTIONS_v1";
+const std::string kDoneStatus = "done";
+// subaccount of the limits on an asset total
+const std::string kAllSubaccounts;
+
+constexpr int64_t kDayMs = 24 * 60 * 60 * 1'000;
+
+constexpr std::array<std::string_view, 3> kTypeNames = {"max_loan", "max_hedge", "max_daily_transfer"};
+
+int64_t today() {
+  return static_cast<int64_t>(nowSystem()) / 1'000'000 / kDayMs;
+}
+
+size_t index(Limit::Type type) {
+  return static_cast<size_t>(type);
+}
+
+}  // namespace
+
+std::string LimitRejection::message() const {
+  return std::format("{} {} of {} {} exceeded: usage {}, requested {}",
+                     kTypeNames[index(limit.type)],
+                     limit.value,
+                     limit.subaccount.empty() ? "all subaccounts" : limit.subaccount,
+                     limit.asset,
+                     usage,
+                     requested);
+}
+
+LimitsEngine::LimitsEngine(const ExposureEngine& exposure):
+    exposure_(exposure),
+    subscription_id_(ledgerEvents().subscribe([this](const LedgerEvent& event) { apply(event); })) {
+}
+
+LimitsEngine::~LimitsEngine() {
+  ledgerEvents().unsubscribe(subscription_id_);
+}
+
+tl::expected<void, std::string> LimitsEngine::load() {
+  struct Row {
+    std::string subaccount;
+    std::string asset;
+    std::string type;
+    infra::Volume value;
+  };
+  std::vector<Row> limit_rows;
+  std::vector<Row> transfer_rows;
+  auto load_rows = [this](std::string query, std::vector<Row>& rows, bool with_type) {
+    clickhouse_client_.select({std::move(query)}, [&rows, with_type](const clickhouse::Block& block) {
+      const size_t value_column = with_type ? 3 : 2;
+      for (size_t i = 0; i < block.GetRowCount(); ++i) {
+        rows.push_back(
+            {std::string{block[0]->As<clickhouse::ColumnString>()->At(i)},
+             std::string{block[1]->As<clickhouse::ColumnString>()->At(i)},
+             with_type ? std::string{block[2]->As<clickhouse::ColumnString>()->At(i)} : std::string{},
+             convertClickhouseDecimalToDecimal(block[value_column]->As<clickhouse::ColumnDecimal>()->At(i))});
+      }
+    });
+  };
+  std::lock_guard load_lock(load_mutex_);
+  const auto day = today();
+  {
+    // from here on the transfers are read, later events are kept to be added on top
+    std::unique_lock lock(mutex_);
+    loading_events_.emplace();
+  }
+  struct StopBuffering {
+    LimitsEngine& engine;
+    ~StopBuffering() {
+      std::unique_lock lock(engine.mutex_);
+      engine.loading_events_.reset();
+    }
+  } stop_buffering{*this};
+  try {
+    load_rows(std::format("SELECT subaccount, asset, type, argMax(value, timestamp) FROM {} "
+                          "GROUP BY subaccount, asset, type HAVING argMax(status, timestamp) = '{}'",
+                          kLimitsTable,
+                          kDoneStatus),
+              limit_rows,
+              true);
+    load_rows(std::format("SELECT from_subaccount, asset, sum(amount) FROM {} "
+                          "WHERE type = 'transfer' AND status = '{}' AND timestamp >= {} "
+                          "GROUP BY from_subaccount, asset",
+                          kTransactionsTable,
+                          kDoneStatus,
+                          day * kDayMs),
+              transfer_rows,
+              false);
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to load limits. Exception: "} + e.what());
+  }
+
+  std::unordered_map<std::string, AssetLimits> limits;
+  for (const auto& row : limit_rows) {
+    auto type = std::find(kTypeNames.begin(), kTypeNames.end(), row.type);
+    EXPECT_WITH_STRING(type != kTypeNames.end(), "Unknown limit type " << row.type);
+    auto& asset_limits = limits[row.asset];
+    auto& values = row.subaccount.empty() ? asset_limits.total : asset_limits.by_subaccount[row.subaccount];
+    values[static_cast<size_t>(type - kTypeNames.begin())] = row.value;
+  }
+  std::unordered_map<std::string, AssetTransfers> transfers;
+  for (const auto& row : transfer_rows) {
+    auto& asset_transfers = transfers[row.asset];
+    asset_transfers.total += row.value;
+    asset_transfers.by_subaccount[row.subaccount] += row.value;
+  }
+
+  std::unique_lock lock(mutex_);
+  limits_ = std::move(limits);
+  transfer_day_ = day;
+  transfers_ = std::move(transfers);
+  for (const auto& event : *loading_events_) {
+    if (today() == transfer_day_) {
+      addTransfer(transfers_, event);
+    }
+  }
+  LOG_INFO("Loaded {} limits, {} transfers published during the load", limit_rows.size(), loading_events_->size());
+  return {};
+}
+
+LimitsEngine::LimitCheckResults LimitsEngine::check(const std::vector<LimitCheck>& checks) const {
+  LimitCheckResults results;
+  results.reserve(checks.size());
+  // usage added by the accepted checks of this batch, the empty subaccount holds the asset total
+  std::map<std::tuple<Limit::Type, std::string_view, std::string_view>, infra::Volume> pending;
+
+  std::shared_lock lock(mutex_);
+  for (const auto& check : checks) {
+    tl::expected<void, LimitRejection> result;
+    auto asset_it = limits_.find(check.asset);
+    if (check.amount > 0 && asset_it != limits_.end()) {
+      const auto& asset_limits = asset_it->second;
+      auto subaccount_it = asset_limits.by_subaccount.find(check.subaccount);
+      const std::optional<infra::Volume>* scopes[] = {
+          subaccount_it != asset_limits.by_subaccount.end() ? &subaccount_it->second[index(check.type)] : nullptr,
+          &asset_limits.total[index(check.type)],
+      };
+      for (size_t scope = 0; scope < 2 && result.has_value(); ++scope) {
+        if (scopes[scope] == nullptr || !scopes[scope]->has_value()) {
+          continue;
+        }
+        const std::string& subaccount = scope == 0 ? check.subaccount : kAllSubaccounts;
+        auto pending_it = pending.find({check.type, subaccount, check.asset});
+        auto used = usage(check.type, subaccount, check.asset) +
+                    (pending_it != pending.end() ? pending_it->second : infra::Volume{});
+        if (used + check.amount > **scopes[scope]) {
+          result = tl::make_unexpected(
+              LimitRejection{Limit{check.type, subaccount, check.asset, **scopes[scope]}, used, check.amount});
+        }
+      }
+    }
+    if (result.has_value()) {
+      pending[{check.type, check.subaccount, check.asset}] += check.amount;
+      pending[{check.type, std::string_view{}, check.asset}] += check.amount;
+    }
+    results.push_back(std::move(result));
+  }
+  return results;
+}
+
+infra::Volume LimitsEngine::usage(Limit::Type type, const std::string& subaccount, const std::string& asset) const {
+  switch (type) {
+    case Limit::Type::MaxLoan:
+      return subaccount.empty() ? exposure_.exposure(asset).loans : exposure_.exposure(subaccount, asset).loans;
+    case Limit::Type::MaxHedge:
+      return subaccount.empty() ? exposure_.exposure(asset).hedges : exposure_.exposure(subaccount, asset).hedges;
+    case Limit::Type::MaxDailyTransfer: {
+      auto asset_it = transfers_.find(asset);
+      if (transfer_day_ != today() || asset_it == transfers_.end()) {
+        return {};
+      }
+      if (subaccount.empty()) {
+        return asset_it->second.total;
+      }
+      auto it = asset_it->second.by_subaccount.find(subaccount);
+      return it != asset_it->second.by_subaccount.end() ? it->second : infra::Volume{};
+    }
+  }
+  return {};
+}
+
+void LimitsEngine::apply(const LedgerEvent& event) {
+  // transfers publish a negative event for the sender, that is the outgoing volume
+  if (event.kind != LedgerEvent::Kind::Transfer || event.amount >= 0) {
+    return;
+  }
+  const auto day = today();
+  std::unique_lock lock(mutex_);
+  if (loading_events_.has_value()) {
+    loading_events_->push_back(event);
+  }
+  if (day != transfer_day_) {
+    transfer_day_ = day;
+    transfers_.clear();
+  }
+  addTransfer(transfers_, event);
+}
+
+void LimitsEngine::addTransfer(std::unordered_map<std::string, AssetTransfers>& transfers, const LedgerEvent& event) {
+  auto& asset_transfers = transfers[event.asset];
+  asset_transfers.total -= event.amount;
+  asset_transfers.by_subaccount[event.subaccount] -= event.amount;
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,523 @@
+#include "prod/funds_controller/listings_watcher.h"
+
+#include "util/error/error.h"
+
+#include <magic_enum/magic_enum.hpp>
+
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <future>
+#include <utility>
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kUnknownStatus = "unknown";
+
+// Where the instrument list lives inside an exchangeInfo response and how its fields are named.
+struct ListingSchema {
+  std::string_view result;
+  std::string_view list;
+  std::string_view symbol;
+  std::string_view status;
+  std::string_view fallback_status;
+  std::string_view listing_time;
+  std::string_view tick_size;
+  std::string_view lot_size;
+  std::string_view contract_size;
+  std::string_view filters;
+  std::string_view price_filter;
+  std::string_view lot_size_filter;
+};
+
+ListingSchema listingSchema(infra::Exchange exchange) {
+  switch (exchange) {
+    case infra::Exchange::Binance:
+      return {.list = "symbols",
+              .symbol = "symbol",
+              .status = "status",
+              .fallback_status = "contractStatus",
+              .listing_time = "onboardDate",
+              .contract_size = "contractSize",
+              .filters = "filters"};
+    case infra::Exchange::Okex:
+      return {.list = "data",
+              .symbol = "instId",
+              .status = "state",
+              .listing_time = "listTime",
+              .tick_size = "tickSz",
+              .lot_size = "lotSz",
+              .contract_size = "ctVal"};
+    case infra::Exchange::Bybit:
+      return {.result = "result",
+              .list = "list",
+              .symbol = "symbol",
+              .status = "status",
+              .listing_time = "launchTime",
+              .price_filter = "priceFilter",
+              .lot_size_filter = "lotSizeFilter"};
+    default:
+      ASSERT_FATAL(false, "Unknown exchange " << exchange);
+  }
+  return {};
+}
+
+struct ParsedListing {
+  std::string_view pair;
+  std::string_view status;
+  int64_t listing_time_ms = 0;
+  ContractMetadata metadata;
+};
+
+tl::unexpected<std::string> parseError(simdjson::error_code error) {
+  return tl::make_unexpected(std::string{"Failed to parse exchange info: "} + simdjson::error_message(error));
+}
+
+bool matches(std::string_view key, std::string_view schema_key) {
+  return !schema_key.empty() && key == schema_key;
+}
+
+template <class OnField>
+simdjson::error_code forEachField(simdjson::ondemand::value& value, OnField&& on_field) {
+  simdjson::ondemand::object object;
+  if (auto error = value.get_object().get(object)) {
+    return error;
+  }
+  for (auto field_result : object) {
+    simdjson::ondemand::field field;
+    std::string_view key;
+    if (auto error = field_result.get(field)) {
+      return error;
+    }
+    if (auto error = field.unescaped_key().get(key)) {
+      return error;
+    }
+    if (auto error = on_field(key, field.value())) {
+      return error;
+    }
+  }
+  return simdjson::SUCCESS;
+}
+
+template <class OnElement>
+simdjson::error_code forEachElement(simdjson::ondemand::value& value, OnElement&& on_element) {
+  simdjson::ondemand::array array;
+  if (auto error = value.get_array().get(array)) {
+    return error;
+  }
+  for (auto element_result : array) {
+    simdjson::ondemand::value element;
+    if (auto error = element_result.get(element)) {
+      return error;
+    }
+    if (auto error = on_element(element)) {
+      return error;
+    }
+  }
+  return simdjson::SUCCESS;
+}
+
+// Okex and Bybit send timestamps as strings, Binance as numbers.
+simdjson::error_code parseTimestamp(simdjson::ondemand::value& value, int64_t& timestamp_ms) {
+  simdjson::ondemand::json_type type;
+  if (auto error = value.type().get(type)) {
+    return error;
+  }
+  switch (type) {
+    case simdjson::ondemand::json_type::number:
+      return value.get_int64().get(timestamp_ms);
+    case simdjson::ondemand::json_type::string: {
+      std::string_view text;
+      if (auto error = value.get_string().get(text)) {
+        return error;
+      }
+      timestamp_ms = 0;
+      std::from_chars(text.data(), text.data() + text.size(), timestamp_ms);
+      return simdjson::SUCCESS;
+    }
+    case simdjson::ondemand::json_type::null:
+      return simdjson::SUCCESS;
+    default:
+      return simdjson::INCORRECT_TYPE;
+  }
+}
+
+simdjson::error_code parseFixedPoint(simdjson::ondemand::value& value, int64_t& mantissa) {
+  simdjson::ondemand::json_type type;
+  if (auto error = value.type().get(type)) {
+    return error;
+  }
+  if (type == simdjson::ondemand::json_type::number) {
+    double number = 0;
+    if (auto error = value.get_double().get(number)) {
+      return error;
+    }
+    mantissa = std::llround(number * 1e12);
+    return simdjson::SUCCESS;
+  }
+  std::string_view text;
+  if (auto error = value.get_string().get(text)) {
+    return error;
+  }
+  mantissa = parseFixedPointMantissa(text).value_or(0);
+  return simdjson::SUCCESS;
+}
+
+// Binance filters are objects keyed by filterType, which comes first in every filter.
+simdjson::error_code parseBinanceFilters(simdjson::ondemand::value& value, ContractMetadata& metadata) {
+  return forEachElement(value, [&metadata](simdjson::ondemand::value& filter) {
+    std::string_view filter_type;
+    return forEachField(filter, [&](std::string_view key, simdjson::ondemand::value& field_value) {
+      if (key == "filterType") {
+        return field_value.get_string().get(filter_type);
+      }
+      if (key == "tickSize" && filter_type == "PRICE_FILTER") {
+        return parseFixedPoint(field_value, metadata.tick_size);
+      }
+      if (key == "stepSize" && filter_type == "LOT_SIZE") {
+        return parseFixedPoint(field_value, metadata.lot_size);
+      }
+      return simdjson::SUCCESS;
+    });
+  });
+}
+
+// Walks the instrument list in document order without materialising it; string views passed to
+// on_listing point into body and are valid only for the duration of the call.
+template <class OnListing>
+tl::expected<void, std::string> parseListings(simdjson::ondemand::parser& parser,
+                                              std::string& body,
+                                              const ListingSchema& schema,
+                                              OnListing&& on_listing) {
+  body.reserve(body.size() + simdjson::SIMDJSON_PADDING);
+  simdjson::ondemand::document document;
+  if (auto error = parser.iterate(simdjson::padded_string_view(body.data(), body.size(), body.capacity()))
+                       .get(document)) {
+    return parseError(error);
+  }
+  simdjson::ondemand::value list;
+  if (schema.result.empty()) {
+    if (auto error = document[schema.list].get(list)) {
+      return parseError(error);
+    }
+  } else {
+    simdjson::ondemand::value result;
+    if (auto error = document[schema.result].get(result)) {
+      return parseError(error);
+    }
+    if (auto error = result[schema.list].get(list)) {
+      return parseError(error);
+    }
+  }
+
+  std::string missing_symbol_error;
+  auto error = forEachElement(list, [&](simdjson::ondemand::value& item) {
+    ParsedListing listing;
+    std::string_view fallback_status;
+    auto error = forEachField(item, [&](std::string_view key, simdjson::ondemand::value& value) {
+      if (matches(key, schema.symbol)) {
+        return value.get_string().get(listing.pair);
+      }
+      if (matches(key, schema.status)) {
+        return value.get_string().get(listing.status);
+      }
+      if (matches(key, schema.fallback_status)) {
+        return value.get_string().get(fallback_status);
+      }
+      if (matches(key, schema.listing_time)) {
+        return parseTimestamp(value, listing.listing_time_ms);
+      }
+      if (matches(key, schema.tick_size)) {
+        return parseFixedPoint(value, listing.metadata.tick_size);
+      }
+      if (matches(key, schema.lot_size)) {
+        return parseFixedPoint(value, listing.metadata.lot_size);
+      }
+      if (matches(key, schema.contract_size)) {
+        return parseFixedPoint(value, listing.metadata.contract_size);
+      }
+      if (matches(key, schema.filters)) {
+        return parseBinanceFilters(value, listing.metadata);
+      }
+      if (matches(key, schema.price_filter)) {
+        return forEachField(value, [&](std::string_view filter_key, simdjson::ondemand::value& filter_value) {
+          return filter_key == "tickSize" ? parseFixedPoint(filter_value, listing.metadata.tick_size)
+                                          : simdjson::SUCCESS;
+        });
+      }
+      if (matches(key, schema.lot_size_filter)) {
+        // qtyStep for derivatives, basePrecision for spot
+        return forEachField(value, [&](std::string_view filter_key, simdjson::ondemand::value& filter_value) {
+          return filter_key == "qtyStep" || filter_key == "basePrecision"
+              ? parseFixedPoint(filter_value, listing.metadata.lot_size)
+              : simdjson::SUCCESS;
+        });
+      }
+      return simdjson::SUCCESS;
+    });
+    if (error) {
+      return error;
+    }
+    if (listing.pair.empty()) {
+      missing_symbol_error = std::string{"Instrument without "} + std::string{schema.symbol} + " in exchange info";
+      return simdjson::NO_SUCH_FIELD;
+    }
+    if (listing.status.empty()) {
+      listing.status = fallback_status.empty() ? std::string_view{kUnknownStatus} : fallback_status;
+    }
+    on_listing(listing);
+    return simdjson::SUCCESS;
+  });
+  EXPECT_WITH_STRING(missing_symbol_error.empty(), missing_symbol_error);
+  if (error) {
+    return parseError(error);
+  }
+  return {};
+}
+
+}  // namespace
+
+ListingsWatcher::MarketState::MarketState(infra::Market market, HttpClient http_client):
+    market(market), http_client(std::move(http_client)) {
+}
+
+std::vector<infra::Market> ListingsWatcher::defaultMarkets() {
+  return {
+      infra::Market{infra::Market::BinanceFutures},
+      infra::Market{infra::Market::BinanceSpots},
+      infra::Market{infra::Market::BinanceDelivery},
+      infra::Market{infra::Market::OkexSwaps},
+      infra::Market{infra::Market::OkexSpots},
+      infra::Market{infra::Market::BybitFutures},
+      infra::Market{infra::Market::BybitInverse},
+      infra::Market{infra::Market::BybitSpots},
+  };
+}
+
+std::string ListingsWatcher::defaultEndpoint(infra::Market market) {
+  switch (market.type()) {
+    case infra::Market::BinanceDelivery:
+      return "https://dapi.binance.com/dapi/v1";
+    case infra::Market::BinanceFutures:
+      return "https://fapi.binance.com/fapi/v1";
+    case infra::Market::BinanceSpots:
+      return "https://api.binance.com/api/v1";
+    case infra::Market::OkexSpots:
+    case infra::Market::OkexSwaps:
+      return "https://www.okx.com/api/v5";
+    case infra::Market::BybitFutures:
+    case infra::Market::BybitInverse:
+    case infra::Market::BybitSpots:
+      return "https://api.bybit.com/v5";
+    default:
+      ASSERT_FATAL(false, "No listings endpoint for market " << market);
+  }
+  return {};
+}
+
+std::string ListingsWatcher::exchangeInfoPath(infra::Market market) {
+  switch (market.type()) {
+    case infra::Market::BinanceDelivery:
+    case infra::Market::BinanceFutures:
+    case infra::Market::BinanceSpots:
+      return "/exchangeInfo";
+    case infra::Market::OkexSpots:
+      return "/public/instruments?instType=SPOT";
+    case infra::Market::OkexSwaps:
+      return "/public/instruments?instType=SWAP";
+    case infra::Market::BybitFutures:
+      return "/market/instruments-info?category=linear";
+    case infra::Market::BybitInverse:
+      return "/market/instruments-info?category=inverse";
+    case infra::Market::BybitSpots:
+      return "/market/instruments-info?category=spot";
+    default:
+      ASSERT_FATAL(false, "No exchange info path for market " << market);
+  }
+  return {};
+}
+
+ListingsWatcher::ListingsWatcher(Options options, Callback callback):
+    options_(std::move(options)), callback_(std::move(callback)) {
+  if (options_.markets.empty()) {
+    options_.markets = defaultMarkets();
+  }
+  for (const auto& market : options_.markets) {
+    auto endpoint_it = options_.endpoints.find(market.type());
+    std::string endpoint = endpoint_it != options_.endpoints.end() ? endpoint_it->second : defaultEndpoint(market);
+    markets_.push_back(std::make_unique<MarketState>(market, HttpClient(endpoint, options_.request_timeout)));
+  }
+  if (!options_.snapshot_path.empty()) {
+    loadSnapshot();
+  }
+}
+
+ListingsWatcher::~ListingsWatcher() {
+  stop();
+}
+
+void ListingsWatcher::start() {
+  ASSERT_FATAL(threads_.empty(), "Listings watcher is already started");
+  for (auto& state : markets_) {
+    threads_.emplace_back([this, &state](std::stop_token stop_token) { run(*state, stop_token); });
+  }
+}
+
+void ListingsWatcher::stop() {
+  for (auto& thread : threads_) {
+    thread.request_stop();
+  }
+  threads_.clear();
+}
+
+tl::expected<void, std::string> ListingsWatcher::pollOnce() {
+  std::vector<std::future<tl::expected<void, std::string>>> results;
+  results.reserve(markets_.size());
+  for (auto& state : markets_) {
+    results.push_back(std::async(std::launch::async, [this, &state] { return poll(*state); }));
+  }
+  std::string errors;
+  for (auto& result : results) {
+    auto poll_result = result.get();
+    if (!poll_result.has_value()) {
+      errors += poll_result.error() + "; ";
+    }
+  }
+  EXPECT_WITH_STRING(errors.empty(), "Failed to poll listings: " << errors);
+  return {};
+}
+
+std::vector<InstrumentListing> ListingsWatcher::universe() const {
+  std::vector<InstrumentListing> result;
+  for (const auto& state : markets_) {
+    std::lock_guard lock(state->listings_mutex);
+    for (const auto& [pair, entry] : state->listings) {
+      result.push_back(entry.listing);
+    }
+  }
+  return result;
+}
+
+tl::expected<void, std::string> ListingsWatcher::poll(MarketState& state) {
+  std::lock_guard poll_lock(state.poll_mutex);
+  auto response = state.http_client.get(exchangeInfoPath(state.market));
+  PROPAGATE_ERROR(response);
+  size_t response_hash = std::hash<std::string_view>{}(*response);
+  if (state.initialized && response_hash == state.last_response_hash) {
+    return {};
+  }
+
+  std::vector<ListingEvent> events;
+  tl::expected<void, std::string> parsed;
+  {
+    std::lock_guard listings_lock(state.listings_mutex);
+    // the first snapshot of a market is a baseline, like the first run of listings.py
+    bool emit_events = state.initialized;
+    uint64_t generation = ++state.generation;
+    parsed = parseListings(
+        state.parser, *response, listingSchema(state.market.exchange()), [&](const ParsedListing& listing) {
+          auto it = state.listings.find(listing.pair);
+          if (it == state.listings.end()) {
+            Entry entry{.listing = {state.market,
+                                    std::string{listing.pair},
+                                    std::string{listing.status},
+                                    listing.listing_time_ms,
+                                    listing.metadata},
+                        .seen_generation = generation};
+            if (emit_events) {
+              events.push_back({ListingEvent::Type::Added, entry.listing, {}});
+            }
+            std::string key = entry.listing.pair;
+            state.listings.emplace(std::move(key), std::move(entry));
+            return;
+          }
+          Entry& entry = it->second;
+          entry.seen_generation = generation;
+          entry.listing.listing_time_ms = listing.listing_time_ms;
+          entry.listing.metadata = listing.metadata;
+          if (entry.listing.status != listing.status) {
+            std::string previous_status = std::exchange(entry.listing.status, std::string{listing.status});
+            if (emit_events) {
+              events.push_back({ListingEvent::Type::StatusChanged, entry.listing, std::move(previous_status)});
+            }
+          }
+        });
+    // a truncated or malformed response must not be mistaken for mass delisting
+    if (parsed.has_value()) {
+      for (auto it = state.listings.begin(); it != state.listings.end();) {
+        if (it->second.seen_generation == generation) {
+          ++it;
+          continue;
+        }
+        if (emit_events) {
+          events.push_back({ListingEvent::Type::Removed, std::move(it->second.listing), {}});
+        }
+        it = state.listings.erase(it);
+      }
+      state.initialized = true;
+      state.last_response_hash = response_hash;
+    }
+  }
+
+  if (!events.empty()) {
+    LOG_INFO("{} listing events for {}", events.size(), magic_enum::enum_name(state.market.type()));
+  }
+  for (const auto& event : events) {
+    callback_(event);
+  }
+  PROPAGATE_ERROR(parsed);
+  if (!options_.snapshot_path.empty()) {
+    return persistSnapshot();
+  }
+  return {};
+}
+
+void ListingsWatcher::loadSnapshot() {
+  auto snapshot = UniverseSnapshot::open(options_.snapshot_path);
+  if (!snapshot.has_value()) {
+    LOG_INFO("Starting listings watcher without a baseline: {}", snapshot.error());
+    return;
+  }
+  for (auto& state : markets_) {
+    std::lock_guard lock(state->listings_mutex);
+    for (const auto& record : snapshot->records()) {
+      if (record.market() != state->market) {
+        continue;
+      }
+      std::string pair{record.pair()};
+      state->listings.emplace(std::move(pair), Entry{.listing = UniverseSnapshot::toListing(record)});
+    }
+    // a market missing from the snapshot takes its first poll as the baseline instead of reporting
+    // every pair as added
+    state->initialized = !state->listings.empty();
+  }
+  std::lock_guard lock(snapshot_mutex_);
+  snapshot_ = std::move(*snapshot);
+}
+
+tl::expected<void, std::string> ListingsWatcher::persistSnapshot() {
+  std::lock_guard lock(snapshot_mutex_);
+  auto listings = universe();
+  PROPAGATE_ERROR(UniverseSnapshot::write(options_.snapshot_path, listings, snapshot_ ? &*snapshot_ : nullptr));
+  auto snapshot = UniverseSnapshot::open(options_.snapshot_path);
+  PROPAGATE_ERROR(snapshot);
+  snapshot_ = std::move(*snapshot);
+  return {};
+}
+
+void ListingsWatcher::run(MarketState& state, std::stop_token stop_token) {
+  std::mutex mutex;
+  std::condition_variable_any stop_condition;
+  while (!stop_token.stop_requested()) {
+    auto result = poll(state);
+    if (!result.has_value()) {
+      LOG_ERROR("{}", result.error());
+    }
+    std::unique_lock lock(mutex);
+    stop_condition.wait_for(lock, stop_token, options_.poll_interval, [] { return false; });
+  }
+}
+
+}  // namespace funds_controller
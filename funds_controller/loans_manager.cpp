@@ -1,7 +1,14 @@
 #include "prod/funds_controller/loans_manager.h"
 
+#include "prod/funds_controller/alert_dispatcher.h"
 #include "prod/funds_controller/block_trading.h"
+#include "prod/funds_controller/idempotency_store.h"
+#include "prod/funds_controller/ledger_events.h"
+#include "prod/funds_controller/lease_manager.h"
+#include "prod/funds_controller/ledger_writer.h"
 #include "prod/funds_controller/main_commands.h"
+#include "prod/funds_controller/operation_arena.h"
+#include "prod/funds_controller/row_updates.h"
 #include "prod/transfer/transfer.h"
 
 #include "common/instrument_description/util/market_map.h"
@@ -9,10 +16,11 @@
 #include "util/generator/generate_uuid.h"
 #include "util/lexical_cast/lexical_cast.h"
 #include "util/time/time.h"
-#include "util/slack/slack.h"
 
 #include <magic_enum/magic_enum.hpp>
 
+#include <iterator>
+#include <map>
 #include <set>
 
 namespace funds_controller {
@@ -24,57 +32,12 @@ const std::string kLoansInfoTable = "LOANS_INFO_v2";
 const std::string kDoneLoanStatus = "done";
 // const std::string kPendingLoanStatus = "pending";
 const std::string kRemoveLoanStatus = "removed";
+const AmountTable kBorrowsRows{.name = kBorrowsTable};
+const AmountTable kLoansInfoRows{.name = kLoansInfoTable};
 
 }  // namespace
 
-class BorrowCommand : public ICommand {
-public:
-  BorrowCommand(const std::string& subaccount,
-                infra::Exchange exchange,
-                const std::string& asset,
-                infra::Volume amount):
-      subaccount_(subaccount), exchange_(exchange), asset_(asset), amount_(amount) {
-  }
-
-  tl::expected<void, std::string> execute() override {
-    return transfer::CryptoTransfer({exchange_}).borrow(subaccount_, exchange_, asset_, amount_);
-  }
-
-  tl::expected<void, std::string> undo() override {
-    return transfer::CryptoTransfer({exchange_}).repay(subaccount_, exchange_, asset_, amount_);
-  }
-
-private:
-  std::string subaccount_;
-  infra::Exchange exchange_;
-  std::string asset_;
-  infra::Volume amount_;
-};
-
-class RepayCommand : public ICommand {
-public:
-  RepayCommand(const std::string& subaccount, infra::Exchange exchange, const std::string& asset, infra::Volume amount):
-      subaccount_(subaccount), exchange_(exchange), asset_(asset), amount_(amount) {
-  }
-
-  tl::expected<void, std::string> execute() override {
-    return transfer::CryptoTransfer({exchange_}).repay(subaccount_, exchange_, asset_, amount_);
-  }
-
-  tl::expected<void, std::string> undo() override {
-    return transfer::CryptoTransfer({exchange_}).borrow(subaccount_, exchange_, asset_, amount_);
-  }
-
-private:
-  std::string subaccount_;
-  infra::Exchange exchange_;
-  std::string asset_;
-  infra::Volume amount_;
-};
-
-LoansManager::LoansManager(): clickhouse_client_(getFundsControllerClickhouseClient()) {
-  ASSERT_FATAL(clickhouse_client_, "Failed to create clickhouse client");
-}
+LoansManager::LoansManager() = default;
 
 tl::expected<std::vector<LoansManager::LoanInfo>, std::string> LoansManager::getLoansInfo(const std::string& subaccount,
                                                                                           const std::string& asset) {
@@ -83,7 +46,7 @@ tl::expected<std::vector<LoansManager::LoanInfo>, std::string> LoansManager::get
   std::vector<LoanInfo> loans_info;
   LOG_DEBUG("{}", query);
   try {
-    clickhouse_client_->Select({std::move(query)}, [&loans_info, &subaccount, &asset](const clickhouse::Block& block) {
+    clickhouse_client_.select({std::move(query)}, [&loans_info, &subaccount, &asset](const clickhouse::Block& block) {
       for (size_t i = 0; i < block.GetRowCount(); ++i) {
         LoanInfo loan_info;
         loan_info.subaccount = subaccount;
@@ -111,32 +74,47 @@ tl::expected<std::vector<LoansManager::LoanInfo>, std::string> LoansManager::get
 }
 
 tl::expected<LoansManager::BorrowInfo, std::string> LoansManager::getBorrowInfo(const std::string& loan_id) {
-  std::string query = "SELECT id, subaccount, asset, amount, open_amount_usd, loan_id, status FROM " + kBorrowsTable +
-      " WHERE loan_id = '" + loan_id + "'";
-  BorrowInfo borrow_info;
+  auto borrows_info = getBorrowsInfo({loan_id});
+  PROPAGATE_ERROR(borrows_info);
+  auto it = borrows_info->find(loan_id);
+  return it != borrows_info->end() ? it->second : BorrowInfo{};
+}
+
+tl::expected<std::map<std::string, LoansManager::BorrowInfo>, std::string> LoansManager::getBorrowsInfo(
+    const std::vector<std::string>& loan_ids) {
+  std::map<std::string, BorrowInfo> borrows_info;
+  if (loan_ids.empty()) {
+    return borrows_info;
+  }
+  std::string query = std::format(
+      "SELECT id, subaccount, asset, amount, open_amount_usd, loan_id, status FROM {} WHERE loan_id IN ({})",
+      kBorrowsTable,
+      quotedList(loan_ids));
   LOG_DEBUG("{}", query);
   try {
-    clickhouse_client_->Select({std::move(query)}, [&borrow_info](const clickhouse::Block& block) {
-      ASSERT_FATAL(block.GetRowCount() <= 1, "Expected only one row");
-      if (block.GetRowCount() == 0) {
-        return;
+    clickhouse_client_.select({std::move(query)}, [&borrows_info](const clickhouse::Block& block) {
+      for (size_t i = 0; i < block.GetRowCount(); ++i) {
+        BorrowInfo borrow_info;
+        borrow_info.id = convertUUIDToString(block[0]->As<clickhouse::ColumnUUID>()->At(i));
+        borrow_info.subaccount = std::string{block[1]->As<clickhouse::ColumnString>()->At(i)};
+        borrow_info.asset = std::string{block[2]->As<clickhouse::ColumnString>()->At(i)};
+        borrow_info.amount = convertClickhouseDecimalToDecimal(block[3]->As<clickhouse::ColumnDecimal>()->At(i));
+        borrow_info.open_amount_usd =
+            convertClickhouseDecimalToDecimal(block[4]->As<clickhouse::ColumnDecimal>()->At(i));
+        borrow_info.loan_id = std::string{block[5]->As<clickhouse::ColumnString>()->At(i)};
+        borrow_info.status = std::string{block[6]->As<clickhouse::ColumnString>()->At(i)};
+        auto loan_id = borrow_info.loan_id;
+        ASSERT_FATAL(borrows_info.emplace(std::move(loan_id), std::move(borrow_info)).second,
+                     "Expected only one row");
       }
-      borrow_info.id = convertUUIDToString(block[0]->As<clickhouse::ColumnUUID>()->At(0));
-      borrow_info.subaccount = std::string{block[1]->As<clickhouse::ColumnString>()->At(0)};
-      borrow_info.asset = std::string{block[2]->As<clickhouse::ColumnString>()->At(0)};
-      borrow_info.amount = convertClickhouseDecimalToDecimal(block[3]->As<clickhouse::ColumnDecimal>()->At(0));
-      borrow_info.open_amount_usd = convertClickhouseDecimalToDecimal(block[4]->As<clickhouse::ColumnDecimal>()->At(0));
-      borrow_info.loan_id = std::string{block[5]->As<clickhouse::ColumnString>()->At(0)};
-      borrow_info.status = std::string{block[6]->As<clickhouse::ColumnString>()->At(0)};
     });
   } catch (const std::exception& e) {
     LOG_ERROR("clickhouse error: {}", e.what());
     return tl::make_unexpected(std::string{"Failed to get borrow info. Exception: "} + e.what());
   }
-  return borrow_info;
+  return borrows_info;
 }
 
-
 tl::expected<infra::Volume, std::string> LoansManager::getCurrentLoanAmountOnAccount(const std::string& subaccount,
                                                                                      const std::string& asset) {
   auto loans_info = getLoansInfo(subaccount, asset);
@@ -151,22 +129,57 @@ tl::expected<infra::Volume, std::string> LoansManager::getCurrentLoanAmountOnAcc
 tl::expected<void, std::string> LoansManager::borrow(const std::string& subaccount,
                                                      infra::Exchange exchange,
                                                      const std::string& asset,
-                                                     infra::Volume amount) {
+                                                     infra::Volume amount,
+                                                     const std::string& idempotency_key) {
+  if (!idempotency_key.empty()) {
+    return idempotencyStore().run({{subaccount, asset}},
+                                  idempotency_key,
+                                  std::format("borrow {} {} {} {}",
+                                              subaccount,
+                                              util::lexical_cast<std::string>(exchange),
+                                              asset,
+                                              util::lexical_cast<std::string>(amount)),
+                                  [&] { return executeBorrow(subaccount, exchange, asset, amount); });
+  }
+  return toResult(executeBorrow(subaccount, exchange, asset, amount));
+}
+
+OperationResult LoansManager::executeBorrow(const std::string& subaccount,
+                                            infra::Exchange exchange,
+                                            const std::string& asset,
+                                            infra::Volume amount) {
   ASSERT_FATAL(amount > 0, "Amount should be positive");
+  auto lease = lockKeys({{subaccount, asset}});
+  PROPAGATE_ERROR(lease);
   LOG_INFO("Borrowing {} {} {}", subaccount, asset, amount);
   std::string loan_id = util::generateUuid().substr(0, 30);
   std::unique_ptr<ICommand> borrow_command = std::make_unique<BorrowCommand>(subaccount, exchange, asset, amount);
   auto borrow_result = borrow_command->execute();
   PROPAGATE_ERROR(borrow_result);
 
-  auto process_error = [&](const std::string& error) -> tl::expected<void, std::string> {
+  auto process_error = [&](const OperationError& error) -> OperationResult {
+    // a write that may still land leaves the loan booked, repaying it would leave it unfunded
+    if (error.isUnknownOutcome()) {
+      alertDispatcher().alert("borrow_write_unknown " + subaccount + " " + asset,
+                              std::format("Borrow of {} {} by {} may not be recorded, not repaying: {}",
+                                          util::lexical_cast<std::string>(amount),
+                                          asset,
+                                          subaccount,
+                                          error.message));
+      return tl::make_unexpected(error);
+    }
     LOG_INFO("repaying, because inserting to clickhouse failed");
     auto repay_result = borrow_command->undo();
     if (!repay_result.has_value()) {
-       util::SlackAlerter::FundsAlerter().send("Failed to write to clickhouse and to repay. Repay error: " + repay_result.error());
-      return tl::make_unexpected("Failed to write to clickhouse and to repay. Repay error: " + repay_result.error());
+      alertDispatcher().alert("borrow_undo " + subaccount + " " + asset,
+                              std::format("Failed to record borrow of {} {} by {} and to repay it: {}",
+                                          util::lexical_cast<std::string>(amount),
+                                          asset,
+                                          subaccount,
+                                          repay_result.error()));
+      return unknownOutcome("Failed to write to clickhouse and to repay. Repay error: " + repay_result.error());
     }
-    return tl::make_unexpected(std::string{"Failed to write to clickhouse. Exception: "} + error);
+    return tl::make_unexpected(std::string{"Failed to write to clickhouse. Exception: "} + error.message);
   };
 
   auto result = createNewBorrowRow(subaccount, asset, amount, loan_id, exchange);
@@ -175,79 +188,151 @@ tl::expected<void, std::string> LoansManager::borrow(const std::string& subaccou
   }
   result = createNewLoansRow(subaccount, asset, amount, subaccount, loan_id);
   if (!result.has_value()) {
-    deleteRowByLoanId(kBorrowsTable, loan_id);
-    return process_error(result.error());
+    if (result.error().isUnknownOutcome()) {
+      return process_error(result.error());
+    }
+    auto delete_result = deleteRowByLoanId(kBorrowsTable, loan_id);
+    auto undo_result = process_error(result.error());
+    if (!delete_result.has_value()) {
+      alertDispatcher().alert("borrow_delete " + subaccount + " " + asset,
+                              std::format("Failed to delete borrow row {} of {} {} after failed write: {}",
+                                          loan_id,
+                                          subaccount,
+                                          asset,
+                                          delete_result.error().message));
+      return unknownOutcome("Failed to delete borrow row after failed write: " + delete_result.error().message);
+    }
+    return undo_result;
   }
+  publishLedgerEvent(LedgerEvent::Kind::Loan, subaccount, asset, amount);
   return {};
 }
 
 tl::expected<void, std::string> LoansManager::repay(const std::string& subaccount,
                                                     infra::Exchange exchange,
                                                     const std::string& asset,
-                                                    infra::Volume amount) {
+                                                    infra::Volume amount,
+                                                    const std::string& idempotency_key) {
+  if (!idempotency_key.empty()) {
+    return idempotencyStore().run({{subaccount, asset}},
+                                  idempotency_key,
+                                  std::format("repay {} {} {} {}",
+                                              subaccount,
+                                              util::lexical_cast<std::string>(exchange),
+                                              asset,
+                                              util::lexical_cast<std::string>(amount)),
+                                  [&] { return executeRepay(subaccount, exchange, asset, amount); });
+  }
+  return toResult(executeRepay(subaccount, exchange, asset, amount));
+}
+
+OperationResult LoansManager::executeRepay(const std::string& subaccount,
+                                           infra::Exchange exchange,
+                                           const std::string& asset,
+                                           infra::Volume amount) {
   ASSERT_FATAL(amount > 0, "Amount should be positive");
+  auto lease = lockKeys({{subaccount, asset}});
+  PROPAGATE_ERROR(lease);
   LOG_INFO("Repaying {} {} {} {}", subaccount, exchange, asset, amount);
+  OperationArena arena;
   auto loans_info = getLoansInfo(subaccount, asset);
   PROPAGATE_ERROR(loans_info);
-  infra::Volume total_loan_amount_on_account;
+
+  // split the amount over the loan rows in memory, oldest rows first as before
+  std::pmr::vector<RowUpdate> loan_updates(arena.resource());
+  std::pmr::vector<RowUpdate> loan_restores(arena.resource());
+  // keyed by views of the loaded rows, they outlive the operation
+  std::pmr::map<std::string_view, infra::Volume> repay_by_loan_id(arena.resource());
+  std::vector<std::string> loan_ids;
+  infra::Volume remaining = amount;
   for (const auto& loan_info : *loans_info) {
-    if (loan_info.initial_account != subaccount) {
+    if (loan_info.initial_account != subaccount || remaining == 0) {
       continue;
     }
-    total_loan_amount_on_account += loan_info.amount;
+    infra::Volume repay_amount = util::decimal::min(loan_info.amount, remaining);
+    loan_updates.emplace_back(loan_info.id, loan_info.amount - repay_amount);
+    loan_restores.emplace_back(loan_info.id, loan_info.amount);
+    auto [it, inserted] = repay_by_loan_id.emplace(loan_info.loan_id, infra::Volume{});
+    if (inserted) {
+      loan_ids.push_back(loan_info.loan_id);
+    }
+    it->second += repay_amount;
+    remaining -= repay_amount;
   }
-  EXPECT_WITH_STRING(total_loan_amount_on_account >= amount, "Not enough borrowed amount to repay");
-  for (const auto& loan_info : *loans_info) {
-    if (loan_info.initial_account != subaccount) {
-      continue;
+  EXPECT_WITH_STRING(remaining == 0, "Not enough borrowed amount to repay");
+
+  auto borrows_info = getBorrowsInfo(loan_ids);
+  PROPAGATE_ERROR(borrows_info);
+  std::pmr::vector<RowUpdate> borrow_updates(arena.resource());
+  for (const auto& loan_id : loan_ids) {
+    auto it = borrows_info->find(loan_id);
+    EXPECT_WITH_STRING(it != borrows_info->end(), "Borrow " << loan_id << " not found");
+    const auto& borrow_info = it->second;
+    EXPECT_WITH_STRING(borrow_info.status == kDoneLoanStatus, "Borrow should be done");
+    const auto repay_amount = repay_by_loan_id[loan_id];
+    EXPECT_WITH_STRING(borrow_info.amount >= repay_amount, "Borrow amount should be greater than loan amount");
+    borrow_updates.emplace_back(borrow_info.id, borrow_info.amount - repay_amount);
+  }
+
+  std::unique_ptr<ICommand> repay_command = std::make_unique<RepayCommand>(subaccount, exchange, asset, amount);
+  auto repay_result = repay_command->execute();
+  PROPAGATE_ERROR(repay_result);
+
+  auto process_error = [&](const OperationError& error) -> OperationResult {
+    // a write that may still land books the repay, borrowing again would leave it unfunded
+    if (error.isUnknownOutcome()) {
+      alertDispatcher().alert("repay_write_unknown " + subaccount + " " + asset,
+                              std::format("Repay of {} {} by {} may not be recorded, not borrowing back: {}",
+                                          util::lexical_cast<std::string>(amount),
+                                          asset,
+                                          subaccount,
+                                          error.message));
+      return tl::make_unexpected(error);
     }
-    auto borrow_info = getBorrowInfo(loan_info.loan_id);
-    PROPAGATE_ERROR(borrow_info);
-    EXPECT_WITH_STRING(borrow_info->status == kDoneLoanStatus, "Borrow should be done");
-    EXPECT_WITH_STRING(borrow_info->amount >= loan_info.amount, "Borrow amount should be greater than loan amount");
-    infra::Volume repay_amount = util::decimal::min(loan_info.amount, amount);
-    std::unique_ptr<ICommand> repay_command = std::make_unique<RepayCommand>(subaccount, exchange, asset, repay_amount);
-    auto repay_result = repay_command->execute();
-    PROPAGATE_ERROR(repay_result);
-
-    auto result = [&]() {
-      if (loan_info.amount == repay_amount) {
-        return deleteRowById(kLoansInfoTable, loan_info.id);
-      }
-      return changeAmountInRowById(kLoansInfoTable, loan_info.id, loan_info.amount - repay_amount);
-    }();
-    if (!result.has_value()) {
-      auto borrow_result = repay_command->undo();
-      if (!borrow_result.has_value()) {
-         util::SlackAlerter::FundsAlerter().send("Failed to repay and to write to clickhouse");
-        return tl::make_unexpected("Failed to repay and to write to clickhouse");
-      }
-      return result;
+    auto borrow_result = repay_command->undo();
+    if (!borrow_result.has_value()) {
+      alertDispatcher().alert("repay_undo " + subaccount + " " + asset,
+                              std::format("Failed to record repay of {} {} by {} and to borrow it back: {}",
+                                          util::lexical_cast<std::string>(amount),
+                                          asset,
+                                          subaccount,
+                                          borrow_result.error()));
+      return unknownOutcome("Failed to repay and to write to clickhouse");
     }
-
-    result = [&]() {
-      if (borrow_info->amount == repay_amount) {
-        return deleteRowById(kBorrowsTable, borrow_info->id);
-      }
-      return changeAmountInRowById(kBorrowsTable, borrow_info->id, borrow_info->amount - repay_amount);
-    }();
-
-    if (!result.has_value()) {
-      auto borrow_result = repay_command->undo();
-      if (!borrow_result.has_value()) {
-         util::SlackAlerter::FundsAlerter().send("Failed to repay and to write to clickhouse");
-        return tl::make_unexpected("Failed to repay and to write to clickhouse");
-      }
-      return result;
+    return tl::make_unexpected(error.message);
+  };
+  // fully repaid rows are only marked as removed here, so the loans table can be restored if the
+  // borrows table write fails
+  auto result = updateRows(clickhouse_client_, kLoansInfoRows, loan_updates);
+  if (!result.has_value()) {
+    return process_error(result.error());
+  }
+  result = updateRows(clickhouse_client_, kBorrowsRows, borrow_updates);
+  if (!result.has_value()) {
+    if (result.error().isUnknownOutcome()) {
+      return process_error(result.error());
     }
-
-    amount -= repay_amount;
-    if (amount == 0) {
-      break;
+    auto restore_result = updateRows(clickhouse_client_, kLoansInfoRows, loan_restores);
+    auto undo_result = process_error(result.error());
+    if (!restore_result.has_value()) {
+      alertDispatcher().alert("repay_restore " + subaccount + " " + asset,
+                              std::format("Failed to restore loans of {} {} after failed repay write: {}",
+                                          subaccount,
+                                          asset,
+                                          restore_result.error().message));
+      return unknownOutcome("Failed to restore loans after failed repay write: " + restore_result.error().message);
+    }
+    return undo_result;
+  }
+  // removed rows are already invisible to the managers, a failed cleanup only leaves them behind
+  for (const auto& [table, updates] : {std::pair{&kLoansInfoRows, &loan_updates},
+                                       std::pair{&kBorrowsRows, &borrow_updates}}) {
+    auto delete_result = deleteRemovedRows(clickhouse_client_, *table, *updates);
+    if (!delete_result.has_value()) {
+      LOG_ERROR("{}", delete_result.error().message);
     }
-    // sleep for 1 second to avoid rate limit repayment
-    std::this_thread::sleep_for(1s);
   }
+  publishLedgerEvent(LedgerEvent::Kind::Loan, subaccount, asset, -amount);
   return {};
 }
 
@@ -256,8 +341,40 @@ tl::expected<void, std::string> LoansManager::transfer(const std::string& from_s
                                                        const std::string& to_subaccount,
                                                        infra::Exchange to_subaccount_exchange,
                                                        const std::string& asset,
-                                                       infra::Volume amount) {
+                                                       infra::Volume amount,
+                                                       const std::string& idempotency_key) {
+  if (!idempotency_key.empty()) {
+    return idempotencyStore().run({{from_subaccount, asset}, {to_subaccount, asset}},
+                                  idempotency_key,
+                                  std::format("loan_transfer {} {} {} {} {} {}",
+                                              from_subaccount,
+                                              util::lexical_cast<std::string>(from_subaccount_exchange),
+                                              to_subaccount,
+                                              util::lexical_cast<std::string>(to_subaccount_exchange),
+                                              asset,
+                                              util::lexical_cast<std::string>(amount)),
+                                  [&] {
+                                    return executeTransfer(from_subaccount,
+                                                           from_subaccount_exchange,
+                                                           to_subaccount,
+                                                           to_subaccount_exchange,
+                                                           asset,
+                                                           amount);
+                                  });
+  }
+  return toResult(
+      executeTransfer(from_subaccount, from_subaccount_exchange, to_subaccount, to_subaccount_exchange, asset, amount));
+}
+
+OperationResult LoansManager::executeTransfer(const std::string& from_subaccount,
+                                              infra::Exchange from_subaccount_exchange,
+                                              const std::string& to_subaccount,
+                                              infra::Exchange to_subaccount_exchange,
+                                              const std::string& asset,
+                                              infra::Volume amount) {
   EXPECT_WITH_STRING(amount > 0, "Amount should be positive");
+  auto lease = lockKeys({{from_subaccount, asset}, {to_subaccount, asset}});
+  PROPAGATE_ERROR(lease);
   LOG_INFO("Transferring {} {} {} {} {}",
            from_subaccount,
            from_subaccount_exchange,
@@ -274,89 +391,112 @@ tl::expected<void, std::string> LoansManager::transfer(const std::string& from_s
                                                      transfer_amount);
     }
 
-    std::unique_ptr<ICommand> sell_command = std::make_unique<SendMarketCommand>(
-        from_subaccount,
-        transfer::CryptoTransfer({from_subaccount_exchange}).getSpotInstrumentByAsset(asset, from_subaccount_exchange),
-        -transfer_amount);
-    std::unique_ptr<ICommand> buy_command = std::make_unique<SendMarketCommand>(
-        to_subaccount,
-        transfer::CryptoTransfer({from_subaccount_exchange}).getSpotInstrumentByAsset(asset, to_subaccount_exchange),
-        transfer_amount);
-    std::vector<std::unique_ptr<ICommand>> commands;
-    commands.push_back(std::move(sell_command));
-    commands.push_back(std::move(buy_command));
-    return std::make_unique<MergeCommands>(std::move(commands));
+    transfer::CryptoTransfer crypto_transfer({from_subaccount_exchange});
+    return makeCommand(SequenceCommand(
+        SendMarketCommand(from_subaccount,
+                          crypto_transfer.getSpotInstrumentByAsset(asset, from_subaccount_exchange),
+                          -transfer_amount),
+        SendMarketCommand(
+            to_subaccount, crypto_transfer.getSpotInstrumentByAsset(asset, to_subaccount_exchange), transfer_amount)));
   };
+  OperationArena arena;
   auto loans_info = getLoansInfo(from_subaccount, asset);
   PROPAGATE_ERROR(loans_info);
-  infra::Volume total_loan_amount_on_account;
+
+  // split the movement over the loan rows in memory, the funds move in one go
+  std::pmr::vector<RowUpdate> loan_updates(arena.resource());
+  std::pmr::vector<RowUpdate> loan_restores(arena.resource());
+  std::vector<LoanInfo> new_loans;
+  infra::Volume remaining = amount;
   for (const auto& loan_info : *loans_info) {
-    total_loan_amount_on_account += loan_info.amount;
+    if (remaining == 0) {
+      break;
+    }
+    infra::Volume transfer_amount = util::decimal::min(loan_info.amount, remaining);
+    loan_updates.emplace_back(loan_info.id, loan_info.amount - transfer_amount);
+    loan_restores.emplace_back(loan_info.id, loan_info.amount);
+    LoanInfo new_loan = loan_info;
+    new_loan.subaccount = to_subaccount;
+    new_loan.amount = transfer_amount;
+    // the transferred part is a plain loan of the receiver, whatever the source row was
+    new_loan.type = LoanType::Normal;
+    new_loans.push_back(std::move(new_loan));
+    remaining -= transfer_amount;
   }
-  EXPECT_WITH_STRING(total_loan_amount_on_account >= amount, "Not enough borrowed amount to repay");
-  for (const auto& loan_info : *loans_info) {
-    infra::Volume transfer_amount = util::decimal::min(loan_info.amount, amount);
-    std::unique_ptr<ICommand> transfer_command = make_transfer_command(transfer_amount);
-    auto repay_result = transfer_command->execute();
-    PROPAGATE_ERROR(repay_result);
-
-    auto result = [&]() {
-      if (loan_info.amount == transfer_amount) {
-        return deleteRowById(kLoansInfoTable, loan_info.id);
-      }
-      return changeAmountInRowById(kLoansInfoTable, loan_info.id, loan_info.amount - transfer_amount);
-    }();
-    if (!result.has_value()) {
-      auto transfer_result = transfer_command->undo();
-      if (!transfer_result.has_value()) {
-        util::SlackAlerter::FundsAlerter().send("Failed to transfer and to write to clickhouse");
-        return tl::make_unexpected("Failed to transfer and to write to clickhouse");
-      }
-      return result;
+  EXPECT_WITH_STRING(remaining == 0, "Not enough borrowed amount to repay");
+
+  std::unique_ptr<ICommand> transfer_command = make_transfer_command(amount);
+  auto transfer_result = transfer_command->execute();
+  PROPAGATE_ERROR(transfer_result);
+
+  auto process_error = [&](const OperationError& error) -> OperationResult {
+    // a write that may still land moves the loan, moving the funds back would leave it unfunded
+    if (error.isUnknownOutcome()) {
+      alertDispatcher().alert("loan_transfer_write_unknown " + from_subaccount + " " + asset,
+                              std::format("Loan transfer of {} {} from {} to {} may not be recorded, not undoing: {}",
+                                          util::lexical_cast<std::string>(amount),
+                                          asset,
+                                          from_subaccount,
+                                          to_subaccount,
+                                          error.message));
+      return tl::make_unexpected(error);
     }
-
-    result = createNewLoansRow(to_subaccount, asset, transfer_amount, loan_info.initial_account, loan_info.loan_id);
-
-    if (!result.has_value()) {
-      auto transfer_result = transfer_command->undo();
-      if (!transfer_result.has_value()) {
-         util::SlackAlerter::FundsAlerter().send("Failed to transfer and to write to clickhouse");
-        return tl::make_unexpected("Failed to transfer and to write to clickhouse");
-      }
-      return result;
+    auto undo_result = transfer_command->undo();
+    if (!undo_result.has_value()) {
+      alertDispatcher().alert("loan_transfer_undo " + from_subaccount + " " + asset,
+                              std::format("Failed to record loan transfer of {} {} from {} to {} and to undo it: {}",
+                                          util::lexical_cast<std::string>(amount),
+                                          asset,
+                                          from_subaccount,
+                                          to_subaccount,
+                                          undo_result.error()));
+      return unknownOutcome("Failed to transfer and to write to clickhouse");
     }
-
-    amount -= transfer_amount;
-    if (amount == 0) {
-      break;
+    return tl::make_unexpected(error.message);
+  };
+  auto result = updateRows(clickhouse_client_, kLoansInfoRows, loan_updates);
+  if (!result.has_value()) {
+    return process_error(result.error());
+  }
+  result = createNewLoansRows(new_loans);
+  if (!result.has_value()) {
+    if (result.error().isUnknownOutcome()) {
+      return process_error(result.error());
+    }
+    auto restore_result = updateRows(clickhouse_client_, kLoansInfoRows, loan_restores);
+    auto undo_result = process_error(result.error());
+    if (!restore_result.has_value()) {
+      alertDispatcher().alert("loan_transfer_restore " + from_subaccount + " " + asset,
+                              std::format("Failed to restore loans of {} {} after failed transfer write: {}",
+                                          from_subaccount,
+                                          asset,
+                                          restore_result.error().message));
+      return unknownOutcome("Failed to restore loans after failed transfer write: " +
+                            restore_result.error().message);
     }
+    return undo_result;
   }
+  auto delete_result = deleteRemovedRows(clickhouse_client_, kLoansInfoRows, loan_updates);
+  if (!delete_result.has_value()) {
+    LOG_ERROR("{}", delete_result.error().message);
+  }
+  publishLedgerEvent(LedgerEvent::Kind::Loan, from_subaccount, asset, -amount);
+  publishLedgerEvent(LedgerEvent::Kind::Loan, to_subaccount, asset, amount);
   return {};
 }
 
-tl::expected<void, std::string> LoansManager::deleteRowByLoanId(const std::string& table_name, const std::string& loan_id) {
+OperationResult LoansManager::deleteRowByLoanId(const std::string& table_name, const std::string& loan_id) {
   std::string query =
-      std::format("ALTER TABLE {} UPDATE status = '{}' WHERE loan_id = '{}'", table_name, kRemoveLoanStatus, id);
+      std::format("ALTER TABLE {} UPDATE status = '{}' WHERE loan_id = '{}'", table_name, kRemoveLoanStatus, loan_id);
   LOG_DEBUG("{}", query);
   try {
-    clickhouse_client_->Execute({std::move(query)});
-    query = std::format("ALTER TABLE {} DELETE WHERE loan_id = '{}'", table_name, id);
+    clickhouse_client_.execute({std::move(query)});
+    query = std::format("ALTER TABLE {} DELETE WHERE loan_id = '{}'", table_name, loan_id);
     LOG_DEBUG("{}", query);
-    clickhouse_client_->Execute({std::move(query)});
-  } catch (const std::exception& e) {
+    clickhouse_client_.execute({std::move(query)});
+  } catch (const ClickhouseUnknownOutcome& e) {
     LOG_ERROR("clickhouse error: {}", e.what());
-    return tl::make_unexpected(std::string{"Failed to delete row. Exception: "} + e.what());
-  }
-  return {};
-}
-
-tl::expected<void, std::string> LoansManager::deleteRowById(const std::string& table_name, const std::string& id) {
-  std::string query =
-      std::format("ALTER TABLE {} UPDATE status = '{}' WHERE id = '{}'", table_name, kRemoveLoanStatus, id);
-  try {
-    clickhouse_client_->Execute({std::move(query)});
-    query = std::format("ALTER TABLE {} DELETE WHERE id = '{}'", table_name, id);
-    clickhouse_client_->Execute({std::move(query)});
+    return unknownOutcome(std::string{"Failed to delete row. Exception: "} + e.what());
   } catch (const std::exception& e) {
     LOG_ERROR("clickhouse error: {}", e.what());
     return tl::make_unexpected(std::string{"Failed to delete row. Exception: "} + e.what());
@@ -364,70 +504,71 @@ tl::expected<void, std::string> LoansManager::deleteRowById(const std::string& t
   return {};
 }
 
-tl::expected<void, std::string> LoansManager::changeAmountInRowById(const std::string& table_name,
-                                                                    const std::string& id,
-                                                                    infra::Volume new_amount) {
-  std::string query = std::format("ALTER TABLE {} UPDATE amount = '{}' WHERE id = '{}'",
-                                  table_name,
-                                  util::lexical_cast<std::string>(new_amount),
-                                  id);
-  try {
-    clickhouse_client_->Execute({std::move(query)});
-  } catch (const std::exception& e) {
-    LOG_ERROR("clickhouse error: {}", e.what());
-    return tl::make_unexpected(std::string{"Failed to change amount in row. Exception: "} + e.what());
+OperationResult LoansManager::createNewBorrowRow(const std::string& subaccount,
+                                                const std::string& asset,
+                                                infra::Volume amount,
+                                                const std::string& loan_id,
+                                                infra::Exchange exchange) {
+  infra::Volume amount_usd = amount * transfer::CryptoTransfer({exchange}).getLastPrice(asset, exchange);
+  auto result = ledgerWriter()
+                    .insert(kBorrowsTable,
+                            "(open_timestamp, subaccount, asset, amount, open_amount_usd, loan_id, status)",
+                            std::format("('{}', '{}', '{}', '{}', '{}', '{}', '{}')",
+                                        static_cast<int64_t>(nowSystem()) / 1'000'000,
+                                        subaccount,
+                                        asset,
+                                        util::lexical_cast<std::string>(amount),
+                                        util::lexical_cast<std::string>(amount_usd),
+                                        loan_id,
+                                        kDoneLoanStatus))
+                    .get();
+  if (!result.has_value()) {
+    return withContext("Failed to create new borrow row. ", result.error());
   }
   return {};
 }
 
-tl::expected<void, std::string> LoansManager::createNewBorrowRow(const std::string& subaccount,
-                                                                 const std::string& asset,
-                                                                 infra::Volume amount,
-                                                                 const std::string& loan_id,
-                                                                 infra::Exchange exchange) {
-  infra::Volume amount_usd = amount * transfer::CryptoTransfer({exchange}).getLastPrice(asset, exchange);
-  std::string query = std::format(
-      "INSERT INTO {} (open_timestamp, subaccount, asset, amount, open_amount_usd, loan_id, status) VALUES ('{}', "
-      "'{}', '{}', '{}', '{}', '{}', '{}')",
-      kBorrowsTable,
-      static_cast<int64_t>(nowSystem()) / 1'000'000,
-      subaccount,
-      asset,
-      util::lexical_cast<std::string>(amount),
-      util::lexical_cast<std::string>(amount_usd),
-      loan_id,
-      kDoneLoanStatus);
-  try {
-    clickhouse_client_->Execute({std::move(query)});
-  } catch (const std::exception& e) {
-    LOG_ERROR("clickhouse error: {}", e.what());
-    return tl::make_unexpected(std::string{"Failed to create new borrow row. Exception: "} + e.what());
-  }
-  return {};
+OperationResult LoansManager::createNewLoansRow(const std::string& subaccount,
+                                               const std::string& asset,
+                                               infra::Volume amount,
+                                               const std::string& initial_subaccount,
+                                               const std::string& loan_id) {
+  LoanInfo loan_info;
+  loan_info.subaccount = subaccount;
+  loan_info.asset = asset;
+  loan_info.amount = amount;
+  loan_info.initial_account = initial_subaccount;
+  loan_info.loan_id = loan_id;
+  loan_info.type = LoanType::Normal;
+  return createNewLoansRows({loan_info});
 }
 
-tl::expected<void, std::string> LoansManager::createNewLoansRow(const std::string& subaccount,
-                                                                const std::string& asset,
-                                                                infra::Volume amount,
-                                                                const std::string& initial_subaccount,
-                                                                const std::string& loan_id) {
-  std::string query = std::format(
-      "INSERT INTO {} (timestamp, subaccount, asset, amount, initial_subaccount, type, loan_id, status) VALUES "
-      "('{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}')",
-      kLoansInfoTable,
-      static_cast<int64_t>(nowSystem()) / 1'000'000,
-      subaccount,
-      asset,
-      util::lexical_cast<std::string>(amount),
-      initial_subaccount,
-      magic_enum::enum_name(LoanType::Normal),
-      loan_id,
-      kDoneLoanStatus);
-  try {
-    clickhouse_client_->Execute({std::move(query)});
-  } catch (const std::exception& e) {
-    LOG_ERROR("clickhouse error: {}", e.what());
-    return tl::make_unexpected(std::string{"Failed to create new loans row. Exception: "} + e.what());
+OperationResult LoansManager::createNewLoansRows(const std::vector<LoanInfo>& loans_info) {
+  if (loans_info.empty()) {
+    return {};
+  }
+  const auto timestamp = static_cast<int64_t>(nowSystem()) / 1'000'000;
+  std::string values;
+  for (const auto& loan_info : loans_info) {
+    values += std::format("{}('{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}')",
+                          values.empty() ? "" : ", ",
+                          timestamp,
+                          loan_info.subaccount,
+                          loan_info.asset,
+                          util::lexical_cast<std::string>(loan_info.amount),
+                          loan_info.initial_account,
+                          magic_enum::enum_name(loan_info.type),
+                          loan_info.loan_id,
+                          kDoneLoanStatus);
+  }
+  auto result = ledgerWriter()
+                    .insert(kLoansInfoTable,
+                            "(timestamp, subaccount, asset, amount, initial_subaccount, type, loan_id, status)",
+                            std::move(values),
+                            loans_info.size())
+                    .get();
+  if (!result.has_value()) {
+    return withContext("Failed to create new loans row. ", result.error());
   }
   return {};
 }
@@ -1,6 +1,18 @@
+#include "prod/funds_controller/batch_runner.h"
+#include "prod/funds_controller/binance_state_source.h"
 #include "prod/funds_controller/block_trading.h"
+#include "prod/funds_controller/blocklist_bitmap_publisher.h"
+#include "prod/funds_controller/blocklist_feed.h"
+#include "prod/funds_controller/exposure_engine.h"
+#include "prod/funds_controller/hedge_manager.h"
+#include "prod/funds_controller/lease_manager.h"
+#include "prod/funds_controller/limits_engine.h"
+#include "prod/funds_controller/ledger_replay.h"
+#include "prod/funds_controller/listings_watcher.h"
 #include "prod/funds_controller/loans_manager.h"
+#include "prod/funds_controller/reconciliation.h"
 #include "prod/funds_controller/transaction_manager.h"
+#include "prod/funds_controller/universe_snapshot.h"
 #include "prod/transfer/transfer.h"
 
 #include "common/instrument/instruments_controller.h"
@@ -9,32 +21,335 @@
 #include "util/lexical_cast/lexical_cast.h"
 #include "util/log/log.h"
 
+#include <boost/program_options.hpp>
+#include <magic_enum/magic_enum.hpp>
+
+#include <chrono>
+#include <csignal>
+#include <ctime>
 #include <map>
+#include <memory>
+#include <optional>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 namespace po = boost::program_options;
 
-struct CommandLineArgs {};
+struct CommandLineArgs {
+  // binary universe written by the listings watcher, mapped at startup
+  std::string universe_snapshot_path;
+  // runs the commands of the file instead of the test sequence when set
+  std::string commands_path;
+  size_t parallelism = funds_controller::BatchRunner::Options{}.parallelism;
+  // polls the exchanges and keeps the universe snapshot up to date
+  bool watch_listings = false;
+  // shared memory segment the blocklist bitmap is published to, needs the universe snapshot
+  std::string blocklist_bitmap_path;
+  // unix socket the blocklist change feed is served on
+  std::string blocklist_feed_path;
+  // how often the served blocklist picks up the rules changed by other processes
+  int64_t blocklist_poll_ms = 250;
+  // name of this instance among those sharing the ledger, keys are sharded over the live ones when set
+  std::string instance;
+  // keeps the net exposure in memory from the ledger events and logs it after the batch
+  bool exposure = false;
+  // checks the batch commands against LIMITS_v1 before running them, keeps the exposure too
+  bool limits = false;
+  // copies the ledger events into LEDGER_EVENTS_v1, every run that mutates the ledger needs it for the
+  // replay and the reports to be complete
+  bool journal = false;
+  // local snapshot of the journal replay, seeds the exposure instead of the ledger scans when set
+  std::string ledger_snapshot_path;
+  // compares the ledger with the binance accounts that have read keys, reports and exits
+  bool reconcile = false;
+
+  bool journaling() const {
+    return journal || !ledger_snapshot_path.empty();
+  }
+  bool keepsExposure() const {
+    return exposure || limits || !ledger_snapshot_path.empty();
+  }
+
+  // services run until SIGINT or SIGTERM when there are no commands
+  bool serving() const {
+    return commands_path.empty() && (watch_listings || !blocklist_bitmap_path.empty() || !blocklist_feed_path.empty());
+  }
+};
 
 CommandLineArgs parseArgs(int argc, char* argv[]) {
   CommandLineArgs result;
 
-  util::argparse::ArgumentParser("Test").addLogLevelOption().parse(argc, argv);
+  po::options_description options("Funds controller");
+  options.add_options()(
+      "universe-snapshot", po::value(&result.universe_snapshot_path), "Instrument universe snapshot to map")(
+      "commands", po::value(&result.commands_path), "JSONL or CSV file of commands to run")(
+      "parallelism", po::value(&result.parallelism), "Commands run at once, commands on one key run in order")(
+      "watch-listings", po::bool_switch(&result.watch_listings), "Poll listings into the universe snapshot")(
+      "blocklist-bitmap", po::value(&result.blocklist_bitmap_path), "Shared memory path to publish the blocklist to")(
+      "blocklist-feed", po::value(&result.blocklist_feed_path), "Unix socket to serve blocklist changes on")(
+      "blocklist-poll-ms", po::value(&result.blocklist_poll_ms), "Interval of reading rule changes made elsewhere")(
+      "instance", po::value(&result.instance), "Instance name, shards the keys with the other live instances")(
+      "exposure", po::bool_switch(&result.exposure), "Keep the net exposure in memory, logged after the batch")(
+      "limits", po::bool_switch(&result.limits), "Check borrows, hedges and transfers of the batch against the limits")(
+      "journal", po::bool_switch(&result.journal), "Journal the ledger events into LEDGER_EVENTS_v1")(
+      "ledger-snapshot", po::value(&result.ledger_snapshot_path), "Ledger replay snapshot to warm start the exposure")(
+      "reconcile", po::bool_switch(&result.reconcile), "Reconcile the ledger with the binance accounts and exit");
+  auto parsed = po::command_line_parser(argc, argv).options(options).allow_unregistered().run();
+  po::variables_map variables;
+  po::store(parsed, variables);
+  po::notify(variables);
+
+  // the rest is the common options
+  auto rest = po::collect_unrecognized(parsed.options, po::include_positional);
+  std::vector<char*> rest_argv{argv[0]};
+  for (auto& arg : rest) {
+    rest_argv.push_back(arg.data());
+  }
+  util::argparse::ArgumentParser("Test").addLogLevelOption().parse(static_cast<int>(rest_argv.size()),
+                                                                   rest_argv.data());
 
   return result;
 }
 
+int runBatch(const CommandLineArgs& args, funds_controller::BatchRunner::Managers managers) {
+  auto commands = funds_controller::parseBatchFile(args.commands_path);
+  if (!commands.has_value()) {
+    LOG_CRIT("{}", commands.error());
+    return 1;
+  }
+  funds_controller::BatchRunner runner({.parallelism = args.parallelism}, managers);
+  auto summary = runner.run(*commands, [](const funds_controller::BatchRunner::Result& result) {
+    if (result.result.has_value()) {
+      LOG_CRIT("line {} {} done in {} us",
+               result.command.line,
+               magic_enum::enum_name(result.command.type),
+               result.latency.count());
+    } else {
+      LOG_CRIT("line {} {} failed in {} us: {}",
+               result.command.line,
+               magic_enum::enum_name(result.command.type),
+               result.latency.count(),
+               result.result.error());
+    }
+  });
+  LOG_CRIT("{} commands, {} failed in {} ms, {:.1f} commands/s, latency p50 {} us p99 {} us max {} us",
+           summary.commands,
+           summary.failed,
+           summary.elapsed.count() / 1'000,
+           summary.commandsPerSecond(),
+           summary.p50.count(),
+           summary.p99.count(),
+           summary.max.count());
+  return summary.failed == 0 ? 0 : 1;
+}
+
+int reconcile() {
+  auto api_keys = funds_controller::environmentApiKeys();
+  std::vector<funds_controller::ReconciliationAccount> accounts;
+  for (const auto& [subaccount, creds] : connector::datahub::getBinanceCreds()) {
+    if (api_keys(subaccount).has_value()) {
+      accounts.push_back({subaccount, infra::Exchange::Binance});
+    }
+  }
+  LOG_CRIT("Reconciling {} binance accounts with read keys", accounts.size());
+  funds_controller::Reconciler reconciler(
+      std::make_shared<funds_controller::BinanceStateSource>(funds_controller::BinanceStateSource::Options{},
+                                                             std::move(api_keys)),
+      {.requests_per_account = funds_controller::BinanceStateSource::kRequestsPerFetch,
+       .rate_budgets = {{infra::Exchange::Binance, {.requests_per_second = 10, .burst = 20}}}});
+  auto report = reconciler.reconcile(accounts);
+  if (!report.has_value()) {
+    LOG_CRIT("{}", report.error());
+    return 1;
+  }
+  for (const auto& diff : report->diffs) {
+    LOG_CRIT("{} {} {} {}: ledger {} exchange {}",
+             magic_enum::enum_name(diff.kind),
+             diff.account.subaccount,
+             diff.account.exchange,
+             diff.symbol,
+             diff.ledger_amount,
+             diff.exchange_amount);
+  }
+  for (const auto& [account, error] : report->failed_accounts) {
+    LOG_CRIT("Failed to reconcile {} {}: {}", account.first, account.second, error);
+  }
+  return report->diffs.empty() && report->failed_accounts.empty() ? 0 : 1;
+}
+
+void logExposure(const funds_controller::ExposureEngine& exposure_engine) {
+  auto snapshot = exposure_engine.snapshot();
+  std::map<std::string, funds_controller::Exposure> by_asset(snapshot.by_asset.begin(), snapshot.by_asset.end());
+  for (const auto& [asset, exposure] : by_asset) {
+    LOG_CRIT("Exposure {}: loans {} hedges {} net {}", asset, exposure.loans, exposure.hedges, exposure.net());
+  }
+}
+
+int serve(const CommandLineArgs& args, const sigset_t& signals, funds_controller::TradingBlocker& trading_blocker) {
+  std::optional<funds_controller::ListingsWatcher> listings_watcher;
+  if (args.watch_listings) {
+    if (args.universe_snapshot_path.empty()) {
+      LOG_CRIT("--watch-listings needs --universe-snapshot");
+      return 1;
+    }
+    listings_watcher.emplace(funds_controller::ListingsWatcher::Options{.snapshot_path = args.universe_snapshot_path},
+                             [](const funds_controller::ListingEvent& event) {
+                               LOG_INFO("Listing {} {} {}",
+                                        magic_enum::enum_name(event.type),
+                                        event.listing.market,
+                                        event.listing.pair);
+                             });
+    listings_watcher->start();
+  }
+
+  std::optional<funds_controller::BlocklistBitmapPublisher> bitmap_publisher;
+  if (!args.blocklist_bitmap_path.empty()) {
+    bitmap_publisher.emplace(trading_blocker,
+                             funds_controller::BlocklistBitmapPublisher::Options{
+                                 .segment_path = args.blocklist_bitmap_path,
+                                 .universe_path = args.universe_snapshot_path,
+                             });
+    if (auto started = bitmap_publisher->start(); !started.has_value()) {
+      LOG_CRIT("Failed to start blocklist bitmap publisher: {}", started.error());
+      return 1;
+    }
+  }
+
+  std::optional<funds_controller::BlocklistFeedServer> feed_server;
+  if (!args.blocklist_feed_path.empty()) {
+    feed_server.emplace(trading_blocker, args.blocklist_feed_path);
+    if (auto started = feed_server->start(); !started.has_value()) {
+      LOG_CRIT("Failed to start blocklist feed: {}", started.error());
+      return 1;
+    }
+  }
+
+  LOG_CRIT("Serving until SIGINT or SIGTERM");
+  // this process changes no rules itself, the bitmap and the feed get the changes of the others from the
+  // table
+  const bool serving_blocklist = bitmap_publisher.has_value() || feed_server.has_value();
+  const timespec poll_interval{.tv_sec = args.blocklist_poll_ms / 1'000,
+                               .tv_nsec = args.blocklist_poll_ms % 1'000 * 1'000'000};
+  // the watcher rewrites the snapshot after its events, the publisher picks it up here
+  const auto universe_refresh_interval = std::chrono::seconds(5);
+  auto next_universe_refresh = std::chrono::steady_clock::now() + universe_refresh_interval;
+  while (::sigtimedwait(&signals, nullptr, &poll_interval) < 0) {
+    if (serving_blocklist) {
+      if (auto refreshed = trading_blocker.refreshBlockRules(); !refreshed.has_value()) {
+        LOG_ERROR("Failed to refresh block rules: {}", refreshed.error());
+      }
+    }
+    if (bitmap_publisher.has_value() && std::chrono::steady_clock::now() >= next_universe_refresh) {
+      next_universe_refresh += universe_refresh_interval;
+      if (auto refreshed = bitmap_publisher->refreshUniverse(); !refreshed.has_value()) {
+        LOG_ERROR("Failed to refresh blocklist bitmap universe: {}", refreshed.error());
+      }
+    }
+  }
+  LOG_CRIT("Stopping");
+  return 0;
+}
+
 int main(int argc, char** argv) {
   quill::setupGlobal("global2", quill::LogLevel::Info);
   util::signal_handler::initDefault();
 
-  parseArgs(argc, argv);
+  auto args = parseArgs(argc, argv);
+  if (!args.universe_snapshot_path.empty()) {
+    // without it instruments are fetched from the exchanges when needed
+    if (auto loaded = funds_controller::loadUniverseSnapshot(args.universe_snapshot_path); !loaded.has_value()) {
+      LOG_ERROR("Starting without a universe snapshot: {}", loaded.error());
+    }
+  }
+  // blocked before any thread starts so that only serve() receives them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  if (args.serving()) {
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  }
 
+  // subscribed before the managers exist so that every ledger change they publish is journaled
+  std::optional<funds_controller::LedgerJournal> ledger_journal;
+  if (args.journaling()) {
+    ledger_journal.emplace();
+  }
+  std::optional<funds_controller::LedgerReplay> ledger_replay;
+  if (!args.ledger_snapshot_path.empty()) {
+    funds_controller::LedgerReplay::Options replay_options;
+    replay_options.snapshot_path = args.ledger_snapshot_path;
+    ledger_replay.emplace(replay_options);
+  }
+  std::optional<funds_controller::ExposureEngine> exposure_engine;
+  std::optional<funds_controller::LimitsEngine> limits_engine;
+  if (args.keepsExposure()) {
+    exposure_engine.emplace();
+  }
+  if (args.limits) {
+    limits_engine.emplace(*exposure_engine);
+  }
   funds_controller::TradingBlocker trading_blocker;
   funds_controller::LoansManager loans_manager;
+  funds_controller::HedgeManager hedge_manager;
   funds_controller::TransactionManager transaction_manager;
+  // the managers connect concurrently, wait for all of them once
+  if (!funds_controller::waitForClickhouseConnections()) {
+    LOG_CRIT("Failed to connect to ClickHouse");
+    return 1;
+  }
+  if (ledger_journal.has_value()) {
+    if (auto bootstrapped = funds_controller::LedgerJournal::bootstrap(); !bootstrapped.has_value()) {
+      LOG_CRIT("Failed to bootstrap ledger journal: {}", bootstrapped.error());
+      return 1;
+    }
+  }
+  if (ledger_replay.has_value()) {
+    // the snapshot and the rows written since instead of scanning the whole ledger
+    auto state = ledger_replay->warmStart();
+    if (!state.has_value()) {
+      LOG_CRIT("Failed to replay the ledger journal: {}", state.error());
+      return 1;
+    }
+    exposure_engine->restore(state->toExposure());
+  } else if (exposure_engine.has_value()) {
+    if (auto loaded = exposure_engine->load(); !loaded.has_value()) {
+      LOG_CRIT("Failed to load exposure: {}", loaded.error());
+      return 1;
+    }
+  }
+  if (limits_engine.has_value()) {
+    if (auto loaded = limits_engine->load(); !loaded.has_value()) {
+      LOG_CRIT("Failed to load limits: {}", loaded.error());
+      return 1;
+    }
+  }
+  std::optional<funds_controller::LeaseManager> lease_manager;
+  if (!args.instance.empty()) {
+    funds_controller::LeaseManager::Options lease_options{.instance = args.instance};
+    lease_manager.emplace(lease_options, std::make_shared<funds_controller::ClickhouseLeaseStore>());
+    // an instance serves nothing until it held its shards for one renewal
+    if (!lease_manager->waitUntilServing(3 * lease_options.renew_interval)) {
+      LOG_CRIT("Instance {} got no shards", args.instance);
+      return 1;
+    }
+    funds_controller::setLeaseManager(&*lease_manager);
+  }
+  if (args.reconcile) {
+    return reconcile();
+  }
+  if (!args.commands_path.empty()) {
+    const funds_controller::LimitsEngine* limits = limits_engine.has_value() ? &*limits_engine : nullptr;
+    auto status = runBatch(args, {loans_manager, hedge_manager, transaction_manager, trading_blocker, limits});
+    if (exposure_engine.has_value()) {
+      logExposure(*exposure_engine);
+    }
+    return status;
+  }
+  if (args.serving()) {
+    return serve(args, signals, trading_blocker);
+  }
   auto result = loans_manager.borrow("sm_hft02_virtual", infra::Exchange::Binance, "BTC", 4.5);
   if (result.has_value()) {
     LOG_CRIT("Borrow was successful");
@@ -107,13 +422,13 @@ int main(int argc, char** argv) {
   }
   trading_blocker.addBlockRule("sm_hft02_virtual", infra::Market{infra::Market::BinanceFutures}, "BTCUSDT", "pair");
   trading_blocker.removeBlockRule("sm_hft03_virtual", infra::Market{infra::Market::BinanceSpots}, "BTC", "asset");
-  auto result = trading_blocker.isTradingBlocked(
+  auto blocked = trading_blocker.isTradingBlocked(
       "sm_hft02_virtual",
       {infra::InstrumentDescriptionFactory::get().create(infra::Market{infra::Market::BinanceFutures}, "BTCUSDT")});
-  if (result) {
+  if (blocked) {
     LOG_CRIT("Trading is not blocked");
   } else {
-    LOG_CRIT("{}", result.error());
+    LOG_CRIT("{}", blocked.error());
   }
   LOG_CRIT("Test finished");
   return 0;
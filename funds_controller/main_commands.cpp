@@ -4,7 +4,6 @@
 
 #include "util/assert/assert.h"
 #include "util/error/error.h"
-#include "util/slack/slack.h"
 
 
 namespace funds_controller {
@@ -12,7 +11,7 @@ namespace funds_controller {
 MergeCommands::MergeCommands(std::vector<std::unique_ptr<ICommand>> commands): commands_(std::move(commands)) {
 }
 
-tl::expected<void, std::string> MergeCommands::execute() {
+OperationResult MergeCommands::execute() {
   for (auto& command : commands_) {
     auto result = command->execute();
     EXPECT_WITH_STRING(result.has_value(), "Failed to execute command");
@@ -22,13 +21,13 @@ tl::expected<void, std::string> MergeCommands::execute() {
 }
 
 tl::expected<void, std::string> MergeCommands::undo() {
-  for (size_t i = executed_commands_count_; i >= 0; --i) {
+  while (executed_commands_count_ > 0) {
+    size_t i = executed_commands_count_ - 1;
     auto result = commands_[i]->undo();
     if (!result.has_value()) {
-      util::SlackAlerter::FundsAlerter().send("Failed to undo command, command index: " + std::to_string(i));
+      alertDispatcher().alert("command_undo", "Failed to undo command, command index: " + std::to_string(i));
       EXPECT_WITH_STRING(false, "Failed to undo command");
     }
-    ASSERT_FATAL(executed_commands_count_ > 0, "executed_commands_count_ should be always positive");
     --executed_commands_count_;
   }
   return {};
@@ -40,12 +39,12 @@ SendMarketCommand::SendMarketCommand(const std::string& subaccount,
     subaccount_(subaccount), instrument_description_(instrument_description), amount_(amount) {
 }
 
-tl::expected<void, std::string> SendMarketCommand::execute() {
-  return transfer::CryptoTransfer({instrument_description_.value.market.exchange()})
-      .sendMarket(subaccount_,
-                  instrument_description_,
-                  amount_ > 0 ? infra::Side::Bid : infra::Side::Ask,
-                  util::decimal::abs(amount_));
+OperationResult SendMarketCommand::execute() {
+  return fromResult(transfer::CryptoTransfer({instrument_description_.value.market.exchange()})
+                        .sendMarket(subaccount_,
+                                    instrument_description_,
+                                    amount_ > 0 ? infra::Side::Bid : infra::Side::Ask,
+                                    util::decimal::abs(amount_)));
 }
 tl::expected<void, std::string> SendMarketCommand::undo() {
   return transfer::CryptoTransfer({instrument_description_.value.market.exchange()})
@@ -69,9 +68,9 @@ TransferCryptoCommand::TransferCryptoCommand(const std::string& from_subaccount,
     amount_(amount) {
 }
 
-tl::expected<void, std::string> TransferCryptoCommand::execute() {
-  return transfer::CryptoTransfer({from_wallet_.exchange()})
-      .transfer(from_subaccount_, from_wallet_, to_subaccount_, to_wallet_, asset_, amount_);
+OperationResult TransferCryptoCommand::execute() {
+  return fromResult(transfer::CryptoTransfer({from_wallet_.exchange()})
+                        .transfer(from_subaccount_, from_wallet_, to_subaccount_, to_wallet_, asset_, amount_));
 }
 
 tl::expected<void, std::string> TransferCryptoCommand::undo() {
@@ -79,4 +78,34 @@ tl::expected<void, std::string> TransferCryptoCommand::undo() {
       .transfer(to_subaccount_, to_wallet_, from_subaccount_, from_wallet_, asset_, amount_);
 }
 
+BorrowCommand::BorrowCommand(const std::string& subaccount,
+                             infra::Exchange exchange,
+                             const std::string& asset,
+                             infra::Volume amount):
+    subaccount_(subaccount), exchange_(exchange), asset_(asset), amount_(amount) {
+}
+
+OperationResult BorrowCommand::execute() {
+  return fromResult(transfer::CryptoTransfer({exchange_}).borrow(subaccount_, exchange_, asset_, amount_));
+}
+
+tl::expected<void, std::string> BorrowCommand::undo() {
+  return transfer::CryptoTransfer({exchange_}).repay(subaccount_, exchange_, asset_, amount_);
+}
+
+RepayCommand::RepayCommand(const std::string& subaccount,
+                           infra::Exchange exchange,
+                           const std::string& asset,
+                           infra::Volume amount):
+    subaccount_(subaccount), exchange_(exchange), asset_(asset), amount_(amount) {
+}
+
+OperationResult RepayCommand::execute() {
+  return fromResult(transfer::CryptoTransfer({exchange_}).repay(subaccount_, exchange_, asset_, amount_));
+}
+
+tl::expected<void, std::string> RepayCommand::undo() {
+  return transfer::CryptoTransfer({exchange_}).borrow(subaccount_, exchange_, asset_, amount_);
+}
+
 }  // namespace funds_controller
@@ -0,0 +1,116 @@
+#include "prod/funds_controller/mapped_file.h"
+
+#include "util/error/error.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <utility>
+
+namespace funds_controller {
+
+tl::expected<MappedFile, std::string> MappedFile::open(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  EXPECT_WITH_STRING(fd >= 0, "Failed to open " << path << ": " << std::strerror(errno));
+  struct stat file_stat {};
+  if (::fstat(fd, &file_stat) != 0) {
+    ::close(fd);
+    EXPECT_WITH_STRING(false, "Failed to stat " << path << ": " << std::strerror(errno));
+  }
+  MappedFile file;
+  file.size_ = static_cast<size_t>(file_stat.st_size);
+  file.device_ = file_stat.st_dev;
+  file.inode_ = file_stat.st_ino;
+  if (file.size_ > 0) {
+    void* data = ::mmap(nullptr, file.size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      ::close(fd);
+      EXPECT_WITH_STRING(false, "Failed to mmap " << path << ": " << std::strerror(errno));
+    }
+    file.data_ = data;
+  }
+  ::close(fd);
+  return file;
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    ::munmap(data_, size_);
+  }
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept:
+    data_(std::exchange(other.data_, nullptr)),
+    size_(std::exchange(other.size_, 0)),
+    device_(other.device_),
+    inode_(other.inode_) {
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+  if (this != &other) {
+    if (data_ != nullptr) {
+      ::munmap(data_, size_);
+    }
+    data_ = std::exchange(other.data_, nullptr);
+    size_ = std::exchange(other.size_, 0);
+    device_ = other.device_;
+    inode_ = other.inode_;
+  }
+  return *this;
+}
+
+bool MappedFile::isReplaced(const std::string& path) const {
+  struct stat file_stat {};
+  if (::stat(path.c_str(), &file_stat) != 0) {
+    return true;
+  }
+  return file_stat.st_dev != device_ || file_stat.st_ino != inode_;
+}
+
+tl::expected<void, std::string> replaceFileAtomically(const std::string& path, std::string_view content) {
+  static std::atomic<uint64_t> counter = 0;
+  std::string tmp_path = path + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(counter++);
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  EXPECT_WITH_STRING(fd >= 0, "Failed to create " << tmp_path << ": " << std::strerror(errno));
+  auto fail = [&](const std::string& action) -> tl::expected<void, std::string> {
+    std::string error = std::strerror(errno);
+    ::close(fd);
+    ::unlink(tmp_path.c_str());
+    EXPECT_WITH_STRING(false, "Failed to " << action << " " << tmp_path << ": " << error);
+  };
+  while (!content.empty()) {
+    ssize_t written = ::write(fd, content.data(), content.size());
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return fail("write");
+    }
+    content.remove_prefix(static_cast<size_t>(written));
+  }
+  if (::fsync(fd) != 0) {
+    return fail("fsync");
+  }
+  ::close(fd);
+  if (::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::string error = std::strerror(errno);
+    ::unlink(tmp_path.c_str());
+    EXPECT_WITH_STRING(false, "Failed to rename " << tmp_path << " to " << path << ": " << error);
+  }
+  // persist the rename itself
+  std::string directory = std::filesystem::path(path).parent_path().string();
+  int directory_fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory_fd >= 0) {
+    ::fsync(directory_fd);
+    ::close(directory_fd);
+  }
+  return {};
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,288 @@
+#include "prod/funds_controller/reconciliation.h"
+
+#include "prod/funds_controller/clickhouse_client.h"
+#include "prod/funds_controller/main_commands.h"
+#include "prod/funds_controller/universe_snapshot.h"
+#include "prod/transfer/transfer.h"
+
+#include "common/instrument/instrument_impl.h"
+#include "util/error/error.h"
+#include "util/lexical_cast/lexical_cast.h"
+
+#include <magic_enum/magic_enum.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <set>
+#include <thread>
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kBorrowsTable = "BORROWS_v2";
+const std::string kLoansInfoTable = "LOANS_INFO_v2";
+const std::string kHedgeTable = "FUTURES_HEDGES_v2";
+const std::string kDoneStatus = "done";
+
+std::string subaccountList(const std::vector<ReconciliationAccount>& accounts) {
+  std::set<std::string> subaccounts;
+  for (const auto& account : accounts) {
+    subaccounts.insert(account.subaccount);
+  }
+  std::string list;
+  for (const auto& subaccount : subaccounts) {
+    list += std::format("{}'{}'", list.empty() ? "" : ", ", subaccount);
+  }
+  return list;
+}
+
+// Entries of a map keyed by tuples starting with the subaccount.
+template <class Map>
+auto subaccountRange(const Map& map, const std::string& subaccount) {
+  typename Map::key_type first_key{};
+  std::get<0>(first_key) = subaccount;
+  auto begin = map.lower_bound(first_key);
+  auto end = begin;
+  while (end != map.end() && std::get<0>(end->first) == subaccount) {
+    ++end;
+  }
+  return std::make_pair(begin, end);
+}
+
+}  // namespace
+
+Reconciler::Reconciler(std::shared_ptr<ExchangeStateSource> source, Options options):
+    source_(std::move(source)), options_(std::move(options)) {
+  ASSERT_FATAL(source_, "Exchange state source is required");
+  ASSERT_FATAL(options_.parallelism > 0, "Parallelism should be positive");
+  for (const auto& [exchange, rate_budget] : options_.rate_budgets) {
+    budgets_.emplace(exchange, std::make_unique<TokenBucket>(rate_budget.requests_per_second, rate_budget.burst));
+  }
+}
+
+tl::expected<ReconciliationReport, std::string> Reconciler::reconcile(
+    const std::vector<ReconciliationAccount>& accounts) {
+  auto start = std::chrono::steady_clock::now();
+  ReconciliationReport report;
+  if (accounts.empty()) {
+    return report;
+  }
+  auto ledger_future = std::async(std::launch::async, [this, &accounts] { return loadLedger(accounts); });
+
+  std::vector<tl::expected<ExchangeAccountState, std::string>> states(accounts.size());
+  std::atomic<size_t> next_account = 0;
+  {
+    std::vector<std::jthread> workers;
+    for (size_t worker = 0; worker < std::min(options_.parallelism, accounts.size()); ++worker) {
+      workers.emplace_back([&] {
+        for (size_t i = next_account++; i < accounts.size(); i = next_account++) {
+          if (auto* rate_budget = budget(accounts[i].exchange)) {
+            rate_budget->acquire(options_.requests_per_account);
+          }
+          try {
+            states[i] = source_->fetch(accounts[i]);
+          } catch (const std::exception& e) {
+            states[i] = tl::make_unexpected(std::string{"Failed to fetch exchange state. Exception: "} + e.what());
+          }
+        }
+      });
+    }
+  }
+  auto ledger = ledger_future.get();
+  PROPAGATE_ERROR(ledger);
+
+  auto compare = [&](ReconciliationDiff::Kind kind,
+                     const ReconciliationAccount& account,
+                     const std::string& symbol,
+                     infra::Market market,
+                     infra::Volume ledger_amount,
+                     infra::Volume exchange_amount) {
+    if (util::decimal::abs(ledger_amount - exchange_amount) > options_.tolerance) {
+      report.diffs.push_back({kind, account, symbol, market, ledger_amount, exchange_amount});
+    }
+  };
+  for (size_t i = 0; i < accounts.size(); ++i) {
+    const auto& account = accounts[i];
+    if (!states[i].has_value()) {
+      report.failed_accounts.emplace(std::make_pair(account.subaccount, account.exchange), states[i].error());
+      continue;
+    }
+    const auto& state = *states[i];
+    ++report.reconciled_accounts;
+    auto market = infra::Market{infra::Market::BinanceFutures};
+
+    auto [borrowed_begin, borrowed_end] = subaccountRange(ledger->borrowed, account.subaccount);
+    std::map<std::string, infra::Volume> ledger_borrowed;
+    for (auto it = borrowed_begin; it != borrowed_end; ++it) {
+      ledger_borrowed.emplace(it->first.second, it->second);
+    }
+    for (const auto& [asset, amount] : ledger_borrowed) {
+      auto it = state.borrowed.find(asset);
+      compare(ReconciliationDiff::Kind::Borrow,
+              account,
+              asset,
+              market,
+              amount,
+              it != state.borrowed.end() ? it->second : infra::Volume{});
+    }
+    for (const auto& [asset, amount] : state.borrowed) {
+      if (!ledger_borrowed.contains(asset)) {
+        compare(ReconciliationDiff::Kind::Borrow, account, asset, market, infra::Volume{}, amount);
+      }
+    }
+
+    auto [loans_begin, loans_end] = subaccountRange(ledger->loans, account.subaccount);
+    for (auto it = loans_begin; it != loans_end; ++it) {
+      const auto& asset = it->first.second;
+      auto balance = state.balances.find(asset);
+      infra::Volume exchange_amount = balance != state.balances.end() ? balance->second : infra::Volume{};
+      // the balance may hold more than the loans, only missing funds are drift
+      if (exchange_amount + options_.tolerance < it->second) {
+        report.diffs.push_back({ReconciliationDiff::Kind::Balance, account, asset, market, it->second, exchange_amount});
+      }
+    }
+
+    auto [hedges_begin, hedges_end] = subaccountRange(ledger->futures_hedges, account.subaccount);
+    std::map<std::pair<infra::Market::Type, std::string>, infra::Volume> ledger_positions;
+    for (auto it = hedges_begin; it != hedges_end; ++it) {
+      // hedges are recorded as positive amounts of short futures
+      ledger_positions.emplace(std::make_pair(std::get<1>(it->first), std::get<2>(it->first)), -it->second);
+    }
+    for (const auto& [key, amount] : ledger_positions) {
+      auto it = state.futures_positions.find(key);
+      compare(ReconciliationDiff::Kind::FuturesPosition,
+              account,
+              key.second,
+              infra::Market{key.first},
+              amount,
+              it != state.futures_positions.end() ? it->second : infra::Volume{});
+    }
+    for (const auto& [key, amount] : state.futures_positions) {
+      if (!ledger_positions.contains(key)) {
+        compare(ReconciliationDiff::Kind::FuturesPosition,
+                account,
+                key.second,
+                infra::Market{key.first},
+                infra::Volume{},
+                amount);
+      }
+    }
+  }
+  report.duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  LOG_INFO("Reconciled {} accounts in {} ms: {} diffs, {} failed",
+           report.reconciled_accounts,
+           report.duration.count(),
+           report.diffs.size(),
+           report.failed_accounts.size());
+  return report;
+}
+
+tl::expected<std::vector<std::unique_ptr<ICommand>>, std::string> Reconciler::corrections(
+    const ReconciliationReport& report) {
+  std::vector<std::unique_ptr<ICommand>> commands;
+  std::map<infra::Market::Type, std::vector<infra::InstrumentUpdate>> instrument_updates;
+  for (const auto& diff : report.diffs) {
+    const auto& account = diff.account;
+    switch (diff.kind) {
+      case ReconciliationDiff::Kind::Borrow: {
+        infra::Volume excess = diff.exchange_amount - diff.ledger_amount;
+        if (excess > 0) {
+          commands.push_back(std::make_unique<RepayCommand>(account.subaccount, account.exchange, diff.symbol, excess));
+        } else {
+          commands.push_back(std::make_unique<BorrowCommand>(account.subaccount, account.exchange, diff.symbol, -excess));
+        }
+        break;
+      }
+      case ReconciliationDiff::Kind::Balance:
+        break;
+      case ReconciliationDiff::Kind::FuturesPosition: {
+        auto instrument_description = infra::InstrumentDescriptionFactory::get().create(diff.market, diff.symbol);
+        auto lots_per_unit = lotsPerUnit(diff.market, diff.symbol);
+        if (!lots_per_unit.has_value()) {
+          auto updates = instrument_updates.find(diff.market.type());
+          if (updates == instrument_updates.end()) {
+            auto market_updates =
+                transfer::CryptoTransfer({diff.market.exchange()}).getInstrumentUpdates(diff.market);
+            PROPAGATE_ERROR(market_updates);
+            updates = instrument_updates.emplace(diff.market.type(), std::move(*market_updates)).first;
+          }
+          auto instrument_update =
+              std::find_if(updates->second.begin(), updates->second.end(), [&](const auto& update) {
+                return update.description() == instrument_description;
+              });
+          EXPECT_WITH_STRING(instrument_update != updates->second.end(),
+                             "Instrument update for " << instrument_description << " not found");
+          infra::InstrumentImpl instrument(*instrument_update);
+          lots_per_unit = instrument.contractSize() * (1 / instrument.lotSize());
+        }
+        // same crypto equivalent to order amount conversion as HedgeManager::createHedge
+        commands.push_back(std::make_unique<SendMarketCommand>(
+            account.subaccount, instrument_description, (diff.ledger_amount - diff.exchange_amount) * *lots_per_unit));
+        break;
+      }
+    }
+  }
+  return commands;
+}
+
+tl::expected<Reconciler::LedgerSnapshot, std::string> Reconciler::loadLedger(
+    const std::vector<ReconciliationAccount>& accounts) {
+  // runs next to the fetch workers, so it gets its own connection
+  auto clickhouse_client = getFundsControllerClickhouseClient();
+  EXPECT_WITH_STRING(clickhouse_client, "Failed to create clickhouse client");
+  auto subaccounts = subaccountList(accounts);
+  LedgerSnapshot ledger;
+  auto load_amounts = [&](const std::string& table, auto& amounts) {
+    clickhouse_client->Select(
+        {std::format("SELECT subaccount, asset, sum(amount) FROM {} WHERE status = '{}' AND subaccount IN ({}) "
+                     "GROUP BY subaccount, asset",
+                     table,
+                     kDoneStatus,
+                     subaccounts)},
+        [&amounts](const clickhouse::Block& block) {
+          for (size_t i = 0; i < block.GetRowCount(); ++i) {
+            amounts.emplace(std::make_pair(std::string{block[0]->As<clickhouse::ColumnString>()->At(i)},
+                                           std::string{block[1]->As<clickhouse::ColumnString>()->At(i)}),
+                            convertClickhouseDecimalToDecimal(block[2]->As<clickhouse::ColumnDecimal>()->At(i)));
+          }
+        });
+  };
+  try {
+    load_amounts(kBorrowsTable, ledger.borrowed);
+    load_amounts(kLoansInfoTable, ledger.loans);
+    clickhouse_client->Select(
+        {std::format("SELECT subaccount, market, pair, sum(crypto_eq_amount) FROM {} WHERE status = '{}' AND "
+                     "subaccount IN ({}) GROUP BY subaccount, market, pair",
+                     kHedgeTable,
+                     kDoneStatus,
+                     subaccounts)},
+        [&ledger](const clickhouse::Block& block) {
+          for (size_t i = 0; i < block.GetRowCount(); ++i) {
+            auto market_type =
+                magic_enum::enum_cast<infra::Market::Type>(std::string{block[1]->As<clickhouse::ColumnString>()->At(i)});
+            if (!market_type.has_value()) {
+              LOG_ERROR("Unknown market type {}", std::string{block[1]->As<clickhouse::ColumnString>()->At(i)});
+              continue;
+            }
+            ledger.futures_hedges.emplace(
+                std::make_tuple(std::string{block[0]->As<clickhouse::ColumnString>()->At(i)},
+                                *market_type,
+                                std::string{block[2]->As<clickhouse::ColumnString>()->At(i)}),
+                convertClickhouseDecimalToDecimal(block[3]->As<clickhouse::ColumnDecimal>()->At(i)));
+          }
+        });
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to load ledger snapshot. Exception: "} + e.what());
+  }
+  return ledger;
+}
+
+TokenBucket* Reconciler::budget(infra::Exchange exchange) const {
+  auto it = budgets_.find(exchange);
+  return it != budgets_.end() ? it->second.get() : nullptr;
+}
+
+}  // namespace funds_controller
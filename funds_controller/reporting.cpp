@@ -0,0 +1,229 @@
+#include "prod/funds_controller/reporting.h"
+
+#include "prod/funds_controller/ledger_events.h"
+#include "prod/funds_controller/ledger_writer.h"
+#include "prod/funds_controller/select_cursor.h"
+
+#include "util/error/error.h"
+
+#include <magic_enum/magic_enum.hpp>
+
+#include <future>
+#include <vector>
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kLedgerEventsTable = "LEDGER_EVENTS_v1";
+const std::string kTransactionsTable = "TRANSACTIONS_v1";
+const std::string kDoneStatus = "done";
+constexpr double kMillisecondsPerYear = 365.0 * 24 * 3600 * 1000;
+constexpr size_t kInsertChunkRows = 10'000;
+const std::string kReportColumns =
+    "(bucket_start, subaccount, asset, average_loan, average_hedge, transferred_in, transferred_out, borrow_cost)";
+
+tl::expected<void, std::string> streamBlocks(std::string query,
+                                             const std::function<void(const clickhouse::Block&)>& fold) {
+  SelectCursor<clickhouse::Block> cursor(std::move(query), [](const clickhouse::Block& block) { return block; });
+  while (true) {
+    auto block = cursor.next();
+    PROPAGATE_ERROR(block);
+    if (!block->has_value()) {
+      return {};
+    }
+    fold(**block);
+  }
+}
+
+}  // namespace
+
+ReportingEngine::ReportingEngine(Options options): options_(std::move(options)) {
+  ASSERT_FATAL(options_.parallelism > 0, "Parallelism should be positive");
+  ASSERT_FATAL(options_.bucket.count() > 0, "Bucket should be positive");
+}
+
+tl::expected<ReportingEngine::Report, std::string> ReportingEngine::build(int64_t from_timestamp_ms,
+                                                                          int64_t to_timestamp_ms) {
+  EXPECT_WITH_STRING(from_timestamp_ms < to_timestamp_ms, "Empty report range");
+  std::optional<int64_t> journal_start;
+  PROPAGATE_ERROR(streamBlocks(std::format("SELECT toInt64(min(timestamp)), count() FROM {}", kLedgerEventsTable),
+                               [&journal_start](const clickhouse::Block& block) {
+                                 if (block.GetRowCount() > 0 && block[1]->As<clickhouse::ColumnUInt64>()->At(0) > 0) {
+                                   journal_start = block[0]->As<clickhouse::ColumnInt64>()->At(0);
+                                 }
+                               }));
+  EXPECT_WITH_STRING(journal_start.has_value(), "Ledger journal is empty");
+  EXPECT_WITH_STRING(from_timestamp_ms >= *journal_start,
+                     "Report starts at " << from_timestamp_ms << ", before the ledger journal at " << *journal_start);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::future<tl::expected<Report, std::string>>> partitions;
+  for (size_t partition = 0; partition < options_.parallelism; ++partition) {
+    partitions.push_back(std::async(std::launch::async, [this, partition, from_timestamp_ms, to_timestamp_ms] {
+      return buildPartition(partition, from_timestamp_ms, to_timestamp_ms);
+    }));
+  }
+  Report report;
+  std::optional<std::string> error;
+  for (auto& partition : partitions) {
+    auto partition_report = partition.get();
+    if (!partition_report.has_value()) {
+      error = partition_report.error();
+      continue;
+    }
+    // partitions hold disjoint subaccounts
+    report.merge(*partition_report);
+  }
+  EXPECT_WITH_STRING(!error.has_value(), *error);
+  LOG_INFO("Built report of {} rows in {} ms",
+           report.size(),
+           std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+  return report;
+}
+
+tl::expected<ReportingEngine::Report, std::string> ReportingEngine::buildPartition(size_t partition,
+                                                                                   int64_t from_timestamp_ms,
+                                                                                   int64_t to_timestamp_ms) {
+  const int64_t bucket_ms = options_.bucket.count();
+  const auto partition_filter = [&](const std::string& column) {
+    return std::format("cityHash64({}) % {} = {}", column, options_.parallelism, partition);
+  };
+  Report report;
+  // spreads an amount change at `timestamp_ms` over the buckets until the end of the range
+  auto add_change = [&](const std::string& subaccount,
+                        const std::string& asset,
+                        int64_t timestamp_ms,
+                        double amount,
+                        double Row::*average) {
+    int64_t held_from = std::max(timestamp_ms, from_timestamp_ms);
+    Key key{subaccount, asset, from_timestamp_ms + (held_from - from_timestamp_ms) / bucket_ms * bucket_ms};
+    for (; key.bucket_start_ms < to_timestamp_ms; key.bucket_start_ms += bucket_ms) {
+      int64_t bucket_end = std::min(key.bucket_start_ms + bucket_ms, to_timestamp_ms);
+      double weight = static_cast<double>(bucket_end - std::max(key.bucket_start_ms, held_from)) /
+          static_cast<double>(bucket_end - key.bucket_start_ms);
+      report[key].*average += amount * weight;
+    }
+  };
+
+  // amounts held at the start of the range are the sums before it, later movements are kept apart
+  PROPAGATE_ERROR(streamBlocks(
+      std::format("SELECT subaccount, asset, kind, toInt64(if(timestamp < {0}, {0}, timestamp)) AS at, "
+                  "toFloat64(sum(amount)) FROM {1} WHERE kind IN ('{2}', '{3}') AND timestamp < {4} AND {5} "
+                  "GROUP BY subaccount, asset, kind, at",
+                  from_timestamp_ms,
+                  kLedgerEventsTable,
+                  magic_enum::enum_name(LedgerEvent::Kind::Loan),
+                  magic_enum::enum_name(LedgerEvent::Kind::Hedge),
+                  to_timestamp_ms,
+                  partition_filter("subaccount")),
+      [&](const clickhouse::Block& block) {
+        auto subaccounts = block[0]->As<clickhouse::ColumnString>();
+        auto assets = block[1]->As<clickhouse::ColumnString>();
+        auto kinds = block[2]->As<clickhouse::ColumnString>();
+        auto timestamps = block[3]->As<clickhouse::ColumnInt64>();
+        auto amounts = block[4]->As<clickhouse::ColumnFloat64>();
+        for (size_t i = 0; i < block.GetRowCount(); ++i) {
+          bool loan = kinds->At(i) == magic_enum::enum_name(LedgerEvent::Kind::Loan);
+          add_change(std::string{subaccounts->At(i)},
+                     std::string{assets->At(i)},
+                     timestamps->At(i),
+                     amounts->At(i),
+                     loan ? &Row::average_loan : &Row::average_hedge);
+        }
+      }));
+
+  PROPAGATE_ERROR(streamBlocks(
+      std::format("SELECT from_subaccount, to_subaccount, asset, toInt64(timestamp), toFloat64(amount), "
+                  "cityHash64(from_subaccount) % {0}, cityHash64(to_subaccount) % {0} FROM {1} "
+                  "WHERE type = 'transfer' AND status = '{2}' AND timestamp >= {3} AND timestamp < {4} "
+                  "AND ({5} OR {6})",
+                  options_.parallelism,
+                  kTransactionsTable,
+                  kDoneStatus,
+                  from_timestamp_ms,
+                  to_timestamp_ms,
+                  partition_filter("from_subaccount"),
+                  partition_filter("to_subaccount")),
+      [&](const clickhouse::Block& block) {
+        auto from_subaccounts = block[0]->As<clickhouse::ColumnString>();
+        auto to_subaccounts = block[1]->As<clickhouse::ColumnString>();
+        auto assets = block[2]->As<clickhouse::ColumnString>();
+        auto timestamps = block[3]->As<clickhouse::ColumnInt64>();
+        auto amounts = block[4]->As<clickhouse::ColumnFloat64>();
+        auto from_partitions = block[5]->As<clickhouse::ColumnUInt64>();
+        auto to_partitions = block[6]->As<clickhouse::ColumnUInt64>();
+        for (size_t i = 0; i < block.GetRowCount(); ++i) {
+          int64_t bucket_start =
+              from_timestamp_ms + (timestamps->At(i) - from_timestamp_ms) / bucket_ms * bucket_ms;
+          // only the side of the transfer owned by this partition is counted here
+          if (from_partitions->At(i) == partition) {
+            report[{std::string{from_subaccounts->At(i)}, std::string{assets->At(i)}, bucket_start}]
+                .transferred_out += amounts->At(i);
+          }
+          if (to_partitions->At(i) == partition) {
+            report[{std::string{to_subaccounts->At(i)}, std::string{assets->At(i)}, bucket_start}]
+                .transferred_in += amounts->At(i);
+          }
+        }
+      }));
+
+  for (auto& [key, row] : report) {
+    auto rate = options_.annual_borrow_rates.find(key.asset);
+    if (rate != options_.annual_borrow_rates.end()) {
+      int64_t bucket_end = std::min(key.bucket_start_ms + bucket_ms, to_timestamp_ms);
+      row.borrow_cost =
+          row.average_loan * rate->second * static_cast<double>(bucket_end - key.bucket_start_ms) /
+          kMillisecondsPerYear;
+    }
+  }
+  return report;
+}
+
+void ReportingEngine::writeCsv(const Report& report, std::ostream& out) {
+  out << "subaccount,asset,bucket_start_ms,average_loan,average_hedge,transferred_in,transferred_out,borrow_cost\n";
+  for (const auto& [key, row] : report) {
+    out << std::format("{},{},{},{},{},{},{},{}\n",
+                       key.subaccount,
+                       key.asset,
+                       key.bucket_start_ms,
+                       row.average_loan,
+                       row.average_hedge,
+                       row.transferred_in,
+                       row.transferred_out,
+                       row.borrow_cost);
+  }
+}
+
+tl::expected<void, std::string> ReportingEngine::insert(const Report& report, const std::string& table_name) {
+  std::vector<std::future<LedgerWriter::Result>> chunks;
+  std::string values;
+  size_t rows = 0;
+  for (const auto& [key, row] : report) {
+    values += std::format("{}('{}', '{}', '{}', {}, {}, {}, {}, {})",
+                          values.empty() ? "" : ", ",
+                          key.bucket_start_ms,
+                          key.subaccount,
+                          key.asset,
+                          row.average_loan,
+                          row.average_hedge,
+                          row.transferred_in,
+                          row.transferred_out,
+                          row.borrow_cost);
+    if (++rows == kInsertChunkRows) {
+      chunks.push_back(
+          ledgerWriter().insert(table_name, kReportColumns, std::exchange(values, {}), std::exchange(rows, 0)));
+    }
+  }
+  if (rows > 0) {
+    chunks.push_back(ledgerWriter().insert(table_name, kReportColumns, std::move(values), rows));
+  }
+  for (auto& chunk : chunks) {
+    auto result = chunk.get();
+    if (!result.has_value()) {
+      return tl::make_unexpected("Failed to insert report. " + result.error().message);
+    }
+  }
+  return {};
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,290 @@
+#include "prod/funds_controller/resilient_clickhouse_client.h"
+
+#include "prod/funds_controller/alert_dispatcher.h"
+
+#include "util/error/error.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <optional>
+#include <thread>
+
+namespace funds_controller {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// reads needed before the hedge delay follows the observed p99
+constexpr size_t kMinHedgeSamples = 100;
+// the hedge delay is recomputed every kHedgeDelayRefresh reads
+constexpr size_t kHedgeDelayRefresh = 64;
+
+int64_t percentile(std::vector<int64_t> latencies, double quantile) {
+  if (latencies.empty()) {
+    return 0;
+  }
+  auto nth = latencies.begin() + static_cast<ptrdiff_t>(quantile * static_cast<double>(latencies.size() - 1));
+  std::nth_element(latencies.begin(), nth, latencies.end());
+  return *nth;
+}
+
+}  // namespace
+
+ClickhouseCircuitBreaker::ClickhouseCircuitBreaker(Options options): options_(options) {
+}
+
+bool ClickhouseCircuitBreaker::allow() {
+  std::lock_guard lock(mutex_);
+  if (state_ == State::Open && Clock::now() >= open_until_) {
+    state_ = State::HalfOpen;
+    probe_in_flight_ = false;
+  }
+  if (state_ == State::Closed || (state_ == State::HalfOpen && !probe_in_flight_)) {
+    probe_in_flight_ = state_ == State::HalfOpen;
+    return true;
+  }
+  ++rejected_;
+  return false;
+}
+
+void ClickhouseCircuitBreaker::onSuccess() {
+  std::lock_guard lock(mutex_);
+  if (state_ != State::Closed) {
+    LOG_INFO("ClickHouse circuit breaker closed");
+  }
+  state_ = State::Closed;
+  consecutive_failures_ = 0;
+  probe_in_flight_ = false;
+}
+
+void ClickhouseCircuitBreaker::onFailure(const std::string& error) {
+  bool opened = false;
+  {
+    std::lock_guard lock(mutex_);
+    ++consecutive_failures_;
+    probe_in_flight_ = false;
+    if (state_ == State::HalfOpen || (state_ == State::Closed && consecutive_failures_ >= options_.failure_threshold)) {
+      opened = state_ == State::Closed;
+      state_ = State::Open;
+      open_until_ = Clock::now() + options_.open_duration;
+    }
+  }
+  if (opened) {
+    LOG_ERROR("ClickHouse circuit breaker opened: {}", error);
+    alertDispatcher().alert("clickhouse_circuit_breaker", "ClickHouse circuit breaker opened: " + error);
+  }
+}
+
+ClickhouseCircuitBreaker& clickhouseCircuitBreaker() {
+  static ClickhouseCircuitBreaker breaker({});
+  return breaker;
+}
+
+// Idle connections. A connection running a query is owned by its attempt and comes back when the query
+// returned, even after the caller gave up on it. A connection that failed is replaced by a new one.
+struct ResilientClickhouseClient::Pool {
+  std::chrono::milliseconds io_timeout;
+  std::mutex mutex;
+  std::condition_variable released;
+  std::vector<std::shared_ptr<ClickhouseClientHandle>> idle;
+
+  std::shared_ptr<ClickhouseClientHandle> acquire(Clock::time_point deadline) {
+    std::unique_lock lock(mutex);
+    if (!released.wait_until(lock, deadline, [this] { return !idle.empty(); })) {
+      return nullptr;
+    }
+    auto connection = std::move(idle.back());
+    idle.pop_back();
+    return connection;
+  }
+
+  void release(std::shared_ptr<ClickhouseClientHandle> connection, bool healthy) {
+    if (!healthy) {
+      connection = std::make_shared<ClickhouseClientHandle>(io_timeout);
+    }
+    {
+      std::lock_guard lock(mutex);
+      idle.push_back(std::move(connection));
+    }
+    released.notify_one();
+  }
+};
+
+// Shared by the caller and its attempts, the caller may return before the attempts do.
+struct ResilientClickhouseClient::Call {
+  std::mutex mutex;
+  std::condition_variable done;
+  size_t started = 0;
+  size_t failed = 0;
+  std::optional<size_t> winner;
+  std::vector<clickhouse::Block> blocks;
+  std::string error;
+};
+
+ResilientClickhouseClient::ResilientClickhouseClient(): ResilientClickhouseClient(Options{}) {
+}
+
+ResilientClickhouseClient::ResilientClickhouseClient(Options options):
+    options_(options),
+    pool_(std::make_shared<Pool>()),
+    latencies_(kLatencyWindow),
+    hedge_delay_us_(std::chrono::microseconds(options.max_hedge_delay).count()) {
+  ASSERT_FATAL(options_.connections > 0, "ClickHouse client needs at least one connection");
+  // a straggler holds its connection until the socket gives up, keep that bounded
+  pool_->io_timeout = std::max(options_.read_deadline, options_.write_deadline);
+  for (size_t i = 0; i < options_.connections; ++i) {
+    pool_->idle.push_back(std::make_shared<ClickhouseClientHandle>(pool_->io_timeout));
+  }
+}
+
+void ResilientClickhouseClient::select(const std::string& query,
+                                       const std::function<void(const clickhouse::Block&)>& callback) {
+  ++reads_;
+  for (const auto& block : run(query, true)) {
+    callback(block);
+  }
+}
+
+void ResilientClickhouseClient::execute(const std::string& query) {
+  ++writes_;
+  run(query, false);
+}
+
+std::vector<clickhouse::Block> ResilientClickhouseClient::run(const std::string& query, bool read) {
+  auto& breaker = clickhouseCircuitBreaker();
+  if (!breaker.allow()) {
+    throw ClickhouseUnavailable("ClickHouse circuit breaker is open");
+  }
+  const auto start = Clock::now();
+  const auto deadline_duration = read ? options_.read_deadline : options_.write_deadline;
+  const auto deadline = start + deadline_duration;
+  auto timeout = [&](bool sent) {
+    ++timeouts_;
+    auto error = std::format("ClickHouse {} missed its {}ms deadline{}",
+                             read ? "read" : "write",
+                             deadline_duration.count(),
+                             sent && !read ? ", its outcome is unknown" : "");
+    LOG_ERROR("{}: {}", error, query.substr(0, 200));
+    breaker.onFailure(error);
+    return error;
+  };
+
+  auto connection = pool_->acquire(deadline);
+  if (connection == nullptr) {
+    // nothing was sent yet
+    throw ClickhouseUnavailable(timeout(false));
+  }
+  auto call = std::make_shared<Call>();
+  call->started = 1;
+  startAttempt(call, std::move(connection), 0, query, read);
+
+  std::unique_lock lock(call->mutex);
+  auto finished = [&call] { return call->winner.has_value() || call->failed == call->started; };
+  if (read) {
+    auto hedge_at = std::min(start + std::chrono::microseconds(hedge_delay_us_.load()), deadline);
+    if (!call->done.wait_until(lock, hedge_at, finished)) {
+      // hedge only on an idle connection, waiting for one would just queue behind the straggler
+      if (auto hedge = pool_->acquire(Clock::now())) {
+        ++hedged_reads_;
+        ++call->started;
+        startAttempt(call, std::move(hedge), 1, query, read);
+      }
+    }
+  }
+  if (!call->done.wait_until(lock, deadline, finished)) {
+    lock.unlock();
+    if (read) {
+      throw ClickhouseUnavailable(timeout(true));
+    }
+    throw ClickhouseUnknownOutcome(timeout(true));
+  }
+  if (!call->winner.has_value()) {
+    auto error = std::move(call->error);
+    lock.unlock();
+    ++failures_;
+    breaker.onFailure(error);
+    throw std::runtime_error(error);
+  }
+  if (*call->winner > 0) {
+    ++hedge_wins_;
+  }
+  auto blocks = std::move(call->blocks);
+  lock.unlock();
+  breaker.onSuccess();
+  if (read) {
+    recordLatency(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start));
+  }
+  return blocks;
+}
+
+void ResilientClickhouseClient::startAttempt(const std::shared_ptr<Call>& call,
+                                             std::shared_ptr<ClickhouseClientHandle> connection,
+                                             size_t attempt,
+                                             const std::string& query,
+                                             bool read) {
+  // detached, the attempt owns everything it touches and may outlive the call
+  std::thread([pool = pool_, call, connection = std::move(connection), attempt, query, read]() mutable {
+    std::vector<clickhouse::Block> blocks;
+    std::optional<std::string> error;
+    try {
+      if (read) {
+        (*connection)->Select(query, [&blocks](const clickhouse::Block& block) { blocks.push_back(block); });
+      } else {
+        (*connection)->Execute({query});
+      }
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+    {
+      std::lock_guard lock(call->mutex);
+      if (!error.has_value()) {
+        if (!call->winner.has_value()) {
+          call->winner = attempt;
+          call->blocks = std::move(blocks);
+        }
+      } else {
+        ++call->failed;
+        if (call->error.empty()) {
+          call->error = *error;
+        }
+      }
+    }
+    call->done.notify_all();
+    pool->release(std::move(connection), !error.has_value());
+  }).detach();
+}
+
+void ResilientClickhouseClient::recordLatency(std::chrono::microseconds latency) {
+  std::lock_guard lock(latency_mutex_);
+  latencies_[recorded_ % kLatencyWindow] = latency.count();
+  ++recorded_;
+  if (recorded_ >= kMinHedgeSamples && recorded_ % kHedgeDelayRefresh == 0) {
+    auto samples = std::vector<int64_t>(latencies_.begin(), latencies_.begin() + std::min(recorded_, kLatencyWindow));
+    hedge_delay_us_ = std::clamp(percentile(std::move(samples), 0.99),
+                                 std::chrono::microseconds(options_.min_hedge_delay).count(),
+                                 std::chrono::microseconds(options_.max_hedge_delay).count());
+  }
+}
+
+ResilientClickhouseClient::Stats ResilientClickhouseClient::stats() const {
+  Stats stats{
+      .reads = reads_.load(),
+      .writes = writes_.load(),
+      .hedged_reads = hedged_reads_.load(),
+      .hedge_wins = hedge_wins_.load(),
+      .timeouts = timeouts_.load(),
+      .failures = failures_.load(),
+  };
+  std::vector<int64_t> samples;
+  {
+    std::lock_guard lock(latency_mutex_);
+    samples.assign(latencies_.begin(), latencies_.begin() + std::min(recorded_, kLatencyWindow));
+  }
+  stats.p50 = std::chrono::microseconds(percentile(samples, 0.5));
+  stats.p99 = std::chrono::microseconds(percentile(samples, 0.99));
+  stats.p999 = std::chrono::microseconds(percentile(std::move(samples), 0.999));
+  return stats;
+}
+
+}  // namespace funds_controller
@@ -0,0 +1,101 @@
+#include "prod/funds_controller/row_updates.h"
+
+#include "prod/funds_controller/operation_arena.h"
+
+#include "util/lexical_cast/lexical_cast.h"
+#include "util/log/log.h"
+#include "util/time/time.h"
+
+#include <iterator>
+
+namespace funds_controller {
+
+namespace {
+
+const std::string kDoneStatus = "done";
+const std::string kRemoveStatus = "removed";
+
+}  // namespace
+
+std::pmr::string quotedList(const std::vector<std::string>& values) {
+  std::pmr::string list(OperationArena::current());
+  for (const auto& value : values) {
+    std::format_to(std::back_inserter(list), "{}'{}'", list.empty() ? "" : ", ", value);
+  }
+  return list;
+}
+
+OperationResult updateRows(ResilientClickhouseClient& clickhouse_client,
+                           const AmountTable& table,
+                           std::span<const RowUpdate> updates) {
+  if (updates.empty()) {
+    return {};
+  }
+  std::pmr::string amounts(OperationArena::current());
+  std::pmr::string removed_ids(OperationArena::current());
+  std::pmr::string ids(OperationArena::current());
+  for (const auto& update : updates) {
+    std::format_to(std::back_inserter(amounts),
+                   "id = '{}', toDecimal128('{}', 12), ",
+                   update.id,
+                   util::lexical_cast<std::string>(update.amount));
+    std::format_to(std::back_inserter(ids), "{}'{}'", ids.empty() ? "" : ", ", update.id);
+    if (update.amount == 0) {
+      std::format_to(std::back_inserter(removed_ids), "{}'{}'", removed_ids.empty() ? "" : ", ", update.id);
+    }
+  }
+  std::string query = std::format("ALTER TABLE {} UPDATE {} = multiIf({}{}), status = if(id IN ({}), '{}', '{}'){} "
+                                  "WHERE id IN ({})",
+                                  table.name,
+                                  table.amount_column,
+                                  amounts,
+                                  table.amount_column,
+                                  removed_ids.empty() ? std::string_view{"NULL"} : std::string_view{removed_ids},
+                                  kRemoveStatus,
+                                  kDoneStatus,
+                                  table.has_update_timestamp
+                                      ? std::format(", last_update_timestamp = '{}'",
+                                                    static_cast<int64_t>(nowSystem()) / 1'000'000)
+                                      : "",
+                                  ids);
+  LOG_DEBUG("{}", query);
+  try {
+    clickhouse_client.execute({std::move(query)});
+  } catch (const ClickhouseUnknownOutcome& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return unknownOutcome(std::string{"Failed to update rows. Exception: "} + e.what());
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to update rows. Exception: "} + e.what());
+  }
+  return {};
+}
+
+OperationResult deleteRemovedRows(ResilientClickhouseClient& clickhouse_client,
+                                  const AmountTable& table,
+                                  std::span<const RowUpdate> updates) {
+  std::pmr::string removed_ids(OperationArena::current());
+  for (const auto& update : updates) {
+    if (update.amount == 0) {
+      std::format_to(std::back_inserter(removed_ids), "{}'{}'", removed_ids.empty() ? "" : ", ", update.id);
+    }
+  }
+  if (removed_ids.empty()) {
+    return {};
+  }
+  std::string query = std::format(
+      "ALTER TABLE {} DELETE WHERE id IN ({}) AND status = '{}'", table.name, removed_ids, kRemoveStatus);
+  LOG_DEBUG("{}", query);
+  try {
+    clickhouse_client.execute({std::move(query)});
+  } catch (const ClickhouseUnknownOutcome& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return unknownOutcome(std::string{"Failed to delete removed rows. Exception: "} + e.what());
+  } catch (const std::exception& e) {
+    LOG_ERROR("clickhouse error: {}", e.what());
+    return tl::make_unexpected(std::string{"Failed to delete removed rows. Exception: "} + e.what());
+  }
+  return {};
+}
+
+}  // namespace funds_controller
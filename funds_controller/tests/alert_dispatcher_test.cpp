@@ -0,0 +1,122 @@
+#include "prod/funds_controller/alert_dispatcher.h"
+
+#include "check.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace funds_controller {
+
+namespace {
+
+// polls until the condition holds, the dispatcher sends from its own thread
+bool waitFor(const std::function<bool()>& condition, std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (!condition()) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  return true;
+}
+
+bool contains(const std::vector<std::string>& messages, const std::string& text) {
+  return std::any_of(messages.begin(), messages.end(), [&](const std::string& message) {
+    return message.find(text) != std::string::npos;
+  });
+}
+
+// The first alert of a key goes out at once, the repeats within the window come as one summary.
+void testCoalescesRepeats() {
+  auto sink = std::make_shared<LocalAlertSink>();
+  AlertDispatcher dispatcher({.coalesce_window = std::chrono::milliseconds(200)}, sink);
+
+  CHECK(dispatcher.alert("repay_undo sub1 BTC", "first"));
+  CHECK(waitFor([&] { return sink->messages().size() == 1; }));
+  CHECK(sink->messages()[0] == "first");
+
+  CHECK(dispatcher.alert("repay_undo sub1 BTC", "second"));
+  CHECK(dispatcher.alert("repay_undo sub1 BTC", "third"));
+  CHECK(waitFor([&] { return sink->messages().size() == 2; }));
+  CHECK(sink->messages()[1] == "2 more alerts of repay_undo sub1 BTC, last: third");
+
+  auto stats = dispatcher.stats();
+  CHECK(stats.alerts == 3);
+  CHECK(stats.coalesced == 2);
+  CHECK(stats.dropped == 0);
+}
+
+// Keys naming the subaccount and asset keep alerts of different keys apart.
+void testSeparatesKeys() {
+  auto sink = std::make_shared<LocalAlertSink>();
+  AlertDispatcher dispatcher({.coalesce_window = std::chrono::seconds(10)}, sink);
+
+  CHECK(dispatcher.alert("repay_undo sub1 BTC", "sub1 BTC"));
+  CHECK(dispatcher.alert("repay_undo sub2 BTC", "sub2 BTC"));
+  CHECK(dispatcher.alert("repay_undo sub1 ETH", "sub1 ETH"));
+  CHECK(waitFor([&] {
+    auto messages = sink->messages();
+    return contains(messages, "sub1 BTC") && contains(messages, "sub2 BTC") && contains(messages, "sub1 ETH");
+  }));
+  CHECK(dispatcher.stats().coalesced == 0);
+}
+
+// Alerts of new keys beyond max_keys are dropped and the count goes out with the next send.
+void testDropsBeyondMaxKeys() {
+  auto sink = std::make_shared<LocalAlertSink>();
+  AlertDispatcher dispatcher({.coalesce_window = std::chrono::seconds(10), .max_keys = 2}, sink);
+
+  CHECK(dispatcher.alert("a", "a"));
+  CHECK(dispatcher.alert("b", "b"));
+  CHECK(!dispatcher.alert("c", "c"));
+  CHECK(waitFor([&] { return contains(sink->messages(), "1 alerts dropped"); }));
+  CHECK(dispatcher.stats().dropped == 1);
+}
+
+// A slow sink gets the alerts raised meanwhile in one call instead of one call each.
+void testBatchesBehindSlowSink() {
+  auto sink = std::make_shared<LocalAlertSink>(std::chrono::milliseconds(200));
+  AlertDispatcher dispatcher({.coalesce_window = std::chrono::seconds(10)}, sink);
+
+  CHECK(dispatcher.alert("key 0", "message 0"));
+  // the first send is under way when the others arrive
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  for (int i = 1; i < 10; ++i) {
+    CHECK(dispatcher.alert("key " + std::to_string(i), "message " + std::to_string(i)));
+  }
+  CHECK(waitFor([&] { return contains(sink->messages(), "message 9"); }));
+  CHECK(sink->messages().size() == 2);
+  CHECK(dispatcher.stats().sends == 2);
+}
+
+// The destructor sends the summaries of windows still open.
+void testFlushesOnDestruction() {
+  auto sink = std::make_shared<LocalAlertSink>();
+  {
+    AlertDispatcher dispatcher({.coalesce_window = std::chrono::seconds(60)}, sink);
+    CHECK(dispatcher.alert("borrow_undo sub1 BTC", "first"));
+    CHECK(dispatcher.alert("borrow_undo sub1 BTC", "second"));
+  }
+  auto messages = sink->messages();
+  CHECK(contains(messages, "first"));
+  CHECK(contains(messages, "1 more alerts of borrow_undo sub1 BTC, last: second"));
+}
+
+}  // namespace
+
+}  // namespace funds_controller
+
+int main() {
+  funds_controller::testCoalescesRepeats();
+  funds_controller::testSeparatesKeys();
+  funds_controller::testDropsBeyondMaxKeys();
+  funds_controller::testBatchesBehindSlowSink();
+  funds_controller::testFlushesOnDestruction();
+  return 0;
+}
@@ -0,0 +1,153 @@
+#include "prod/funds_controller/listings_watcher.h"
+
+#include "check.h"
+#include "local_http_server.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace funds_controller {
+
+namespace {
+
+const infra::Market kFutures{infra::Market::BinanceFutures};
+const infra::Market kSpots{infra::Market::BinanceSpots};
+
+std::string exchangeInfo(const std::vector<std::pair<std::string, std::string>>& symbols) {
+  std::string list;
+  for (const auto& [symbol, status] : symbols) {
+    list += std::format(R"({}{{"symbol":"{}","status":"{}","onboardDate":1569398400000,"filters":[)"
+                        R"({{"filterType":"PRICE_FILTER","tickSize":"0.10"}},)"
+                        R"({{"filterType":"LOT_SIZE","stepSize":"0.001"}}]}})",
+                        list.empty() ? "" : ",",
+                        symbol,
+                        status);
+  }
+  return std::format(R"({{"timezone":"UTC","symbols":[{}]}})", list);
+}
+
+class EventLog {
+public:
+  ListingsWatcher::Callback callback() {
+    return [this](const ListingEvent& event) {
+      std::lock_guard lock(mutex_);
+      events_.push_back(event);
+    };
+  }
+
+  bool contains(ListingEvent::Type type, infra::Market market, const std::string& pair) const {
+    std::lock_guard lock(mutex_);
+    return std::any_of(events_.begin(), events_.end(), [&](const ListingEvent& event) {
+      return event.type == type && event.listing.market == market && event.listing.pair == pair;
+    });
+  }
+
+  size_t size() const {
+    std::lock_guard lock(mutex_);
+    return events_.size();
+  }
+
+  void clear() {
+    std::lock_guard lock(mutex_);
+    events_.clear();
+  }
+
+private:
+  mutable std::mutex mutex_;
+  std::vector<ListingEvent> events_;
+};
+
+ListingsWatcher::Options options(const testing::LocalHttpServer& server, std::string snapshot_path = {}) {
+  return {
+      .markets = {kFutures, kSpots},
+      .request_timeout = std::chrono::seconds(2),
+      .endpoints = {{kFutures.type(), server.url() + "/futures"}, {kSpots.type(), server.url() + "/spots"}},
+      .snapshot_path = std::move(snapshot_path),
+  };
+}
+
+// The first poll is the baseline, later polls report the differences.
+void testDiffsPolls() {
+  testing::LocalHttpServer server;
+  server.setBody("/futures/exchangeInfo", exchangeInfo({{"BTCUSDT", "TRADING"}}));
+  server.setBody("/spots/exchangeInfo", exchangeInfo({{"BTCUSDT", "TRADING"}}));
+  EventLog events;
+  ListingsWatcher watcher(options(server), events.callback());
+
+  CHECK(watcher.pollOnce().has_value());
+  CHECK(events.size() == 0);
+  CHECK(watcher.universe().size() == 2);
+
+  server.setBody("/futures/exchangeInfo", exchangeInfo({{"BTCUSDT", "SETTLING"}, {"ETHUSDT", "TRADING"}}));
+  CHECK(watcher.pollOnce().has_value());
+  CHECK(events.size() == 2);
+  CHECK(events.contains(ListingEvent::Type::Added, kFutures, "ETHUSDT"));
+  CHECK(events.contains(ListingEvent::Type::StatusChanged, kFutures, "BTCUSDT"));
+
+  // unchanged responses are skipped without parsing
+  events.clear();
+  CHECK(watcher.pollOnce().has_value());
+  CHECK(events.size() == 0);
+
+  server.setBody("/futures/exchangeInfo", exchangeInfo({{"ETHUSDT", "TRADING"}}));
+  CHECK(watcher.pollOnce().has_value());
+  CHECK(events.size() == 1);
+  CHECK(events.contains(ListingEvent::Type::Removed, kFutures, "BTCUSDT"));
+  CHECK(server.requests() == 8);
+}
+
+// A malformed response is an error, never a mass delisting.
+void testKeepsListingsOnBadResponse() {
+  testing::LocalHttpServer server;
+  server.setBody("/futures/exchangeInfo", exchangeInfo({{"BTCUSDT", "TRADING"}}));
+  server.setBody("/spots/exchangeInfo", exchangeInfo({}));
+  EventLog events;
+  ListingsWatcher watcher(options(server), events.callback());
+  CHECK(watcher.pollOnce().has_value());
+
+  server.setBody("/futures/exchangeInfo", R"({"symbols":[{"symbol":"BTCUSDT","status":)");
+  CHECK(!watcher.pollOnce().has_value());
+  CHECK(events.size() == 0);
+  CHECK(watcher.universe().size() == 1);
+}
+
+// Markets present in the snapshot diff against it on the first poll, the others take the first
+// poll as their baseline.
+void testSnapshotBaseline() {
+  std::string snapshot_path = std::format("/tmp/listings_watcher_test_{}.snapshot", ::getpid());
+  CHECK(UniverseSnapshot::write(snapshot_path, {{kFutures, "BTCUSDT", "TRADING", 0, {}}}, nullptr).has_value());
+
+  testing::LocalHttpServer server;
+  server.setBody("/futures/exchangeInfo", exchangeInfo({{"BTCUSDT", "TRADING"}, {"ETHUSDT", "TRADING"}}));
+  server.setBody("/spots/exchangeInfo", exchangeInfo({{"BTCUSDT", "TRADING"}, {"ETHUSDT", "TRADING"}}));
+  EventLog events;
+  {
+    ListingsWatcher watcher(options(server, snapshot_path), events.callback());
+    CHECK(watcher.pollOnce().has_value());
+    CHECK(events.size() == 1);
+    CHECK(events.contains(ListingEvent::Type::Added, kFutures, "ETHUSDT"));
+  }
+
+  // the rewritten snapshot now holds both markets
+  auto snapshot = UniverseSnapshot::open(snapshot_path);
+  CHECK(snapshot.has_value());
+  CHECK(snapshot->records().size() == 4);
+  CHECK(snapshot->find(kSpots, "ETHUSDT") != nullptr);
+  std::remove(snapshot_path.c_str());
+}
+
+}  // namespace
+
+}  // namespace funds_controller
+
+int main() {
+  funds_controller::testDiffsPolls();
+  funds_controller::testKeepsListingsOnBadResponse();
+  funds_controller::testSnapshotBaseline();
+  return 0;
+}
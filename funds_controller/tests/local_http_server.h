@@ -0,0 +1,123 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <format>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace funds_controller::testing {
+
+// Plain http stand-in for the exchanges on 127.0.0.1. Answers every GET with the body set for its
+// path, 404 otherwise, and keeps connections alive like the exchanges do.
+class LocalHttpServer {
+public:
+  LocalHttpServer() {
+    listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_size = sizeof(address);
+    ::bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), address_size);
+    ::listen(listen_fd_, 16);
+    ::getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&address), &address_size);
+    port_ = ntohs(address.sin_port);
+    accept_thread_ = std::thread([this] { acceptLoop(); });
+  }
+
+  ~LocalHttpServer() {
+    ::shutdown(listen_fd_, SHUT_RDWR);
+    accept_thread_.join();
+    ::close(listen_fd_);
+    {
+      std::lock_guard lock(mutex_);
+      for (int fd : connection_fds_) {
+        ::shutdown(fd, SHUT_RDWR);
+      }
+    }
+    for (auto& thread : connection_threads_) {
+      thread.join();
+    }
+    // closed only here so a shutdown above never hits a reused descriptor
+    for (int fd : connection_fds_) {
+      ::close(fd);
+    }
+  }
+
+  std::string url() const {
+    return std::format("http://127.0.0.1:{}", port_);
+  }
+
+  void setBody(const std::string& path, std::string body) {
+    std::lock_guard lock(mutex_);
+    bodies_[path] = std::move(body);
+  }
+
+  size_t requests() const {
+    std::lock_guard lock(mutex_);
+    return requests_;
+  }
+
+private:
+  void acceptLoop() {
+    while (true) {
+      int fd = ::accept(listen_fd_, nullptr, nullptr);
+      if (fd < 0) {
+        return;
+      }
+      std::lock_guard lock(mutex_);
+      connection_fds_.push_back(fd);
+      connection_threads_.emplace_back([this, fd] { serve(fd); });
+    }
+  }
+
+  void serve(int fd) {
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+      size_t headers_end;
+      while ((headers_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t read = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (read <= 0) {
+          return;
+        }
+        buffer.append(chunk, static_cast<size_t>(read));
+      }
+      // "GET <path> HTTP/1.1"
+      size_t path_start = buffer.find(' ') + 1;
+      std::string path = buffer.substr(path_start, buffer.find(' ', path_start) - path_start);
+      buffer.erase(0, headers_end + 4);
+
+      std::string response;
+      {
+        std::lock_guard lock(mutex_);
+        ++requests_;
+        auto it = bodies_.find(path);
+        response = it != bodies_.end()
+            ? std::format("HTTP/1.1 200 OK\r\nContent-Length: {}\r\n\r\n{}", it->second.size(), it->second)
+            : std::string{"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n"};
+      }
+      if (::send(fd, response.data(), response.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(response.size())) {
+        return;
+      }
+    }
+  }
+
+  int listen_fd_ = -1;
+  uint16_t port_ = 0;
+  std::thread accept_thread_;
+
+  mutable std::mutex mutex_;
+  std::map<std::string, std::string> bodies_;
+  size_t requests_ = 0;
+  std::vector<int> connection_fds_;
+  std::vector<std::thread> connection_threads_;
+};
+
+}  // namespace funds_controller::testing
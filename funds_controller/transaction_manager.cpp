@@ -1,15 +1,21 @@
 #include "prod/funds_controller/transaction_manager.h"
 
+#include "prod/funds_controller/alert_dispatcher.h"
 #include "prod/funds_controller/block_trading.h"
+#include "prod/funds_controller/idempotency_store.h"
+#include "prod/funds_controller/ledger_events.h"
+#include "prod/funds_controller/ledger_writer.h"
 #include "prod/transfer/transfer.h"
 
 #include "common/instrument_description/util/market_map.h"
 #include "util/error/error.h"
+#include "util/generator/generate_uuid.h"
 #include "util/lexical_cast/lexical_cast.h"
 #include "util/time/time.h"
-#include "util/slack/slack.h"
 
+#include <map>
 #include <set>
+#include <tuple>
 
 namespace funds_controller {
 
@@ -20,18 +26,197 @@ const std::string kDoneStatus = "done";
 const std::string kPendingStatus = "pending";
 const std::string kRemoveStatus = "removed";
 
+std::string transactionValues(const TransferIntent& transfer,
+                              const std::string& type,
+                              const std::string& inner_id,
+                              int64_t timestamp) {
+  return std::format("('{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}')",
+                     timestamp,
+                     transfer.from_subaccount,
+                     util::lexical_cast<std::string>(transfer.from_wallet),
+                     transfer.to_subaccount,
+                     util::lexical_cast<std::string>(transfer.to_wallet),
+                     transfer.asset,
+                     util::lexical_cast<std::string>(transfer.amount),
+                     type,
+                     inner_id,
+                     kDoneStatus);
+}
+
 }  // namespace
 
-TransactionManager::TransactionManager(): clickhouse_client_(getFundsControllerClickhouseClient()) {
-  ASSERT_FATAL(clickhouse_client_, "Failed to create clickhouse client");
-}
+TransactionManager::TransactionManager() = default;
 
 tl::expected<void, std::string> TransactionManager::transfer(const std::string& from_subaccount,
                                                              infra::Wallet from_subaccount_wallet,
                                                              const std::string& to_subaccount,
                                                              infra::Wallet to_subaccount_wallet,
                                                              const std::string& asset,
-                                                             infra::Volume amount) {
+                                                             infra::Volume amount,
+                                                             const std::string& idempotency_key) {
+  auto execute = [&]() -> OperationResult {
+    auto transfer_result =
+        executeTransfer({from_subaccount, from_subaccount_wallet, to_subaccount, to_subaccount_wallet, asset, amount});
+    if (!transfer_result.has_value()) {
+      return transfer_result;
+    }
+    auto result = addTransferTransaction(from_subaccount,
+                                         from_subaccount_wallet,
+                                         to_subaccount,
+                                         to_subaccount_wallet,
+                                         asset,
+                                         amount,
+                                         idempotency_key.empty() ? "0" : idempotency_key);
+    if (!result.has_value()) {
+      // the funds moved, only the record is missing
+      alertDispatcher().alert("transfer_record " + from_subaccount + " " + asset,
+                              std::format("Transfer of {} {} from {} to {} was executed but not recorded: {}",
+                                          util::lexical_cast<std::string>(amount),
+                                          asset,
+                                          from_subaccount,
+                                          to_subaccount,
+                                          result.error()));
+      return unknownOutcome("Transfer was executed but not recorded: " + result.error());
+    }
+    publishLedgerEvent(LedgerEvent::Kind::Transfer, from_subaccount, asset, -amount);
+    publishLedgerEvent(LedgerEvent::Kind::Transfer, to_subaccount, asset, amount);
+    return {};
+  };
+  if (idempotency_key.empty()) {
+    return toResult(execute());
+  }
+  return idempotencyStore().run({{from_subaccount, asset}, {to_subaccount, asset}},
+                                idempotency_key,
+                                std::format("transfer {} {} {} {} {} {}",
+                                            from_subaccount,
+                                            util::lexical_cast<std::string>(from_subaccount_wallet),
+                                            to_subaccount,
+                                            util::lexical_cast<std::string>(to_subaccount_wallet),
+                                            asset,
+                                            util::lexical_cast<std::string>(amount)),
+                                execute);
+}
+
+tl::expected<TransactionManager::NettedTransfers, std::string> TransactionManager::transferNetted(
+    const std::vector<TransferIntent>& intents) {
+  using Endpoint = std::pair<std::string, std::string>;
+  struct Flow {
+    TransferIntent transfer;
+    std::vector<size_t> intents;
+  };
+  // flows keyed by the ordered endpoint pair, amount is positive from the first endpoint to the second
+  std::map<std::tuple<std::string, Endpoint, Endpoint>, Flow> flows;
+  NettedTransfers netted{.batch_id = util::generateUuid().substr(0, 30)};
+  netted.results.resize(intents.size());
+  for (size_t i = 0; i < intents.size(); ++i) {
+    const auto& intent = intents[i];
+    EXPECT_WITH_STRING(intent.amount > 0, "Amount should be positive");
+    Endpoint from{intent.from_subaccount, util::lexical_cast<std::string>(intent.from_wallet)};
+    Endpoint to{intent.to_subaccount, util::lexical_cast<std::string>(intent.to_wallet)};
+    EXPECT_WITH_STRING(from != to, "Transfer to the same wallet " << intent.from_subaccount);
+    bool forward = from < to;
+    auto [it, inserted] = flows.try_emplace(
+        std::make_tuple(intent.asset, forward ? from : to, forward ? to : from), Flow{.transfer = intent});
+    auto& flow = it->second;
+    if (inserted) {
+      if (!forward) {
+        std::swap(flow.transfer.from_subaccount, flow.transfer.to_subaccount);
+        std::swap(flow.transfer.from_wallet, flow.transfer.to_wallet);
+      }
+      flow.transfer.amount = 0;
+    }
+    flow.transfer.amount += forward ? intent.amount : -intent.amount;
+    flow.intents.push_back(i);
+  }
+
+  const auto timestamp = static_cast<int64_t>(nowSystem()) / 1'000'000;
+  std::string values;
+  size_t rows = 0;
+  for (auto& [key, flow] : flows) {
+    auto& transfer = flow.transfer;
+    if (transfer.amount < 0) {
+      std::swap(transfer.from_subaccount, transfer.to_subaccount);
+      std::swap(transfer.from_wallet, transfer.to_wallet);
+      transfer.amount = -transfer.amount;
+    }
+    auto result = transfer.amount == 0 ? tl::expected<void, std::string>{} : toResult(executeTransfer(transfer));
+    for (size_t i : flow.intents) {
+      netted.results[i] = result;
+    }
+    if (!result.has_value()) {
+      LOG_ERROR("Net transfer of {} {} failed: {}", transfer.amount, transfer.asset, result.error());
+      continue;
+    }
+    for (size_t i : flow.intents) {
+      values += (values.empty() ? "" : ", ") +
+          transactionValues(intents[i], "transfer_intent", netted.batch_id, timestamp);
+      ++rows;
+    }
+    if (transfer.amount > 0) {
+      values += (values.empty() ? "" : ", ") + transactionValues(transfer, "transfer", netted.batch_id, timestamp);
+      ++rows;
+      netted.executed.push_back(transfer);
+    }
+  }
+  LOG_INFO("Netted {} transfers into {}", intents.size(), netted.executed.size());
+  if (!values.empty()) {
+    if (auto inserted = insertTransactions(values, rows); !inserted.has_value()) {
+      std::string executed;
+      for (const auto& transfer : netted.executed) {
+        executed += std::format("\n{} {} -> {} {}",
+                                util::lexical_cast<std::string>(transfer.amount),
+                                transfer.from_subaccount,
+                                transfer.to_subaccount,
+                                transfer.asset);
+      }
+      alertDispatcher().alert("transfer_netted_record " + netted.batch_id,
+                              std::format("Net transfers of batch {} were executed but not recorded: {}{}",
+                                          netted.batch_id,
+                                          inserted.error(),
+                                          executed));
+      // the ledger events follow the recorded rows, none are published for this batch
+      netted.record_error = inserted.error();
+      return netted;
+    }
+  }
+  for (const auto& transfer : netted.executed) {
+    publishLedgerEvent(LedgerEvent::Kind::Transfer, transfer.from_subaccount, transfer.asset, -transfer.amount);
+    publishLedgerEvent(LedgerEvent::Kind::Transfer, transfer.to_subaccount, transfer.asset, transfer.amount);
+  }
+  return netted;
+}
+
+std::unique_ptr<TransactionManager::TransactionCursor> TransactionManager::streamTransactions(
+    int64_t from_timestamp_ms, int64_t to_timestamp_ms, const std::string& subaccount) {
+  std::string query = std::format(
+      "SELECT toInt64(timestamp), from_subaccount, from_wallet, to_subaccount, to_wallet, asset, amount, type, "
+      "inner_id, status FROM {} WHERE timestamp >= {} AND timestamp < {}{} ORDER BY timestamp",
+      kTransactionsTable,
+      from_timestamp_ms,
+      to_timestamp_ms,
+      subaccount.empty()
+          ? ""
+          : std::format(" AND (from_subaccount = '{0}' OR to_subaccount = '{0}')", subaccount));
+  LOG_DEBUG("{}", query);
+  return std::make_unique<TransactionCursor>(
+      std::move(query), decodeRows<TransactionRecord>([](const clickhouse::Block& block, size_t i) {
+        return TransactionRecord{
+            .timestamp_ms = block[0]->As<clickhouse::ColumnInt64>()->At(i),
+            .from_subaccount = std::string{block[1]->As<clickhouse::ColumnString>()->At(i)},
+            .from_wallet = std::string{block[2]->As<clickhouse::ColumnString>()->At(i)},
+            .to_subaccount = std::string{block[3]->As<clickhouse::ColumnString>()->At(i)},
+            .to_wallet = std::string{block[4]->As<clickhouse::ColumnString>()->At(i)},
+            .asset = std::string{block[5]->As<clickhouse::ColumnString>()->At(i)},
+            .amount = convertClickhouseDecimalToDecimal(block[6]->As<clickhouse::ColumnDecimal>()->At(i)),
+            .type = std::string{block[7]->As<clickhouse::ColumnString>()->At(i)},
+            .inner_id = std::string{block[8]->As<clickhouse::ColumnString>()->At(i)},
+            .status = std::string{block[9]->As<clickhouse::ColumnString>()->At(i)},
+        };
+      }));
+}
+
+OperationResult TransactionManager::executeTransfer(const TransferIntent& transfer) {
+  const auto& [from_subaccount, from_subaccount_wallet, to_subaccount, to_subaccount_wallet, asset, amount] = transfer;
   PROPAGATE_ERROR(checkAccount(from_subaccount, from_subaccount_wallet));
   PROPAGATE_ERROR(checkAccount(to_subaccount, to_subaccount_wallet));
 
@@ -47,13 +232,15 @@ tl::expected<void, std::string> TransactionManager::transfer(const std::string&
       amount == transfer_loan_amount || from_subaccount_wallet.exchange() == to_subaccount_wallet.exchange(),
       "Can't transfer crypto (not loan) between different exchanges");
   if (transfer_loan_amount > 0) {
-    auto result = loans_manager_.transfer(from_subaccount,
-                                          from_subaccount_wallet.exchange(),
-                                          to_subaccount,
-                                          to_subaccount_wallet.exchange(),
-                                          asset,
-                                          transfer_loan_amount);
-    PROPAGATE_ERROR(result);
+    auto result = loans_manager_.executeTransfer(from_subaccount,
+                                                 from_subaccount_wallet.exchange(),
+                                                 to_subaccount,
+                                                 to_subaccount_wallet.exchange(),
+                                                 asset,
+                                                 transfer_loan_amount);
+    if (!result.has_value()) {
+      return result;
+    }
   }
 
 
@@ -68,23 +255,28 @@ tl::expected<void, std::string> TransactionManager::transfer(const std::string&
     if (!transfer_result.has_value()) {
       LOG_ERROR("Transfer failed: {}", transfer_result.error());
       if (transfer_loan_amount == 0) {
-        return transfer_result;
+        return tl::make_unexpected(transfer_result.error());
       }
-      auto result = loans_manager_.transfer(to_subaccount,
-                                            to_subaccount_wallet.exchange(),
-                                            from_subaccount,
-                                            from_subaccount_wallet.exchange(),
-                                            asset,
-                                            transfer_loan_amount);
+      auto result = loans_manager_.executeTransfer(to_subaccount,
+                                                   to_subaccount_wallet.exchange(),
+                                                   from_subaccount,
+                                                   from_subaccount_wallet.exchange(),
+                                                   asset,
+                                                   transfer_loan_amount);
       if (!result.has_value()) {
-        util::SlackAlerter::FundsAlerter().send("Failed to transfer loan back. Error: " + result.error());
-        EXPECT_WITH_STRING(false, "Failed to transfer loan back. Error: " << transfer_result.error());
+        alertDispatcher().alert("transfer_loan_undo " + from_subaccount + " " + asset,
+                                std::format("Failed to transfer loan of {} {} back from {} to {}: {}",
+                                            util::lexical_cast<std::string>(transfer_loan_amount),
+                                            asset,
+                                            to_subaccount,
+                                            from_subaccount,
+                                            result.error().message));
+        return unknownOutcome("Failed to transfer loan back. Error: " + transfer_result.error());
       }
-      return transfer_result;
+      return tl::make_unexpected(transfer_result.error());
     }
   }
-  return addTransferTransaction(
-      from_subaccount, from_subaccount_wallet, to_subaccount, to_subaccount_wallet, asset, amount);
+  return {};
 }
 
 
@@ -117,25 +309,26 @@ tl::expected<void, std::string> TransactionManager::addTransferTransaction(const
                                                                            const std::string& to_subaccount,
                                                                            infra::Wallet to_subaccount_wallet,
                                                                            const std::string& asset,
-                                                                           infra::Volume amount) {
-  std::string query = std::format(
-      "INSERT INTO {} (timestamp, from_subaccount, from_wallet, to_subaccount, to_wallet, asset, amount, type, "
-      "inner_id, status) VALUES ('{}', '{}', '{}', '{}', '{}', '{}', '{}', '{}', '0', '{}')",
-      kTransactionsTable,
-      static_cast<int64_t>(nowSystem()) / 1'000'000,
-      from_subaccount,
-      util::lexical_cast<std::string>(from_subaccount_wallet),
-      to_subaccount,
-      util::lexical_cast<std::string>(to_subaccount_wallet),
-      asset,
-      util::lexical_cast<std::string>(amount),
-      "transfer",
-      kDoneStatus);
-  try {
-    clickhouse_client_->Execute({std::move(query)});
-  } catch (const std::exception& e) {
-    LOG_ERROR("clickhouse error: {}", e.what());
-    return tl::make_unexpected(std::string{"Failed to write to clickhouse. Exception: "} + e.what());
+                                                                           infra::Volume amount,
+                                                                           const std::string& inner_id) {
+  return insertTransactions(
+      transactionValues({from_subaccount, from_subaccount_wallet, to_subaccount, to_subaccount_wallet, asset, amount},
+                        "transfer",
+                        inner_id,
+                        static_cast<int64_t>(nowSystem()) / 1'000'000),
+      1);
+}
+
+tl::expected<void, std::string> TransactionManager::insertTransactions(const std::string& values, size_t rows) {
+  auto result = ledgerWriter()
+                    .insert(kTransactionsTable,
+                            "(timestamp, from_subaccount, from_wallet, to_subaccount, to_wallet, asset, amount, type, "
+                            "inner_id, status)",
+                            values,
+                            rows)
+                    .get();
+  if (!result.has_value()) {
+    return tl::make_unexpected("Failed to write to clickhouse. " + result.error().message);
   }
   return {};
 }
@@ -0,0 +1,221 @@
+#include "prod/funds_controller/universe_snapshot.h"
+
+#include "util/error/error.h"
+#include "util/time/time.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <mutex>
+#include <tuple>
+
+namespace funds_controller {
+
+namespace {
+
+constexpr int kFixedPointScale = 12;
+constexpr int64_t kMaxIntegerPart = INT64_MAX / 1'000'000'000'000;
+
+std::mutex universe_mutex;
+std::shared_ptr<const UniverseSnapshot> universe;
+std::string universe_path;
+
+auto recordKey(const UniverseSnapshot::Record& record) {
+  return std::make_tuple(record.market_type, record.pair());
+}
+
+}  // namespace
+
+std::optional<int64_t> parseFixedPointMantissa(std::string_view text) {
+  bool negative = !text.empty() && text.front() == '-';
+  if (negative) {
+    text.remove_prefix(1);
+  }
+  size_t point = text.find('.');
+  std::string_view integer_text = text.substr(0, point);
+  std::string_view fraction_text = point == std::string_view::npos ? std::string_view{} : text.substr(point + 1);
+  if (integer_text.empty() && fraction_text.empty()) {
+    return std::nullopt;
+  }
+  int64_t integer = 0;
+  if (!integer_text.empty()) {
+    auto [end, error] = std::from_chars(integer_text.data(), integer_text.data() + integer_text.size(), integer);
+    if (error != std::errc{} || end != integer_text.data() + integer_text.size() || integer > kMaxIntegerPart) {
+      return std::nullopt;
+    }
+  }
+  int64_t fraction = 0;
+  for (int digit = 0; digit < kFixedPointScale; ++digit) {
+    fraction *= 10;
+    if (static_cast<size_t>(digit) < fraction_text.size()) {
+      char c = fraction_text[digit];
+      if (c < '0' || c > '9') {
+        return std::nullopt;
+      }
+      fraction += c - '0';
+    }
+  }
+  int64_t mantissa = integer * 1'000'000'000'000 + fraction;
+  return negative ? -mantissa : mantissa;
+}
+
+UniverseSnapshot::UniverseSnapshot(std::string path, MappedFile file): path_(std::move(path)), file_(std::move(file)) {
+}
+
+tl::expected<UniverseSnapshot, std::string> UniverseSnapshot::open(const std::string& path) {
+  auto file = MappedFile::open(path);
+  PROPAGATE_ERROR(file);
+  auto data = file->data();
+  EXPECT_WITH_STRING(data.size() >= sizeof(Header), "Universe snapshot " << path << " is truncated");
+  const auto& header = *reinterpret_cast<const Header*>(data.data());
+  EXPECT_WITH_STRING(header.magic == kMagic, "Not a universe snapshot: " << path);
+  EXPECT_WITH_STRING(header.version == kVersion,
+                     "Unsupported universe snapshot version " << header.version << ", expected " << kVersion);
+  EXPECT_WITH_STRING(header.record_size == sizeof(Record), "Unexpected universe record size " << header.record_size);
+  size_t expected_size =
+      sizeof(Header) + header.record_count * sizeof(Record) + header.instrument_id_capacity * sizeof(uint32_t);
+  EXPECT_WITH_STRING(data.size() == expected_size,
+                     "Universe snapshot " << path << " has size " << data.size() << ", expected " << expected_size);
+  return UniverseSnapshot(path, std::move(*file));
+}
+
+tl::expected<void, std::string> UniverseSnapshot::write(const std::string& path,
+                                                        const std::vector<InstrumentListing>& listings,
+                                                        const UniverseSnapshot* previous) {
+  uint32_t next_instrument_id = previous != nullptr ? previous->instrumentIdCapacity() : 0;
+  std::vector<Record> records;
+  records.reserve(listings.size());
+  for (const auto& listing : listings) {
+    EXPECT_WITH_STRING(listing.pair.size() <= sizeof(Record::pair_data), "Pair is too long: " << listing.pair);
+    EXPECT_WITH_STRING(listing.status.size() <= sizeof(Record::status_data),
+                       "Status is too long: " << listing.status << " for " << listing.pair);
+    Record record{};
+    const Record* previous_record = previous != nullptr ? previous->find(listing.market, listing.pair) : nullptr;
+    record.instrument_id = previous_record != nullptr ? previous_record->instrument_id : next_instrument_id++;
+    record.market_type = static_cast<uint16_t>(listing.market.type());
+    record.pair_size = static_cast<uint8_t>(listing.pair.size());
+    record.status_size = static_cast<uint8_t>(listing.status.size());
+    std::memcpy(record.pair_data, listing.pair.data(), listing.pair.size());
+    std::memcpy(record.status_data, listing.status.data(), listing.status.size());
+    record.listing_time_ms = listing.listing_time_ms;
+    record.metadata = listing.metadata;
+    records.push_back(record);
+  }
+  std::sort(records.begin(), records.end(), [](const Record& lhs, const Record& rhs) {
+    return recordKey(lhs) < recordKey(rhs);
+  });
+  auto duplicate = std::adjacent_find(records.begin(), records.end(), [](const Record& lhs, const Record& rhs) {
+    return recordKey(lhs) == recordKey(rhs);
+  });
+  EXPECT_WITH_STRING(duplicate == records.end(), "Duplicate listing " << duplicate->pair() << " in universe");
+
+  std::vector<uint32_t> instrument_index(next_instrument_id, kNoRecord);
+  for (size_t i = 0; i < records.size(); ++i) {
+    instrument_index[records[i].instrument_id] = static_cast<uint32_t>(i);
+  }
+  Header header{
+      .magic = kMagic,
+      .version = kVersion,
+      .record_size = sizeof(Record),
+      .record_count = records.size(),
+      .instrument_id_capacity = next_instrument_id,
+      .reserved = 0,
+      .created_at_ms = static_cast<int64_t>(nowSystem()) / 1'000'000,
+  };
+  std::string content;
+  content.reserve(sizeof(Header) + records.size() * sizeof(Record) + instrument_index.size() * sizeof(uint32_t));
+  content.append(reinterpret_cast<const char*>(&header), sizeof(Header));
+  content.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Record));
+  content.append(reinterpret_cast<const char*>(instrument_index.data()), instrument_index.size() * sizeof(uint32_t));
+  return replaceFileAtomically(path, content);
+}
+
+const UniverseSnapshot::Header& UniverseSnapshot::header() const {
+  return *reinterpret_cast<const Header*>(file_.data().data());
+}
+
+std::span<const UniverseSnapshot::Record> UniverseSnapshot::records() const {
+  return {reinterpret_cast<const Record*>(file_.data().data() + sizeof(Header)), header().record_count};
+}
+
+const UniverseSnapshot::Record* UniverseSnapshot::find(infra::Market market, std::string_view pair) const {
+  auto key = std::make_tuple(static_cast<uint16_t>(market.type()), pair);
+  auto all_records = records();
+  auto it = std::lower_bound(all_records.begin(), all_records.end(), key, [](const Record& record, const auto& key) {
+    return recordKey(record) < key;
+  });
+  if (it == all_records.end() || recordKey(*it) != key) {
+    return nullptr;
+  }
+  return &*it;
+}
+
+const UniverseSnapshot::Record* UniverseSnapshot::byInstrumentId(uint32_t instrument_id) const {
+  if (instrument_id >= instrumentIdCapacity()) {
+    return nullptr;
+  }
+  auto all_records = records();
+  const auto* instrument_index = reinterpret_cast<const uint32_t*>(all_records.data() + all_records.size());
+  uint32_t record_index = instrument_index[instrument_id];
+  return record_index == kNoRecord ? nullptr : &all_records[record_index];
+}
+
+uint32_t UniverseSnapshot::instrumentIdCapacity() const {
+  return header().instrument_id_capacity;
+}
+
+int64_t UniverseSnapshot::createdAtMs() const {
+  return header().created_at_ms;
+}
+
+bool UniverseSnapshot::isStale() const {
+  return file_.isReplaced(path_);
+}
+
+InstrumentListing UniverseSnapshot::toListing(const Record& record) {
+  return {record.market(), std::string{record.pair()}, std::string{record.status()}, record.listing_time_ms,
+          record.metadata};
+}
+
+infra::InstrumentDescription UniverseSnapshot::toInstrumentDescription(const Record& record) {
+  return infra::InstrumentDescriptionFactory::get().create(record.market(), std::string{record.pair()});
+}
+
+infra::Volume UniverseSnapshot::toVolume(int64_t mantissa) {
+  return util::Decimal::withMantissa(mantissa);
+}
+
+tl::expected<void, std::string> loadUniverseSnapshot(const std::string& path) {
+  auto snapshot = UniverseSnapshot::open(path);
+  PROPAGATE_ERROR(snapshot);
+  LOG_INFO("Loaded universe of {} instruments from {}", snapshot->records().size(), path);
+  std::lock_guard lock(universe_mutex);
+  universe = std::make_shared<const UniverseSnapshot>(std::move(*snapshot));
+  universe_path = path;
+  return {};
+}
+
+std::shared_ptr<const UniverseSnapshot> universeSnapshot() {
+  std::lock_guard lock(universe_mutex);
+  if (universe != nullptr && universe->isStale()) {
+    auto snapshot = UniverseSnapshot::open(universe_path);
+    if (snapshot.has_value()) {
+      universe = std::make_shared<const UniverseSnapshot>(std::move(*snapshot));
+    } else {
+      LOG_ERROR("Keeping the previous universe: {}", snapshot.error());
+    }
+  }
+  return universe;
+}
+
+std::optional<infra::Volume> lotsPerUnit(infra::Market market, std::string_view pair) {
+  auto snapshot = universeSnapshot();
+  const auto* record = snapshot != nullptr ? snapshot->find(market, pair) : nullptr;
+  if (record == nullptr || record->metadata.lot_size <= 0 || record->metadata.contract_size <= 0) {
+    return std::nullopt;
+  }
+  return UniverseSnapshot::toVolume(record->metadata.contract_size) *
+      (1 / UniverseSnapshot::toVolume(record->metadata.lot_size));
+}
+
+}  // namespace funds_controller
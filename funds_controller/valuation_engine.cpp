@@ -0,0 +1,171 @@
+#include "prod/funds_controller/valuation_engine.h"
+
+#include "util/error/error.h"
+#include "util/lexical_cast/lexical_cast.h"
+
+#include <algorithm>
+
+namespace funds_controller {
+
+namespace {
+
+double toDouble(infra::Volume amount) {
+  return util::lexical_cast<double>(util::lexical_cast<std::string>(amount));
+}
+
+// out[i] += in[i] * factor, a plain loop over non aliasing arrays the compiler vectorizes
+void multiplyAccumulate(double* __restrict out, const double* __restrict in, size_t size, double factor) {
+  for (size_t i = 0; i < size; ++i) {
+    out[i] += in[i] * factor;
+  }
+}
+
+}  // namespace
+
+ValuationEngine::ValuationEngine():
+    subscription_id_(ledgerEvents().subscribe([this](const LedgerEvent& event) { apply(event); })) {
+}
+
+ValuationEngine::~ValuationEngine() {
+  ledgerEvents().unsubscribe(subscription_id_);
+}
+
+void ValuationEngine::load(const ExposureSnapshot& exposure) {
+  std::lock_guard lock(mutex_);
+  for (auto& [name, columns] : assets_) {
+    std::fill(columns.loans.begin(), columns.loans.end(), 0.0);
+    std::fill(columns.hedges.begin(), columns.hedges.end(), 0.0);
+  }
+  for (const auto& [subaccount_name, by_asset] : exposure.by_subaccount) {
+    const size_t index = subaccount(subaccount_name);
+    for (const auto& [asset_name, asset_exposure] : by_asset) {
+      auto& columns = asset(asset_name);
+      columns.loans[index] = toDouble(asset_exposure.loans);
+      columns.hedges[index] = toDouble(asset_exposure.hedges);
+    }
+  }
+  revalue();
+  LOG_INFO("Loaded valuation of {} subaccounts and {} assets", subaccounts_.size(), assets_.size());
+  publish();
+}
+
+void ValuationEngine::onPrice(const std::string& asset_name, double price) {
+  std::lock_guard lock(mutex_);
+  auto& columns = asset(asset_name);
+  const double change = price - columns.price;
+  columns.price = price;
+  if (change == 0) {
+    return;
+  }
+  if (sequence_ % kRevalueInterval == kRevalueInterval - 1) {
+    revalue();
+  } else {
+    multiplyAccumulate(loans_usd_.data(), columns.loans.data(), subaccounts_.size(), change);
+    multiplyAccumulate(hedges_usd_.data(), columns.hedges.data(), subaccounts_.size(), change);
+    total_loans_usd_ += columns.total_loans * change;
+    total_hedges_usd_ += columns.total_hedges * change;
+  }
+  publish();
+}
+
+ValuationSnapshot ValuationEngine::snapshot() const {
+  ValuationSnapshot snapshot;
+  std::lock_guard lock(mutex_);
+  snapshot.sequence = sequence_;
+  for (size_t i = 0; i < subaccounts_.size(); ++i) {
+    snapshot.by_subaccount[subaccounts_[i]] = {loans_usd_[i], hedges_usd_[i]};
+  }
+  snapshot.total = {total_loans_usd_, total_hedges_usd_};
+  return snapshot;
+}
+
+uint64_t ValuationEngine::subscribe(Subscribers<Valuation>::Callback callback) {
+  return subscribers_.subscribe(std::move(callback));
+}
+
+void ValuationEngine::unsubscribe(uint64_t subscription_id) {
+  subscribers_.unsubscribe(subscription_id);
+}
+
+void ValuationEngine::apply(const LedgerEvent& event) {
+  // loan transfers already move the loans, transfers carry no position
+  if (event.kind == LedgerEvent::Kind::Transfer) {
+    return;
+  }
+  const double amount = toDouble(event.amount);
+  std::lock_guard lock(mutex_);
+  const size_t index = subaccount(event.subaccount);
+  auto& columns = asset(event.asset);
+  const double value = amount * columns.price;
+  if (event.kind == LedgerEvent::Kind::Loan) {
+    columns.loans[index] += amount;
+    columns.total_loans += amount;
+    loans_usd_[index] += value;
+    total_loans_usd_ += value;
+  } else {
+    columns.hedges[index] += amount;
+    columns.total_hedges += amount;
+    hedges_usd_[index] += value;
+    total_hedges_usd_ += value;
+  }
+  publish();
+}
+
+ValuationEngine::AssetColumns& ValuationEngine::asset(const std::string& asset) {
+  auto [it, inserted] = assets_.try_emplace(asset);
+  if (inserted) {
+    it->second.loans.resize(subaccounts_.size());
+    it->second.hedges.resize(subaccounts_.size());
+  }
+  return it->second;
+}
+
+size_t ValuationEngine::subaccount(const std::string& subaccount) {
+  auto [it, inserted] = subaccount_index_.try_emplace(subaccount, subaccounts_.size());
+  if (inserted) {
+    subaccounts_.push_back(subaccount);
+    loans_usd_.push_back(0);
+    hedges_usd_.push_back(0);
+    for (auto& [name, columns] : assets_) {
+      columns.loans.push_back(0);
+      columns.hedges.push_back(0);
+    }
+  }
+  return it->second;
+}
+
+void ValuationEngine::revalue() {
+  std::fill(loans_usd_.begin(), loans_usd_.end(), 0.0);
+  std::fill(hedges_usd_.begin(), hedges_usd_.end(), 0.0);
+  total_loans_usd_ = 0;
+  total_hedges_usd_ = 0;
+  for (auto& [name, columns] : assets_) {
+    columns.total_loans = 0;
+    columns.total_hedges = 0;
+    for (size_t i = 0; i < subaccounts_.size(); ++i) {
+      columns.total_loans += columns.loans[i];
+      columns.total_hedges += columns.hedges[i];
+    }
+    multiplyAccumulate(loans_usd_.data(), columns.loans.data(), subaccounts_.size(), columns.price);
+    multiplyAccumulate(hedges_usd_.data(), columns.hedges.data(), subaccounts_.size(), columns.price);
+    total_loans_usd_ += columns.total_loans * columns.price;
+    total_hedges_usd_ += columns.total_hedges * columns.price;
+  }
+}
+
+void ValuationEngine::publish() {
+  ++sequence_;
+  if (subscribers_.empty()) {
+    return;
+  }
+  subscribers_.publish(Valuation{
+      .sequence = sequence_,
+      .subaccounts = subaccounts_,
+      .loans_usd = loans_usd_,
+      .hedges_usd = hedges_usd_,
+      .total_loans_usd = total_loans_usd_,
+      .total_hedges_usd = total_hedges_usd_,
+  });
+}
+
+}  // namespace funds_controller